@@ -13,9 +13,21 @@ layout(location = 2) out vec3 outColor;
 layout(location = 3) out vec2 outUV;
 layout(location = 4) out vec4 ndcPrev;
 layout(location = 5) out vec4 ndc;
+layout(location = 6) flat out uint outMaterial;
 
-struct ObjectData{
-	mat4 model;
+// Written by the renderer every frame, indexed through the instance buffer
+struct ClusterDraw
+{
+	mat4  model;
+	mat4  normalMatrix;
+	uint  firstMeshlet;
+	uint  meshletCount;
+	float scale;
+	uint  lod;
+	uint  material;
+	uint  batch;
+	uint  batchMeshlet;
+	uint  pad;
 };
 
 // Set 0 - Camera information
@@ -27,22 +39,24 @@ layout(set = 0, binding = 0) uniform CameraBuffer
 	mat4 pProj;
 } cameraData;
 
-layout(push_constant) uniform constants
-{
-	mat4 matrix;
-	mat4 inv_matrix;
-}pushC;
+layout(set = 0, binding = 4) readonly buffer Draws { ClusterDraw d[]; } draws;
+// Draw id of every instance. Meshlet commands start at their draw id, whole level commands of
+// instanced draws at the list of their instances
+layout(set = 0, binding = 5) readonly buffer Instances { uint id[]; } instances;
 
 void main()
 {
-	mat4 transformationMatrix 	= cameraData.projection * cameraData.view * pushC.matrix;
-	mat4 previousTransformation = cameraData.pProj * cameraData.pView * pushC.matrix;
+	const uint drawID			= instances.id[gl_InstanceIndex];
+	const mat4 model			= draws.d[drawID].model;
+	mat4 transformationMatrix 	= cameraData.projection * cameraData.view * model;
+	mat4 previousTransformation = cameraData.pProj * cameraData.pView * model;
 	gl_Position 				= transformationMatrix * vec4(inPosition, 1.0);
 
-	outPosition = vec3(pushC.matrix * vec4(inPosition, 1.0)).xyz;
+	outPosition = vec3(model * vec4(inPosition, 1.0)).xyz;
     outColor  	= inColor;
-	outNormal 	= mat3(transpose(pushC.inv_matrix)) * vec3(inNormal);
+	outNormal 	= mat3(draws.d[drawID].normalMatrix) * vec3(inNormal);
     outUV 		= inUV;
+	outMaterial	= draws.d[drawID].material;
 	ndc 		= transformationMatrix * vec4(inPosition, 1.0);	// in homogeneous space
 	ndcPrev 	= previousTransformation * vec4(inPosition, 1.0);
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #version 460
+#extension GL_GOOGLE_include_directive : enable
 
 struct Light{
 	vec4 pos;	// w used for max distance
@@ -18,7 +19,13 @@ layout (std140, set = 0, binding = 4) buffer LightBuffer {Light lights[];} light
 layout (set = 0, binding = 5) uniform debugInfo {int target;} debug;
 layout (set = 0, binding = 6) uniform sampler2D materialTexture;
 layout (set = 0, binding = 8) uniform sampler2D emissiveTexture;
-layout (set = 0, binding = 9) uniform sampler2D environmentTexture;
+layout (set = 0, binding = 9) uniform sampler2D prefilteredEnvironment;
+layout (set = 0, binding = 10) uniform EnvironmentSH { vec4 sh[9]; } environmentSH;
+layout (set = 0, binding = 11) uniform ClusterGrid { mat4 view; mat4 inverseProjection; uvec4 size; vec4 depth; } clusterGrid;
+layout (set = 0, binding = 12) readonly buffer ClusterLights { uint data[]; } clusterLights;
+
+#include "environment.glsl"
+#include "light_clusters.glsl"
 
 const float PI = 3.14159265359;
 
@@ -43,8 +50,7 @@ void main()
 	vec3 V 			= normalize(inCamPosition - position.xyz);
 	float NdotV 	= max(dot(N, V), 0.0);
 	vec3 F0 		= mix(vec3(0.04), pow(albedo, vec3(2.2)), metallic);
-	vec2 envUV 		= vec2(0.5 + atan(N.x, N.z) / (2 * PI), 0.5 - asin(N.y) / PI);
-	vec3 irradiance = texture(environmentTexture, envUV).xyz;
+	vec3 irradiance = evalEnvironmentIrradiance(N);
 
 	if(debug.target > 0.001)
 	{
@@ -74,9 +80,13 @@ void main()
 	vec3 color = vec3(1), Lo = vec3(0);
 	float attenuation = 1.0, light_intensity = 1.0;
 	
-	for(int i = 0; i < lightBuffer.lights.length(); i++)
+	// Only the lights whose range reaches the cluster of the pixel
+	const uint clusterStart	= clusterOffset(inUV, position);
+	const uint clusterCount	= background ? 0 : clusterLights.data[clusterStart];
+
+	for(uint c = 0; c < clusterCount; c++)
 	{
-		Light light 		= lightBuffer.lights[i];
+		Light light 		= lightBuffer.lights[clusterLights.data[clusterStart + 1 + c]];
 		bool isDirectional 	= light.pos.w < 0;
 		vec3 L 				= isDirectional ? light.pos.xyz : (light.pos.xyz - position.xyz);
 		vec3 H 				= normalize(V + normalize(L));
@@ -121,7 +131,8 @@ void main()
 		vec3 F = FresnelSchlick(NdotV, F0);
   		vec3 kD = (1.0 - F) * (1.0 - metallic);
   		vec3 diffuse = kD * albedo * irradiance;
-  		vec3 ambient = diffuse;
+  		vec3 specular = evalEnvironmentSpecular(prefilteredEnvironment, N, V, roughness, F0);
+  		vec3 ambient = diffuse + specular;
 
 		color = Lo + ambient;
 		color += emissive;
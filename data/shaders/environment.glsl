@@ -0,0 +1,40 @@
+// Image based lighting precomputed by EnvironmentLighting on the CPU.
+// The including shader declares, with its own binding:
+//   uniform EnvironmentSH { vec4 sh[9]; } environmentSH;
+
+#define ENV_PREFILTER_LEVELS 6
+
+// Irradiance / PI around N, the L2 coefficients already hold the cosine convolution
+vec3 evalEnvironmentIrradiance(vec3 N)
+{
+  vec3 irradiance = environmentSH.sh[0].xyz * 0.282095
+                  + environmentSH.sh[1].xyz * 0.488603 * N.y
+                  + environmentSH.sh[2].xyz * 0.488603 * N.z
+                  + environmentSH.sh[3].xyz * 0.488603 * N.x
+                  + environmentSH.sh[4].xyz * 1.092548 * N.x * N.y
+                  + environmentSH.sh[5].xyz * 1.092548 * N.y * N.z
+                  + environmentSH.sh[6].xyz * 0.315392 * (3.0 * N.z * N.z - 1.0)
+                  + environmentSH.sh[7].xyz * 1.092548 * N.x * N.z
+                  + environmentSH.sh[8].xyz * 0.546274 * (N.x * N.x - N.y * N.y);
+  return max(irradiance, vec3(0));
+}
+
+vec2 equirectUV(vec3 D)
+{
+  return vec2(0.5 + atan(D.x, D.z) / (2.0 * 3.14159265359), 0.5 - asin(clamp(D.y, -1.0, 1.0)) / 3.14159265359);
+}
+
+// Split sum approximation of the specular environment, analytic fit of the BRDF integral
+vec3 evalEnvironmentSpecular(sampler2D prefiltered, vec3 N, vec3 V, float roughness, vec3 F0)
+{
+  const vec3 R        = reflect(-V, N);
+  const vec3 radiance = textureLod(prefiltered, equirectUV(R), roughness * (ENV_PREFILTER_LEVELS - 1)).rgb;
+
+  const vec4 c0 = vec4(-1, -0.0275, -0.572, 0.022);
+  const vec4 c1 = vec4(1, 0.0425, 1.04, -0.04);
+  const vec4 r  = roughness * c0 + c1;
+  const float a004 = min(r.x * r.x, exp2(-9.28 * max(dot(N, V), 0.0))) * r.x + r.y;
+  const vec2 AB = vec2(-1.04, 1.04) * a004 + r.zw;
+
+  return radiance * (F0 * AB.x + AB.y);
+}
@@ -7,6 +7,7 @@ layout (location = 2) in vec3 inColor;
 layout (location = 3) in vec2 inUV;
 layout (location = 4) in vec4 inNdc;
 layout (location = 5) in vec4 inNdcPrev;
+layout (location = 6) flat in uint inMaterial;
 
 layout (location = 0) out vec4 outPosition;
 layout (location = 1) out vec4 outNormal;
@@ -18,12 +19,17 @@ layout (location = 5) out vec3 outEmissive;
 // Set 1: texture array
 layout(set = 0, binding = 1) uniform sampler2D[] textures;
 
-layout(push_constant) uniform constants
+// Textures sampled, read back by the residency manager
+layout(set = 0, binding = 2) buffer TextureFeedback { uint used[]; } textureFeedback;
+
+struct Material
 {
-	layout (offset = 128)vec4 color;
+	vec4 diffuse;
     vec4 textures;
     vec4 shadingMetallicRoughness;
-}pushC;
+};
+
+layout(set = 0, binding = 3) readonly buffer Materials { Material m[]; } materials;
 
 mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 {
@@ -43,22 +49,34 @@ mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 
 vec3 perturbNormal(vec3 N, vec3 WP, vec2 uv, vec3 normal_pixel)
 {
-    normal_pixel = normal_pixel * 255./127. - 128./127.;
+    // Normal maps are BC5, only x and y are stored
+    vec2 xy = normal_pixel.xy * 255./127. - 128./127.;
+    normal_pixel = vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
     mat3 TBN = cotangent_frame(N, WP, uv);
     return normalize(TBN * normal_pixel);
 }
 
 void main()
 {
+    const Material mat = materials.m[inMaterial];
+
+    vec3 color      = mat.textures.x > -1 ? texture(textures[nonuniformEXT(int(mat.textures.x))], inUV).xyz * inColor : mat.diffuse.xyz;
+    vec3 N          = mat.textures.y > -1 ? texture(textures[nonuniformEXT(int(mat.textures.y))], inUV).xyz : normalize( inNormal );
+    vec3 emissive   = mat.textures.z > -1 ? texture(textures[nonuniformEXT(int(mat.textures.z))], inUV).xyz : vec3(0);
+    vec3 material   = mat.textures.w > -1 ? texture(textures[nonuniformEXT(int(mat.textures.w))], inUV).xyz : vec3(0, mat.shadingMetallicRoughness.z, mat.shadingMetallicRoughness.y);
 
-    vec3 color      = pushC.textures.x > -1 ? texture(textures[int(pushC.textures.x)], inUV).xyz * inColor : pushC.color.xyz;
-    vec3 N          = pushC.textures.y > -1 ? texture(textures[int(pushC.textures.y)], inUV).xyz : normalize( inNormal );
-    vec3 emissive   = pushC.textures.z > -1 ? texture(textures[int(pushC.textures.z)], inUV).xyz : vec3(0);
-    vec3 material   = pushC.textures.w > -1 ? texture(textures[int(pushC.textures.w)], inUV).xyz : vec3(0, pushC.shadingMetallicRoughness.z, pushC.shadingMetallicRoughness.y);
+    float materialIdx = mat.shadingMetallicRoughness.w;
 
-    float materialIdx = pushC.shadingMetallicRoughness.w;
+    // One pixel in 8x8 is enough to keep the textures of a visible surface resident
+    if(all(equal(ivec2(gl_FragCoord.xy) & 7, ivec2(0))))
+    {
+        if(mat.textures.x > -1) textureFeedback.used[int(mat.textures.x)] = 1u;
+        if(mat.textures.y > -1) textureFeedback.used[int(mat.textures.y)] = 1u;
+        if(mat.textures.z > -1) textureFeedback.used[int(mat.textures.z)] = 1u;
+        if(mat.textures.w > -1) textureFeedback.used[int(mat.textures.w)] = 1u;
+    }
 
-    if(pushC.textures.y > -1)
+    if(mat.textures.y > -1)
     {
         N = perturbNormal(inNormal, inWorldPos, inUV, N);
     }
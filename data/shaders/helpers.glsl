@@ -28,6 +28,16 @@ struct Material{
 };
 
 // FUNCTIONS --------------------------------------------------
+// Ray cone texture LOD (Akenine-Moller et al. 2019), there are no derivatives in ray tracing stages.
+// texelDensity is sqrt(uv area / object area) and scale the object to world scale of the instance.
+// The level of a texture is the returned value plus log2 of its size.
+float rayConeLod(float spreadAngle, float coneDistance, float texelDensity, float scale, vec3 N, vec3 D)
+{
+  const float width = spreadAngle * coneDistance;
+  const float NdotD = max(abs(dot(N, D)), 0.05);
+  return log2(max(width * texelDensity / (scale * NdotD), 1e-8));
+}
+
 // Polynomial approximation by Christophe Schlick
 // Trowbridge-Reitz GGX - Normal Distribution Function
 float DistributionGGX(vec3 N, vec3 H, float roughness)
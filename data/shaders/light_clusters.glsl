@@ -0,0 +1,28 @@
+// Lights binned per view cluster by LightClusters, screen tiles split in exponential depth slices.
+// The including shader declares, with its own bindings:
+//   uniform ClusterGrid { mat4 view; mat4 inverseProjection; uvec4 size; vec4 depth; } clusterGrid;
+//   buffer ClusterLights { uint data[]; } clusterLights;
+// Every cluster holds its light count followed by the light indices.
+
+#define CLUSTER_MAX_LIGHTS 63
+#define CLUSTER_STRIDE (CLUSTER_MAX_LIGHTS + 1)
+
+// View depth where the slice starts, slices grow exponentially from the near plane
+float clusterSliceDepth(uint slice)
+{
+  return clusterGrid.depth.x * exp(clusterGrid.depth.z * float(slice) / float(clusterGrid.size.z));
+}
+
+uint clusterSlice(float depth)
+{
+  const float slice = log(max(depth, clusterGrid.depth.x) / clusterGrid.depth.x) * float(clusterGrid.size.z) / clusterGrid.depth.z;
+  return min(uint(slice), clusterGrid.size.z - 1);
+}
+
+// Offset in clusterLights of the cluster holding the pixel at uv, 0 on the top row, and world position
+uint clusterOffset(vec2 uv, vec3 position)
+{
+  const float depth = -(clusterGrid.view * vec4(position, 1)).z;
+  const uvec2 tile  = min(uvec2(uv * vec2(clusterGrid.size.xy)), clusterGrid.size.xy - 1);
+  return ((clusterSlice(depth) * clusterGrid.size.y + tile.y) * clusterGrid.size.x + tile.x) * CLUSTER_STRIDE;
+}
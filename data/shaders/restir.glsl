@@ -0,0 +1,118 @@
+// Light reservoirs of LightReservoirs, resampled importance sampling of one light per pixel.
+// The including shader defines Light and includes random.glsl, reservoirs are stored as a uvec4:
+// light and history length, contribution weight, octahedral normal and view depth of the pixel.
+
+struct Reservoir
+{
+  uint  light;    // Index in the light buffer
+  uint  M;        // Candidates it stands for
+  float W;        // Contribution weight, 0 when empty or occluded
+  vec3  normal;   // Surface it was built for, neighbours only reuse it on a similar one
+  float depth;
+};
+
+// Built by streaming candidates, turned into a Reservoir once every candidate was seen
+struct ReservoirStream
+{
+  uint  light;
+  uint  M;
+  float weightSum;
+  float target;   // Target function of the light kept
+};
+
+// Alias table of LightReservoirs, built on the CPU from the power of the lights
+struct AliasEntry
+{
+  float threshold;  // Probability of keeping the slot's own light rather than its alias
+  uint  alias;
+  float pdf;        // Probability of drawing the light of this slot
+};
+
+#define RESERVOIR_MAX_M 0xFFFF
+
+vec2 octEncode(vec3 n)
+{
+  n /= abs(n.x) + abs(n.y) + abs(n.z);
+  const vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+}
+
+vec3 octDecode(vec2 e)
+{
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if(n.z < 0.0)
+    n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  return normalize(n);
+}
+
+uvec4 packReservoir(Reservoir r)
+{
+  return uvec4(r.light | (min(r.M, RESERVOIR_MAX_M) << 16), floatBitsToUint(r.W), packSnorm2x16(octEncode(r.normal)), floatBitsToUint(r.depth));
+}
+
+Reservoir unpackReservoir(uvec4 data)
+{
+  Reservoir r;
+  r.light   = data.x & 0xFFFF;
+  r.M       = data.x >> 16;
+  r.W       = uintBitsToFloat(data.y);
+  r.normal  = octDecode(unpackSnorm2x16(data.z));
+  r.depth   = uintBitsToFloat(data.w);
+  return r;
+}
+
+// Unshadowed contribution of the light without the material, proportional to what the hybrid raygen shades
+float lightTarget(Light light, vec3 position, vec3 N)
+{
+  const bool isDirectional  = light.pos.w < 0;
+  const vec3 L              = isDirectional ? light.pos.xyz : (light.pos.xyz - position);
+  const float distance      = length(L);
+  const float NdotL         = max(dot(N, L / max(distance, 1e-4)), 0.0);
+  if(isDirectional)
+    return NdotL * dot(light.color.rgb, vec3(0.2126, 0.7152, 0.0722));
+
+  const float intensity     = light.color.w / max(distance * distance, 1e-4);
+  float attenuation         = max((light.pos.w - distance) / light.pos.w, 0.0);
+  attenuation               *= attenuation;
+  return NdotL * intensity * attenuation * dot(light.color.rgb, vec3(0.2126, 0.7152, 0.0722));
+}
+
+ReservoirStream emptyStream()
+{
+  return ReservoirStream(0, 0, 0.0, 0.0);
+}
+
+// Keeps the candidate with a probability of its weight over the weights seen so far
+void streamCandidate(inout ReservoirStream s, uint light, float target, float weight, uint count, inout uint seed)
+{
+  s.weightSum += weight;
+  s.M         += count;
+  if(weight > 0.0 && rnd(seed) * s.weightSum <= weight)
+  {
+    s.light   = light;
+    s.target  = target;
+  }
+}
+
+// Merges a reservoir built elsewhere, its target is evaluated again for this pixel
+void streamReservoir(inout ReservoirStream s, Reservoir r, float target, inout uint seed)
+{
+  streamCandidate(s, r.light, target, target * r.W * float(r.M), r.M, seed);
+}
+
+Reservoir finishStream(ReservoirStream s, vec3 normal, float depth)
+{
+  Reservoir r;
+  r.light   = s.light;
+  r.M       = s.M;
+  r.W       = s.target > 0.0 ? s.weightSum / (float(s.M) * s.target) : 0.0;
+  r.normal  = normal;
+  r.depth   = depth;
+  return r;
+}
+
+// Reservoirs are only shared between pixels of the same surface
+bool similarSurface(Reservoir r, vec3 normal, float depth)
+{
+  return r.depth > 0.0 && dot(r.normal, normal) > 0.9 && abs(r.depth - depth) < 0.1 * depth;
+}
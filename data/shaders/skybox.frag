@@ -1,8 +1,13 @@
 #version 450
+#extension GL_GOOGLE_include_directive : enable
 
 layout(location = 0) in vec2 inUV;
 
-layout(set = 0, binding = 1) uniform sampler2D sky;
+layout(set = 0, binding = 1) uniform sampler2D sky;     // Physical cache of the virtual sky
+layout(set = 0, binding = 3) readonly buffer VTPageTable { uint data[]; } vtPages;
+layout(set = 0, binding = 4) buffer VTFeedback { uint requested[]; } vtFeedback;
+
+#include "virtual_texture.glsl"
 
 layout(location = 0) out vec4 outPosition;
 layout(location = 1) out vec4 outNormal;
@@ -15,7 +20,11 @@ void main()
 {
     outPosition     = vec4(0);
     outNormal       = vec4(0);
-    outFragColor    = texture(sky, inUV);
+    // Level from the screen space footprint of the finest level
+    vec2 texels     = inUV * vec2(vtLevelSize(0));
+    float lod       = log2(max(max(length(dFdx(texels)), length(dFdy(texels))), 1.0));
+
+    outFragColor    = sampleVirtualTexture(sky, inUV, lod);
     outMotion       = vec4(0);
     outMaterial     = vec4(0);
     outEmissive     = vec4(0);
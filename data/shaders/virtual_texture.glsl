@@ -0,0 +1,67 @@
+// Virtual texture lookup, mirrors VirtualTexture on the CPU.
+// The including shader declares, with its own bindings:
+//   buffer VTPageTable { uint data[]; } vtPages;
+//   buffer VTFeedback { uint requested[]; } vtFeedback;
+
+// Page table header
+#define VT_WIDTH          0
+#define VT_HEIGHT         1
+#define VT_LEVELS         2
+#define VT_PAYLOAD        3
+#define VT_BORDER         4
+#define VT_SLOTS_PER_ROW  5
+#define VT_CACHE_SIZE     6
+#define VT_PAGE_SIZE      7
+#define VT_FIRST_PAGE     8
+#define VT_HEADER_SIZE    24
+#define VT_NOT_RESIDENT   0xFFFFFFFFu
+
+uvec2 vtLevelSize(uint level)
+{
+  return max(uvec2(vtPages.data[VT_WIDTH], vtPages.data[VT_HEIGHT]) >> level, uvec2(1));
+}
+
+// Page of the level under uv, and the position of uv inside the level in texels
+uint vtPage(uint level, vec2 uv, out vec2 texel, out uvec2 pageCoord)
+{
+  const uint payload  = vtPages.data[VT_PAYLOAD];
+  const uvec2 size    = vtLevelSize(level);
+  const uvec2 pages   = (size + payload - 1) / payload;
+
+  texel       = clamp(uv, 0.0, 1.0) * vec2(size);
+  pageCoord   = min(uvec2(texel) / payload, pages - 1);
+  return vtPages.data[VT_FIRST_PAGE + level] + pageCoord.y * pages.x + pageCoord.x;
+}
+
+// Flags the page wanted at lod and samples the finest resident level at or above it
+vec4 sampleVirtualTexture(sampler2D cache, vec2 uv, float lod)
+{
+  const uint levels = vtPages.data[VT_LEVELS];
+  uint level        = uint(clamp(lod, 0.0, float(levels - 1)));
+
+  vec2 texel;
+  uvec2 pageCoord;
+  vtFeedback.requested[vtPage(level, uv, texel, pageCoord)] = 1u;
+
+  // The coarsest page is always resident, the loop ends there at the latest
+  for (; level < levels; level++)
+  {
+    const uint slot = vtPages.data[VT_HEADER_SIZE + vtPage(level, uv, texel, pageCoord)];
+    if (slot == VT_NOT_RESIDENT)
+      continue;
+
+    const uint slotsPerRow  = vtPages.data[VT_SLOTS_PER_ROW];
+    const uvec2 slotCoord   = uvec2(slot % slotsPerRow, slot / slotsPerRow);
+    const vec2 local        = texel - vec2(pageCoord * vtPages.data[VT_PAYLOAD]);
+    const vec2 physical     = vec2(slotCoord * vtPages.data[VT_PAGE_SIZE] + vtPages.data[VT_BORDER]) + local;
+    return textureLod(cache, physical / float(vtPages.data[VT_CACHE_SIZE]), 0.0);
+  }
+
+  return vec4(0);
+}
+
+// Level of a texture covering 360 degrees horizontally seen through a cone of spreadAngle radians
+float vtEquirectLod(float spreadAngle)
+{
+  return log2(max(spreadAngle * float(vtPages.data[VT_WIDTH]) / (2.0 * 3.14159265359), 1.0));
+}
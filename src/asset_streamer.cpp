@@ -0,0 +1,182 @@
+#include "asset_streamer.h"
+
+#include "vk_utils.h"
+
+extern std::vector<std::string> searchPaths;
+
+static bool is_obj(const std::string& filename)
+{
+	return filename.find(".obj") != std::string::npos;
+}
+
+void AssetStreamer::init(const uint32_t nThreads)
+{
+	_jobs.init(nThreads);
+}
+
+void AssetStreamer::shutdown()
+{
+	_jobs.shutdown();
+
+	// Nothing else will consume what the workers finished
+	StreamedAsset* asset;
+	while (_finished.pop(asset))
+	{
+		for (ImageData& image : asset->images)
+			vkutil::free_image(image);
+		delete asset;
+	}
+	_requests.clear();
+}
+
+void AssetStreamer::set_capacity(const uint32_t maxMeshes, const uint32_t maxTextures)
+{
+	_maxMeshes		= maxMeshes;
+	_maxTextures	= maxTextures;
+}
+
+void AssetStreamer::request_mesh(const std::string& filename, std::function<void(Mesh*)>&& onLoaded)
+{
+	const std::string name = vkutil::findFile(filename, searchPaths, true);
+
+	auto loaded = Mesh::_loadedMeshes.find(name);
+	if (loaded != Mesh::_loadedMeshes.end() && loaded->second)
+	{
+		onLoaded(loaded->second);
+		return;
+	}
+
+	const bool inFlight = _requests.count(name) > 0;
+	_requests[name].onMesh.push_back(std::move(onLoaded));
+	if (!inFlight)
+		schedule(name, false);
+}
+
+void AssetStreamer::request_prefab(const std::string& filename, std::function<void(Prefab*)>&& onLoaded, const bool invertNormals)
+{
+	const std::string name = vkutil::findFile(filename, searchPaths, true);
+
+	auto loaded = Prefab::_prefabsMap.find(name);
+	if (loaded != Prefab::_prefabsMap.end() && loaded->second)
+	{
+		onLoaded(loaded->second);
+		return;
+	}
+
+	const bool inFlight = _requests.count(name) > 0;
+	_requests[name].onPrefab.push_back(std::move(onLoaded));
+	if (!inFlight)
+		schedule(name, invertNormals);
+}
+
+void AssetStreamer::schedule(const std::string& name, const bool invertNormals)
+{
+	_jobs.schedule([this, name, invertNormals]() {
+		StreamedAsset* asset = new StreamedAsset();
+		asset->name = name;
+
+		if (is_obj(name))
+		{
+			asset->mesh = Mesh::load(name);
+		}
+		else
+		{
+			asset->prefab = Prefab::load(name, invertNormals);
+
+			// Decode here what loadTextures would otherwise decode on the render thread
+			if (asset->prefab)
+				asset->prefab->decodeImages(asset->images);
+		}
+
+		_finished.push(asset);
+	});
+}
+
+uint32_t AssetStreamer::update(const uint32_t maxAssets)
+{
+	uint32_t inserted = 0;
+	StreamedAsset* asset;
+
+	// A few assets per frame so uploads do not stall a single frame for too long
+	while (inserted < maxAssets && _finished.pop(asset))
+	{
+		Request request = std::move(_requests[asset->name]);
+		_requests.erase(asset->name);
+
+		if (!fits(*asset))
+		{
+			std::cout << "Could not stream " << asset->name << ", mesh or texture capacity reached" << std::endl;
+			discard(asset);
+			inserted++;
+			continue;
+		}
+
+		if (asset->mesh)
+		{
+			Mesh* mesh = Mesh::insert(asset->name, asset->mesh);
+			for (auto& onLoaded : request.onMesh)
+				onLoaded(mesh);
+
+			// OBJ prefabs wrap the mesh that is now registered
+			if (!request.onPrefab.empty())
+			{
+				Prefab* prefab = Prefab::GET(asset->name);
+				for (auto& onLoaded : request.onPrefab)
+					onLoaded(prefab);
+			}
+		}
+		else if (asset->prefab)
+		{
+			Prefab* prefab = Prefab::insert(asset->name, asset->prefab, asset->images);
+			for (auto& onLoaded : request.onPrefab)
+				onLoaded(prefab);
+		}
+		else
+		{
+			std::cout << "Could not stream " << asset->name << std::endl;
+		}
+
+		delete asset;
+		inserted++;
+	}
+
+	return inserted;
+}
+
+// Each asset registers one mesh and at most one texture per decoded image
+bool AssetStreamer::fits(const StreamedAsset& asset) const
+{
+	if (asset.mesh)
+	{
+		auto loaded = Mesh::_loadedMeshes.find(asset.name);
+		if (loaded != Mesh::_loadedMeshes.end() && loaded->second)
+			return true;
+	}
+	else if (asset.prefab)
+	{
+		auto loaded = Prefab::_prefabsMap.find(asset.name);
+		if (loaded != Prefab::_prefabsMap.end() && loaded->second)
+			return true;
+	}
+	else
+	{
+		return true;
+	}
+
+	return Mesh::_meshes.size() < _maxMeshes && Texture::_textures.size() + asset.images.size() <= _maxTextures;
+}
+
+void AssetStreamer::discard(StreamedAsset* asset)
+{
+	for (ImageData& image : asset->images)
+		vkutil::free_image(image);
+
+	delete asset->mesh;
+	if (asset->prefab)
+	{
+		delete asset->prefab->_gltfModel;
+		delete asset->prefab->_mesh;
+		delete asset->prefab;
+	}
+	delete asset;
+}
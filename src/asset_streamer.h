@@ -0,0 +1,50 @@
+#pragma once
+
+#include "vk_mesh.h"
+#include "job_system.h"
+
+// CPU side result of a background load, finished on the render thread
+struct StreamedAsset
+{
+	std::string				name;					// Resolved path, key of the mesh and prefab maps
+	Mesh*					mesh{ nullptr };		// OBJ geometry
+	Prefab*					prefab{ nullptr };		// glTF hierarchy and geometry
+	std::vector<ImageData>	images;					// Textures referenced by the glTF materials
+};
+
+// Loads meshes and prefabs on worker threads. Finished assets come back through a lock-free
+// queue and are uploaded, registered and handed to their callbacks in update().
+class AssetStreamer
+{
+public:
+	void init(const uint32_t nThreads = 0);
+	void shutdown();
+
+	// Assets that would not fit in the renderer descriptor arrays are dropped when they finish
+	void set_capacity(const uint32_t maxMeshes, const uint32_t maxTextures);
+
+	// Render thread. Callbacks run immediately when the asset is already loaded
+	void request_mesh(const std::string& filename, std::function<void(Mesh*)>&& onLoaded);
+	void request_prefab(const std::string& filename, std::function<void(Prefab*)>&& onLoaded, const bool invertNormals = false);
+
+	// Render thread, once per frame. Returns the number of assets inserted
+	uint32_t update(const uint32_t maxAssets = 2);
+	uint32_t pending() const { return static_cast<uint32_t>(_requests.size()); }
+
+private:
+	struct Request
+	{
+		std::vector<std::function<void(Mesh*)>>	onMesh;
+		std::vector<std::function<void(Prefab*)>>	onPrefab;
+	};
+
+	void schedule(const std::string& name, const bool invertNormals);
+	bool fits(const StreamedAsset& asset) const;
+	void discard(StreamedAsset* asset);
+
+	JobSystem								_jobs;
+	MPSCQueue<StreamedAsset*>				_finished;
+	std::unordered_map<std::string, Request> _requests;	// In flight, a file is only loaded once
+	uint32_t								_maxMeshes{ UINT32_MAX };
+	uint32_t								_maxTextures{ UINT32_MAX };
+};
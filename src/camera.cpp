@@ -1,7 +1,7 @@
 
 #include "camera.h"
 
-Camera::Camera(glm::vec3 position, glm::vec3 up, float fov, float yaw, float pitch) : _direction(glm::vec3(0, 0, -1)), _speed(SPEED), _sensitivity(SENSITIVITY)
+Camera::Camera(glm::vec3 position, glm::vec3 up, float fov, float yaw, float pitch) : _direction(glm::vec3(0, 0, -1)), _speed(SPEED), _sensitivity(SENSITIVITY), _near(0.1f), _far(1000.0f)
 {
 	_position	= position;
 	_up			= up;
@@ -53,8 +53,7 @@ glm::mat4 Camera::getView()
 
 glm::mat4 Camera::getProjection(const float ratio)
 {
-	// TODO
-	return glm::perspective(glm::radians(_fov), ratio, 0.1f, 1000.0f);
+	return glm::perspective(glm::radians(_fov), ratio, _near, _far);
 }
 
 void Camera::updateCameraVectors()
@@ -34,6 +34,8 @@ public:
 	float _speed;
 	float _sensitivity;
 	float _fov;
+	float _near;
+	float _far;
 
 	void processKeyboard(Camera_Movement direction, const float dt);
 	void rotate(float xoffset, float yoffset, bool constrainPitch = true);
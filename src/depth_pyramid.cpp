@@ -0,0 +1,183 @@
+#include "depth_pyramid.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "vk_utils.h"
+
+#include <algorithm>
+#include <iostream>
+
+extern std::vector<std::string> searchPaths;
+
+struct ReduceConstants
+{
+	glm::ivec2 sourceSize;
+	glm::ivec2 destinationSize;
+};
+
+void DepthPyramid::init(VkImageView depthView, const uint32_t width, const uint32_t height)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	_width	= width;
+	_height	= height;
+
+	uint32_t levels = 1;
+	while ((std::max(_width, _height) >> levels) > 0)
+		levels++;
+
+	VkImageCreateInfo imageInfo = vkinit::image_create_info(VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, { _width, _height, 1 });
+	imageInfo.mipLevels			= levels;
+
+	VmaAllocationCreateInfo allocInfo{};
+	allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VK_CHECK(vmaCreateImage(engine._allocator, &imageInfo, &allocInfo, &_image._image, &_image._allocation, nullptr));
+	_image._mipLevels = levels;
+
+	VkImageViewCreateInfo viewInfo = vkinit::image_view_create_info(VK_FORMAT_R32_SFLOAT, _image._image, VK_IMAGE_ASPECT_COLOR_BIT);
+	viewInfo.subresourceRange.levelCount = levels;
+	VK_CHECK(vkCreateImageView(engine._device, &viewInfo, nullptr, &_view));
+
+	_levelViews.resize(levels);
+	for (uint32_t i = 0; i < levels; i++)
+	{
+		viewInfo.subresourceRange.baseMipLevel	= i;
+		viewInfo.subresourceRange.levelCount	= 1;
+		VK_CHECK(vkCreateImageView(engine._device, &viewInfo, nullptr, &_levelViews[i]));
+	}
+
+	// Texels are fetched, the sampler only has to reach every level
+	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	samplerInfo.mipmapMode	= VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxLod		= static_cast<float>(levels);
+	VK_CHECK(vkCreateSampler(engine._device, &samplerInfo, nullptr, &_sampler));
+
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		VkImageMemoryBarrier barrier{};
+		barrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image				= _image._image;
+		barrier.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout			= VK_IMAGE_LAYOUT_GENERAL;
+		barrier.srcAccessMask		= 0;
+		barrier.dstAccessMask		= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, levels, 0, 1 };
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	});
+
+	// binding = 0 Source level
+	// binding = 1 Destination level
+	std::vector<VkDescriptorPoolSize> poolSizes = {
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, levels},
+		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, levels}
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo = vkinit::descriptor_pool_create_info(poolSizes, levels);
+	VK_CHECK(vkCreateDescriptorPool(engine._device, &poolInfo, nullptr, &_descriptorPool));
+
+	VkDescriptorSetLayoutBinding sourceBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding destinationBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+
+	std::vector<VkDescriptorSetLayoutBinding> bindings = { sourceBinding, destinationBinding };
+	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(static_cast<uint32_t>(bindings.size()), bindings);
+	VK_CHECK(vkCreateDescriptorSetLayout(engine._device, &setInfo, nullptr, &_descriptorSetLayout));
+
+	std::vector<VkDescriptorSetLayout> setLayouts(levels, _descriptorSetLayout);
+	VkDescriptorSetAllocateInfo setAllocInfo = vkinit::descriptor_set_allocate_info(_descriptorPool, setLayouts.data(), levels);
+	_descriptorSets.resize(levels);
+	VK_CHECK(vkAllocateDescriptorSets(engine._device, &setAllocInfo, _descriptorSets.data()));
+
+	for (uint32_t i = 0; i < levels; i++)
+	{
+		VkDescriptorImageInfo sourceInfo = i == 0 ?
+			vkinit::descriptor_image_info(depthView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, _sampler) :
+			vkinit::descriptor_image_info(_levelViews[i - 1], VK_IMAGE_LAYOUT_GENERAL, _sampler);
+		VkDescriptorImageInfo destinationInfo = vkinit::descriptor_image_info(_levelViews[i], VK_IMAGE_LAYOUT_GENERAL);
+
+		VkWriteDescriptorSet sourceWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _descriptorSets[i], &sourceInfo, 0);
+		VkWriteDescriptorSet destinationWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _descriptorSets[i], &destinationInfo, 1);
+
+		std::vector<VkWriteDescriptorSet> writes = { sourceWrite, destinationWrite };
+		vkUpdateDescriptorSets(engine._device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+	}
+
+	// Compute pipeline
+	VkShaderModule reduceShaderModule;
+	if (!engine.load_shader_module(vkutil::findFile("depth_reduce.comp.spv", searchPaths, true).c_str(), &reduceShaderModule)) {
+		std::cout << "Could not load depth reduction compute shader!" << std::endl;
+	}
+
+	VkPushConstantRange pushConstantRange = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ReduceConstants) };
+
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount			= 1;
+	pipelineLayoutCI.pSetLayouts			= &_descriptorSetLayout;
+	pipelineLayoutCI.pushConstantRangeCount	= 1;
+	pipelineLayoutCI.pPushConstantRanges	= &pushConstantRange;
+	VK_CHECK(vkCreatePipelineLayout(engine._device, &pipelineLayoutCI, nullptr, &_pipelineLayout));
+
+	VkComputePipelineCreateInfo computePipelineCI = {};
+	computePipelineCI.sType		= VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCI.stage		= vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, reduceShaderModule);
+	computePipelineCI.layout	= _pipelineLayout;
+	VK_CHECK(vkCreateComputePipelines(engine._device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_pipeline));
+
+	vkDestroyShaderModule(engine._device, reduceShaderModule, nullptr);
+}
+
+void DepthPyramid::destroy()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	vkDestroyPipeline(engine._device, _pipeline, nullptr);
+	vkDestroyPipelineLayout(engine._device, _pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(engine._device, _descriptorSetLayout, nullptr);
+	vkDestroyDescriptorPool(engine._device, _descriptorPool, nullptr);
+	vkDestroySampler(engine._device, _sampler, nullptr);
+	for (VkImageView view : _levelViews)
+		vkDestroyImageView(engine._device, view, nullptr);
+	vkDestroyImageView(engine._device, _view, nullptr);
+	vmaDestroyImage(engine._allocator, _image._image, _image._allocation);
+
+	_levelViews.clear();
+	_descriptorSets.clear();
+}
+
+void DepthPyramid::record(VkCommandBuffer cmd)
+{
+	// The culling shader of the previous frame may still read the levels about to be written
+	VkMemoryBarrier readBarrier{};
+	readBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	readBarrier.srcAccessMask	= 0;
+	readBarrier.dstAccessMask	= 0;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &readBarrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline);
+
+	ReduceConstants constants = { glm::ivec2(_width, _height), glm::ivec2(_width, _height) };
+	for (uint32_t i = 0; i < _image._mipLevels; i++)
+	{
+		constants.destinationSize = glm::ivec2(std::max(_width >> i, 1u), std::max(_height >> i, 1u));
+
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipelineLayout, 0, 1, &_descriptorSets[i], 0, nullptr);
+		vkCmdPushConstants(cmd, _pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ReduceConstants), &constants);
+		vkCmdDispatch(cmd, (constants.destinationSize.x + GROUP_SIZE - 1) / GROUP_SIZE, (constants.destinationSize.y + GROUP_SIZE - 1) / GROUP_SIZE, 1);
+
+		// The next level, or the culling shader, reads this one
+		VkImageMemoryBarrier barrier{};
+		barrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image				= _image._image;
+		barrier.oldLayout			= VK_IMAGE_LAYOUT_GENERAL;
+		barrier.newLayout			= VK_IMAGE_LAYOUT_GENERAL;
+		barrier.srcAccessMask		= VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask		= VK_ACCESS_SHADER_READ_BIT;
+		barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, i, 1, 0, 1 };
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		constants.sourceSize = constants.destinationSize;
+	}
+}
+
+VkDescriptorImageInfo DepthPyramid::get_descriptor_info() const
+{
+	return vkinit::descriptor_image_info(_view, VK_IMAGE_LAYOUT_GENERAL, _sampler);
+}
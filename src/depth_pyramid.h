@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Max reduction of the geometry pass depth, read by the cluster culling shader to reject meshlets
+// hidden behind what was already drawn. Level 0 has the size of the depth attachment and every
+// level is half the previous one rounded down. A texel keeps the farthest depth of the texels it
+// overlaps in the level below, three per axis when that size is odd, so no depth is skipped.
+class DepthPyramid
+{
+public:
+	static constexpr uint32_t GROUP_SIZE = 8;	// Mirrored in depth_reduce.comp
+
+	// The depth view is sampled in DEPTH_STENCIL_READ_ONLY_OPTIMAL
+	void init(VkImageView depthView, const uint32_t width, const uint32_t height);
+	void destroy();
+
+	// Outside a render pass, once the depth attachment was written. Leaves every level ready to be sampled by compute
+	void record(VkCommandBuffer cmd);
+
+	VkDescriptorImageInfo get_descriptor_info() const;
+
+	uint32_t get_width() const { return _width; }
+	uint32_t get_height() const { return _height; }
+	uint32_t get_levels() const { return _image._mipLevels; }
+
+private:
+	uint32_t					_width{ 0 };
+	uint32_t					_height{ 0 };
+	AllocatedImage				_image;				// R32_SFLOAT, always in GENERAL
+	VkImageView					_view{ VK_NULL_HANDLE };	// Every level, for the culling shader
+	std::vector<VkImageView>	_levelViews;		// One level each, written by the reduction
+	VkSampler					_sampler{ VK_NULL_HANDLE };
+
+	VkDescriptorPool			_descriptorPool{ VK_NULL_HANDLE };
+	VkDescriptorSetLayout		_descriptorSetLayout{ VK_NULL_HANDLE };
+	std::vector<VkDescriptorSet>	_descriptorSets;	// Level i reads level i - 1, level 0 the depth attachment
+	VkPipelineLayout			_pipelineLayout{ VK_NULL_HANDLE };
+	VkPipeline					_pipeline{ VK_NULL_HANDLE };
+};
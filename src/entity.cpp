@@ -1,42 +1,25 @@
 
 #include "entity.h"
 
-#include "vk_engine.h"
-
-Object::Object(glm::vec3 position, Mesh* mesh, Material* material) :
-	material(material)
+uint32_t ObjectStore::add(Prefab* prefab, const glm::mat4& transform)
 {
-	prefab = new Prefab();
-	prefab->_mesh = mesh;
-	m_matrix = glm::translate(glm::mat4(1), position);
-}
+	transforms.push_back(transform);
+	prefabs.push_back(prefab);
+	materials.push_back(prefab->_root.empty() || prefab->_root[0]->_primitives.empty() ? nullptr :
+		Material::_materials[prefab->_root[0]->_primitives[0]->materialID]);
 
-void Object::draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::mat4 model)
-{
-	if(prefab) 
-	{
-		prefab->draw(cmd, pipelineLayout, model);
-	}
+	return size() - 1;
 }
 
-Light::Light(lightType type, glm::vec3 color /*white*/, glm::vec3 position/*0,0,0*/, float intensity/*1000*/, float maxDistance/*500*/, float radius/*1.0*/) :
-	type{ type },
-	color{ color },
-	position{ position },
-	intensity{ intensity },
-	maxDistance{ maxDistance },
-	radius{radius}
+uint32_t LightStore::add(const glm::vec3& position, const glm::vec3& color, const float intensity, const float radius,
+	const lightType type, const float maxDistance)
 {
-	this->m_matrix		= glm::translate(glm::mat4(1), position);
-	this->m_selected	= false;
-	this->m_visible		= true;
-}
+	transforms.push_back(glm::translate(glm::mat4(1), position));
+	types.push_back(type);
+	colors.push_back(color);
+	intensities.push_back(intensity);
+	maxDistances.push_back(maxDistance);
+	radii.push_back(radius);
 
-void Light::update()
-{
-	this->position = (glm::vec3)m_matrix[3];
+	return size() - 1;
 }
-
-void Light::setColor(glm::vec3 color) {
-	color = color;
-}
\ No newline at end of file
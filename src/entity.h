@@ -22,48 +22,40 @@ struct EntityIndices {
 	int albedoIdx;
 };
 
-class Entity 
+// Scene entities as parallel component arrays: entry i of every array of a store belongs to entity i.
+// Entities are only appended, their index stays valid and per-frame passes are linear scans.
+struct ObjectStore
 {
-public:
-	glm::mat4	m_matrix;
-	bool		m_visible;
-	bool		m_selected;
+	std::vector<glm::mat4>	transforms;
+	std::vector<Prefab*>	prefabs;	// Geometry and node hierarchy drawn
+	std::vector<Material*>	materials;	// Material edited from the GUI, the first of the prefab
 
-	virtual void update() = 0;
-	virtual void setColor(glm::vec3 color) = 0;
-	virtual void draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::mat4 model) = 0;
+	uint32_t add(Prefab* prefab, const glm::mat4& transform = glm::mat4(1));
+	uint32_t size() const { return static_cast<uint32_t>(prefabs.size()); }
 };
 
-// TODO: Object class
-class Object : public Entity
+struct LightStore
 {
-public:
-	Prefab*			prefab;
-	Material*		material;
-	int				materialIdx{ 0 };
-	int				id{ 0 };
-
-	Object(glm::vec3 position = glm::vec3(0), Mesh* mesh = NULL, Material* material = NULL);
-
-	void update() {};
-	void setColor(glm::vec3 color) {};
-	void draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::mat4 model);
-
+	std::vector<glm::mat4>	transforms;	// Edited by the gizmo, the position is the translation
+	std::vector<lightType>	types;
+	std::vector<glm::vec3>	colors;
+	std::vector<float>		intensities;
+	std::vector<float>		maxDistances;
+	std::vector<float>		radii;
+
+	uint32_t add(const glm::vec3& position, const glm::vec3& color = glm::vec3(1), const float intensity = 1000.0f, const float radius = 1.0f,
+		const lightType type = POINT_LIGHT, const float maxDistance = 500.0f);
+	uint32_t size() const { return static_cast<uint32_t>(types.size()); }
 };
 
-class Light : public Entity
-{
-public:
-	lightType type;
-	glm::vec3 color;
-	glm::vec3 position;
-	float intensity;
-	float maxDistance;
-	float radius;
-
-	Light(lightType type = POINT_LIGHT, glm::vec3 color = glm::vec3(1), glm::vec3 position = glm::vec3(0), float intensity = 1000.0f, float maxDistance = 500.0f, float radius = 1.0f);
+enum entityType {
+	NO_ENTITY,
+	OBJECT_ENTITY,
+	LIGHT_ENTITY
+};
 
-	void update();
-	void setColor(glm::vec3 color);
-	void draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::mat4 model) {};
+// Refers to an entity by store and index, unlike pointers into the arrays it survives insertions
+struct EntityHandle {
+	entityType	type{ NO_ENTITY };
+	uint32_t	index{ 0 };
 };
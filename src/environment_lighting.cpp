@@ -0,0 +1,369 @@
+#include "environment_lighting.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "vk_textures.h"
+#include "texture_cache.h"
+#include "job_system.h"
+#include "stb_image.h"
+
+#include <glm/glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <fstream>
+
+static const float PI = 3.14159265359f;
+
+// Linear radiance of an equirect map
+struct RadianceImage
+{
+	uint32_t				width{ 0 };
+	uint32_t				height{ 0 };
+	std::vector<glm::vec3>	texels;
+};
+
+// Same mapping as the shaders, uv = (0.5 + atan(x, z) / 2pi, 0.5 - asin(y) / pi)
+static glm::vec3 equirect_direction(const float u, const float v)
+{
+	const float phi		= (u - 0.5f) * 2.0f * PI;
+	const float theta	= (0.5f - v) * PI;
+	return { cosf(theta) * sinf(phi), sinf(theta), cosf(theta) * cosf(phi) };
+}
+
+static glm::vec2 equirect_uv(const glm::vec3& d)
+{
+	return { 0.5f + atan2f(d.x, d.z) / (2.0f * PI), 0.5f - asinf(glm::clamp(d.y, -1.0f, 1.0f)) / PI };
+}
+
+// HDR files are read as they are, LDR ones are linearized. Every factor x factor block is averaged
+// so the result is at most maxWidth wide
+static bool load_radiance(const std::string& filename, const uint32_t maxWidth, RadianceImage& outImage)
+{
+	int width, height, channels;
+	float* hdr			= nullptr;
+	stbi_uc* ldr		= nullptr;
+	if (stbi_is_hdr(filename.c_str()))
+		hdr = stbi_loadf(filename.c_str(), &width, &height, &channels, STBI_rgb);
+	else
+		ldr = stbi_load(filename.c_str(), &width, &height, &channels, STBI_rgb);
+
+	if (!hdr && !ldr)
+	{
+		std::cout << "Failed to load environment file: " << filename << std::endl;
+		return false;
+	}
+
+	float linear[256];
+	for (int i = 0; i < 256; i++)
+		linear[i] = powf(i / 255.0f, 2.2f);
+
+	const uint32_t factor	= std::max(static_cast<uint32_t>(width) / maxWidth, 1u);
+	outImage.width			= std::max(static_cast<uint32_t>(width) / factor, 1u);
+	outImage.height			= std::max(static_cast<uint32_t>(height) / factor, 1u);
+	outImage.texels.assign(static_cast<size_t>(outImage.width) * outImage.height, glm::vec3(0.0f));
+
+	parallel_for(outImage.height, [&](const uint32_t y) {
+		for (uint32_t x = 0; x < outImage.width; x++)
+		{
+			glm::vec3 sum(0.0f);
+			for (uint32_t j = 0; j < factor; j++)
+			{
+				const size_t row = static_cast<size_t>(y * factor + j) * width;
+				for (uint32_t i = 0; i < factor; i++)
+				{
+					const size_t src = (row + x * factor + i) * 3;
+					sum += hdr ? glm::vec3(hdr[src], hdr[src + 1], hdr[src + 2]) : glm::vec3(linear[ldr[src]], linear[ldr[src + 1]], linear[ldr[src + 2]]);
+				}
+			}
+			outImage.texels[static_cast<size_t>(y) * outImage.width + x] = sum / static_cast<float>(factor * factor);
+		}
+	});
+
+	stbi_image_free(hdr ? static_cast<void*>(hdr) : static_cast<void*>(ldr));
+	return true;
+}
+
+// 2x2 box filter, odd sizes clamp the last row and column
+static RadianceImage downsample_radiance(const RadianceImage& src)
+{
+	RadianceImage dst;
+	dst.width	= std::max(src.width / 2, 1u);
+	dst.height	= std::max(src.height / 2, 1u);
+	dst.texels.resize(static_cast<size_t>(dst.width) * dst.height);
+
+	for (uint32_t y = 0; y < dst.height; y++)
+	{
+		const uint32_t y0 = std::min(y * 2, src.height - 1), y1 = std::min(y * 2 + 1, src.height - 1);
+		for (uint32_t x = 0; x < dst.width; x++)
+		{
+			const uint32_t x0 = std::min(x * 2, src.width - 1), x1 = std::min(x * 2 + 1, src.width - 1);
+			dst.texels[static_cast<size_t>(y) * dst.width + x] = 0.25f * (
+				src.texels[y0 * src.width + x0] + src.texels[y0 * src.width + x1] +
+				src.texels[y1 * src.width + x0] + src.texels[y1 * src.width + x1]);
+		}
+	}
+
+	return dst;
+}
+
+// Wraps horizontally, clamps at the poles
+static glm::vec3 sample_bilinear(const RadianceImage& image, const glm::vec2& uv)
+{
+	const int w = static_cast<int>(image.width), h = static_cast<int>(image.height);
+	const float x	= uv.x * w - 0.5f;
+	const float y	= glm::clamp(uv.y * h - 0.5f, 0.0f, static_cast<float>(h - 1));
+	const int x0	= static_cast<int>(floorf(x));
+	const int y0	= static_cast<int>(floorf(y));
+	const float fx	= x - x0;
+	const float fy	= y - y0;
+
+	auto texel = [&](int tx, int ty) {
+		tx = ((tx % w) + w) % w;
+		ty = std::min(ty, h - 1);
+		return image.texels[static_cast<size_t>(ty) * w + tx];
+	};
+
+	return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx), glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx), fy);
+}
+
+static glm::vec3 sample_trilinear(const std::vector<RadianceImage>& chain, const glm::vec2& uv, const float lod)
+{
+	const float level	= glm::clamp(lod, 0.0f, static_cast<float>(chain.size() - 1));
+	const uint32_t l0	= static_cast<uint32_t>(level);
+	const uint32_t l1	= std::min(l0 + 1, static_cast<uint32_t>(chain.size() - 1));
+	return glm::mix(sample_bilinear(chain[l0], uv), sample_bilinear(chain[l1], uv), level - l0);
+}
+
+static void sh_basis(const glm::vec3& d, float out[9])
+{
+	out[0] = 0.282095f;
+	out[1] = 0.488603f * d.y;
+	out[2] = 0.488603f * d.z;
+	out[3] = 0.488603f * d.x;
+	out[4] = 1.092548f * d.x * d.y;
+	out[5] = 1.092548f * d.y * d.z;
+	out[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+	out[7] = 1.092548f * d.x * d.z;
+	out[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+// Every texel weighted by its solid angle, then convolved with the clamped cosine lobe
+static GPUEnvironmentData project_sh(const RadianceImage& image)
+{
+	glm::dvec3 sum[9] = {};
+	const double texelArea = (2.0 * PI / image.width) * (PI / image.height);
+
+	for (uint32_t y = 0; y < image.height; y++)
+	{
+		const float v			= (y + 0.5f) / image.height;
+		const double solidAngle	= texelArea * cos((0.5 - v) * PI);
+		for (uint32_t x = 0; x < image.width; x++)
+		{
+			float basis[9];
+			sh_basis(equirect_direction((x + 0.5f) / image.width, v), basis);
+
+			const glm::dvec3 radiance = glm::dvec3(image.texels[static_cast<size_t>(y) * image.width + x]) * solidAngle;
+			for (int i = 0; i < 9; i++)
+				sum[i] += radiance * static_cast<double>(basis[i]);
+		}
+	}
+
+	// Divided by pi so albedo * irradiance stays the diffuse term the shaders already used
+	const float band[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+
+	GPUEnvironmentData data;
+	for (int i = 0; i < 9; i++)
+		data.sh[i] = glm::vec4(glm::vec3(sum[i]) * band[i], 0.0f);
+
+	return data;
+}
+
+static glm::vec2 hammersley(const uint32_t i, const uint32_t n)
+{
+	uint32_t bits = i;
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return { static_cast<float>(i) / n, bits * 2.3283064365386963e-10f };
+}
+
+// Split sum prefilter, the view is assumed along the normal. Samples read the source level that
+// matches their solid angle so few of them are enough without aliasing
+static glm::vec3 prefilter(const std::vector<RadianceImage>& chain, const glm::vec3& N, const float roughness, const float baseLod)
+{
+	if (roughness == 0.0f)
+		return sample_trilinear(chain, equirect_uv(N), baseLod);
+
+	const glm::vec3 up			= fabsf(N.y) < 0.999f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+	const glm::vec3 tangent		= glm::normalize(glm::cross(up, N));
+	const glm::vec3 bitangent	= glm::cross(N, tangent);
+
+	const float a2				= roughness * roughness * roughness * roughness;
+	const float texelSolidAngle	= 4.0f * PI / (chain[0].width * chain[0].height);
+
+	glm::vec3 sum(0.0f);
+	float weight = 0.0f;
+	for (uint32_t i = 0; i < EnvironmentLighting::PREFILTER_SAMPLES; i++)
+	{
+		const glm::vec2 xi		= hammersley(i, EnvironmentLighting::PREFILTER_SAMPLES);
+		const float phi			= 2.0f * PI * xi.x;
+		const float cosTheta	= sqrtf((1.0f - xi.y) / (1.0f + (a2 - 1.0f) * xi.y));
+		const float sinTheta	= sqrtf(1.0f - cosTheta * cosTheta);
+
+		const glm::vec3 H = tangent * (cosf(phi) * sinTheta) + bitangent * (sinf(phi) * sinTheta) + N * cosTheta;
+		const glm::vec3 L = 2.0f * glm::dot(N, H) * H - N;
+
+		const float NdotL = glm::dot(N, L);
+		if (NdotL <= 0.0f)
+			continue;
+
+		// With V = N the pdf of L is D / 4
+		const float d				= cosTheta * cosTheta * (a2 - 1.0f) + 1.0f;
+		const float pdf				= a2 / (PI * d * d) / 4.0f;
+		const float sampleSolidAngle = 1.0f / (EnvironmentLighting::PREFILTER_SAMPLES * pdf);
+		const float lod				= std::max(0.5f * log2f(sampleSolidAngle / texelSolidAngle) + 1.0f, baseLod);
+
+		sum		+= sample_trilinear(chain, equirect_uv(L), lod) * NdotL;
+		weight	+= NdotL;
+	}
+
+	return weight > 0.0f ? sum / weight : glm::vec3(0.0f);
+}
+
+static void compute_specular(const RadianceImage& source, ImageData& outImage)
+{
+	std::vector<RadianceImage> chain = { source };
+	while (chain.back().width > 1 && chain.back().height > 1)
+		chain.push_back(downsample_radiance(chain.back()));
+
+	outImage.width	= EnvironmentLighting::PREFILTER_WIDTH;
+	outImage.height	= EnvironmentLighting::PREFILTER_WIDTH / 2;
+	outImage.format	= VK_FORMAT_R16G16B16A16_SFLOAT;
+	outImage.levels.resize(EnvironmentLighting::PREFILTER_LEVELS);
+
+	for (uint32_t level = 0; level < EnvironmentLighting::PREFILTER_LEVELS; level++)
+	{
+		const uint32_t width	= std::max(static_cast<uint32_t>(outImage.width) >> level, 1u);
+		const uint32_t height	= std::max(static_cast<uint32_t>(outImage.height) >> level, 1u);
+		const float roughness	= static_cast<float>(level) / (EnvironmentLighting::PREFILTER_LEVELS - 1);
+		const float baseLod		= log2f(static_cast<float>(source.width) / width);
+
+		std::vector<unsigned char>& out = outImage.levels[level];
+		out.resize(static_cast<size_t>(width) * height * 4 * sizeof(uint16_t));
+		uint16_t* texels = reinterpret_cast<uint16_t*>(out.data());
+
+		parallel_for(height, [&](const uint32_t y) {
+			for (uint32_t x = 0; x < width; x++)
+			{
+				const glm::vec3 N = equirect_direction((x + 0.5f) / width, (y + 0.5f) / height);
+				const glm::vec3 c = prefilter(chain, N, roughness, baseLod);
+
+				uint16_t* texel = texels + (static_cast<size_t>(y) * width + x) * 4;
+				texel[0] = glm::packHalf1x16(c.r);
+				texel[1] = glm::packHalf1x16(c.g);
+				texel[2] = glm::packHalf1x16(c.b);
+				texel[3] = glm::packHalf1x16(1.0f);
+			}
+		});
+	}
+}
+
+bool EnvironmentLighting::init(const std::string& irradianceFile, const std::string& radianceFile)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	if (!load_sh(irradianceFile) || !load_specular(radianceFile))
+		return false;
+
+	engine.create_buffer(sizeof(GPUEnvironmentData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _shBuffer, false);
+
+	void* data;
+	vmaMapMemory(engine._allocator, _shBuffer._allocation, &data);
+	memcpy(data, &_sh, sizeof(GPUEnvironmentData));
+	vmaUnmapMemory(engine._allocator, _shBuffer._allocation);
+
+	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_LINEAR);
+	samplerInfo.addressModeV	= VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.mipmapMode		= VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	samplerInfo.maxLod			= static_cast<float>(PREFILTER_LEVELS - 1);
+	VK_CHECK(vkCreateSampler(engine._device, &samplerInfo, nullptr, &_sampler));
+
+	return true;
+}
+
+void EnvironmentLighting::destroy()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	vkDestroySampler(engine._device, _sampler, nullptr);
+	vkDestroyImageView(engine._device, _specularView, nullptr);
+	vmaDestroyImage(engine._allocator, _specular._image, _specular._allocation);
+	vmaDestroyBuffer(engine._allocator, _shBuffer._buffer, _shBuffer._allocation);
+}
+
+bool EnvironmentLighting::load_sh(const std::string& filename)
+{
+	const std::string cacheFilename = filename + ".sh9";
+	if (vkutil::is_cache_valid(cacheFilename, filename))
+	{
+		std::ifstream file(cacheFilename, std::ios::binary);
+		file.read(reinterpret_cast<char*>(&_sh), sizeof(GPUEnvironmentData));
+		if (file.gcount() == sizeof(GPUEnvironmentData))
+			return true;
+	}
+
+	RadianceImage image;
+	if (!load_radiance(filename, UINT32_MAX, image))
+		return false;
+
+	_sh = project_sh(image);
+
+	std::ofstream file(cacheFilename, std::ios::binary);
+	if (!file.write(reinterpret_cast<const char*>(&_sh), sizeof(GPUEnvironmentData)))
+		std::cout << "Could not write environment cache " << cacheFilename << std::endl;
+
+	return true;
+}
+
+bool EnvironmentLighting::load_specular(const std::string& filename)
+{
+	ImageData image;
+	const std::string cacheFilename = filename + ".ggx.ktx2";
+	const bool cached = vkutil::is_cache_valid(cacheFilename, filename) && vkutil::read_ktx2(cacheFilename, image) &&
+		image.format == VK_FORMAT_R16G16B16A16_SFLOAT && image.width == PREFILTER_WIDTH && image.levels.size() == PREFILTER_LEVELS;
+
+	if (!cached)
+	{
+		RadianceImage source;
+		if (!load_radiance(filename, SOURCE_WIDTH, source))
+			return false;
+
+		image = ImageData();
+		compute_specular(source, image);
+
+		if (!vkutil::write_ktx2(cacheFilename, image))
+			std::cout << "Could not write environment cache " << cacheFilename << std::endl;
+	}
+
+	image.name = cacheFilename;
+	if (!vkutil::upload_image(*VulkanEngine::engine, image, _specular))
+		return false;
+
+	VkImageViewCreateInfo viewInfo = vkinit::image_view_create_info(image.format, _specular._image, VK_IMAGE_ASPECT_COLOR_BIT);
+	viewInfo.subresourceRange.levelCount = _specular._mipLevels;
+	VK_CHECK(vkCreateImageView(VulkanEngine::engine->_device, &viewInfo, nullptr, &_specularView));
+
+	return true;
+}
+
+VkDescriptorBufferInfo EnvironmentLighting::get_sh_info() const
+{
+	return { _shBuffer._buffer, 0, sizeof(GPUEnvironmentData) };
+}
+
+VkDescriptorImageInfo EnvironmentLighting::get_specular_info() const
+{
+	return { _sampler, _specularView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vk_types.h>
+#include <glm/glm/glm.hpp>
+
+// L2 spherical harmonics of the diffuse irradiance divided by pi, rgb in xyz.
+// Evaluated by evalEnvironmentIrradiance in environment.glsl
+struct GPUEnvironmentData {
+	glm::vec4 sh[9];
+};
+
+// Image based lighting precomputed on the CPU at startup. The irradiance map is projected into
+// spherical harmonics and the radiance map is prefiltered with GGX lobes, one roughness per mip.
+// Both results are cached next to their source, a cache older than the source is computed again.
+class EnvironmentLighting
+{
+public:
+	static constexpr uint32_t PREFILTER_WIDTH	= 256;	// Level 0, equirect so half as high
+	static constexpr uint32_t PREFILTER_LEVELS	= 6;	// Roughness 0 to 1, mirrored in environment.glsl
+	static constexpr uint32_t PREFILTER_SAMPLES	= 64;	// GGX samples per texel
+	static constexpr uint32_t SOURCE_WIDTH		= 1024;	// The radiance map is reduced to this before prefiltering
+
+	bool init(const std::string& irradianceFile, const std::string& radianceFile);
+	void destroy();
+
+	VkDescriptorBufferInfo	get_sh_info() const;
+	VkDescriptorImageInfo	get_specular_info() const;
+
+private:
+	bool load_sh(const std::string& filename);
+	bool load_specular(const std::string& filename);
+
+	GPUEnvironmentData	_sh{};
+	AllocatedBuffer		_shBuffer;
+	AllocatedImage		_specular;
+	VkImageView			_specularView{ VK_NULL_HANDLE };
+	VkSampler			_sampler{ VK_NULL_HANDLE };
+};
@@ -0,0 +1,114 @@
+#include "frustum_culler.h"
+
+#include "job_system.h"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FRUSTUM_CULLER_SSE
+#include <xmmintrin.h>
+#endif
+
+void FrustumCuller::resize(const uint32_t count)
+{
+	_count = count;
+
+	// Padding boxes have no extent and sit at the origin, whatever they return is never read
+	const size_t padded = (count + 3) & ~3u;
+	for (std::vector<float>* v : { &_centerX, &_centerY, &_centerZ, &_extentX, &_extentY, &_extentZ })
+		v->assign(padded, 0.0f);
+}
+
+void FrustumCuller::set_planes(const glm::vec4 planes[6])
+{
+	for (int i = 0; i < 6; i++)
+		_planes[i] = planes[i];
+}
+
+void FrustumCuller::set_box(const uint32_t i, const glm::mat4& model, const glm::vec3& min, const glm::vec3& max)
+{
+	// Transformed box enclosed in a world space box (Arvo 1990)
+	const glm::vec3 center	= glm::vec3(model * glm::vec4((min + max) * 0.5f, 1.0f));
+	const glm::vec3 half	= (max - min) * 0.5f;
+	const glm::mat3 m		= glm::mat3(model);
+	const glm::vec3 extent	= glm::abs(m[0]) * half.x + glm::abs(m[1]) * half.y + glm::abs(m[2]) * half.z;
+
+	_centerX[i] = center.x;	_centerY[i] = center.y;	_centerZ[i] = center.z;
+	_extentX[i] = extent.x;	_extentY[i] = extent.y;	_extentZ[i] = extent.z;
+}
+
+uint32_t FrustumCuller::cull(std::vector<uint8_t>& visible) const
+{
+	visible.resize((_count + 3) & ~3u);
+
+	if (_count < PARALLEL_MIN)
+	{
+		_lastJobs = 1;
+		return cull_range(0, _count, visible.data());
+	}
+
+	const uint32_t nChunks = (_count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	std::atomic<uint32_t> nVisible{ 0 };
+	parallel_for(nChunks, [&](uint32_t chunk) {
+		const uint32_t first = chunk * CHUNK_SIZE;
+		nVisible.fetch_add(cull_range(first, std::min(first + CHUNK_SIZE, _count), visible.data()), std::memory_order_relaxed);
+		});
+	_lastJobs = nChunks;
+
+	return nVisible.load();
+}
+
+// A box is outside when its center lies further behind a plane than its projected extent
+uint32_t FrustumCuller::cull_range(const uint32_t first, const uint32_t last, uint8_t* visible) const
+{
+	uint32_t nVisible = 0;
+
+#ifdef FRUSTUM_CULLER_SSE
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	for (uint32_t i = first; i < last; i += 4)
+	{
+		const __m128 cx = _mm_loadu_ps(&_centerX[i]);
+		const __m128 cy = _mm_loadu_ps(&_centerY[i]);
+		const __m128 cz = _mm_loadu_ps(&_centerZ[i]);
+		const __m128 ex = _mm_loadu_ps(&_extentX[i]);
+		const __m128 ey = _mm_loadu_ps(&_extentY[i]);
+		const __m128 ez = _mm_loadu_ps(&_extentZ[i]);
+
+		__m128 outside = _mm_setzero_ps();
+		for (const glm::vec4& plane : _planes)
+		{
+			const __m128 nx = _mm_set1_ps(plane.x);
+			const __m128 ny = _mm_set1_ps(plane.y);
+			const __m128 nz = _mm_set1_ps(plane.z);
+
+			const __m128 distance	= _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)), _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(plane.w)));
+			const __m128 radius		= _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, nx), ex), _mm_mul_ps(_mm_andnot_ps(signMask, ny), ey)), _mm_mul_ps(_mm_andnot_ps(signMask, nz), ez));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+		}
+
+		const int mask = _mm_movemask_ps(outside);
+		const uint32_t lanes = std::min(4u, last - i);
+		for (uint32_t lane = 0; lane < lanes; lane++)
+		{
+			visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+			nVisible += visible[i + lane];
+		}
+	}
+#else
+	for (uint32_t i = first; i < last; i++)
+	{
+		bool outside = false;
+		for (const glm::vec4& plane : _planes)
+		{
+			const float distance	= plane.x * _centerX[i] + plane.y * _centerY[i] + plane.z * _centerZ[i] + plane.w;
+			const float radius		= std::abs(plane.x) * _extentX[i] + std::abs(plane.y) * _extentY[i] + std::abs(plane.z) * _extentZ[i];
+			outside |= distance + radius < 0.0f;
+		}
+		visible[i] = outside ? 0 : 1;
+		nVisible += visible[i];
+	}
+#endif
+
+	return nVisible;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Object space boxes of the drawn primitives tested against the camera frustum. Boxes are moved to
+// world space as a center and half extents kept in separate arrays, then tested four at a time
+// with SSE. Large draw lists are split in chunks processed in parallel.
+class FrustumCuller
+{
+public:
+	static constexpr uint32_t PARALLEL_MIN	= 8192;	// Boxes below which a single thread is faster
+	static constexpr uint32_t CHUNK_SIZE	= 2048;	// Boxes per parallel job, a multiple of 4
+
+	void resize(const uint32_t count);
+	void set_planes(const glm::vec4 planes[6]);		// Normalized, pointing inside
+	void set_box(const uint32_t i, const glm::mat4& model, const glm::vec3& min, const glm::vec3& max);
+
+	// Fills one flag per box, returns the number of visible boxes
+	uint32_t cull(std::vector<uint8_t>& visible) const;
+
+	uint32_t get_last_jobs() const { return _lastJobs; }
+
+private:
+	uint32_t cull_range(const uint32_t first, const uint32_t last, uint8_t* visible) const;
+
+	uint32_t			_count{ 0 };
+	glm::vec4			_planes[6];
+	std::vector<float>	_centerX, _centerY, _centerZ;	// Padded to a multiple of 4
+	std::vector<float>	_extentX, _extentY, _extentZ;
+	mutable uint32_t	_lastJobs{ 0 };
+};
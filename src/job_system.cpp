@@ -0,0 +1,119 @@
+#include "job_system.h"
+
+#include <algorithm>
+
+void JobSystem::init(uint32_t nThreads)
+{
+	if (nThreads == 0)
+		nThreads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+	_quit = false;
+	for (uint32_t i = 0; i < nThreads; i++)
+		_workers.emplace_back(&JobSystem::worker_loop, this);
+}
+
+void JobSystem::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+		_jobs.clear();
+	}
+	_wakeup.notify_all();
+
+	for (std::thread& worker : _workers)
+	{
+		if (worker.joinable())
+			worker.join();
+	}
+	_workers.clear();
+}
+
+void JobSystem::schedule(std::function<void()>&& job)
+{
+	_pending.fetch_add(1, std::memory_order_acq_rel);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_jobs.push_back(std::move(job));
+	}
+	_wakeup.notify_one();
+}
+
+void JobSystem::worker_loop()
+{
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wakeup.wait(lock, [this]() { return _quit || !_jobs.empty(); });
+			if (_quit)
+				return;
+
+			job = std::move(_jobs.front());
+			_jobs.pop_front();
+		}
+
+		job();
+		_pending.fetch_sub(1, std::memory_order_acq_rel);
+	}
+}
+
+bool JobSystem::run_one()
+{
+	std::function<void()> job;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_jobs.empty())
+			return false;
+
+		job = std::move(_jobs.front());
+		_jobs.pop_front();
+	}
+
+	job();
+	_pending.fetch_sub(1, std::memory_order_acq_rel);
+	return true;
+}
+
+void JobSystem::parallel_for(const uint32_t count, const std::function<void(uint32_t)>& job, uint32_t nJobs)
+{
+	if (nJobs == 0)
+		nJobs = static_cast<uint32_t>(_workers.size()) + 1;
+	nJobs = std::min(nJobs, count);
+	if (nJobs == 0)
+		return;
+
+	// Items are claimed one at a time, uneven work balances itself
+	std::atomic<uint32_t> next{ 0 };
+	std::atomic<uint32_t> running{ nJobs - 1 };
+	auto loop = [&]() {
+		for (uint32_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+			job(i);
+	};
+
+	for (uint32_t i = 1; i < nJobs; i++)
+	{
+		schedule([&]() {
+			loop();
+			running.fetch_sub(1, std::memory_order_release);
+		});
+	}
+	loop();
+
+	// Jobs still queued are as likely to be run here as by a worker, nested loops never block a worker
+	while (running.load(std::memory_order_acquire) > 0)
+	{
+		if (!run_one())
+			std::this_thread::yield();
+	}
+}
+
+void parallel_for(const uint32_t count, const std::function<void(uint32_t)>& job, uint32_t nJobs)
+{
+	static JobSystem jobs;
+	static std::once_flag started;
+	std::call_once(started, []() { jobs.init(); });
+
+	jobs.parallel_for(count, job, nJobs);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Multiple producer single consumer queue, producers never take a lock.
+// The node popped last stays as the stub the next pop starts from.
+template<typename T>
+class MPSCQueue
+{
+public:
+	MPSCQueue()
+	{
+		_head.store(&_stub, std::memory_order_relaxed);
+		_tail = &_stub;
+	}
+
+	~MPSCQueue()
+	{
+		T item;
+		while (pop(item)) {}
+		if (_tail != &_stub)
+			delete _tail;
+	}
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	// Any thread
+	void push(T item)
+	{
+		Node* node = new Node();
+		node->value = std::move(item);
+		Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	// Consumer thread only. Returns false when empty or while a push is still linking its node
+	bool pop(T& item)
+	{
+		Node* tail = _tail;
+		Node* next = tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+
+		item	= std::move(next->value);
+		_tail	= next;
+		if (tail != &_stub)
+			delete tail;
+		return true;
+	}
+
+private:
+	struct Node
+	{
+		T					value{};
+		std::atomic<Node*>	next{ nullptr };
+	};
+
+	std::atomic<Node*>	_head;
+	Node*				_tail;
+	Node				_stub;
+};
+
+// Fixed pool of worker threads running fire and forget jobs in submission order
+class JobSystem
+{
+public:
+	~JobSystem() { shutdown(); }
+
+	// 0 threads picks one less than the hardware threads, the render thread keeps a core
+	void init(uint32_t nThreads = 0);
+	void shutdown();
+
+	void schedule(std::function<void()>&& job);
+	uint32_t pending() const { return _pending.load(std::memory_order_acquire); }
+
+	// Runs job(i) for every i in [0, count) as at most nJobs jobs, the calling thread takes part.
+	// While the last ones finish it runs other queued jobs, so it can also be called from a job.
+	void parallel_for(const uint32_t count, const std::function<void(uint32_t)>& job, uint32_t nJobs = 0);
+
+	// Runs the oldest queued job on the calling thread, false if there was none
+	bool run_one();
+
+private:
+	void worker_loop();
+
+	std::vector<std::thread>			_workers;
+	std::deque<std::function<void()>>	_jobs;
+	std::mutex							_mutex;
+	std::condition_variable				_wakeup;
+	std::atomic<uint32_t>				_pending{ 0 };
+	bool								_quit{ false };
+};
+
+// JobSystem::parallel_for on a pool shared by the whole process, started on first use
+void parallel_for(const uint32_t count, const std::function<void(uint32_t)>& job, uint32_t nJobs = 0);
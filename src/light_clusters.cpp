@@ -0,0 +1,164 @@
+#include "light_clusters.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "vk_utils.h"
+
+#include <cmath>
+#include <iostream>
+
+extern std::vector<std::string> searchPaths;
+
+struct GPUClusterGrid
+{
+	glm::mat4	view;
+	glm::mat4	inverseProjection;
+	glm::uvec4	size;		// Clusters per axis, lights in w
+	glm::vec4	depth;		// Near, far, log(far / near)
+};
+
+void LightClusters::init(const AllocatedBuffer& lightBuffer, const uint32_t nLights)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	_lightCount = nLights;
+
+	engine.create_buffer(sizeof(GPUClusterGrid), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _gridBuffer, false);
+	engine.create_buffer(sizeof(uint32_t) * STRIDE * get_cluster_count(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _listBuffer, false);
+	engine.create_buffer(sizeof(uint32_t) * 2, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, _overflowBuffer, false);
+
+	void* overflowData;
+	vmaMapMemory(engine._allocator, _overflowBuffer._allocation, &overflowData);
+	memset(overflowData, 0, sizeof(uint32_t) * 2);
+	vmaFlushAllocation(engine._allocator, _overflowBuffer._allocation, 0, VK_WHOLE_SIZE);
+	vmaUnmapMemory(engine._allocator, _overflowBuffer._allocation);
+
+	// binding = 0 Grid
+	// binding = 1 Lights
+	// binding = 2 Cluster lists
+	// binding = 3 Overflow
+	std::vector<VkDescriptorPoolSize> poolSizes = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3}
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo = vkinit::descriptor_pool_create_info(poolSizes, 1);
+	VK_CHECK(vkCreateDescriptorPool(engine._device, &poolInfo, nullptr, &_descriptorPool));
+
+	VkDescriptorSetLayoutBinding gridBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding lightsBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+	VkDescriptorSetLayoutBinding listsBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
+	VkDescriptorSetLayoutBinding overflowBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
+
+	std::vector<VkDescriptorSetLayoutBinding> bindings = { gridBinding, lightsBinding, listsBinding, overflowBinding };
+	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(static_cast<uint32_t>(bindings.size()), bindings);
+	VK_CHECK(vkCreateDescriptorSetLayout(engine._device, &setInfo, nullptr, &_descriptorSetLayout));
+
+	VkDescriptorSetAllocateInfo setAllocInfo = vkinit::descriptor_set_allocate_info(_descriptorPool, &_descriptorSetLayout);
+	VK_CHECK(vkAllocateDescriptorSets(engine._device, &setAllocInfo, &_descriptorSet));
+
+	VkDescriptorBufferInfo gridInfo		= get_grid_info();
+	VkDescriptorBufferInfo lightsInfo	= vkinit::descriptor_buffer_info(lightBuffer._buffer, sizeof(uboLight) * nLights);
+	VkDescriptorBufferInfo listsInfo	= get_lists_info();
+	VkDescriptorBufferInfo overflowInfo	= vkinit::descriptor_buffer_info(_overflowBuffer._buffer, sizeof(uint32_t) * 2);
+
+	VkWriteDescriptorSet gridWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _descriptorSet, &gridInfo, 0);
+	VkWriteDescriptorSet lightsWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSet, &lightsInfo, 1);
+	VkWriteDescriptorSet listsWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSet, &listsInfo, 2);
+	VkWriteDescriptorSet overflowWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSet, &overflowInfo, 3);
+
+	std::vector<VkWriteDescriptorSet> writes = { gridWrite, lightsWrite, listsWrite, overflowWrite };
+	vkUpdateDescriptorSets(engine._device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+	// Compute pipeline
+	VkShaderModule cullShaderModule;
+	if (!engine.load_shader_module(vkutil::findFile("light_cull.comp.spv", searchPaths, true).c_str(), &cullShaderModule)) {
+		std::cout << "Could not load light culling compute shader!" << std::endl;
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount	= 1;
+	pipelineLayoutCI.pSetLayouts	= &_descriptorSetLayout;
+	VK_CHECK(vkCreatePipelineLayout(engine._device, &pipelineLayoutCI, nullptr, &_pipelineLayout));
+
+	VkComputePipelineCreateInfo computePipelineCI = {};
+	computePipelineCI.sType		= VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCI.stage		= vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, cullShaderModule);
+	computePipelineCI.layout	= _pipelineLayout;
+	VK_CHECK(vkCreateComputePipelines(engine._device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_pipeline));
+
+	vkDestroyShaderModule(engine._device, cullShaderModule, nullptr);
+}
+
+void LightClusters::destroy()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	vkDestroyPipeline(engine._device, _pipeline, nullptr);
+	vkDestroyPipelineLayout(engine._device, _pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(engine._device, _descriptorSetLayout, nullptr);
+	vkDestroyDescriptorPool(engine._device, _descriptorPool, nullptr);
+	vmaDestroyBuffer(engine._allocator, _listBuffer._buffer, _listBuffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _overflowBuffer._buffer, _overflowBuffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _gridBuffer._buffer, _gridBuffer._allocation);
+}
+
+void LightClusters::update(const glm::mat4& view, const glm::mat4& projection, const float nearPlane, const float farPlane)
+{
+	GPUClusterGrid grid;
+	grid.view				= view;
+	grid.inverseProjection	= glm::inverse(projection);
+	grid.size				= glm::uvec4(GRID_X, GRID_Y, GRID_Z, _lightCount);
+	grid.depth				= glm::vec4(nearPlane, farPlane, std::log(farPlane / nearPlane), 0);
+
+	void* data;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _gridBuffer._allocation, &data);
+	memcpy(data, &grid, sizeof(GPUClusterGrid));
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _gridBuffer._allocation);
+}
+
+void LightClusters::record(VkCommandBuffer cmd)
+{
+	// The shaders of the previous frame may still read the lists about to be written
+	VkMemoryBarrier readBarrier{};
+	readBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	readBarrier.srcAccessMask	= 0;
+	readBarrier.dstAccessMask	= 0;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &readBarrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipelineLayout, 0, 1, &_descriptorSet, 0, nullptr);
+	vkCmdDispatch(cmd, (get_cluster_count() + GROUP_SIZE - 1) / GROUP_SIZE, 1, 1);
+
+	VkMemoryBarrier cullBarrier{};
+	cullBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	cullBarrier.srcAccessMask	= VK_ACCESS_SHADER_WRITE_BIT;
+	cullBarrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &cullBarrier, 0, nullptr, 0, nullptr);
+}
+
+void LightClusters::read_overflow()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	void* data;
+	vmaMapMemory(engine._allocator, _overflowBuffer._allocation, &data);
+	vmaInvalidateAllocation(engine._allocator, _overflowBuffer._allocation, 0, VK_WHOLE_SIZE);
+	_overflowClusters	= static_cast<uint32_t*>(data)[0];
+	_maxClusterLights	= static_cast<uint32_t*>(data)[1];
+	memset(data, 0, sizeof(uint32_t) * 2);
+	vmaFlushAllocation(engine._allocator, _overflowBuffer._allocation, 0, VK_WHOLE_SIZE);
+	vmaUnmapMemory(engine._allocator, _overflowBuffer._allocation);
+}
+
+VkDescriptorBufferInfo LightClusters::get_grid_info() const
+{
+	return vkinit::descriptor_buffer_info(_gridBuffer._buffer, sizeof(GPUClusterGrid));
+}
+
+VkDescriptorBufferInfo LightClusters::get_lists_info() const
+{
+	return vkinit::descriptor_buffer_info(_listBuffer._buffer, sizeof(uint32_t) * STRIDE * get_cluster_count());
+}
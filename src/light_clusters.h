@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Lights binned into clusters of the view frustum, screen tiles split in depth slices that grow
+// exponentially from the near to the far plane. A compute pass tests the range of every light
+// against the box of every cluster, so deferred lighting, the shadow rays and the denoiser only
+// loop over the lights that can reach the pixel. Directional lights are in every cluster.
+// A cluster keeps at most MAX_LIGHTS, the clusters over it are counted for the debug window.
+class LightClusters
+{
+public:
+	static constexpr uint32_t GRID_X		= 16;
+	static constexpr uint32_t GRID_Y		= 9;
+	static constexpr uint32_t GRID_Z		= 24;
+	static constexpr uint32_t MAX_LIGHTS	= 63;	// Per cluster, mirrored in light_clusters.glsl
+	static constexpr uint32_t STRIDE		= MAX_LIGHTS + 1;	// Count then indices
+	static constexpr uint32_t GROUP_SIZE	= 64;	// Mirrored in light_cull.comp
+
+	void init(const AllocatedBuffer& lightBuffer, const uint32_t nLights);
+	void destroy();
+
+	// Matrices of the geometry pass, the projection with its y axis flipped
+	void update(const glm::mat4& view, const glm::mat4& projection, const float nearPlane, const float farPlane);
+	// Outside a render pass, leaves the lists ready for the fragment, ray tracing and compute shaders
+	void record(VkCommandBuffer cmd);
+	// Reads and clears the overflow of the frames recorded since the last call
+	void read_overflow();
+
+	uint32_t get_overflow_clusters() const { return _overflowClusters; }
+	uint32_t get_max_cluster_lights() const { return _maxClusterLights; }
+
+	VkDescriptorBufferInfo get_grid_info() const;
+	VkDescriptorBufferInfo get_lists_info() const;
+
+	uint32_t get_cluster_count() const { return GRID_X * GRID_Y * GRID_Z; }
+
+private:
+	uint32_t				_lightCount{ 0 };
+	AllocatedBuffer			_gridBuffer;		// GPUClusterGrid, written every frame
+	AllocatedBuffer			_listBuffer;		// STRIDE uints per cluster
+	AllocatedBuffer			_overflowBuffer;	// Clusters over MAX_LIGHTS and most lights reaching one, read back
+	uint32_t				_overflowClusters{ 0 };
+	uint32_t				_maxClusterLights{ 0 };
+
+	VkDescriptorPool		_descriptorPool{ VK_NULL_HANDLE };
+	VkDescriptorSetLayout	_descriptorSetLayout{ VK_NULL_HANDLE };
+	VkDescriptorSet			_descriptorSet{ VK_NULL_HANDLE };
+	VkPipelineLayout		_pipelineLayout{ VK_NULL_HANDLE };
+	VkPipeline				_pipeline{ VK_NULL_HANDLE };
+};
@@ -0,0 +1,267 @@
+#include "light_reservoirs.h"
+
+#include "entity.h"
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "vk_utils.h"
+
+#include <algorithm>
+#include <iostream>
+
+extern std::vector<std::string> searchPaths;
+
+struct GPURestirSettings
+{
+	glm::uvec2	size;
+	uint32_t	frame;
+	uint32_t	candidates;
+	uint32_t	spatialSamples;
+	float		spatialRadius;
+	uint32_t	maxHistory;
+	uint32_t	history;		// The history reservoirs were written by the last frame
+	uint32_t	enabled;		// Read by the hybrid raygen
+};
+
+// Vose's alias table: light i is kept with probability threshold, else alias is taken instead
+struct GPULightAlias
+{
+	float		threshold;
+	uint32_t	alias;
+	float		pdf;			// Probability of drawing the light, its power over the total
+};
+
+void LightReservoirs::init(const uint32_t width, const uint32_t height, const std::vector<VkDescriptorImageInfo>& gbuffers, const VkDescriptorBufferInfo& lights,
+	const uint32_t lightCount, const VkDescriptorBufferInfo& clusterGrid)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	_width		= width;
+	_height		= height;
+	_lightCount	= lightCount;
+	engine.create_buffer(sizeof(GPULightAlias) * _lightCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _aliasBuffer, false);
+
+	// Light, history length, weight, normal and depth of each pixel packed in a uvec4
+	engine.create_buffer(sizeof(GPURestirSettings), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _settingsBuffer, false);
+	for (AllocatedBuffer& buffer : _reservoirBuffers)
+		engine.create_buffer(sizeof(glm::uvec4) * _width * _height, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer, false);
+
+	// binding = 0 Settings
+	// binding = 1 Position, normal and motion G-buffers
+	// binding = 2 Lights
+	// binding = 3 Light cluster grid, for its view matrix
+	// binding = 4 Light alias table
+	// binding = 5 Source reservoirs
+	// binding = 6 Destination reservoirs
+	std::vector<VkDescriptorPoolSize> poolSizes = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 4},
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 6},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 8}
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo = vkinit::descriptor_pool_create_info(poolSizes, 2);
+	VK_CHECK(vkCreateDescriptorPool(engine._device, &poolInfo, nullptr, &_descriptorPool));
+
+	const uint32_t nGbuffers = static_cast<uint32_t>(gbuffers.size());
+
+	std::vector<VkDescriptorSetLayoutBinding> bindings = {
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 1, nGbuffers),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6)
+	};
+
+	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(static_cast<uint32_t>(bindings.size()), bindings);
+	VK_CHECK(vkCreateDescriptorSetLayout(engine._device, &setInfo, nullptr, &_descriptorSetLayout));
+
+	VkDescriptorSetLayout setLayouts[2] = { _descriptorSetLayout, _descriptorSetLayout };
+	VkDescriptorSetAllocateInfo setAllocInfo = vkinit::descriptor_set_allocate_info(_descriptorPool, setLayouts, 2);
+	VK_CHECK(vkAllocateDescriptorSets(engine._device, &setAllocInfo, _descriptorSets));
+
+	VkDescriptorBufferInfo settingsInfo = get_settings_info();
+	VkDescriptorBufferInfo aliasInfo	= vkinit::descriptor_buffer_info(_aliasBuffer._buffer, sizeof(GPULightAlias) * _lightCount);
+	VkDescriptorBufferInfo reservoirInfos[2] = {
+		vkinit::descriptor_buffer_info(_reservoirBuffers[0]._buffer, sizeof(glm::uvec4) * _width * _height),
+		vkinit::descriptor_buffer_info(_reservoirBuffers[1]._buffer, sizeof(glm::uvec4) * _width * _height)
+	};
+
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		// The temporal pass merges the spatial output of the last frame into the first buffer,
+		// the spatial pass writes the second one from the first
+		const VkDescriptorBufferInfo& source		= reservoirInfos[i == 0 ? 1 : 0];
+		const VkDescriptorBufferInfo& destination	= reservoirInfos[i == 0 ? 0 : 1];
+
+		std::vector<VkWriteDescriptorSet> writes = {
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _descriptorSets[i], &settingsInfo, 0),
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _descriptorSets[i], gbuffers.data(), 1, nGbuffers),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSets[i], &lights, 2),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _descriptorSets[i], &clusterGrid, 3),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSets[i], &aliasInfo, 4),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSets[i], &source, 5),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _descriptorSets[i], &destination, 6)
+		};
+		vkUpdateDescriptorSets(engine._device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+	}
+
+	// Compute pipelines
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount	= 1;
+	pipelineLayoutCI.pSetLayouts	= &_descriptorSetLayout;
+	VK_CHECK(vkCreatePipelineLayout(engine._device, &pipelineLayoutCI, nullptr, &_pipelineLayout));
+
+	VkShaderModule temporalShaderModule, spatialShaderModule;
+	if (!engine.load_shader_module(vkutil::findFile("restir_temporal.comp.spv", searchPaths, true).c_str(), &temporalShaderModule)) {
+		std::cout << "Could not load temporal reservoir compute shader!" << std::endl;
+	}
+	if (!engine.load_shader_module(vkutil::findFile("restir_spatial.comp.spv", searchPaths, true).c_str(), &spatialShaderModule)) {
+		std::cout << "Could not load spatial reservoir compute shader!" << std::endl;
+	}
+
+	VkComputePipelineCreateInfo computePipelineCI = {};
+	computePipelineCI.sType		= VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCI.stage		= vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, temporalShaderModule);
+	computePipelineCI.layout	= _pipelineLayout;
+	VK_CHECK(vkCreateComputePipelines(engine._device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_temporalPipeline));
+
+	computePipelineCI.stage		= vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, spatialShaderModule);
+	VK_CHECK(vkCreateComputePipelines(engine._device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_spatialPipeline));
+
+	vkDestroyShaderModule(engine._device, temporalShaderModule, nullptr);
+	vkDestroyShaderModule(engine._device, spatialShaderModule, nullptr);
+}
+
+void LightReservoirs::destroy()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	vkDestroyPipeline(engine._device, _spatialPipeline, nullptr);
+	vkDestroyPipeline(engine._device, _temporalPipeline, nullptr);
+	vkDestroyPipelineLayout(engine._device, _pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(engine._device, _descriptorSetLayout, nullptr);
+	vkDestroyDescriptorPool(engine._device, _descriptorPool, nullptr);
+	for (AllocatedBuffer& buffer : _reservoirBuffers)
+		vmaDestroyBuffer(engine._allocator, buffer._buffer, buffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _aliasBuffer._buffer, _aliasBuffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _settingsBuffer._buffer, _settingsBuffer._allocation);
+}
+
+void LightReservoirs::update(const bool enabled, const bool history, const LightStore& lights)
+{
+	GPURestirSettings settings;
+	settings.size			= glm::uvec2(_width, _height);
+	settings.frame			= _frame++;
+	settings.candidates		= static_cast<uint32_t>(std::max(_settings.candidates, 1));
+	settings.spatialSamples	= static_cast<uint32_t>(std::max(_settings.spatialSamples, 0));
+	settings.spatialRadius	= _settings.spatialRadius;
+	settings.maxHistory		= static_cast<uint32_t>(std::max(_settings.maxHistory, 1));
+	settings.history		= history ? 1 : 0;
+	settings.enabled		= enabled ? 1 : 0;
+
+	void* data;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _settingsBuffer._allocation, &data);
+	memcpy(data, &settings, sizeof(GPURestirSettings));
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _settingsBuffer._allocation);
+
+	if (!enabled)
+		return;
+
+	// Power as seen by lightTarget in restir.glsl: directional lights ignore the intensity
+	_lightPower.resize(_lightCount);
+	float totalPower = 0.0f;
+	for (uint32_t i = 0; i < _lightCount; i++)
+	{
+		const float luminance	= glm::dot(lights.colors[i], glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		_lightPower[i]			= std::max(lights.types[i] == DIRECTIONAL_LIGHT ? luminance : luminance * lights.intensities[i], 0.0f);
+		totalPower				+= _lightPower[i];
+	}
+
+	vmaMapMemory(VulkanEngine::engine->_allocator, _aliasBuffer._allocation, &data);
+	GPULightAlias* table = static_cast<GPULightAlias*>(data);
+
+	// Every light is as likely when none emits, their targets are all zero anyway
+	if (totalPower <= 0.0f)
+	{
+		for (uint32_t i = 0; i < _lightCount; i++)
+			table[i] = { 1.0f, i, 1.0f / _lightCount };
+		vmaUnmapMemory(VulkanEngine::engine->_allocator, _aliasBuffer._allocation);
+		return;
+	}
+
+	// Scaled so the average light has 1, lights under it borrow the rest of their slot from one above
+	_small.clear();
+	_large.clear();
+	for (uint32_t i = 0; i < _lightCount; i++)
+	{
+		const float pdf		= _lightPower[i] / totalPower;
+		table[i].pdf		= pdf;
+		table[i].alias		= i;
+		_lightPower[i]		= pdf * _lightCount;
+		(_lightPower[i] < 1.0f ? _small : _large).push_back(i);
+	}
+	while (!_small.empty() && !_large.empty())
+	{
+		const uint32_t s = _small.back();
+		const uint32_t l = _large.back();
+		_small.pop_back();
+		_large.pop_back();
+
+		table[s].threshold	= _lightPower[s];
+		table[s].alias		= l;
+		_lightPower[l]		= (_lightPower[l] + _lightPower[s]) - 1.0f;
+		(_lightPower[l] < 1.0f ? _small : _large).push_back(l);
+	}
+	// Left overs are 1 up to rounding
+	for (const uint32_t i : _large)
+		table[i].threshold = 1.0f;
+	for (const uint32_t i : _small)
+		table[i].threshold = 1.0f;
+
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _aliasBuffer._allocation);
+}
+
+void LightReservoirs::record(VkCommandBuffer cmd)
+{
+	// The hybrid raygen of the last frame cleared the occluded reservoirs of the history
+	VkMemoryBarrier historyBarrier{};
+	historyBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	historyBarrier.srcAccessMask	= VK_ACCESS_SHADER_WRITE_BIT;
+	historyBarrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &historyBarrier, 0, nullptr, 0, nullptr);
+
+	const uint32_t groupsX = (_width + GROUP_SIZE - 1) / GROUP_SIZE;
+	const uint32_t groupsY = (_height + GROUP_SIZE - 1) / GROUP_SIZE;
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _temporalPipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipelineLayout, 0, 1, &_descriptorSets[0], 0, nullptr);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+
+	VkMemoryBarrier temporalBarrier{};
+	temporalBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	temporalBarrier.srcAccessMask	= VK_ACCESS_SHADER_WRITE_BIT;
+	temporalBarrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &temporalBarrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _spatialPipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipelineLayout, 0, 1, &_descriptorSets[1], 0, nullptr);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+
+	VkMemoryBarrier spatialBarrier{};
+	spatialBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	spatialBarrier.srcAccessMask	= VK_ACCESS_SHADER_WRITE_BIT;
+	spatialBarrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &spatialBarrier, 0, nullptr, 0, nullptr);
+}
+
+VkDescriptorBufferInfo LightReservoirs::get_settings_info() const
+{
+	return vkinit::descriptor_buffer_info(_settingsBuffer._buffer, sizeof(GPURestirSettings));
+}
+
+VkDescriptorBufferInfo LightReservoirs::get_reservoirs_info() const
+{
+	return vkinit::descriptor_buffer_info(_reservoirBuffers[1]._buffer, sizeof(glm::uvec4) * _width * _height);
+}
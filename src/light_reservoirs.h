@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vk_types.h>
+
+struct LightStore;
+
+// One light per pixel picked by resampled importance sampling (ReSTIR, Bitterli et al. 2020) for
+// the hybrid renderer. Candidates are drawn from every light of the scene in proportion to its
+// power, through an alias table, and kept with a probability proportional to their unshadowed
+// contribution at the pixel. They are then merged with the reservoir of the previous frame, found
+// through the motion vectors, and with a few neighbours. The hybrid raygen traces a single shadow
+// ray towards the chosen light and clears the reservoir when it is occluded, so the cost does not
+// depend on the number of lights.
+class LightReservoirs
+{
+public:
+	static constexpr uint32_t GROUP_SIZE = 8;	// Mirrored in restir_temporal.comp and restir_spatial.comp
+
+	struct Settings
+	{
+		int		candidates{ 8 };		// Lights drawn from the alias table every frame
+		int		spatialSamples{ 4 };	// Neighbours merged after the temporal pass
+		float	spatialRadius{ 16.0f };	// In pixels
+		int		maxHistory{ 20 };		// Candidates kept from the past, in multiples of the new ones
+	};
+
+	// Position, normal and motion G-buffers in SHADER_READ_ONLY_OPTIMAL, the cluster grid gives the view matrix
+	void init(const uint32_t width, const uint32_t height, const std::vector<VkDescriptorImageInfo>& gbuffers, const VkDescriptorBufferInfo& lights,
+		const uint32_t lightCount, const VkDescriptorBufferInfo& clusterGrid);
+	void destroy();
+
+	// History is dropped when it was not written by the last frame. The alias table is rebuilt
+	// from the lights when enabled, so edited intensities and colors are sampled right away.
+	void update(const bool enabled, const bool history, const LightStore& lights);
+	// Outside a render pass, once the G-buffers and the light clusters are written
+	void record(VkCommandBuffer cmd);
+
+	VkDescriptorBufferInfo get_settings_info() const;
+	VkDescriptorBufferInfo get_reservoirs_info() const;	// Final reservoirs, read and written by the hybrid raygen
+
+	Settings					_settings;
+
+private:
+	uint32_t					_width{ 0 };
+	uint32_t					_height{ 0 };
+	uint32_t					_frame{ 0 };
+	uint32_t					_lightCount{ 0 };
+	AllocatedBuffer				_settingsBuffer;		// GPURestirSettings, written every frame
+	AllocatedBuffer				_aliasBuffer;			// GPULightAlias per light, written every frame
+	std::vector<float>			_lightPower;
+	std::vector<uint32_t>		_small, _large;			// Alias table construction, kept to avoid allocations
+	AllocatedBuffer				_reservoirBuffers[2];	// Temporal output, then spatial output kept as the next history
+
+	VkDescriptorPool			_descriptorPool{ VK_NULL_HANDLE };
+	VkDescriptorSetLayout		_descriptorSetLayout{ VK_NULL_HANDLE };
+	VkDescriptorSet				_descriptorSets[2];		// Temporal reads the history, spatial reads the temporal output
+	VkPipelineLayout			_pipelineLayout{ VK_NULL_HANDLE };
+	VkPipeline					_temporalPipeline{ VK_NULL_HANDLE };
+	VkPipeline					_spatialPipeline{ VK_NULL_HANDLE };
+};
@@ -1,9 +1,24 @@
 #include "vk_engine.h"
 
+#include <cstdlib>
+#include <iostream>
+
 int main(int argc, char* argv[])
 {
 	VulkanEngine engine;
 
+	// A scene index, then the stress scene knobs, e.g. "2 instances=20000 meshes=8 seed=7"
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string argument = argv[i];
+		if (engine._stressSettings.parse(argument))
+			continue;
+		if (argument.find('=') != std::string::npos)
+			std::cout << "Unknown stress scene setting " << argument << std::endl;
+		else
+			engine._sceneIndex = std::atoi(argument.c_str());
+	}
+
 	engine.init();
 
 	engine.run();
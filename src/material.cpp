@@ -1,54 +1,94 @@
 #include "material.h"
 #include "vk_utils.h"
 
+std::unordered_multimap<size_t, int> Material::_handles;
+std::vector<size_t> Material::_hashes;
+std::vector<GPUMaterial> Material::_gpuMaterials;
+std::vector<int> Material::_dirty;
+
 int Material::setDefaultMaterial()
 {
-	Material* mat = new Material();
+	return intern(Material());
+}
+
+int Material::intern(const Material& material)
+{
+	const size_t key = material.hash();
 
-	if (Material::exists(mat))
+	auto range = _handles.equal_range(key);
+	for (auto it = range.first; it != range.second; it++)
 	{
-		return getIndex(mat);
+		if (*_materials[it->second] == material)
+			return it->second;
 	}
-	else
+
+	Material* mat	= new Material(material);
+	mat->handle		= static_cast<int>(_materials.size());
+
+	_materials.push_back(mat);
+	_hashes.push_back(key);
+	_gpuMaterials.push_back(mat->materialToShader());
+	_handles.insert({ key, mat->handle });
+	_dirty.push_back(mat->handle);
+
+	return mat->handle;
+}
+
+void Material::update(const int handle)
+{
+	const Material* mat = _materials[handle];
+
+	// Stored again under the new contents, the handle does not change
+	auto range = _handles.equal_range(_hashes[handle]);
+	for (auto it = range.first; it != range.second; it++)
 	{
-		Material::_materials.push_back(mat);
-		return Material::_materials.size() - 1;
+		if (it->second == handle)
+		{
+			_handles.erase(it);
+			break;
+		}
 	}
+
+	_hashes[handle]			= mat->hash();
+	_gpuMaterials[handle]	= mat->materialToShader();
+	_handles.insert({ _hashes[handle], handle });
+	_dirty.push_back(handle);
 }
 
-GPUMaterial Material::materialToShader()
+void Material::collect_dirty(std::vector<int>& handles)
+{
+	handles.insert(handles.end(), _dirty.begin(), _dirty.end());
+	_dirty.clear();
+}
+
+GPUMaterial Material::materialToShader() const
 {
 	GPUMaterial mat;
 	mat.diffuseColor				= glm::vec4(diffuseColor[0], diffuseColor[1], diffuseColor[2], ior);
 	mat.textures					= glm::vec4(diffuseTexture, normalTexture, emissiveTexture, metallicRoughnessTexture);
-	mat.shadingMetallicRoughness	= glm::vec4(shadingModel, metallicFactor, roughnessFactor, Material::getIndex(this));
+	mat.shadingMetallicRoughness	= glm::vec4(shadingModel, metallicFactor, roughnessFactor, handle);
 	return mat;
 }
 
-bool Material::exists(Material* material)
+// Same fields as operator==, + 0.0f folds -0 into 0 so equal materials hash equally
+size_t Material::hash() const
 {
-	for (Material* m : _materials)
-	{
-		if (*m == *material)
-			return true;
-	}
-	
-	return false;
-}
+	size_t seed = 0;
+	auto combine = [&seed](const size_t h) { seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2); };
 
-int Material::getIndex(Material* material)
-{
-	int count = 0;
-	for (Material* m : _materials)
-	{
-		if (*m == *material)
-			return count;
-		count++;
-	}
-	return -1;
+	combine(std::hash<int>()(shadingModel));
+	combine(std::hash<glm::vec4>()(diffuseColor + glm::vec4(0.0f)));
+	combine(std::hash<int>()(diffuseTexture));
+	combine(std::hash<int>()(normalTexture));
+	combine(std::hash<int>()(emissiveTexture));
+	combine(std::hash<int>()(metallicRoughnessTexture));
+	combine(std::hash<float>()(ior + 0.0f));
+	combine(std::hash<float>()(metallicFactor + 0.0f));
+	combine(std::hash<float>()(roughnessFactor + 0.0f));
+	return seed;
 }
 
-inline bool Material::operator==(const Material& m)
+bool Material::operator==(const Material& m) const
 {
 	return shadingModel == m.shadingModel &&
 		diffuseColor				== m.diffuseColor &&
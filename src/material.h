@@ -12,7 +12,7 @@ struct GPUMaterial
 class Material
 {
 public:
-	static std::vector<Material*> _materials;
+	static std::vector<Material*> _materials;	// Index is the handle used by primitives and shaders, never reordered
 
 	int shadingModel{ 0 }; // 0: metallic-roughnes, 1: specular-glossines
 
@@ -28,10 +28,29 @@ public:
 	int emissiveTexture{ -1 };
 	int normalTexture{ -1 };
 
+	int handle{ -1 };	// Set on the registered copy
+
+	// Handle of an equal registered material, a copy is registered when there is none
+	static int intern(const Material& material);
 	static int setDefaultMaterial();
-	static bool exists(Material* material);
-	static int getIndex(Material* material);
-	GPUMaterial materialToShader();
+
+	// Must be called after the fields of a registered material are edited
+	static void update(const int handle);
+
+	static const GPUMaterial& get_gpu_material(const int handle) { return _gpuMaterials[handle]; }
+	static const std::vector<GPUMaterial>& get_gpu_materials() { return _gpuMaterials; }
+
+	// Appends the handles registered or updated since the last call
+	static void collect_dirty(std::vector<int>& handles);
+
+	GPUMaterial materialToShader() const;
+	size_t hash() const;
 	
-	bool operator== (const Material& m);
+	bool operator== (const Material& m) const;
+
+private:
+	static std::unordered_multimap<size_t, int>	_handles;		// Content hash to handles, collisions are resolved with operator==
+	static std::vector<size_t>					_hashes;		// Indexed by handle, the key each material is stored under
+	static std::vector<GPUMaterial>				_gpuMaterials;	// Indexed by handle
+	static std::vector<int>						_dirty;			// Records not uploaded yet
 };
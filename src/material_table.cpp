@@ -0,0 +1,162 @@
+#include "material_table.h"
+
+#include "material.h"
+#include "vk_engine.h"
+#include "vk_initializers.h"
+
+#include <algorithm>
+
+void MaterialTable::init(const uint32_t capacity)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	_capacity = capacity;
+	engine.create_buffer(capacity * sizeof(GPUMaterial), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VMA_MEMORY_USAGE_GPU_ONLY, _buffer, false);
+	engine.create_buffer(RING_SEGMENTS * SEGMENT_RECORDS * sizeof(GPUMaterial), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, _stagingBuffer, false);
+
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(engine._graphicsQueueFamily, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+	VK_CHECK(vkCreateCommandPool(engine._device, &poolInfo, nullptr, &_commandPool));
+
+	VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(_commandPool, RING_SEGMENTS);
+	VK_CHECK(vkAllocateCommandBuffers(engine._device, &allocInfo, _commandBuffers));
+
+	VkFenceCreateInfo fenceInfo = vkinit::fence_create_info(VK_FENCE_CREATE_SIGNALED_BIT);
+	for (uint32_t i = 0; i < RING_SEGMENTS; i++)
+		VK_CHECK(vkCreateFence(engine._device, &fenceInfo, nullptr, &_fences[i]));
+}
+
+void MaterialTable::destroy()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	vkWaitForFences(engine._device, RING_SEGMENTS, _fences, VK_TRUE, UINT64_MAX);
+	for (uint32_t i = 0; i < RING_SEGMENTS; i++)
+		vkDestroyFence(engine._device, _fences[i], nullptr);
+	vkDestroyCommandPool(engine._device, _commandPool, nullptr);
+
+	vmaDestroyBuffer(engine._allocator, _stagingBuffer._buffer, _stagingBuffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _buffer._buffer, _buffer._allocation);
+}
+
+bool MaterialTable::update()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	_lastUpload = 0;
+	Material::collect_dirty(_pending);
+	if (_pending.empty())
+		return false;
+
+	const std::vector<GPUMaterial>& records = Material::get_gpu_materials();
+
+	const bool reallocated = records.size() > _capacity;
+	if (reallocated)
+		grow(static_cast<uint32_t>(records.size()));
+
+	std::sort(_pending.begin(), _pending.end());
+	_pending.erase(std::unique(_pending.begin(), _pending.end()), _pending.end());
+
+	// The copy that last used this segment was submitted RING_SEGMENTS updates ago
+	VK_CHECK(vkWaitForFences(engine._device, 1, &_fences[_segment], VK_TRUE, UINT64_MAX));
+	VK_CHECK(vkResetFences(engine._device, 1, &_fences[_segment]));
+
+	void* data;
+	vmaMapMemory(engine._allocator, _stagingBuffer._allocation, &data);
+	GPUMaterial* segment = static_cast<GPUMaterial*>(data) + _segment * SEGMENT_RECORDS;
+
+	// Dirty handles close to each other are joined in one region
+	std::vector<VkBufferCopy> copies;
+	size_t next = 0;
+	while (next < _pending.size() && _lastUpload < SEGMENT_RECORDS)
+	{
+		const uint32_t first	= static_cast<uint32_t>(_pending[next]);
+		uint32_t last			= first;
+		size_t end				= next + 1;
+		while (end < _pending.size() && static_cast<uint32_t>(_pending[end]) - last <= MERGE_GAP + 1)
+			last = static_cast<uint32_t>(_pending[end++]);
+
+		// A range larger than what is left of the segment is split, its tail stays pending
+		const uint32_t count = std::min(last - first + 1, SEGMENT_RECORDS - _lastUpload);
+		end = std::upper_bound(_pending.begin() + next, _pending.begin() + end, static_cast<int>(first + count - 1)) - _pending.begin();
+
+		memcpy(segment + _lastUpload, &records[first], count * sizeof(GPUMaterial));
+
+		VkBufferCopy copy;
+		copy.srcOffset	= (_segment * SEGMENT_RECORDS + _lastUpload) * sizeof(GPUMaterial);
+		copy.dstOffset	= first * sizeof(GPUMaterial);
+		copy.size		= count * sizeof(GPUMaterial);
+		copies.push_back(copy);
+
+		_lastUpload	+= count;
+		next		= end;
+	}
+	_pending.erase(_pending.begin(), _pending.begin() + next);
+
+	vmaUnmapMemory(engine._allocator, _stagingBuffer._allocation);
+
+	VkCommandBuffer cmd = _commandBuffers[_segment];
+	VK_CHECK(vkResetCommandBuffer(cmd, 0));
+
+	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+
+	// Frames submitted before may still read the records overwritten, the next ones read the new values
+	VkMemoryBarrier barrier = {};
+	barrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask	= 0;
+	barrier.dstAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	vkCmdCopyBuffer(cmd, _stagingBuffer._buffer, _buffer._buffer, static_cast<uint32_t>(copies.size()), copies.data());
+
+	barrier.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	VK_CHECK(vkEndCommandBuffer(cmd));
+
+	VkSubmitInfo submit = vkinit::submit_info(&cmd);
+	VK_CHECK(vkQueueSubmit(engine._graphicsQueue, 1, &submit, _fences[_segment]));
+
+	_segment = (_segment + 1) % RING_SEGMENTS;
+
+	return reallocated;
+}
+
+// The records already uploaded are copied on the GPU, the pending ones follow with the next update
+void MaterialTable::grow(const uint32_t count)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	uint32_t capacity = std::max(_capacity, 1u);
+	while (capacity < count)
+		capacity *= 2;
+
+	AllocatedBuffer buffer;
+	engine.create_buffer(capacity * sizeof(GPUMaterial), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VMA_MEMORY_USAGE_GPU_ONLY, buffer, false);
+
+	// Frames in flight and pending copies still use the old buffer
+	vkDeviceWaitIdle(engine._device);
+
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		VkBufferCopy copy = { 0, 0, _capacity * sizeof(GPUMaterial) };
+		vkCmdCopyBuffer(cmd, _buffer._buffer, buffer._buffer, 1, &copy);
+
+		VkMemoryBarrier barrier = {};
+		barrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	});
+
+	vmaDestroyBuffer(engine._allocator, _buffer._buffer, _buffer._allocation);
+	_buffer		= buffer;
+	_capacity	= capacity;
+}
+
+VkDescriptorBufferInfo MaterialTable::get_descriptor_info() const
+{
+	return vkinit::descriptor_buffer_info(_buffer._buffer, _capacity * sizeof(GPUMaterial));
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vk_types.h>
+
+// GPU copy of the records of Material, read by the ray tracing shaders. Only the records registered
+// or edited since the last update are copied, staged in a ring of segments so the CPU never waits
+// for the frames still reading the table. The buffer is reallocated with twice the capacity when
+// more materials are registered than it holds.
+class MaterialTable
+{
+public:
+	static constexpr uint32_t RING_SEGMENTS		= 3;
+	static constexpr uint32_t SEGMENT_RECORDS	= 4096;	// Records staged per update at most, the rest waits for the next one
+	static constexpr uint32_t MERGE_GAP			= 8;	// Clean records copied anyway to join two dirty ranges
+
+	void init(const uint32_t capacity);
+	void destroy();
+
+	// Render thread, before the frame is submitted. Returns true when the buffer was reallocated,
+	// descriptors and the command buffers recorded with them have to be updated
+	bool update();
+
+	VkDescriptorBufferInfo get_descriptor_info() const;
+
+	uint32_t get_capacity() const { return _capacity; }
+	uint32_t get_last_upload() const { return _lastUpload; }
+
+private:
+	void grow(const uint32_t count);
+
+	uint32_t			_capacity{ 0 };
+	uint32_t			_segment{ 0 };
+	uint32_t			_lastUpload{ 0 };	// Records copied by the last update
+	std::vector<int>	_pending;			// Dirty handles not staged yet
+
+	AllocatedBuffer		_buffer;
+	AllocatedBuffer		_stagingBuffer;		// RING_SEGMENTS segments of SEGMENT_RECORDS records
+	VkCommandPool		_commandPool{ VK_NULL_HANDLE };
+	VkCommandBuffer		_commandBuffers[RING_SEGMENTS];
+	VkFence				_fences[RING_SEGMENTS];	// Signaled once the copy of the segment is done
+};
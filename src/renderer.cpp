@@ -5,6 +5,9 @@
 #include "window.h"
 #include "vk_utils.h"
 
+#include <algorithm>
+#include <chrono>
+
 extern std::vector<std::string> searchPaths;
 
 Renderer::Renderer(Scene* scene)
@@ -12,7 +15,6 @@ Renderer::Renderer(Scene* scene)
 	device		= &VulkanEngine::engine->_device;
 	swapchain	= &VulkanEngine::engine->_swapchain;
 	frameNumber	= &VulkanEngine::engine->_frameNumber;
-	gizmoEntity	= nullptr;
 	_scene = scene;
 
 	init_commands();
@@ -23,12 +25,26 @@ Renderer::Renderer(Scene* scene)
 	init_offscreen_framebuffers();
 	init_sync_structures();
 
+	_scene->_streamer.set_capacity(MAX_MESHES, MAX_TEXTURES);
+
+	// Grows past MAX_MATERIALS when materials are registered at runtime
+	_materialTable.init(MAX_MATERIALS);
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		_materialTable.destroy();
+		});
+
 	load_data_to_gpu();
+
+	_lightClusters.init(_lightBuffer, static_cast<uint32_t>(_scene->_lights.size()));
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		_lightClusters.destroy();
+		});
 	
 	init_descriptors();
 	init_deferred_descriptors();
 	//init_forward_pipeline();
 	init_deferred_pipelines();
+	init_cluster_culling();
 	build_previous_command_buffer();
 
 	// Ray tracing
@@ -44,6 +60,23 @@ Renderer::Renderer(Scene* scene)
 
 	create_storage_image();
 
+	{
+		std::vector<VkDescriptorImageInfo> gbuffers = {
+			vkinit::descriptor_image_info(_deferredTextures[0].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _offscreenSampler),	// Position
+			vkinit::descriptor_image_info(_deferredTextures[1].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _offscreenSampler),	// Normal
+			vkinit::descriptor_image_info(_deferredTextures[3].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _offscreenSampler)	// Motion
+		};
+		if (_scene->_lights.size() > LightReservoirs::MAX_LIGHTS)
+			throw std::runtime_error("Light reservoirs index at most 65536 lights");
+
+		VkDescriptorBufferInfo lightsInfo = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * _scene->_lights.size());
+		_lightReservoirs.init(VulkanEngine::engine->_window->getWidth(), VulkanEngine::engine->_window->getHeight(), gbuffers, lightsInfo,
+			_scene->_lights.size(), _lightClusters.get_grid_info());
+		VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+			_lightReservoirs.destroy();
+			});
+	}
+
 	// post
 	create_post_renderPass();
 	create_post_framebuffers();
@@ -61,8 +94,11 @@ Renderer::Renderer(Scene* scene)
 	create_shader_binding_table();
 	build_shadow_command_buffer();
 	build_compute_command_buffer();
+	build_restir_command_buffer();
 	build_raytracing_command_buffers();
 	build_hybrid_command_buffers();
+
+	_insertedEntities = _scene->_entities.size();
 }
 
 void Renderer::init_commands()
@@ -97,6 +133,7 @@ void Renderer::init_commands()
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_hybridCommandBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_shadowCommandBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_denoiseCommandBuffer));
+	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_restirCommandBuffer));
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vkDestroyCommandPool(*device, _commandPool, nullptr);
@@ -280,15 +317,16 @@ void Renderer::init_offscreen_render_pass()
 		attachmentDescs[i].storeOp			= VK_ATTACHMENT_STORE_OP_STORE;
 		attachmentDescs[i].stencilLoadOp	= VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		attachmentDescs[i].stencilStoreOp	= VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		// The late pass continues the attachments, depth is sampled in between to build the pyramid
 		if (i == nAttachments - 1)
 		{
 			attachmentDescs[i].initialLayout	= VK_IMAGE_LAYOUT_UNDEFINED;
-			attachmentDescs[i].finalLayout		= VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			attachmentDescs[i].finalLayout		= VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
 		}
 		else
 		{
 			attachmentDescs[i].initialLayout	= VK_IMAGE_LAYOUT_UNDEFINED;
-			attachmentDescs[i].finalLayout		= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			attachmentDescs[i].finalLayout		= VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 		}
 	}
 
@@ -329,13 +367,15 @@ void Renderer::init_offscreen_render_pass()
 	dependencies[0].dstAccessMask	= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 	dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
+	// Depth is read by the pyramid reduction, then both depth and colors by the late pass
 	dependencies[1].srcSubpass		= 0;
 	dependencies[1].dstSubpass		= VK_SUBPASS_EXTERNAL;
-	dependencies[1].srcStageMask	= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependencies[1].dstStageMask	= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-	dependencies[1].srcAccessMask	= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	dependencies[1].dstAccessMask	= VK_ACCESS_MEMORY_READ_BIT;
-	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+	dependencies[1].srcStageMask	= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[1].dstStageMask	= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+	dependencies[1].srcAccessMask	= VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dependencyFlags = 0;
 
 	VkRenderPassCreateInfo renderPassInfo = {};
 	renderPassInfo.sType			= VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -349,8 +389,37 @@ void Renderer::init_offscreen_render_pass()
 
 	VK_CHECK(vkCreateRenderPass(*device, &renderPassInfo, nullptr, &_offscreenRenderPass));
 
+	// Late pass, compatible with the first one so it shares its framebuffer and pipelines
+	for (uint32_t i = 0; i < nAttachments; i++)
+	{
+		attachmentDescs[i].loadOp			= VK_ATTACHMENT_LOAD_OP_LOAD;
+		attachmentDescs[i].initialLayout	= attachmentDescs[i].finalLayout;
+		attachmentDescs[i].finalLayout		= i == nAttachments - 1 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+
+	// The pyramid reduction has to be done reading depth before it is written again
+	dependencies[0].srcSubpass		= VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass		= 0;
+	dependencies[0].srcStageMask	= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].dstStageMask	= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].srcAccessMask	= VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dstAccessMask	= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dependencyFlags = 0;
+
+	dependencies[1].srcSubpass		= 0;
+	dependencies[1].dstSubpass		= VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask	= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].dstStageMask	= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	dependencies[1].srcAccessMask	= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstAccessMask	= VK_ACCESS_MEMORY_READ_BIT;
+	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	VK_CHECK(vkCreateRenderPass(*device, &renderPassInfo, nullptr, &_offscreenLateRenderPass));
+
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vkDestroyRenderPass(*device, _offscreenRenderPass, nullptr);
+		vkDestroyRenderPass(*device, _offscreenLateRenderPass, nullptr);
 		for (int i = 0; i < _deferredTextures.size(); i++) {
 			vkDestroyImageView(*device, _deferredTextures[i].imageView, nullptr);
 			vmaDestroyImage(VulkanEngine::engine->_allocator, _deferredTextures[i].image._image, _deferredTextures[i].image._allocation);
@@ -367,6 +436,9 @@ void Renderer::rasterize()
 {
 	ImGui::Render();
 
+	// Reservoirs are only written by the hybrid frames
+	_restirHistory = false;
+
 	VK_CHECK(vkWaitForFences(*device, 1, &get_current_frame()._renderFence, VK_TRUE, 1000000000));
 	VK_CHECK(vkResetFences(*device, 1, &get_current_frame()._renderFence));
 
@@ -404,6 +476,9 @@ void Renderer::render()
 {
 	ImGui::Render();
 
+	// Reservoirs are only written by the hybrid frames
+	_restirHistory = false;
+
 	// Wait until the gpu has finished rendering the last frame. Timeout 1 second
 	VK_CHECK(vkWaitForFences(*device, 1, &get_current_frame()._renderFence, VK_TRUE, 1000000000));
 	VK_CHECK(vkResetFences(*device, 1, &get_current_frame()._renderFence));
@@ -466,6 +541,9 @@ void Renderer::raytrace()
 {
 	ImGui::Render();
 
+	// Reservoirs are only written by the hybrid frames
+	_restirHistory = false;
+
 	VK_CHECK(vkWaitForFences(*device, 1, &get_current_frame()._renderFence, VK_TRUE, UINT64_MAX));
 	VK_CHECK(vkResetFences(*device, 1, &get_current_frame()._renderFence));
 
@@ -556,21 +634,37 @@ void Renderer::rasterize_hybrid()
 	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
 	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
 
-	// Shadow pass RAYTRACE
-	submit.pWaitSemaphores		= &_offscreenSemaphore;
-	submit.pSignalSemaphores	= &_shadowSemaphore;
-	submit.pCommandBuffers		= &_shadowCommandBuffer;
+	_lightReservoirs.update(_restir, _restirHistory, _scene->_lights);
+	_restirHistory = _restir;
 
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
+	if (_restir)
+	{
+		// Light reservoirs replace the shadow images and their denoiser
+		submit.pWaitSemaphores		= &_offscreenSemaphore;
+		submit.pSignalSemaphores	= &_denoiseSemaphore;
+		submit.pCommandBuffers		= &_restirCommandBuffer;
+
+		VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
+		vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
+	}
+	else
+	{
+		// Shadow pass RAYTRACE
+		submit.pWaitSemaphores		= &_offscreenSemaphore;
+		submit.pSignalSemaphores	= &_shadowSemaphore;
+		submit.pCommandBuffers		= &_shadowCommandBuffer;
 
-	// Compute pass
-	submit.pWaitSemaphores		= &_shadowSemaphore;
-	submit.pSignalSemaphores	= &_denoiseSemaphore;
-	submit.pCommandBuffers		= &_denoiseCommandBuffer;
+		VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
+		vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
 
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
+		// Compute pass
+		submit.pWaitSemaphores		= &_shadowSemaphore;
+		submit.pSignalSemaphores	= &_denoiseSemaphore;
+		submit.pCommandBuffers		= &_denoiseCommandBuffer;
+
+		VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
+		vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
+	}
 
 	// Second pass RAYTRACE
 	submit.pWaitSemaphores		= &_denoiseSemaphore;
@@ -602,7 +696,6 @@ void Renderer::rasterize_hybrid()
 void Renderer::render_gui()
 {
 	bool changed = false;
-	bool changed_material = false;
 
 	// Imgui new frame
 	ImGui_ImplVulkan_NewFrame();
@@ -654,37 +747,128 @@ void Renderer::render_gui()
 	}
 
 	ImGui::DragInt("Shadow Samples", &VulkanEngine::engine->_samples, 1.0f, 1, 64);
+	ImGui::Checkbox("Cluster culling", &_clusterCulling);
+	if (_clusterCulling)
+	{
+		ImGui::Checkbox("Cone culling", &_coneCulling);
+		ImGui::Checkbox("Occlusion culling", &_occlusionCulling);
+	}
+	ImGui::SliderFloat("LOD error (px)", &_lodThreshold, 0.0f, 16.0f);
+	ImGui::Checkbox("Frustum culling", &_frustumCulling);
+	ImGui::Text("Primitives visible %u / %zu, culled in %.3f ms (%u jobs)", _visibleDraws, _clusterDraws.size(), _frustumCullTime, _frustumCuller.get_last_jobs());
+	if (!_clusterCulling)
+		ImGui::Text("Instanced commands %u, %zu instance groups", _instancedCommands, _instanceGroups.size());
+	ImGui::Text("Spatial index %u entities, height %u, %u reinserted in %.3f ms", _scene->_index.get_leaf_count(), _scene->_index.get_height(), _scene->_indexMoved, _scene->_indexUpdateTime);
+	ImGui::Text("Lights %zu, binned in %u x %u x %u clusters of up to %u", _scene->_lights.size(), LightClusters::GRID_X, LightClusters::GRID_Y, LightClusters::GRID_Z, LightClusters::MAX_LIGHTS);
+	if (_lightClusters.get_overflow_clusters() > 0)
+		ImGui::Text("%u clusters over capacity, up to %u lights dropped from one", _lightClusters.get_overflow_clusters(), _lightClusters.get_max_cluster_lights() - LightClusters::MAX_LIGHTS);
+	if (VulkanEngine::engine->_mode == HYBRID)
+	{
+		ImGui::Checkbox("ReSTIR lights", &_restir);
+		if (_restir)
+		{
+			LightReservoirs::Settings& restir = _lightReservoirs._settings;
+			ImGui::DragInt("Light candidates", &restir.candidates, 1.0f, 1, 32);
+			ImGui::DragInt("Spatial samples", &restir.spatialSamples, 1.0f, 0, 8);
+			ImGui::SliderFloat("Spatial radius (px)", &restir.spatialRadius, 1.0f, 32.0f);
+			ImGui::DragInt("History length", &restir.maxHistory, 1.0f, 1, 50);
+		}
+	}
 
-	for (auto& light : _scene->_lights)
+	ImGui::Text("Sky pages resident %u / %u", _skyTexture.get_resident_pages(), _skyTexture.get_slot_count());
+
+	const float MB = 1024.0f * 1024.0f;
+	ImGui::Text("Textures %.1f MB, VRAM %.0f / %.0f MB", _textureResidency.get_resident_bytes() / MB, _textureResidency.get_usage() / MB, _textureResidency.get_budget() / MB);
+	ImGui::Text("Textures reduced %u, evicted %u", _textureResidency.get_reduced(), _textureResidency.get_evicted());
+	ImGui::Text("Materials %zu / %u, %u records uploaded", Material::_materials.size(), _materialTable.get_capacity(), _materialTable.get_last_upload());
+	int textureBudget = static_cast<int>(_textureResidency._budgetOverride / (1024 * 1024));
+	if (ImGui::SliderInt("Texture budget (MB)", &textureBudget, 0, 2048))
+		_textureResidency._budgetOverride = static_cast<VkDeviceSize>(textureBudget) * 1024 * 1024;
+
+	const char* filters[] = { "Nearest", "Bilinear", "Trilinear" };
+	int filter = _textureFilter;
+	bool samplerChanged = ImGui::Combo("Texture filter", &filter, filters, IM_ARRAYSIZE(filters));
+	// Rebuilding the sampler waits for the device, a drag is applied once it is released
+	ImGui::SliderFloat("Anisotropy", &_anisotropy, 1.0f, 16.0f);
+	samplerChanged |= ImGui::IsItemDeactivatedAfterEdit();
+	if (samplerChanged)
 	{
-		if (ImGui::TreeNode(&light, "Light")) {
+		_textureFilter = (textureFilter)filter;
+		update_texture_sampler();
+	}
+
+	LightStore& lights = _scene->_lights;
+	for (uint32_t i = 0; i < lights.size(); i++)
+	{
+		if (ImGui::TreeNode(&lights.types[i], "Light")) {
 			if (ImGui::Button("Select"))
-				gizmoEntity = light;
-			changed |= ImGui::SliderFloat3("Position", &((glm::vec3)light->m_matrix[3])[0], -200, 200);
-			changed |= ImGui::ColorEdit3("Color", &light->color.x);
-			changed |= ImGui::SliderFloat("Intensity", &light->intensity, 0, 1000);
-			changed |= ImGui::SliderFloat("Max Distance", &light->maxDistance, 0, 500);
-			changed |= ImGui::SliderFloat("Radius", &light->radius, 0, 10);
+			{
+				gizmoEntity	= { LIGHT_ENTITY, i };
+				gizmoNode	= nullptr;
+			}
+			changed |= ImGui::SliderFloat3("Position", glm::value_ptr(lights.transforms[i][3]), -200, 200);
+			changed |= ImGui::ColorEdit3("Color", glm::value_ptr(lights.colors[i]));
+			changed |= ImGui::SliderFloat("Intensity", &lights.intensities[i], 0, 1000);
+			changed |= ImGui::SliderFloat("Max Distance", &lights.maxDistances[i], 0, 500);
+			changed |= ImGui::SliderFloat("Radius", &lights.radii[i], 0, 10);
 			ImGui::TreePop();
 		}
 	}
-	for (auto& entity : _scene->_entities)
+	ObjectStore& entities = _scene->_entities;
+	for (uint32_t i = 0; i < entities.size(); i++)
 	{
-		if (ImGui::TreeNode(&entity, "Entity")) {
+		Material* material = entities.materials[i];
+		if (ImGui::TreeNode(&entities.prefabs[i], "Entity")) {
 			if (ImGui::Button("Select"))
-				gizmoEntity = entity;
-			changed_material |= ImGui::SliderFloat3("Color", glm::value_ptr(entity->material->diffuseColor), 0., 1.);
-			changed_material |= ImGui::SliderFloat("Metallic", &entity->material->metallicFactor, 0., 1.);
-			changed_material |= ImGui::SliderFloat("Roughness", &entity->material->roughnessFactor, 0., 1.);
+			{
+				gizmoEntity	= { OBJECT_ENTITY, i };
+				gizmoNode	= nullptr;
+			}
+			for (Node* root : entities.prefabs[i]->_root)
+				node_gui(root, i);
+			if (material)
+			{
+				bool edited = ImGui::SliderFloat3("Color", glm::value_ptr(material->diffuseColor), 0., 1.);
+				edited |= ImGui::SliderFloat("Metallic", &material->metallicFactor, 0., 1.);
+				edited |= ImGui::SliderFloat("Roughness", &material->roughnessFactor, 0., 1.);
+				if (edited)
+					Material::update(material->handle);
+			}
 			ImGui::TreePop();
 		}
 	}
 	ImGui::End();
 
-	if (!gizmoEntity)
+	// Left click outside the windows and the gizmo selects the entity under the cursor
+	if (ImGui::IsMouseClicked(0) && !ImGui::GetIO().WantCaptureMouse && !(gizmoEntity.type != NO_ENTITY && ImGuizmo::IsOver()))
+	{
+		const ImVec2 mouse		= ImGui::GetIO().MousePos;
+		const ImVec2 display	= ImGui::GetIO().DisplaySize;
+		const glm::mat4 inverse	= glm::inverse(_scene->_camera->getProjection(display.x / display.y) * _scene->_camera->getView());
+
+		// Any point of the pixel further than the camera gives the direction
+		const glm::vec4 ndc		= glm::vec4(2.0f * mouse.x / display.x - 1.0f, 1.0f - 2.0f * mouse.y / display.y, 1.0f, 1.0f);
+		const glm::vec4 point	= inverse * ndc;
+		const glm::vec3 origin	= _scene->_camera->_position;
+
+		const EntityHandle picked = _scene->pick(origin, glm::normalize(glm::vec3(point) / point.w - origin));
+		if (picked.type != NO_ENTITY)
+		{
+			gizmoEntity	= picked;
+			gizmoNode	= nullptr;
+		}
+	}
+
+	if (gizmoEntity.type == NO_ENTITY)
 		return;
 
-	glm::mat4& matrix = gizmoEntity->m_matrix;
+	// A node is moved in its prefab, every entity of the prefab follows
+	glm::mat4& entityMatrix = _scene->get_transform(gizmoEntity);
+	glm::mat4 nodeParent = gizmoNode ? entityMatrix : glm::mat4(1);
+	if (gizmoNode && gizmoNode->_parent)
+		nodeParent *= gizmoNode->_parent->getGlobalMatrix();
+
+	glm::mat4 matrix = gizmoNode ? nodeParent * gizmoNode->getLocalMatrix() : entityMatrix;
 	glm::mat4 aux = matrix;
 
 	ImGuizmo::BeginFrame();
@@ -752,25 +936,41 @@ void Renderer::render_gui()
 	// If matrix is different, then turn changed to true
 	if (memcmp(&matrix[0][0], &aux[0][0], sizeof(glm::mat4)) != 0) {
 		changed = true;
+		if (gizmoNode)
+			gizmoNode->setLocalMatrix(glm::inverse(nodeParent) * matrix);
+		else
+			entityMatrix = matrix;
 	}
 
 	if (changed)
 		VulkanEngine::engine->resetFrame();
+}
 
-	// If any material has been modified, update the materials
-	if (changed_material)
+// Nodes with children are listed as a tree, selecting one hands it to the gizmo
+void Renderer::node_gui(Node* node, const uint32_t entity)
+{
+	const char* name = node->_name.empty() ? "Node" : node->_name.c_str();
+	if (node->_children.empty())
 	{
-		std::vector<GPUMaterial> materials;
-		for (Material* it : Material::_materials)
+		if (ImGui::Selectable(name, gizmoNode == node && gizmoEntity.index == entity))
 		{
-			GPUMaterial mat = it->materialToShader();
-			materials.push_back(mat);
+			gizmoEntity	= { OBJECT_ENTITY, entity };
+			gizmoNode	= node;
 		}
+		return;
+	}
 
-		void* matData;
-		vmaMapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation, &matData);
-		memcpy(matData, materials.data(), sizeof(GPUMaterial) * materials.size());
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation);
+	const bool open = ImGui::TreeNode(node, "%s", name);
+	if (ImGui::IsItemClicked())
+	{
+		gizmoEntity	= { OBJECT_ENTITY, entity };
+		gizmoNode	= node;
+	}
+	if (open)
+	{
+		for (Node* child : node->_children)
+			node_gui(child, entity);
+		ImGui::TreePop();
 	}
 }
 
@@ -875,32 +1075,36 @@ void Renderer::init_sync_structures()
 
 void Renderer::init_descriptors()
 {
+	// Texture arrays of the offscreen, texture and hybrid sets, mesh arrays of the hybrid set
 	std::vector<VkDescriptorPoolSize> sizes = {
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
-		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100}
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100 + 2 * MAX_MESHES},
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100 + 4 * MAX_TEXTURES}
 	};
 
 	VkDescriptorPoolCreateInfo pool_info = vkinit::descriptor_pool_create_info(sizes, 10, VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT);
 
 	vkCreateDescriptorPool(*device, &pool_info, nullptr, &_descriptorPool);
 
-	uint32_t nText = (uint32_t)Texture::_textures.size();
 	VkDescriptorSetLayoutBinding cameraBind		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0);
-	VkDescriptorSetLayoutBinding textureBind	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1, nText);
+	VkDescriptorSetLayoutBinding textureBind	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1, MAX_TEXTURES);
 	VkDescriptorSetLayoutBinding materialBind	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 0);
+	VkDescriptorSetLayoutBinding textureFeedbackBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 2);
+	VkDescriptorSetLayoutBinding materialTableBind	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 3);
+	VkDescriptorSetLayoutBinding drawsBind			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 4);
+	VkDescriptorSetLayoutBinding instancesBind		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 5);
 
 	// Create descriptors set layouts
 	// Set = 0
-	// binding camera data at 0
-	std::vector<VkDescriptorSetLayoutBinding> bindings = { cameraBind, textureBind };
+	// binding camera data at 0, textures at 1, the textures sampled at 2, materials at 3, the draws at 4 and their instances at 5
+	std::vector<VkDescriptorSetLayoutBinding> bindings = { cameraBind, textureBind, textureFeedbackBind, materialTableBind, drawsBind, instancesBind };
 	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(bindings.size(), bindings);
 
 	VK_CHECK(vkCreateDescriptorSetLayout(*device, &setInfo, nullptr, &_offscreenDescriptorSetLayout));
 
 	// Set = 1
-	// binding nText textures at 0
+	// binding MAX_TEXTURES textures at 0
 	VkDescriptorSetLayoutCreateInfo set1Info = vkinit::descriptor_set_layout_create_info();
 	set1Info.bindingCount	= 1;
 	set1Info.pBindings		= &textureBind;
@@ -933,30 +1137,27 @@ void Renderer::init_descriptors()
 	VkDescriptorBufferInfo cameraInfo = vkinit::descriptor_buffer_info(_cameraBuffer._buffer, sizeof(GPUCameraData), 0);
 
 	// Textures descriptor image infos
-	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
-	VkSampler sampler;
-	vkCreateSampler(*device, &samplerInfo, nullptr, &sampler);
+	create_texture_sampler();
 
-	std::vector<VkDescriptorImageInfo> imageInfos;
-	for (auto const& texture : Texture::_textures)
-	{
-		VkDescriptorImageInfo imageBufferInfo = {};
-		imageBufferInfo.sampler		= sampler;
-		imageBufferInfo.imageView	= texture.second->imageView;
-		imageBufferInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	// The environment is always resident, texture slots not streamed in yet fall back to it
+	Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr");
+	std::vector<VkDescriptorImageInfo> imageInfos = get_texture_infos();
 
-		imageInfos.push_back(imageBufferInfo);
-	}
+	_textureResidency.init(MAX_TEXTURES);
+	VkDescriptorBufferInfo textureFeedbackInfo = _textureResidency.get_feedback_info();
 
 	// Material descriptor infos
 	VkDescriptorBufferInfo materialInfo = vkinit::descriptor_buffer_info(VulkanEngine::engine->_objectBuffer._buffer, sizeof(GPUMaterial), 0);
+	VkDescriptorBufferInfo materialTableInfo = _materialTable.get_descriptor_info();
 
 	// Writes
 	VkWriteDescriptorSet cameraWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _offscreenDescriptorSet, &cameraInfo, 0);
-	VkWriteDescriptorSet texturesWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _offscreenDescriptorSet, imageInfos.data(), 1, nText);
+	VkWriteDescriptorSet texturesWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _offscreenDescriptorSet, imageInfos.data(), 1, MAX_TEXTURES);
 	VkWriteDescriptorSet materialWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _objectDescriptorSet, &materialInfo, 0);
+	VkWriteDescriptorSet textureFeedbackWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _offscreenDescriptorSet, &textureFeedbackInfo, 2);
+	VkWriteDescriptorSet materialTableWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _offscreenDescriptorSet, &materialTableInfo, 3);
 
-	std::vector<VkWriteDescriptorSet> writes = { cameraWrite, texturesWrite, materialWrite };
+	std::vector<VkWriteDescriptorSet> writes = { cameraWrite, texturesWrite, materialWrite, textureFeedbackWrite, materialTableWrite };
 
 	vkUpdateDescriptorSets(*device, writes.size(), writes.data(), 0, nullptr);
 
@@ -965,11 +1166,15 @@ void Renderer::init_descriptors()
 	// binding single texture as skybox and matrix to position the sphere around camera
 	VkDescriptorSetLayoutBinding skyBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1);
 	VkDescriptorSetLayoutBinding skyBufferBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 2);
+	VkDescriptorSetLayoutBinding skyPagesBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 3);
+	VkDescriptorSetLayoutBinding skyFeedbackBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 4);
 
 	std::vector<VkDescriptorSetLayoutBinding> skyboxBindings = {
 		cameraBind,		// binding = 0 camera info
 		skyBind,		// binding = 1 sky texture
-		skyBufferBind	// binding = 2 sphere matrix
+		skyBufferBind,	// binding = 2 sphere matrix
+		skyPagesBind,	// binding = 3 sky page table
+		skyFeedbackBind	// binding = 4 sky page requests
 	};
 
 	VkDescriptorSetLayoutCreateInfo skyboxSetInfo = {};
@@ -989,10 +1194,16 @@ void Renderer::init_descriptors()
 
 	VK_CHECK(vkAllocateDescriptorSets(*device, &skyboxAllocInfo, &_skyboxDescriptorSet));
 
-	VkDescriptorImageInfo skyboxImageInfo = {};
-	skyboxImageInfo.sampler				= sampler;
-	skyboxImageInfo.imageView = Texture::GET("data/textures/LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView; // Texture::GET("data/textures/woods.jpg")->imageView;
-	skyboxImageInfo.imageLayout			= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	// The sky is paged in on demand, only its physical cache is bound
+	_skyTexture.init(vkutil::findFile("LA_Downtown_Helipad_GoldenHour_8k.jpg", searchPaths, true));
+
+	// Ambient lighting is precomputed from the irradiance map and the sky
+	_environment.init(vkutil::findFile("LA_Downtown_Helipad_GoldenHour_Env.hdr", searchPaths, true),
+		vkutil::findFile("LA_Downtown_Helipad_GoldenHour_8k.jpg", searchPaths, true));
+
+	VkDescriptorImageInfo skyboxImageInfo	= _skyTexture.get_cache_info();
+	VkDescriptorBufferInfo skyPagesInfo		= _skyTexture.get_page_table_info();
+	VkDescriptorBufferInfo skyFeedbackInfo	= _skyTexture.get_feedback_info();
 
 	VulkanEngine::engine->create_buffer(sizeof(glm::mat4), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _skyboxBuffer);
 
@@ -1004,11 +1215,15 @@ void Renderer::init_descriptors()
 	VkWriteDescriptorSet camWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _skyboxDescriptorSet, &cameraInfo, 0);
 	VkWriteDescriptorSet skyboxWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _skyboxDescriptorSet, &skyboxImageInfo, 1);
 	VkWriteDescriptorSet skyboxBuffer	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _skyboxDescriptorSet, &skyboxBufferInfo, 2);
+	VkWriteDescriptorSet skyPagesWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _skyboxDescriptorSet, &skyPagesInfo, 3);
+	VkWriteDescriptorSet skyFeedbackWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _skyboxDescriptorSet, &skyFeedbackInfo, 4);
 
 	std::vector<VkWriteDescriptorSet> skyboxWrites = {
 		camWrite,
 		skyboxWrite,
-		skyboxBuffer
+		skyboxBuffer,
+		skyPagesWrite,
+		skyFeedbackWrite
 	};
 
 	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(skyboxWrites.size()), skyboxWrites.data(), 0, nullptr);
@@ -1020,7 +1235,10 @@ void Renderer::init_descriptors()
 		vkDestroyDescriptorSetLayout(*device, _textureDescriptorSetLayout, nullptr);
 		vkDestroyDescriptorSetLayout(*device, _objectDescriptorSetLayout, nullptr);
 		vkDestroyDescriptorSetLayout(*device, _skyboxDescriptorSetLayout, nullptr);
-		vkDestroySampler(*device, sampler, nullptr);
+		vkDestroySampler(*device, _textureSampler, nullptr);
+		_skyTexture.destroy();
+		_environment.destroy();
+		_textureResidency.destroy();
 		});
 }
 
@@ -1040,7 +1258,10 @@ void Renderer::init_deferred_descriptors()
 	VkDescriptorSetLayoutBinding materialBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 6); // Metallic Roughness
 	VkDescriptorSetLayoutBinding cameraBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 7); // Camera position buffer
 	VkDescriptorSetLayoutBinding emissiveBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 8); // Emissive
-	VkDescriptorSetLayoutBinding environtmentBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 9);
+	VkDescriptorSetLayoutBinding environtmentBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 9);	// Prefiltered environment
+	VkDescriptorSetLayoutBinding environmentSHBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 10);	// Irradiance SH
+	VkDescriptorSetLayoutBinding clusterGridBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 11);	// Light cluster grid
+	VkDescriptorSetLayoutBinding clusterListsBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 12);	// Lights of each cluster
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -1053,7 +1274,10 @@ void Renderer::init_deferred_descriptors()
 		materialBinding,
 		cameraBinding,
 		emissiveBinding,
-		environtmentBinding
+		environtmentBinding,
+		environmentSHBinding,
+		clusterGridBinding,
+		clusterListsBinding
 	};
 
 	VkDescriptorSetLayoutCreateInfo setInfo = {};
@@ -1066,10 +1290,6 @@ void Renderer::init_deferred_descriptors()
 
 	const int nLights = _scene->_lights.size();
 
-	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
-	VkSampler sampler;
-	vkCreateSampler(*device, &samplerInfo, nullptr, &sampler);
-
 	for (int i = 0; i < FRAME_OVERLAP; i++)
 	{
 		VkDescriptorSetAllocateInfo allocInfo = {};
@@ -1113,8 +1333,15 @@ void Renderer::init_deferred_descriptors()
 		cameraDesc.offset		= 0;
 		cameraDesc.range		= sizeof(glm::vec3);
 
-		// Binding = 9 Environment image
-		VkDescriptorImageInfo environmentDesc = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		// Binding = 9 Prefiltered environment
+		// Binding = 10 Irradiance SH
+		VkDescriptorImageInfo environmentDesc		= _environment.get_specular_info();
+		VkDescriptorBufferInfo environmentSHDesc	= _environment.get_sh_info();
+
+		// Binding = 11 Light cluster grid
+		// Binding = 12 Lights of each cluster
+		VkDescriptorBufferInfo clusterGridDesc		= _lightClusters.get_grid_info();
+		VkDescriptorBufferInfo clusterListsDesc		= _lightClusters.get_lists_info();
 
 		VkWriteDescriptorSet positionWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorPosition, 0);
 		VkWriteDescriptorSet normalWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorNormal, 1);
@@ -1126,6 +1353,9 @@ void Renderer::init_deferred_descriptors()
 		VkWriteDescriptorSet cameraWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _frames[i].deferredDescriptorSet, &cameraDesc, 7);
 		VkWriteDescriptorSet emissiveWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorEmissive, 8);
 		VkWriteDescriptorSet environmentWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &environmentDesc, 9);
+		VkWriteDescriptorSet environmentSHWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _frames[i].deferredDescriptorSet, &environmentSHDesc, 10);
+		VkWriteDescriptorSet clusterGridWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _frames[i].deferredDescriptorSet, &clusterGridDesc, 11);
+		VkWriteDescriptorSet clusterListsWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _frames[i].deferredDescriptorSet, &clusterListsDesc, 12);
 
 		std::vector<VkWriteDescriptorSet> writes = {
 			positionWrite,
@@ -1137,7 +1367,10 @@ void Renderer::init_deferred_descriptors()
 			materialWrite,
 			cameraWrite,
 			emissiveWrite,
-			environmentWrite
+			environmentWrite,
+			environmentSHWrite,
+			clusterGridWrite,
+			clusterListsWrite
 		};
 
 		vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
@@ -1145,7 +1378,6 @@ void Renderer::init_deferred_descriptors()
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vkDestroyDescriptorSetLayout(*device, _deferredSetLayout, nullptr);
-		vkDestroySampler(*device, sampler, nullptr);
 		});
 }
 
@@ -1184,23 +1416,10 @@ void Renderer::init_deferred_pipelines()
 
 	VkDescriptorSetLayout offscreenSetLayouts[] = { _offscreenDescriptorSetLayout, _objectDescriptorSetLayout };
 
-	VkPushConstantRange matrix_constant;
-	matrix_constant.offset								= 0;
-	matrix_constant.size								= sizeof(glm::mat4) * 2;
-	matrix_constant.stageFlags							= VK_SHADER_STAGE_VERTEX_BIT;
-
-	VkPushConstantRange material_constant;
-	material_constant.offset							= sizeof(glm::mat4) * 2;
-	material_constant.size								= sizeof(GPUMaterial);
-	material_constant.stageFlags						= VK_SHADER_STAGE_FRAGMENT_BIT;
-
-	VkPushConstantRange constants[] = { matrix_constant, material_constant };
-
+	// Matrices and materials are read from the draws buffer, there are no push constants
 	VkPipelineLayoutCreateInfo offscreenPipelineLayoutInfo = vkinit::pipeline_layout_create_info();
 	offscreenPipelineLayoutInfo.setLayoutCount			= 2;
 	offscreenPipelineLayoutInfo.pSetLayouts				= offscreenSetLayouts;
-	offscreenPipelineLayoutInfo.pushConstantRangeCount	= 2;
-	offscreenPipelineLayoutInfo.pPushConstantRanges		= constants;
 
 	VK_CHECK(vkCreatePipelineLayout(*device, &offscreenPipelineLayoutInfo, nullptr, &_offscreenPipelineLayout));
 
@@ -1336,6 +1555,9 @@ void Renderer::build_forward_command_buffer()
 
 	VK_CHECK(vkBeginCommandBuffer(*cmd, &cmdBufInfo));
 
+	// Sky pages requested by the previous frames
+	_skyTexture.record_uploads(*cmd);
+
 	vkCmdBeginRenderPass(*cmd, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 	// Set = 0 Camera data descriptor
 	uint32_t uniform_offset = VulkanEngine::engine->pad_uniform_buffer_size(sizeof(GPUSceneData));
@@ -1347,25 +1569,22 @@ void Renderer::build_forward_command_buffer()
 
 	Mesh* lastMesh = nullptr;
 
-	for (size_t i = 0; i < _scene->_entities.size(); i++)
+	const ObjectStore& entities = _scene->_entities;
+	for (uint32_t i = 0; i < entities.size(); i++)
 	{
-		Object* object = _scene->_entities[i];
+		Mesh* mesh = entities.prefabs[i]->_mesh;
 
 		vkCmdBindPipeline(*cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _forwardPipeline);
 
+		// The entity is read through the instance index, like the offscreen pass
 		VkDeviceSize offset = { 0 };
 
-		int constant = object->id;
-		int matIdx = object->materialIdx;
-		vkCmdPushConstants(_offscreenComandBuffer, _offscreenPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(int), &constant);
-		vkCmdPushConstants(_offscreenComandBuffer, _offscreenPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, sizeof(int), sizeof(int), &matIdx);
-
-		if (lastMesh != object->prefab->_mesh) {
-			vkCmdBindVertexBuffers(*cmd, 0, 1, &object->prefab->_mesh->_vertexBuffer._buffer, &offset);
-			vkCmdBindIndexBuffer(*cmd, object->prefab->_mesh->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
-			lastMesh = object->prefab->_mesh;
+		if (lastMesh != mesh) {
+			vkCmdBindVertexBuffers(*cmd, 0, 1, &mesh->_vertexBuffer._buffer, &offset);
+			vkCmdBindIndexBuffer(*cmd, mesh->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
+			lastMesh = mesh;
 		}
-		vkCmdDrawIndexed(*cmd, static_cast<uint32_t>(object->prefab->_mesh->_indices.size()), _scene->_entities.size(), 0, 0, i);
+		vkCmdDrawIndexed(*cmd, static_cast<uint32_t>(mesh->_indices.size()), entities.size(), 0, 0, i);
 	}
 
 	ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), *cmd);
@@ -1386,6 +1605,14 @@ void Renderer::build_previous_command_buffer()
 
 	VK_CHECK(vkBeginCommandBuffer(_offscreenComandBuffer, &cmdBufInfo));
 
+	// Sky pages requested by the previous frames
+	_skyTexture.record_uploads(_offscreenComandBuffer);
+
+	// Levels are picked every frame, cluster culling has to run outside the render pass
+	update_cluster_draws();
+	if (_clusterCulling)
+		record_cluster_culling(_offscreenComandBuffer, false);
+
 	VkDeviceSize offset = { 0 };
 
 	std::array<VkClearValue, 7> clearValues;
@@ -1422,14 +1649,42 @@ void Renderer::build_previous_command_buffer()
 
 	vkCmdBindPipeline(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipeline);
 
-	uint32_t instance = 0;
-	for (size_t i = 0; i < _scene->_entities.size(); i++)
+	draw_clusters(_offscreenComandBuffer);
+
+	vkCmdEndRenderPass(_offscreenComandBuffer);
+
+	// Meshlets not drawn yet are tested against the depth of the ones that were, those that
+	// turn out visible are drawn on top. The late pass always runs, it leaves the final layouts
+	const bool occlusion = _clusterCulling && _occlusionCulling;
+	if (occlusion)
+	{
+		_depthPyramid.record(_offscreenComandBuffer);
+		record_cluster_culling(_offscreenComandBuffer, true);
+	}
+
+	renderPassBeginInfo.renderPass		= _offscreenLateRenderPass;
+	renderPassBeginInfo.clearValueCount	= 0;
+	renderPassBeginInfo.pClearValues	= nullptr;
+
+	vkCmdBeginRenderPass(_offscreenComandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+	if (occlusion)
 	{
-		Object* object = _scene->_entities[i];
-		object->draw(_offscreenComandBuffer, _offscreenPipelineLayout, object->m_matrix);
+		vkCmdBindDescriptorSets(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipelineLayout, 0, 1, &_offscreenDescriptorSet, 0, nullptr);
+		vkCmdBindPipeline(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipeline);
+		draw_clusters(_offscreenComandBuffer);
 	}
 
 	vkCmdEndRenderPass(_offscreenComandBuffer);
+
+	// Lights are binned once the G-buffers are written, for the lighting passes that follow
+	Camera* camera			= _scene->_camera;
+	glm::mat4 projection	= camera->getProjection((float)VulkanEngine::engine->_window->getWidth() / (float)VulkanEngine::engine->_window->getHeight());
+	projection[1][1] *= -1;
+	_lightClusters.read_overflow();
+	_lightClusters.update(camera->getView(), projection, camera->_near, camera->_far);
+	_lightClusters.record(_offscreenComandBuffer);
+
 	VK_CHECK(vkEndCommandBuffer(_offscreenComandBuffer));
 }
 
@@ -1474,6 +1729,435 @@ void Renderer::build_deferred_command_buffer()
 	VK_CHECK(vkEndCommandBuffer(get_current_frame()._mainCommandBuffer));
 }
 
+void Renderer::init_cluster_culling()
+{
+	VulkanEngine::engine->create_buffer(sizeof(GPUCullData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _cullDataBuffer);
+
+	// binding = 0 Cull data
+	// binding = 1 Meshlets
+	// binding = 2 Draws
+	// binding = 3 Indirect commands
+	// binding = 4 Draw counts
+	// binding = 5 Depth pyramid
+	// binding = 6 Meshlet visibility
+	std::vector<VkDescriptorPoolSize> poolSizes = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5},
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1}
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo = vkinit::descriptor_pool_create_info(poolSizes, 1);
+	VK_CHECK(vkCreateDescriptorPool(*device, &poolInfo, nullptr, &_cullDescPool));
+
+	VkDescriptorSetLayoutBinding cullDataBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding meshletsBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+	VkDescriptorSetLayoutBinding drawsBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
+	VkDescriptorSetLayoutBinding commandsBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
+	VkDescriptorSetLayoutBinding countsBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
+	VkDescriptorSetLayoutBinding pyramidBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
+	VkDescriptorSetLayoutBinding visibilityBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
+
+	std::vector<VkDescriptorSetLayoutBinding> bindings = { cullDataBinding, meshletsBinding, drawsBinding, commandsBinding, countsBinding, pyramidBinding, visibilityBinding };
+	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(static_cast<uint32_t>(bindings.size()), bindings);
+	VK_CHECK(vkCreateDescriptorSetLayout(*device, &setInfo, nullptr, &_cullDescSetLayout));
+
+	VkDescriptorSetAllocateInfo allocInfo = vkinit::descriptor_set_allocate_info(_cullDescPool, &_cullDescSetLayout);
+	VK_CHECK(vkAllocateDescriptorSets(*device, &allocInfo, &_cullDescSet));
+
+	_depthPyramid.init(_deferredTextures[6].imageView, VulkanEngine::engine->_window->getWidth(), VulkanEngine::engine->_window->getHeight());
+
+	VkDescriptorImageInfo pyramidInfo	= _depthPyramid.get_descriptor_info();
+	VkWriteDescriptorSet pyramidWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _cullDescSet, &pyramidInfo, 5);
+	vkUpdateDescriptorSets(*device, 1, &pyramidWrite, 0, nullptr);
+
+	build_cluster_draws();
+
+	// Compute pipeline
+	VkShaderModule cullShaderModule;
+	if (!VulkanEngine::engine->load_shader_module(vkutil::findFile("cluster_cull.comp.spv", searchPaths, true).c_str(), &cullShaderModule)) {
+		std::cout << "Could not load cluster culling compute shader!" << std::endl;
+	}
+
+	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, cullShaderModule);
+
+	// Culling phase, early or late
+	VkPushConstantRange pushConstantRange = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t) };
+
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount			= 1;
+	pipelineLayoutCI.pSetLayouts			= &_cullDescSetLayout;
+	pipelineLayoutCI.pushConstantRangeCount	= 1;
+	pipelineLayoutCI.pPushConstantRanges	= &pushConstantRange;
+	VK_CHECK(vkCreatePipelineLayout(*device, &pipelineLayoutCI, nullptr, &_cullPipelineLayout));
+
+	VkComputePipelineCreateInfo computePipelineCI = {};
+	computePipelineCI.sType		= VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCI.stage		= shaderStageCI;
+	computePipelineCI.layout	= _cullPipelineLayout;
+
+	VK_CHECK(vkCreateComputePipelines(*device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_cullPipeline));
+
+	vkDestroyShaderModule(*device, cullShaderModule, nullptr);
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		destroy_cluster_draws();
+		_depthPyramid.destroy();
+		vkDestroyPipeline(*device, _cullPipeline, nullptr);
+		vkDestroyPipelineLayout(*device, _cullPipelineLayout, nullptr);
+		vkDestroyDescriptorSetLayout(*device, _cullDescSetLayout, nullptr);
+		vkDestroyDescriptorPool(*device, _cullDescPool, nullptr);
+		});
+}
+
+// Buffers depend on the drawn primitives, they are built again when entities are streamed in
+void Renderer::build_cluster_draws()
+{
+	// Flatten every drawn primitive together with the meshlets of all its levels
+	std::vector<GPUMeshlet> meshlets;
+	const ObjectStore& entities = _scene->_entities;
+
+	// Entities sharing a mesh are gathered together so their draws form a single batch
+	std::vector<uint32_t> order(entities.size());
+	for (uint32_t i = 0; i < entities.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return entities.prefabs[a]->_mesh < entities.prefabs[b]->_mesh;
+		});
+
+	std::function<void(uint32_t, Node*)> gatherNode = [&](uint32_t entity, Node* node)
+	{
+		for (Primitive* prim : node->_primitives)
+		{
+			if (prim->indexCount == 0 || prim->lods.empty())
+				continue;
+
+			const uint32_t drawID = static_cast<uint32_t>(_clusterDraws.size());
+			_clusterDraws.push_back({ entity, node, prim, static_cast<uint32_t>(meshlets.size()), glm::mat4(1), 0, 1.0f });
+			for (uint32_t lod = 0; lod < prim->lods.size(); lod++)
+			{
+				for (uint32_t i = 0; i < prim->lods[lod].meshletCount; i++)
+				{
+					const Meshlet& m = entities.prefabs[entity]->_mesh->_meshlets[prim->lods[lod].firstMeshlet + i];
+					meshlets.push_back({ m.sphere, m.cone, m.firstIndex, m.indexCount, drawID, lod });
+				}
+			}
+		}
+		for (Node* child : node->_children)
+			gatherNode(entity, child);
+	};
+
+	for (const uint32_t i : order)
+	{
+		Mesh* mesh = entities.prefabs[i]->_mesh;
+		if (_drawBatches.empty() || _drawBatches.back().mesh != mesh)
+			_drawBatches.push_back({ mesh, static_cast<uint32_t>(_clusterDraws.size()), 0, static_cast<uint32_t>(meshlets.size()), 0 });
+
+		for (Node* root : entities.prefabs[i]->_root)
+			gatherNode(i, root);
+
+		DrawBatch& batch	= _drawBatches.back();
+		batch.drawCount		= static_cast<uint32_t>(_clusterDraws.size()) - batch.firstDraw;
+		batch.meshletCount	= static_cast<uint32_t>(meshlets.size()) - batch.firstMeshlet;
+	}
+
+	// Draws of the same primitive in the batch form an instance group, their material is the same too
+	for (DrawBatch& batch : _drawBatches)
+	{
+		std::unordered_map<Primitive*, uint32_t> groupIndex;
+		std::vector<std::vector<uint32_t>> groupDraws;
+		for (uint32_t i = batch.firstDraw; i < batch.firstDraw + batch.drawCount; i++)
+		{
+			auto it = groupIndex.emplace(_clusterDraws[i].primitive, static_cast<uint32_t>(groupDraws.size()));
+			if (it.second)
+				groupDraws.emplace_back();
+			groupDraws[it.first->second].push_back(i);
+		}
+
+		batch.firstGroup	= static_cast<uint32_t>(_instanceGroups.size());
+		batch.groupCount	= static_cast<uint32_t>(groupDraws.size());
+		for (const std::vector<uint32_t>& draws : groupDraws)
+		{
+			_instanceGroups.push_back({ static_cast<uint32_t>(_groupedDraws.size()), static_cast<uint32_t>(draws.size()) });
+			_groupedDraws.insert(_groupedDraws.end(), draws.begin(), draws.end());
+		}
+	}
+
+	_nMeshlets = static_cast<uint32_t>(meshlets.size());
+	const uint32_t nDraws = static_cast<uint32_t>(_clusterDraws.size());
+
+	// Empty buffers are not allowed, the scene may still be streaming in
+	const uint32_t meshletCapacity	= std::max(_nMeshlets, 1u);
+	const uint32_t drawCapacity		= std::max(nDraws, 1u);
+
+	VulkanEngine::engine->create_buffer(sizeof(GPUMeshlet) * meshletCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _meshletBuffer, false);
+	VulkanEngine::engine->create_buffer(sizeof(GPUClusterDraw) * drawCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _clusterDrawBuffer, false);
+	VulkanEngine::engine->create_buffer(sizeof(VkDrawIndexedIndirectCommand) * meshletCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _indirectBuffer, false);
+	VulkanEngine::engine->create_buffer(sizeof(uint32_t) * drawCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _drawCountBuffer, false);
+	VulkanEngine::engine->create_buffer(sizeof(VkDrawIndexedIndirectCommand) * drawCapacity, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _drawCommandBuffer, false);
+	VulkanEngine::engine->create_buffer(sizeof(uint32_t) * meshletCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _visibilityBuffer, false);
+	VulkanEngine::engine->create_buffer(sizeof(uint32_t) * 2 * drawCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _drawInstanceBuffer, false);
+
+	void* meshletData;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _meshletBuffer._allocation, &meshletData);
+	memcpy(meshletData, meshlets.data(), sizeof(GPUMeshlet) * _nMeshlets);
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _meshletBuffer._allocation);
+
+	// Meshlet commands are single instances whose first instance is the draw id
+	void* instanceData;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _drawInstanceBuffer._allocation, &instanceData);
+	for (uint32_t i = 0; i < nDraws; i++)
+		static_cast<uint32_t*>(instanceData)[i] = i;
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _drawInstanceBuffer._allocation);
+
+	// Nothing was visible before, the late phase draws the first frame
+	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
+		vkCmdFillBuffer(cmd, _visibilityBuffer._buffer, 0, VK_WHOLE_SIZE, 0);
+		});
+
+	VkDescriptorBufferInfo cullDataInfo	= vkinit::descriptor_buffer_info(_cullDataBuffer._buffer, sizeof(GPUCullData));
+	VkDescriptorBufferInfo meshletsInfo	= vkinit::descriptor_buffer_info(_meshletBuffer._buffer, sizeof(GPUMeshlet) * meshletCapacity);
+	VkDescriptorBufferInfo drawsInfo	= vkinit::descriptor_buffer_info(_clusterDrawBuffer._buffer, sizeof(GPUClusterDraw) * drawCapacity);
+	VkDescriptorBufferInfo commandsInfo	= vkinit::descriptor_buffer_info(_indirectBuffer._buffer, sizeof(VkDrawIndexedIndirectCommand) * meshletCapacity);
+	VkDescriptorBufferInfo countsInfo	= vkinit::descriptor_buffer_info(_drawCountBuffer._buffer, sizeof(uint32_t) * drawCapacity);
+	VkDescriptorBufferInfo visibilityInfo	= vkinit::descriptor_buffer_info(_visibilityBuffer._buffer, sizeof(uint32_t) * meshletCapacity);
+	VkDescriptorBufferInfo instancesInfo	= vkinit::descriptor_buffer_info(_drawInstanceBuffer._buffer, sizeof(uint32_t) * 2 * drawCapacity);
+
+	VkWriteDescriptorSet cullDataWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _cullDescSet, &cullDataInfo, 0);
+	VkWriteDescriptorSet meshletsWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _cullDescSet, &meshletsInfo, 1);
+	VkWriteDescriptorSet drawsWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _cullDescSet, &drawsInfo, 2);
+	VkWriteDescriptorSet commandsWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _cullDescSet, &commandsInfo, 3);
+	VkWriteDescriptorSet countsWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _cullDescSet, &countsInfo, 4);
+	VkWriteDescriptorSet visibilityWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _cullDescSet, &visibilityInfo, 6);
+
+	VkWriteDescriptorSet geometryDrawsWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _offscreenDescriptorSet, &drawsInfo, 4);
+	VkWriteDescriptorSet instancesWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _offscreenDescriptorSet, &instancesInfo, 5);
+
+	std::vector<VkWriteDescriptorSet> writes = { cullDataWrite, meshletsWrite, drawsWrite, commandsWrite, countsWrite, visibilityWrite, geometryDrawsWrite, instancesWrite };
+	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+void Renderer::destroy_cluster_draws()
+{
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _meshletBuffer._buffer, _meshletBuffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _clusterDrawBuffer._buffer, _clusterDrawBuffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _indirectBuffer._buffer, _indirectBuffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _drawCountBuffer._buffer, _drawCountBuffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _drawCommandBuffer._buffer, _drawCommandBuffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _visibilityBuffer._buffer, _visibilityBuffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _drawInstanceBuffer._buffer, _drawInstanceBuffer._allocation);
+	_clusterDraws.clear();
+	_drawBatches.clear();
+	_instanceGroups.clear();
+	_groupedDraws.clear();
+	_nMeshlets = 0;
+}
+
+void Renderer::update_cluster_draws()
+{
+	// Frustum planes from the same matrices used by the geometry pass
+	glm::mat4 view			= _scene->_camera->getView();
+	glm::mat4 projection	= _scene->_camera->getProjection((float)VulkanEngine::engine->_window->getWidth() / (float)VulkanEngine::engine->_window->getHeight());
+	projection[1][1] *= -1;
+
+	// Rows of the view projection matrix
+	const glm::mat4 m = glm::transpose(projection * view);
+
+	GPUCullData cullData;
+	cullData.planes[0]		= m[3] + m[0];	// Left
+	cullData.planes[1]		= m[3] - m[0];	// Right
+	cullData.planes[2]		= m[3] + m[1];	// Bottom
+	cullData.planes[3]		= m[3] - m[1];	// Top
+	cullData.planes[4]		= m[3] + m[2];	// Near
+	cullData.planes[5]		= m[3] - m[2];	// Far
+	for (glm::vec4& plane : cullData.planes)
+		plane /= glm::length(glm::vec3(plane));
+	cullData.cameraPosition	= glm::vec4(_scene->_camera->_position, 1);
+	cullData.viewProjection	= projection * view;
+	cullData.pyramidSize	= glm::vec2(_depthPyramid.get_width(), _depthPyramid.get_height());
+	cullData.pyramidLevels	= _depthPyramid.get_levels();
+	cullData.occlusion		= _clusterCulling && _occlusionCulling ? 1 : 0;
+	cullData.meshletCount	= _nMeshlets;
+	cullData.compact		= VulkanEngine::engine->_drawIndirectCount ? 1 : 0;
+	cullData.coneCulling	= _coneCulling ? 1 : 0;
+	cullData.pad			= 0;
+
+	void* cullDataPtr;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _cullDataBuffer._allocation, &cullDataPtr);
+	memcpy(cullDataPtr, &cullData, sizeof(GPUCullData));
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _cullDataBuffer._allocation);
+
+	// Object space errors are scaled to pixels at the distance of the primitive bounds
+	const float pixelsPerUnit = VulkanEngine::engine->_window->getHeight() / (2.0f * std::tan(glm::radians(_scene->_camera->_fov) * 0.5f));
+
+	void* drawData;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _clusterDrawBuffer._allocation, &drawData);
+	GPUClusterDraw* gpuDraws = (GPUClusterDraw*)drawData;
+	void* commandData;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _drawCommandBuffer._allocation, &commandData);
+	VkDrawIndexedIndirectCommand* commands = (VkDrawIndexedIndirectCommand*)commandData;
+	const uint32_t nDraws = static_cast<uint32_t>(_clusterDraws.size());
+	_frustumCuller.resize(nDraws);
+	_frustumCuller.set_planes(cullData.planes);
+	for (uint32_t i = 0; i < nDraws; i++)
+	{
+		ClusterDraw& draw	= _clusterDraws[i];
+		draw.model			= _scene->_entities.transforms[draw.entity] * draw.node->getGlobalMatrix();
+
+		const float scale = std::max(glm::length(glm::vec3(draw.model[0])), std::max(glm::length(glm::vec3(draw.model[1])), glm::length(glm::vec3(draw.model[2]))));
+
+		// Coarsest level whose error stays under the threshold on screen
+		const std::vector<MeshLod>& lods	= draw.primitive->lods;
+		const glm::vec3 center				= glm::vec3(draw.model * glm::vec4(glm::vec3(lods[0].sphere), 1));
+		const float distance				= std::max(glm::length(center - _scene->_camera->_position) - lods[0].sphere.w * scale, 0.1f);
+		draw.lod = 0;
+		for (uint32_t lod = static_cast<uint32_t>(lods.size()) - 1; lod > 0; lod--)
+		{
+			if (lods[lod].error * scale / distance * pixelsPerUnit <= _lodThreshold)
+			{
+				draw.lod = lod;
+				break;
+			}
+		}
+		draw.scale = scale;
+
+		_frustumCuller.set_box(i, draw.model, draw.primitive->boundsMin, draw.primitive->boundsMax);
+	}
+
+	// Draws outside the frustum have no instances and none of their meshlets reach the culling shader
+	const auto cullStart = std::chrono::high_resolution_clock::now();
+	if (_frustumCulling)
+		_visibleDraws = _frustumCuller.cull(_drawVisible);
+	else
+	{
+		_drawVisible.assign(nDraws, 1);
+		_visibleDraws = nDraws;
+	}
+	_frustumCullTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - cullStart).count();
+
+	uint32_t batch = 0;
+	for (uint32_t i = 0; i < nDraws; i++)
+	{
+		const ClusterDraw& draw		= _clusterDraws[i];
+		const MeshLod& lod			= draw.primitive->lods[draw.lod];
+		const bool visible			= _drawVisible[i] != 0;
+
+		while (i >= _drawBatches[batch].firstDraw + _drawBatches[batch].drawCount)
+			batch++;
+
+		gpuDraws[i] = { draw.model, glm::transpose(glm::inverse(draw.model)), draw.firstMeshlet, visible ? lod.meshletCount : 0, draw.scale,
+			visible ? draw.lod : CULLED_LOD, static_cast<uint32_t>(draw.primitive->materialID), batch, _drawBatches[batch].firstMeshlet, 0 };
+	}
+
+	// Visible draws of a group sharing a level are the instances of one command. Their ids are listed
+	// after the identity range, sorted by level, and read by the vertex shader with the instance index
+	void* instanceData;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _drawInstanceBuffer._allocation, &instanceData);
+	uint32_t* instances = static_cast<uint32_t*>(instanceData) + nDraws;
+	uint32_t nInstances	= 0;
+	_instancedCommands	= 0;
+	std::vector<uint32_t> lodOffsets;
+	for (DrawBatch& batch : _drawBatches)
+	{
+		batch.firstCommand = _instancedCommands;
+		for (uint32_t g = batch.firstGroup; g < batch.firstGroup + batch.groupCount; g++)
+		{
+			const InstanceGroup& group			= _instanceGroups[g];
+			const std::vector<MeshLod>& lods	= _clusterDraws[_groupedDraws[group.first]].primitive->lods;
+
+			lodOffsets.assign(lods.size(), 0);
+			for (uint32_t i = group.first; i < group.first + group.count; i++)
+			{
+				if (_drawVisible[_groupedDraws[i]])
+					lodOffsets[_clusterDraws[_groupedDraws[i]].lod]++;
+			}
+
+			for (uint32_t lod = 0; lod < lods.size(); lod++)
+			{
+				const uint32_t count = lodOffsets[lod];
+				if (count == 0)
+					continue;
+				commands[_instancedCommands++]	= { lods[lod].indexCount, count, lods[lod].firstIndex, 0, nDraws + nInstances };
+				lodOffsets[lod]					= nInstances;
+				nInstances						+= count;
+			}
+
+			for (uint32_t i = group.first; i < group.first + group.count; i++)
+			{
+				const uint32_t drawID = _groupedDraws[i];
+				if (_drawVisible[drawID])
+					instances[lodOffsets[_clusterDraws[drawID].lod]++] = drawID;
+			}
+		}
+		batch.commandCount = _instancedCommands - batch.firstCommand;
+	}
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _drawInstanceBuffer._allocation);
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _drawCommandBuffer._allocation);
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _clusterDrawBuffer._allocation);
+}
+
+void Renderer::record_cluster_culling(VkCommandBuffer cmd, const bool late)
+{
+	// The phase before, early or the late one of the last frame, wrote the visibility and commands its draws may still read
+	VkMemoryBarrier phaseBarrier{};
+	phaseBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	phaseBarrier.srcAccessMask	= VK_ACCESS_SHADER_WRITE_BIT;
+	phaseBarrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &phaseBarrier, 0, nullptr, 0, nullptr);
+
+	// Counts are accumulated with atomics, they start from zero every phase
+	vkCmdFillBuffer(cmd, _drawCountBuffer._buffer, 0, VK_WHOLE_SIZE, 0);
+
+	VkMemoryBarrier fillBarrier{};
+	fillBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	fillBarrier.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+	fillBarrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &fillBarrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _cullPipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _cullPipelineLayout, 0, 1, &_cullDescSet, 0, nullptr);
+	const uint32_t phase = late ? 1 : 0;
+	vkCmdPushConstants(cmd, _cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &phase);
+	vkCmdDispatch(cmd, (_nMeshlets + 63) / 64, 1, 1);
+
+	VkMemoryBarrier cullBarrier{};
+	cullBarrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	cullBarrier.srcAccessMask	= VK_ACCESS_SHADER_WRITE_BIT;
+	cullBarrier.dstAccessMask	= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &cullBarrier, 0, nullptr, 0, nullptr);
+}
+
+// One indirect call per batch, matrices and materials are fetched by the shaders with the draw id of each instance
+void Renderer::draw_clusters(VkCommandBuffer cmd)
+{
+	VkDeviceSize offset = { 0 };
+	const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+	for (size_t i = 0; i < _drawBatches.size(); i++)
+	{
+		const DrawBatch& batch = _drawBatches[i];
+		if (batch.drawCount == 0)
+			continue;
+
+		vkCmdBindVertexBuffers(cmd, 0, 1, &batch.mesh->_vertexBuffer._buffer, &offset);
+		vkCmdBindIndexBuffer(cmd, batch.mesh->_indexBuffer._buffer, offset, VK_INDEX_TYPE_UINT32);
+
+		if (!_clusterCulling)
+		{
+			if (batch.commandCount > 0)
+				vkCmdDrawIndexedIndirect(cmd, _drawCommandBuffer._buffer, stride * batch.firstCommand, batch.commandCount, stride);
+			continue;
+		}
+
+		// Culled meshlets are compacted away, or left with zero instances when draw count is not available
+		const VkDeviceSize commandOffset = stride * batch.firstMeshlet;
+		if (VulkanEngine::engine->_drawIndirectCount)
+			VulkanEngine::engine->vkCmdDrawIndexedIndirectCountKHR(cmd, _indirectBuffer._buffer, commandOffset, _drawCountBuffer._buffer, sizeof(uint32_t) * i, batch.meshletCount, stride);
+		else
+			vkCmdDrawIndexedIndirect(cmd, _indirectBuffer._buffer, commandOffset, batch.meshletCount, stride);
+	}
+}
+
 void Renderer::load_data_to_gpu()
 {
 	// Raster data
@@ -1488,45 +2172,219 @@ void Renderer::load_data_to_gpu()
 
 	// Raytracing data
 	const unsigned int nLights		= _scene->_lights.size();
-	const unsigned int nMaterials	= Material::_materials.size();
 
 	if (!_lightBuffer._buffer)
 		VulkanEngine::engine->create_buffer(sizeof(uboLight) * nLights, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _lightBuffer);
-	if (!_matBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(GPUMaterial) * nMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _matBuffer);
 	if (!_rtCameraBuffer._buffer)
 		VulkanEngine::engine->create_buffer(sizeof(RTCameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _rtCameraBuffer);
 
 	// TODO: rethink how to update vertex and index for each entity
-	for (Object* obj : _scene->_entities)
+	// Called again when entities are streamed in, matrices and indices are rebuilt from scratch
+	std::vector<glm::vec4> idVector;
+	_scene->_matricesVector.clear();
+	const ObjectStore& entities = _scene->_entities;
+	for (uint32_t i = 0; i < entities.size(); i++)
 	{
-		for (Node* root : obj->prefab->_root)
+		for (Node* root : entities.prefabs[i]->_root)
 		{
-			root->fill_matrix_buffer(_scene->_matricesVector, obj->m_matrix);
+			root->fill_matrix_buffer(_scene->_matricesVector, entities.transforms[i]);
+			root->fill_index_buffer(idVector, entities.prefabs[i]->_mesh->_id);
 		}
 	}
 
-	if(!_matricesBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(glm::mat4) * _scene->_matricesVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _matricesBuffer);
+	// Both buffers double when the entities no longer fit, the caller rewrites the descriptors
+	const uint32_t nInstances = static_cast<uint32_t>(_scene->_matricesVector.size());
+	if (!_matricesBuffer._buffer || nInstances > _primitiveCapacity)
+	{
+		if (_matricesBuffer._buffer)
+		{
+			vmaDestroyBuffer(VulkanEngine::engine->_allocator, _matricesBuffer._buffer, _matricesBuffer._allocation);
+			vmaDestroyBuffer(VulkanEngine::engine->_allocator, _idBuffer._buffer, _idBuffer._allocation);
+		}
+		else
+		{
+			VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+				vmaDestroyBuffer(VulkanEngine::engine->_allocator, _matricesBuffer._buffer, _matricesBuffer._allocation);
+				vmaDestroyBuffer(VulkanEngine::engine->_allocator, _idBuffer._buffer, _idBuffer._allocation);
+				});
+		}
+
+		while (_primitiveCapacity < nInstances)
+			_primitiveCapacity *= 2;
+
+		VulkanEngine::engine->create_buffer(sizeof(glm::mat4) * _primitiveCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _matricesBuffer, false);
+		VulkanEngine::engine->create_buffer(sizeof(glm::vec4) * _primitiveCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _idBuffer, false);
+	}
 
 	void* matricesData;
 	vmaMapMemory(VulkanEngine::engine->_allocator, _matricesBuffer._allocation, &matricesData);
 	memcpy(matricesData, _scene->_matricesVector.data(), sizeof(glm::mat4) * _scene->_matricesVector.size());
 	vmaUnmapMemory(VulkanEngine::engine->_allocator, _matricesBuffer._allocation);
 
-	// Update material data
-	std::vector<GPUMaterial> materials;
-	for (Material* it : Material::_materials)
+	// Mesh and material ids of each primitive instance
+	void* idData;
+	vmaMapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation, &idData);
+	memcpy(idData, idVector.data(), sizeof(glm::vec4) * idVector.size());
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation);
+}
+
+// Arrays are sized to their capacity, slots without a texture point to the first one loaded
+std::vector<VkDescriptorImageInfo> Renderer::get_texture_infos()
+{
+	assert(!Texture::_textures.empty() && Texture::_textures.size() <= MAX_TEXTURES);
+
+	std::vector<VkDescriptorImageInfo> imageInfos(MAX_TEXTURES);
+	for (uint32_t i = 0; i < MAX_TEXTURES; i++)
 	{
-		GPUMaterial mat = it->materialToShader();
-		materials.push_back(mat);
+		Texture* texture = i < Texture::_textures.size() ? Texture::_textures[i].second : Texture::_textures[0].second;
+		if (texture->imageView == VK_NULL_HANDLE)
+			texture = Texture::_textures[TextureResidency::PLACEHOLDER].second;	// Evicted
+		imageInfos[i] = vkinit::descriptor_image_info(texture->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _textureSampler);
 	}
+	return imageInfos;
+}
 
-	void* matData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation, &matData);
-	memcpy(matData, materials.data(), sizeof(GPUMaterial) * materials.size());
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation);
+void Renderer::get_mesh_infos(std::vector<VkDescriptorBufferInfo>& vertexInfos, std::vector<VkDescriptorBufferInfo>& indexInfos)
+{
+	assert(!Mesh::_meshes.empty() && Mesh::_meshes.size() <= MAX_MESHES);
 
+	vertexInfos.resize(MAX_MESHES);
+	indexInfos.resize(MAX_MESHES);
+	for (uint32_t i = 0; i < MAX_MESHES; i++)
+	{
+		Mesh* mesh = i < Mesh::_meshes.size() ? Mesh::_meshes[i] : Mesh::_meshes[0];
+		vertexInfos[i]	= vkinit::descriptor_buffer_info(mesh->_rtAttributesBuffer._buffer, sizeof(rtVertexAttribute) * mesh->_vertices.size());
+		indexInfos[i]	= vkinit::descriptor_buffer_info(mesh->_indexBuffer._buffer, sizeof(uint32_t) * mesh->_indices.size());
+	}
+}
+
+// Rewrite the descriptors that change when assets are streamed in
+void Renderer::update_scene_descriptors()
+{
+	std::vector<VkDescriptorImageInfo> imageInfos = get_texture_infos();
+	VkDescriptorBufferInfo materialInfo = _materialTable.get_descriptor_info();
+
+	std::vector<VkDescriptorBufferInfo> vertexInfos;
+	std::vector<VkDescriptorBufferInfo> indexInfos;
+	get_mesh_infos(vertexInfos, indexInfos);
+
+	VkDescriptorBufferInfo matrixInfo	= vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _primitiveCapacity);
+	VkDescriptorBufferInfo idInfo		= vkinit::descriptor_buffer_info(_idBuffer._buffer, sizeof(glm::vec4) * _primitiveCapacity);
+
+	VkWriteDescriptorSetAccelerationStructureKHR tlasInfo{};
+	tlasInfo.sType						= VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+	tlasInfo.accelerationStructureCount	= 1;
+	tlasInfo.pAccelerationStructures	= &_topLevelAS.handle;
+
+	std::vector<VkWriteDescriptorSet> writes = {
+		// Deferred
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _offscreenDescriptorSet, imageInfos.data(), 1, MAX_TEXTURES),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _offscreenDescriptorSet, &materialInfo, 3),
+		// Shadows
+		vkinit::write_descriptor_acceleration_structure(_shadowDescSet, &tlasInfo, 0),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _shadowDescSet, &materialInfo, 6),
+		// Ray tracing
+		vkinit::write_descriptor_acceleration_structure(_rtDescriptorSet, &tlasInfo, 0),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, vertexInfos.data(), 3, MAX_MESHES),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, indexInfos.data(), 4, MAX_MESHES),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &matrixInfo, 5),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &materialInfo, 7),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &idInfo, 8),
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _rtDescriptorSet, imageInfos.data(), 9, MAX_TEXTURES),
+		// Hybrid
+		vkinit::write_descriptor_acceleration_structure(_hybridDescSet, &tlasInfo, 0),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, vertexInfos.data(), 5, MAX_MESHES),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, indexInfos.data(), 6, MAX_MESHES),
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, imageInfos.data(), 7, MAX_TEXTURES),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &idInfo, 8),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &materialInfo, 9),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &matrixInfo, 11)
+	};
+
+	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+void Renderer::update_materials()
+{
+	if (!_materialTable.update())
+		return;
+
+	update_scene_descriptors();
+	record_scene_command_buffers();
+}
+
+void Renderer::update_texture_residency()
+{
+	if (!_textureResidency.update())
+		return;
+
+	update_scene_descriptors();
+	record_scene_command_buffers();
+}
+
+// Entities added by the streamer since the last build get their BLAS, a new TLAS and a slot in
+// every scene buffer. Must run before the TLAS update of the frame.
+void Renderer::insert_streamed_entities()
+{
+	if (_scene->_entities.size() == _insertedEntities)
+		return;
+
+	// Each build waits for the device, while files are still arriving the new entities are
+	// gathered for a few frames and built together
+	if (_scene->_streamer.pending() > 0 && ++_streamFrames < STREAM_BATCH_FRAMES)
+		return;
+	_streamFrames = 0;
+
+	// Descriptor sets and recorded command buffers are about to change
+	vkDeviceWaitIdle(*device);
+
+	create_bottom_acceleration_structure(_insertedEntities);
+	create_top_acceleration_structure();
+	load_data_to_gpu();
+
+	destroy_cluster_draws();
+	build_cluster_draws();
+
+	update_scene_descriptors();
+	record_scene_command_buffers();
+
+	_insertedEntities = _scene->_entities.size();
+}
+
+// Command buffers recorded once bind the scene sets, they are invalid after the sets are written
+void Renderer::record_scene_command_buffers()
+{
+	VK_CHECK(vkResetCommandPool(*device, _commandPool, 0));
+	build_shadow_command_buffer();
+	build_compute_command_buffer();
+	build_restir_command_buffer();
+	build_raytracing_command_buffers();
+	build_hybrid_command_buffers();
+}
+
+void Renderer::create_texture_sampler()
+{
+	const float maxAnisotropy = VulkanEngine::engine->_gpuProperties.limits.maxSamplerAnisotropy;
+
+	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(_textureFilter == NEAREST_FILTER ? VK_FILTER_NEAREST : VK_FILTER_LINEAR);
+	samplerInfo.mipmapMode			= _textureFilter == TRILINEAR_FILTER ? VK_SAMPLER_MIPMAP_MODE_LINEAR : VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.minLod				= 0.0f;
+	samplerInfo.maxLod				= _textureFilter == NEAREST_FILTER ? 0.0f : VK_LOD_CLAMP_NONE;
+	samplerInfo.anisotropyEnable	= _textureFilter != NEAREST_FILTER && _anisotropy > 1.0f ? VK_TRUE : VK_FALSE;
+	samplerInfo.maxAnisotropy		= std::min(_anisotropy, maxAnisotropy);
+
+	VK_CHECK(vkCreateSampler(*device, &samplerInfo, nullptr, &_textureSampler));
+}
+
+void Renderer::update_texture_sampler()
+{
+	vkDeviceWaitIdle(*device);
+
+	vkDestroySampler(*device, _textureSampler, nullptr);
+	create_texture_sampler();
+
+	update_scene_descriptors();
+	record_scene_command_buffers();
 }
 
 void Renderer::create_storage_image()
@@ -1535,7 +2393,12 @@ void Renderer::create_storage_image()
 	VkImageCreateInfo imageInfo = vkinit::image_create_info(VK_FORMAT_B8G8R8A8_UNORM, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
 	imageInfo.initialLayout		= VK_IMAGE_LAYOUT_UNDEFINED;
 
-	VkImageCreateInfo shadowImageInfo	= vkinit::image_create_info(VK_FORMAT_R8_UNORM, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
+	// Only the lights of the cluster of a pixel are shadowed, their visibility is stored by position
+	// in the cluster list so the layers do not grow with the lights of the scene
+	const uint32_t shadowSlots			= std::min(static_cast<uint32_t>(_scene->_lights.size()), static_cast<uint32_t>(LightClusters::MAX_LIGHTS));
+	_shadowLayers						= std::max((shadowSlots + 3) / 4, 1u);
+
+	VkImageCreateInfo shadowImageInfo	= vkinit::image_create_info(VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent, _shadowLayers);
 	shadowImageInfo.initialLayout		= VK_IMAGE_LAYOUT_UNDEFINED;
 
 	VmaAllocationCreateInfo allocInfo{};
@@ -1548,22 +2411,25 @@ void Renderer::create_storage_image()
 	VkImageViewCreateInfo imageViewInfo = vkinit::image_view_create_info(VK_FORMAT_B8G8R8A8_UNORM, _rtImage.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
 	VK_CHECK(vkCreateImageView(*device, &imageViewInfo, nullptr, &_rtImage.imageView));
 
-	_shadowImages.reserve(_scene->_lights.size());
-
-	for (decltype(_scene->_lights.size()) i = 0; i < _scene->_lights.size(); i++)
+	for (Texture* image : { &_shadowImage, &_denoisedImage })
 	{
-		Texture image, denoisedImage;
-		vmaCreateImage(VulkanEngine::engine->_allocator, &shadowImageInfo, &allocInfo,
-			&image.image._image, &image.image._allocation, nullptr);
-		VkImageViewCreateInfo shadowImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R8_UNORM, image.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
-		VK_CHECK(vkCreateImageView(*device, &shadowImageViewInfo, nullptr, &image.imageView));
-		_shadowImages.emplace_back(image);
-	
 		vmaCreateImage(VulkanEngine::engine->_allocator, &shadowImageInfo, &allocInfo,
-			&denoisedImage.image._image, &denoisedImage.image._allocation, nullptr);
-		VkImageViewCreateInfo denoiseImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R8_UNORM, denoisedImage.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
-		VK_CHECK(vkCreateImageView(*device, &denoiseImageViewInfo, nullptr, &denoisedImage.imageView));
-		_denoisedImages.emplace_back(denoisedImage);
+			&image->image._image, &image->image._allocation, nullptr);
+		VkImageViewCreateInfo shadowImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, image->image._image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_VIEW_TYPE_2D_ARRAY);
+		shadowImageViewInfo.subresourceRange.layerCount = _shadowLayers;
+		VK_CHECK(vkCreateImageView(*device, &shadowImageViewInfo, nullptr, &image->imageView));
+	}
+
+	// The denoiser keeps the light list of every pixel to know whose history it accumulated
+	VkImageCreateInfo lightHashImageInfo	= vkinit::image_create_info(VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, extent);
+	lightHashImageInfo.initialLayout		= VK_IMAGE_LAYOUT_UNDEFINED;
+
+	for (int i = 0; i < 2; i++)
+	{
+		vmaCreateImage(VulkanEngine::engine->_allocator, &lightHashImageInfo, &allocInfo,
+			&_lightHashImages[i].image._image, &_lightHashImages[i].image._allocation, nullptr);
+		VkImageViewCreateInfo lightHashViewInfo = vkinit::image_view_create_info(VK_FORMAT_R32_UINT, _lightHashImages[i].image._image, VK_IMAGE_ASPECT_COLOR_BIT);
+		VK_CHECK(vkCreateImageView(*device, &lightHashViewInfo, nullptr, &_lightHashImages[i].imageView));
 	}
 
 	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
@@ -1580,45 +2446,52 @@ void Renderer::create_storage_image()
 	});
 
 	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
-		std::vector<VkImageMemoryBarrier> shadowBarriers(_shadowImages.size());
-		for (int i = 0; i < _shadowImages.size(); i++)
+		VkImageMemoryBarrier shadowBarriers[2];
+		for (int i = 0; i < 2; i++)
 		{
 			VkImageMemoryBarrier shadowImageMemoryBarrier{};
 			shadowImageMemoryBarrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-			shadowImageMemoryBarrier.image				= _shadowImages[i].image._image;
+			shadowImageMemoryBarrier.image				= i == 0 ? _shadowImage.image._image : _denoisedImage.image._image;
 			shadowImageMemoryBarrier.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
 			shadowImageMemoryBarrier.newLayout			= VK_IMAGE_LAYOUT_GENERAL;
-			shadowImageMemoryBarrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+			shadowImageMemoryBarrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, _shadowLayers };
 			shadowBarriers[i] = shadowImageMemoryBarrier;
 		}
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, _shadowImages.size(), shadowBarriers.data());
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 2, shadowBarriers);
 	});
 
+	// No pixel matches a cleared hash on the first frame, so no history is taken from it
 	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
-		std::vector<VkImageMemoryBarrier> denoisedBarriers(_shadowImages.size());
-		for (int i = 0; i < _shadowImages.size(); i++)
+		VkImageMemoryBarrier hashBarriers[2];
+		for (int i = 0; i < 2; i++)
 		{
-			VkImageMemoryBarrier denoiseImageMemoryBarrier{};
-			denoiseImageMemoryBarrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-			denoiseImageMemoryBarrier.image				= _denoisedImages[i].image._image;
-			denoiseImageMemoryBarrier.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
-			denoiseImageMemoryBarrier.newLayout			= VK_IMAGE_LAYOUT_GENERAL;
-			denoiseImageMemoryBarrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-			denoisedBarriers[i] = denoiseImageMemoryBarrier;
+			VkImageMemoryBarrier hashImageMemoryBarrier{};
+			hashImageMemoryBarrier.sType			= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			hashImageMemoryBarrier.image			= _lightHashImages[i].image._image;
+			hashImageMemoryBarrier.oldLayout		= VK_IMAGE_LAYOUT_UNDEFINED;
+			hashImageMemoryBarrier.newLayout		= VK_IMAGE_LAYOUT_GENERAL;
+			hashImageMemoryBarrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+			hashBarriers[i] = hashImageMemoryBarrier;
 		}
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, _shadowImages.size(), denoisedBarriers.data());
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 2, hashBarriers);
+
+		VkClearColorValue zero{};
+		VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		for (int i = 0; i < 2; i++)
+			vkCmdClearColorImage(cmd, _lightHashImages[i].image._image, VK_IMAGE_LAYOUT_GENERAL, &zero, 1, &range);
 	});
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vmaDestroyImage(VulkanEngine::engine->_allocator, _rtImage.image._image, _rtImage.image._allocation);
 		vkDestroyImageView(*device, _rtImage.imageView, nullptr);
-		for (int i = 0; i < _shadowImages.size(); i++)
+		vmaDestroyImage(VulkanEngine::engine->_allocator, _shadowImage.image._image, _shadowImage.image._allocation);
+		vmaDestroyImage(VulkanEngine::engine->_allocator, _denoisedImage.image._image, _denoisedImage.image._allocation);
+		vkDestroyImageView(*device, _shadowImage.imageView, nullptr);
+		vkDestroyImageView(*device, _denoisedImage.imageView, nullptr);
+		for (int i = 0; i < 2; i++)
 		{
-			vmaDestroyImage(VulkanEngine::engine->_allocator, _shadowImages[i].image._image, _shadowImages[i].image._allocation);
-			vmaDestroyImage(VulkanEngine::engine->_allocator, _denoisedImages[i].image._image, _denoisedImages[i].image._allocation);
-			vkDestroyImageView(*device, _shadowImages[i].imageView, nullptr);
-			vkDestroyImageView(*device, _denoisedImages[i].imageView, nullptr);
-
+			vmaDestroyImage(VulkanEngine::engine->_allocator, _lightHashImages[i].image._image, _lightHashImages[i].image._allocation);
+			vkDestroyImageView(*device, _lightHashImages[i].imageView, nullptr);
 		}
 	});
 }
@@ -1639,21 +2512,22 @@ void Renderer::recreate_renderer()
 // Create all the BLAS
 // - Go through all meshes in the scene and convert them to BlasInput (holds geometry and rangeInfo)
 // - Build as many BLAS as BlasInput (geometries defined in the scene)
+// - Entities before firstEntity already have their BLAS, streamed entities are appended
 
-void Renderer::create_bottom_acceleration_structure()
+void Renderer::create_bottom_acceleration_structure(const size_t firstEntity)
 {
 	std::vector<BlasInput> allBlas;
 	allBlas.reserve(_scene->get_drawable_nodes_size());
-	for (Object* obj : _scene->_entities)
+	for (size_t e = firstEntity; e < _scene->_entities.size(); e++)
 	{
-		Prefab* p = obj->prefab;
+		Prefab* p = _scene->_entities.prefabs[e];
 		if (!p->_root.empty())
 		{
 			VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress{};
 			VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress{};
 
-			vertexBufferDeviceAddress.deviceAddress = VulkanEngine::engine->getBufferDeviceAddress(obj->prefab->_mesh->_vertexBuffer._buffer);
-			indexBufferDeviceAddress.deviceAddress = VulkanEngine::engine->getBufferDeviceAddress(obj->prefab->_mesh->_indexBuffer._buffer);
+			vertexBufferDeviceAddress.deviceAddress = VulkanEngine::engine->getBufferDeviceAddress(p->_mesh->_vertexBuffer._buffer);
+			indexBufferDeviceAddress.deviceAddress = VulkanEngine::engine->getBufferDeviceAddress(p->_mesh->_indexBuffer._buffer);
 
 			for (Node* root : p->_root)
 			{
@@ -1669,24 +2543,39 @@ void Renderer::create_bottom_acceleration_structure()
 // Create all the TLAS
 // - Go through all meshes in the scene and convert them to Instances (holds matrices)
 // - Build as many Instances as BlasInput (geometries defined in the scene) and pass them to build the TLAS
+// - Streaming changes the instance count, so an existing TLAS is destroyed and built again
 void Renderer::create_top_acceleration_structure()
 {
+	if (_topLevelAS.handle)
+		destroy_top_acceleration_structure();
+	else
+		VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+			destroy_top_acceleration_structure();
+			});
+
+	_tlas.clear();
 	int instanceIndex = 0;
-	for (auto& entity : _scene->_entities)
+	const ObjectStore& entities = _scene->_entities;
+	for (uint32_t i = 0; i < entities.size(); i++)
 	{
-		Prefab* p = entity->prefab;
-		if (!p->_root.empty())
+		for (Node* root : entities.prefabs[i]->_root)
 		{
-			for (Node* root : p->_root)
-			{
-				root->node_to_instance(_tlas, instanceIndex, entity->m_matrix);
-			}
+			root->node_to_instance(_tlas, instanceIndex, entities.transforms[i]);
 		}
 	}
 
 	buildTlas(_tlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
 }
 
+void Renderer::destroy_top_acceleration_structure()
+{
+	vkDestroyAccelerationStructureKHR(*device, _topLevelAS.handle, nullptr);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _topLevelAS.buffer._buffer, _topLevelAS.buffer._allocation);
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _instanceBuffer._buffer, _instanceBuffer._allocation);
+	_topLevelAS		= {};
+	_instanceBuffer = {};
+}
+
 // ---------------------------------------------------------------------------------------
 // This function will create as many BLAS as input objects.
 // - Create a buildGeometryInfo for each input object and add the necessary information
@@ -1695,12 +2584,15 @@ void Renderer::create_top_acceleration_structure()
 // - Finally submit the creation commands
 void Renderer::buildBlas(const std::vector<BlasInput>& input, VkBuildAccelerationStructureFlagsKHR flags)
 {
-	// Make own copy of the information coming from input
-	assert(_blas.empty());	// Make sure that we are only building blas once
-	_blas = std::vector<BlasInput>(input.begin(), input.end());
-	uint32_t blasSize = static_cast<uint32_t>(_blas.size());
+	if (input.empty())
+		return;
 
-	_bottomLevelAS.resize(blasSize);	// Prepare all necessary BLAS to create
+	// Make own copy of the information coming from input, appended after the BLAS already built
+	const uint32_t firstBlas = static_cast<uint32_t>(_blas.size());
+	_blas.insert(_blas.end(), input.begin(), input.end());
+	uint32_t blasSize = static_cast<uint32_t>(input.size());
+
+	_bottomLevelAS.resize(firstBlas + blasSize);	// Prepare all necessary BLAS to create
 
 	// We will prepare the building information for each of the blas
 	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> asBuildGeoInfos(blasSize);
@@ -1710,7 +2602,7 @@ void Renderer::buildBlas(const std::vector<BlasInput>& input, VkBuildAcceleratio
 		asBuildGeoInfos[i].type						= VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
 		asBuildGeoInfos[i].flags					= flags;
 		asBuildGeoInfos[i].geometryCount			= 1;
-		asBuildGeoInfos[i].pGeometries				= &_blas[i].asGeometry;
+		asBuildGeoInfos[i].pGeometries				= &_blas[firstBlas + i].asGeometry;
 		asBuildGeoInfos[i].mode						= VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
 		asBuildGeoInfos[i].srcAccelerationStructure = VK_NULL_HANDLE;
 	}
@@ -1722,11 +2614,11 @@ void Renderer::buildBlas(const std::vector<BlasInput>& input, VkBuildAcceleratio
 	{
 		VkAccelerationStructureBuildSizesInfoKHR asBuildSizesInfo{};
 		asBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-		vkGetAccelerationStructureBuildSizesKHR(*device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &asBuildGeoInfos[i], &_blas[i].nTriangles, &asBuildSizesInfo);
+		vkGetAccelerationStructureBuildSizesKHR(*device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &asBuildGeoInfos[i], &_blas[firstBlas + i].nTriangles, &asBuildSizesInfo);
 
-		create_acceleration_structure(_bottomLevelAS[i], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, asBuildSizesInfo);
+		create_acceleration_structure(_bottomLevelAS[firstBlas + i], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, asBuildSizesInfo);
 
-		asBuildGeoInfos[i].dstAccelerationStructure = _bottomLevelAS[i].handle;
+		asBuildGeoInfos[i].dstAccelerationStructure = _bottomLevelAS[firstBlas + i].handle;
 
 		maxScratch = std::max(maxScratch, asBuildSizesInfo.buildScratchSize);
 	}
@@ -1741,7 +2633,7 @@ void Renderer::buildBlas(const std::vector<BlasInput>& input, VkBuildAcceleratio
 
 		asBuildGeoInfos[i].scratchData.deviceAddress = scratchBufferDeviceAddress.deviceAddress;
 
-		std::vector<VkAccelerationStructureBuildRangeInfoKHR*> asBuildStructureRangeInfo = { &_blas[i].asBuildRangeInfo };
+		std::vector<VkAccelerationStructureBuildRangeInfoKHR*> asBuildStructureRangeInfo = { &_blas[firstBlas + i].asBuildRangeInfo };
 
 		VulkanEngine::engine->immediate_submit([=](VkCommandBuffer cmd) {
 			vkCmdBuildAccelerationStructuresKHR(cmd, 1, &asBuildGeoInfos[i], asBuildStructureRangeInfo.data());
@@ -1774,7 +2666,7 @@ void Renderer::buildTlas(const std::vector<TlasInstance>& instances, VkBuildAcce
 	{
 		VulkanEngine::engine->create_buffer(instancesSize,
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-			VMA_MEMORY_USAGE_CPU_TO_GPU, _instanceBuffer);
+			VMA_MEMORY_USAGE_CPU_TO_GPU, _instanceBuffer, false);
 	}
 
 	void* instanceData;
@@ -1818,7 +2710,7 @@ void Renderer::buildTlas(const std::vector<TlasInstance>& instances, VkBuildAcce
 
 	if (!update)
 	{
-		create_acceleration_structure(_topLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, asBuildSizesInfo);
+		create_acceleration_structure(_topLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, asBuildSizesInfo, false);
 	}
 
 	AllocatedBuffer scratchBuffer;
@@ -1864,7 +2756,7 @@ void Renderer::buildTlas(const std::vector<TlasInstance>& instances, VkBuildAcce
 	vmaDestroyBuffer(VulkanEngine::engine->_allocator, scratchBuffer._buffer, scratchBuffer._allocation);
 }
 
-void Renderer::create_acceleration_structure(AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo)
+void Renderer::create_acceleration_structure(AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo, const bool destroy)
 {
 
 	VulkanEngine::engine->create_buffer(buildSizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, 
@@ -1885,10 +2777,13 @@ void Renderer::create_acceleration_structure(AccelerationStructure& acceleration
 
 	accelerationStructure.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(*device, &asDeviceAddressInfo);
 
-	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
-		vmaDestroyBuffer(VulkanEngine::engine->_allocator, accelerationStructure.buffer._buffer, accelerationStructure.buffer._allocation);
-		vkDestroyAccelerationStructureKHR(VulkanEngine::engine->_device, accelerationStructure.handle, nullptr);
-		});
+	if (destroy)
+	{
+		VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+			vmaDestroyBuffer(VulkanEngine::engine->_allocator, accelerationStructure.buffer._buffer, accelerationStructure.buffer._allocation);
+			vkDestroyAccelerationStructureKHR(VulkanEngine::engine->_device, accelerationStructure.handle, nullptr);
+			});
+	}
 }
 
 // Pass the information from our instance to the vk instance to function in the TLAS
@@ -1918,12 +2813,15 @@ VkAccelerationStructureInstanceKHR Renderer::object_to_instance(const TlasInstan
 // TODO: Erase if not necessary
 void Renderer::create_shadow_descriptors()
 {
+	const unsigned int nLights		= _scene->_lights.size();
+
+	// Shadow image in the ray tracing set, shadow and denoised images plus the light hashes in the denoise set
 	std::vector<VkDescriptorPoolSize> poolSize = {
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
-		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
+		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 5},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
-		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1}
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10}
 	};
 
 	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vkinit::descriptor_pool_create_info(poolSize, 2);
@@ -1937,16 +2835,18 @@ void Renderer::create_shadow_descriptors()
 	// binding 4 = Samples buffer
 	// binding 5 = Position, Normal, Material, Motion Gbuffer
 	// binding 6 = Material buffer
-	const unsigned int nInstances	= _scene->_entities.size();
-	const unsigned int nLights		= _scene->_lights.size();
+	// binding 7 = Light cluster grid
+	// binding 8 = Lights of each cluster
 
 	VkDescriptorSetLayoutBinding accelerationStructureLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);
-	VkDescriptorSetLayoutBinding storageImageLayoutBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1, nLights);
+	VkDescriptorSetLayoutBinding storageImageLayoutBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1);
 	VkDescriptorSetLayoutBinding uniformBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
 	VkDescriptorSetLayoutBinding lightBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3);
 	VkDescriptorSetLayoutBinding sampleBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 4);	// Samples buffer
 	VkDescriptorSetLayoutBinding gbuffersBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 5, 3);
 	VkDescriptorSetLayoutBinding materialBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 6);
+	VkDescriptorSetLayoutBinding clusterGridBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 7);
+	VkDescriptorSetLayoutBinding clusterListsBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 8);
 
 	std::vector<VkDescriptorSetLayoutBinding> bindings({
 		accelerationStructureLayoutBinding,
@@ -1955,7 +2855,9 @@ void Renderer::create_shadow_descriptors()
 		lightBufferBinding,
 		sampleBufferBinding,
 		gbuffersBinding,
-		materialBinding
+		materialBinding,
+		clusterGridBinding,
+		clusterListsBinding
 	});
 
 	// Allocate Descriptor
@@ -1975,12 +2877,7 @@ void Renderer::create_shadow_descriptors()
 	descriptorSetAS.pAccelerationStructures		= &_topLevelAS.handle;
 
 	// Binding = 1 Storage Image
-	std::vector<VkDescriptorImageInfo> shadowsInfo(nLights);
-	for (int i = 0; i < nLights; i++)
-	{
-		shadowsInfo.at(i).imageView = _shadowImages.at(i).imageView;
-		shadowsInfo.at(i).imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-	}
+	VkDescriptorImageInfo shadowsInfo = { VK_NULL_HANDLE, _shadowImage.imageView, VK_IMAGE_LAYOUT_GENERAL };
 
 	// Binding = 2 Camera data
 	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
@@ -2004,16 +2901,23 @@ void Renderer::create_shadow_descriptors()
 
 	std::vector<VkDescriptorImageInfo> gbuffersDescInfo = {positionDescInfo, normalDescInfo, motionDescInfo};
 
-	VkDescriptorBufferInfo materialDescInfo = vkinit::descriptor_buffer_info(_matBuffer._buffer, sizeof(GPUMaterial) * Material::_materials.size());
+	VkDescriptorBufferInfo materialDescInfo = _materialTable.get_descriptor_info();
+
+	// Binding = 7 Light cluster grid
+	// Binding = 8 Lights of each cluster
+	VkDescriptorBufferInfo clusterGridInfo	= _lightClusters.get_grid_info();
+	VkDescriptorBufferInfo clusterListsInfo	= _lightClusters.get_lists_info();
 
 	// WRITES ---
 	VkWriteDescriptorSet accelerationStructureWrite = vkinit::write_descriptor_acceleration_structure(_shadowDescSet, &descriptorSetAS, 0);
-	VkWriteDescriptorSet resultImageWrite			= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _shadowDescSet, shadowsInfo.data(), 1, nLights);
+	VkWriteDescriptorSet resultImageWrite			= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _shadowDescSet, &shadowsInfo, 1);
 	VkWriteDescriptorSet uniformBufferWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _shadowDescSet, &cameraBufferInfo, 2);
 	VkWriteDescriptorSet lightsBufferWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _shadowDescSet, &lightBufferInfo, 3);
 	VkWriteDescriptorSet samplesWrite				= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _shadowDescSet, &samplesDescInfo, 4);
 	VkWriteDescriptorSet gbuffersWrite				= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _shadowDescSet, gbuffersDescInfo.data(), 5, gbuffersDescInfo.size());
 	VkWriteDescriptorSet materialWrite				= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _shadowDescSet, &materialDescInfo, 6);
+	VkWriteDescriptorSet clusterGridWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _shadowDescSet, &clusterGridInfo, 7);
+	VkWriteDescriptorSet clusterListsWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _shadowDescSet, &clusterListsInfo, 8);
 
 	std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
 		accelerationStructureWrite,
@@ -2022,23 +2926,35 @@ void Renderer::create_shadow_descriptors()
 		lightsBufferWrite,
 		samplesWrite,
 		gbuffersWrite,
-		materialWrite
+		materialWrite,
+		clusterGridWrite,
+		clusterListsWrite
 	};
 
 	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
 	
 	// COMPUTE PASS
 	//-------------
-	VkDescriptorSetLayoutBinding inputImageLayoutBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0, nLights);
-	VkDescriptorSetLayoutBinding resultImageLayoutBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1, nLights);
+	VkDescriptorSetLayoutBinding inputImageLayoutBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding resultImageLayoutBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1);
 	VkDescriptorSetLayoutBinding frameLayoutBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
 	VkDescriptorSetLayoutBinding motionLayoutBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
+	VkDescriptorSetLayoutBinding positionLayoutBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
+	VkDescriptorSetLayoutBinding clusterGridLayoutBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
+	VkDescriptorSetLayoutBinding clusterListsLayoutBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
+	VkDescriptorSetLayoutBinding lightsLayoutBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7);
+	VkDescriptorSetLayoutBinding lightHashLayoutBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 8, 2);
 	
 	std::vector<VkDescriptorSetLayoutBinding> denoiseBindings({
 		inputImageLayoutBinding,
 		resultImageLayoutBinding,
 		frameLayoutBinding,
-		motionLayoutBinding
+		motionLayoutBinding,
+		positionLayoutBinding,
+		clusterGridLayoutBinding,
+		clusterListsLayoutBinding,
+		lightsLayoutBinding,
+		lightHashLayoutBinding
 	});
 
 	// Allocate Descriptor
@@ -2052,31 +2968,41 @@ void Renderer::create_shadow_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &denoiseDescriptorSetAllocateInfo, &_sPostDescSet));
 
 	// Binding = 1 Storage Image
-	std::vector<VkDescriptorImageInfo> inputImagesInfo(nLights);
-	std::vector<VkDescriptorImageInfo> outputImagesInfo(nLights);
-	for (int i = 0; i < nLights; i++)
-	{
-		inputImagesInfo.at(i).imageView = _shadowImages.at(i).imageView;
-		inputImagesInfo.at(i).imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	VkDescriptorImageInfo inputImageInfo	= { VK_NULL_HANDLE, _shadowImage.imageView, VK_IMAGE_LAYOUT_GENERAL };
+	VkDescriptorImageInfo outputImageInfo	= { VK_NULL_HANDLE, _denoisedImage.imageView, VK_IMAGE_LAYOUT_GENERAL };
 
-		outputImagesInfo.at(i).imageView = _denoisedImages.at(i).imageView;
-		outputImagesInfo.at(i).imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-	}
+	// Binding = 2 Frame Count Buffer, accumulated frames and frame index
+	VulkanEngine::engine->create_buffer(sizeof(int) * 2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _frameCountBuffer);
+	VkDescriptorBufferInfo frameDescInfo = vkinit::descriptor_buffer_info(_frameCountBuffer._buffer, sizeof(int) * 2);
 
-	// Binding = 2 Frame Count Buffer
-	VulkanEngine::engine->create_buffer(sizeof(int), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _frameCountBuffer);
-	VkDescriptorBufferInfo frameDescInfo = vkinit::descriptor_buffer_info(_frameCountBuffer._buffer, sizeof(int));
+	// Binding = 8 Light list hashes, current and previous frame
+	std::vector<VkDescriptorImageInfo> lightHashInfo(2);
+	for (int i = 0; i < 2; i++)
+	{
+		lightHashInfo.at(i).imageView = _lightHashImages[i].imageView;
+		lightHashInfo.at(i).imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	}
 
-	VkWriteDescriptorSet inputImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, inputImagesInfo.data(), 0, nLights);
-	VkWriteDescriptorSet outputImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, outputImagesInfo.data(), 1, nLights);
+	VkWriteDescriptorSet inputImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, &inputImageInfo, 0);
+	VkWriteDescriptorSet outputImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, &outputImageInfo, 1);
 	VkWriteDescriptorSet frameBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _sPostDescSet, &frameDescInfo, 2);
 	VkWriteDescriptorSet motionImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _sPostDescSet, &motionDescInfo, 3);
+	VkWriteDescriptorSet positionImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _sPostDescSet, &positionDescInfo, 4);
+	VkWriteDescriptorSet denoiseGridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _sPostDescSet, &clusterGridInfo, 5);
+	VkWriteDescriptorSet denoiseListsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _sPostDescSet, &clusterListsInfo, 6);
+	VkWriteDescriptorSet denoiseLightsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _sPostDescSet, &lightBufferInfo, 7);
+	VkWriteDescriptorSet lightHashWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, lightHashInfo.data(), 8, 2);
 
 	std::vector<VkWriteDescriptorSet> writeDenoiseDescriptorSets = {
 		inputImageWrite,
 		outputImageWrite,
 		frameBufferWrite,
-		motionImageWrite
+		motionImageWrite,
+		positionImageWrite,
+		denoiseGridWrite,
+		denoiseListsWrite,
+		denoiseLightsWrite,
+		lightHashWrite
 	};
 
 	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writeDenoiseDescriptorSets.size()), writeDenoiseDescriptorSets.data(), 0, VK_NULL_HANDLE);
@@ -2091,12 +3017,15 @@ void Renderer::create_shadow_descriptors()
 
 void Renderer::create_rt_descriptors()
 {
+	const unsigned int nLights		= _scene->_lights.size();
+
+	// Result and shadow images
 	std::vector<VkDescriptorPoolSize> poolSize = {
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
-		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100}
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10 + 2 * MAX_MESHES},
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10 + MAX_TEXTURES}
 	};
 
 	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vkinit::descriptor_pool_create_info(poolSize, 1);
@@ -2115,25 +3044,29 @@ void Renderer::create_rt_descriptors()
 	//  binding 9 = textures
 	//  binding 10 = skybox texture
 	//  binding 11 = shadow texture
-
-	const unsigned int nInstances	= _scene->_entities.size();
-	const unsigned int nLights		= _scene->_lights.size();
-	const unsigned int nMaterials	= Material::_materials.size();
-	const unsigned int nTextures	= Texture::_textures.size();
+	//  binding 12 = shadow samples
+	//  binding 13 = sky page table
+	//  binding 14 = sky page requests
+	//  binding 15 = irradiance SH
+	//  binding 16 = textures sampled
 
 	VkDescriptorSetLayoutBinding accelerationStructureLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);
 	VkDescriptorSetLayoutBinding resultImageLayoutBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 1);
-	VkDescriptorSetLayoutBinding uniformBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
-	VkDescriptorSetLayoutBinding vertexBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 3, nInstances);
-	VkDescriptorSetLayoutBinding indexBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4, nInstances);
+	VkDescriptorSetLayoutBinding uniformBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 2);
+	VkDescriptorSetLayoutBinding vertexBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 3, MAX_MESHES);
+	VkDescriptorSetLayoutBinding indexBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4, MAX_MESHES);
 	VkDescriptorSetLayoutBinding matrixBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5);
 	VkDescriptorSetLayoutBinding lightBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6);
 	VkDescriptorSetLayoutBinding materialBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 7);
 	VkDescriptorSetLayoutBinding matIdxBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 8);
-	VkDescriptorSetLayoutBinding texturesBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 9, nTextures);
-	VkDescriptorSetLayoutBinding skyboxBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 10, 2);
-	VkDescriptorSetLayoutBinding textureBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 11, nLights);
+	VkDescriptorSetLayoutBinding texturesBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 9, MAX_TEXTURES);
+	VkDescriptorSetLayoutBinding skyboxBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_MISS_BIT_KHR, 10, 2);
+	VkDescriptorSetLayoutBinding textureBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 11);
 	VkDescriptorSetLayoutBinding sampleBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 12);
+	VkDescriptorSetLayoutBinding skyPagesBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MISS_BIT_KHR, 13);
+	VkDescriptorSetLayoutBinding skyFeedbackBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MISS_BIT_KHR, 14);
+	VkDescriptorSetLayoutBinding environmentSHBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 15);
+	VkDescriptorSetLayoutBinding textureFeedbackBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 16);
 
 	std::vector<VkDescriptorSetLayoutBinding> bindings({
 		accelerationStructureLayoutBinding,
@@ -2148,7 +3081,11 @@ void Renderer::create_rt_descriptors()
 		texturesBufferBinding,
 		skyboxBufferBinding,
 		textureBufferBinding,
-		sampleBufferBinding
+		sampleBufferBinding,
+		skyPagesBinding,
+		skyFeedbackBinding,
+		environmentSHBinding,
+		textureFeedbackBinding
 		});
 
 	// Allocate Descriptor
@@ -2178,86 +3115,34 @@ void Renderer::create_rt_descriptors()
 	// Binding = 2 Camera 
 	VkDescriptorBufferInfo _rtDescriptorBufferInfo = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
 
+	// Binding = 3 Vertices buffer
+	// Binding = 4 Indices buffer
 	std::vector<VkDescriptorBufferInfo> vertexDescInfo;
 	std::vector<VkDescriptorBufferInfo> indexDescInfo;
-	std::vector<glm::vec4> idVector;
-	for (Object* obj : _scene->_entities)
-	{
-		std::vector<Vertex> vertices = obj->prefab->_mesh->_vertices;
-		std::vector<uint32_t> indices = obj->prefab->_mesh->_indices;
-		size_t vertexBufferSize = sizeof(rtVertexAttribute) * vertices.size();
-		size_t indexBufferSize = sizeof(uint32_t) * indices.size();
-		AllocatedBuffer vBuffer;
-		VulkanEngine::engine->create_buffer(vertexBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, vBuffer);
-
-		std::vector<rtVertexAttribute> vAttr;
-		vAttr.reserve(vertices.size());
-		for (Vertex& v : vertices) {
-			vAttr.push_back({ {v.normal.x, v.normal.y, v.normal.z, 1}, {v.color.x, v.color.y, v.color.z, 1}, {v.uv.x, v.uv.y, 1, 1} });
-		}
-
-		void* vdata;
-		vmaMapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation, &vdata);
-		memcpy(vdata, vAttr.data(), vertexBufferSize);
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation);
-
-		// Binding = 3 Vertices buffer
-		VkDescriptorBufferInfo vertexBufferDescriptor = vkinit::descriptor_buffer_info(vBuffer._buffer, vertexBufferSize);
-		vertexDescInfo.push_back(vertexBufferDescriptor);
-
-		// Binding = 4 Indices buffer
-		VkDescriptorBufferInfo indexBufferDescriptor = vkinit::descriptor_buffer_info(obj->prefab->_mesh->_indexBuffer._buffer, indexBufferSize);
-		indexDescInfo.push_back(indexBufferDescriptor);
-
-		for (Node* root : obj->prefab->_root)
-		{
-			root->fill_index_buffer(idVector);
-		}
-	}
+	get_mesh_infos(vertexDescInfo, indexDescInfo);
 
 	// Binding = 5 Matrix buffer
-	VkDescriptorBufferInfo matrixDescInfo = vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _scene->_matricesVector.size());
+	VkDescriptorBufferInfo matrixDescInfo = vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _primitiveCapacity);
 
 	// Binding = 6 lights
 	VkDescriptorBufferInfo lightBufferInfo = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * nLights);
 
-	// Binding = 7 ID buffer
-	if (!_idBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(glm::vec4) * idVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _idBuffer);
-
-	void* idData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation, &idData);
-	memcpy(idData, idVector.data(), sizeof(glm::vec4) * idVector.size());
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation);
-
-	VkDescriptorBufferInfo idDescInfo = vkinit::descriptor_buffer_info(_idBuffer._buffer, sizeof(glm::vec4) * idVector.size());
+	// Binding = 7 ID buffer, filled in load_data_to_gpu
+	VkDescriptorBufferInfo idDescInfo = vkinit::descriptor_buffer_info(_idBuffer._buffer, sizeof(glm::vec4) * _primitiveCapacity);
 
 	// Binding = 8 Materials
-	VkDescriptorBufferInfo materialBufferInfo = vkinit::descriptor_buffer_info(_matBuffer._buffer, sizeof(GPUMaterial) * nMaterials);
+	VkDescriptorBufferInfo materialBufferInfo = _materialTable.get_descriptor_info();
 
 	// Binding = 9 Textures
-	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
-	VkSampler sampler;
-	vkCreateSampler(*device, &samplerInfo, nullptr, &sampler);
+	std::vector<VkDescriptorImageInfo> imageInfos = get_texture_infos();
 
-	std::vector<VkDescriptorImageInfo> imageInfos;
-	for (auto const& texture : Texture::_textures)
-	{
-		VkDescriptorImageInfo imageBufferInfo = vkinit::descriptor_image_info(texture.second->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, sampler);
-		imageInfos.push_back(imageBufferInfo);
-	}
-
-	// Binding = 10 Skybox
+	// Binding = 10 Skybox and prefiltered environment
 	VkDescriptorImageInfo skyboxImagesDesc[2];
-	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
-	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[0] = _skyTexture.get_cache_info();
+	skyboxImagesDesc[1] = _environment.get_specular_info();
 
 	// Binding = 11 Shadow texture
-	std::vector<VkDescriptorImageInfo> shadowImagesDesc(_denoisedImages.size());
-	for (decltype(_denoisedImages.size()) i = 0; i < _denoisedImages.size(); i++)
-	{
-		shadowImagesDesc[i] = { nullptr, _denoisedImages[i].imageView, VK_IMAGE_LAYOUT_GENERAL };
-	}
+	VkDescriptorImageInfo shadowImageDesc = { VK_NULL_HANDLE, _denoisedImage.imageView, VK_IMAGE_LAYOUT_GENERAL };
 
 	// Binding = 12 Sample buffer
 	if (!_shadowSamplesBuffer._buffer)
@@ -2265,19 +3150,34 @@ void Renderer::create_rt_descriptors()
 
 	VkDescriptorBufferInfo samplesDescInfo = vkinit::descriptor_buffer_info(_shadowSamplesBuffer._buffer, sizeof(unsigned int));
 
+	// Binding = 13 Sky page table
+	// Binding = 14 Sky page requests
+	VkDescriptorBufferInfo skyPagesInfo		= _skyTexture.get_page_table_info();
+	VkDescriptorBufferInfo skyFeedbackInfo	= _skyTexture.get_feedback_info();
+
+	// Binding = 15 Irradiance SH
+	VkDescriptorBufferInfo environmentSHInfo = _environment.get_sh_info();
+
+	// Binding = 16 Textures sampled
+	VkDescriptorBufferInfo textureFeedbackInfo = _textureResidency.get_feedback_info();
+
 	// WRITES ---
 	VkWriteDescriptorSet resultImageWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _rtDescriptorSet, &storageImageDescriptor, 1);
 	VkWriteDescriptorSet uniformBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _rtDescriptorSet, &_rtDescriptorBufferInfo, 2);
-	VkWriteDescriptorSet vertexBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, vertexDescInfo.data(), 3, nInstances);
-	VkWriteDescriptorSet indexBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, indexDescInfo.data(), 4, nInstances);
+	VkWriteDescriptorSet vertexBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, vertexDescInfo.data(), 3, MAX_MESHES);
+	VkWriteDescriptorSet indexBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, indexDescInfo.data(), 4, MAX_MESHES);
 	VkWriteDescriptorSet matrixBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &matrixDescInfo, 5);
 	VkWriteDescriptorSet lightsBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &lightBufferInfo, 6);
 	VkWriteDescriptorSet matBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &materialBufferInfo, 7);
 	VkWriteDescriptorSet matIdxBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &idDescInfo, 8);
-	VkWriteDescriptorSet textureBufferWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _rtDescriptorSet, imageInfos.data(), 9, nTextures);
+	VkWriteDescriptorSet textureBufferWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _rtDescriptorSet, imageInfos.data(), 9, MAX_TEXTURES);
 	VkWriteDescriptorSet skyboxBufferWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _rtDescriptorSet, skyboxImagesDesc, 10, 2);
-	VkWriteDescriptorSet shadowBufferWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _rtDescriptorSet, shadowImagesDesc.data(), 11, nLights);
+	VkWriteDescriptorSet shadowBufferWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _rtDescriptorSet, &shadowImageDesc, 11);
 	VkWriteDescriptorSet sampleWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _rtDescriptorSet, &samplesDescInfo, 12);
+	VkWriteDescriptorSet skyPagesWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &skyPagesInfo, 13);
+	VkWriteDescriptorSet skyFeedbackWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &skyFeedbackInfo, 14);
+	VkWriteDescriptorSet environmentSHWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _rtDescriptorSet, &environmentSHInfo, 15);
+	VkWriteDescriptorSet textureFeedbackWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &textureFeedbackInfo, 16);
 
 	std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
 		accelerationStructureWrite,
@@ -2292,7 +3192,11 @@ void Renderer::create_rt_descriptors()
 		textureBufferWrite,
 		skyboxBufferWrite,
 		shadowBufferWrite,
-		sampleWrite
+		sampleWrite,
+		skyPagesWrite,
+		skyFeedbackWrite,
+		environmentSHWrite,
+		textureFeedbackWrite
 	};
 
 	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
@@ -2300,7 +3204,6 @@ void Renderer::create_rt_descriptors()
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vkDestroyDescriptorSetLayout(*device, _rtDescriptorSetLayout, nullptr);
 		vkDestroyDescriptorPool(*device, _rtDescriptorPool, nullptr);
-		vkDestroySampler(*device, sampler, nullptr);
 		});
 }
 
@@ -2674,6 +3577,19 @@ void Renderer::build_compute_command_buffer()
 	VK_CHECK(vkEndCommandBuffer(cmd));
 }
 
+void Renderer::build_restir_command_buffer()
+{
+	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+
+	VkCommandBuffer &cmd = _restirCommandBuffer;
+
+	VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+
+	_lightReservoirs.record(cmd);
+
+	VK_CHECK(vkEndCommandBuffer(cmd));
+}
+
 // POST
 // -------------------------------------------------------
 
@@ -2893,6 +3809,9 @@ void Renderer::build_post_command_buffers()
 
 	vkBeginCommandBuffer(get_current_frame()._mainCommandBuffer, &cmdBufInfo);
 
+	// Only left to record here in ray tracing mode, the pages show up in the next frame
+	_skyTexture.record_uploads(get_current_frame()._mainCommandBuffer);
+
 	vkCmdBeginRenderPass(get_current_frame()._mainCommandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 	vkCmdBindPipeline(get_current_frame()._mainCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _postPipeline);
 
@@ -2916,19 +3835,17 @@ void Renderer::build_post_command_buffers()
 
 void Renderer::create_hybrid_descriptors()
 {
+	const uint32_t nLights		= static_cast<uint32_t>(_scene->_lights.size());
+
+	// Result and shadow images
 	std::vector<VkDescriptorPoolSize> poolSizes = {
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10}
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2}
 	};
 
-	const uint32_t nInstances	= static_cast<uint32_t>(_scene->_entities.size());
-	const uint32_t nDrawables	= static_cast<uint32_t>(_scene->get_drawable_nodes_size());
-	const uint32_t nMaterials	= static_cast<uint32_t>(Material::_materials.size());
-	const uint32_t nTextures	= static_cast<uint32_t>(Texture::_textures.size());
-	const uint32_t nLights		= static_cast<uint32_t>(_scene->_lights.size());
-
 	// binding = 0 TLAS
 	// binding = 1 Storage image
 	// binding = 2 Camera buffer
@@ -2942,20 +3859,36 @@ void Renderer::create_hybrid_descriptors()
 	// binding = 10 Scene indices
 	// binding = 11 Matrices buffer
 	// binding = 12 Shadow image
+	// binding = 13 Sky page table
+	// binding = 14 Sky page requests
+	// binding = 15 Irradiance SH
+	// binding = 16 Textures sampled
+	// binding = 17 Light cluster grid
+	// binding = 18 Lights of each cluster
+	// binding = 19 Light reservoirs
+	// binding = 20 Light reservoirs settings
 
 	VkDescriptorSetLayoutBinding TLASBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);			// TLAS
 	VkDescriptorSetLayoutBinding storageImageBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 1);			// storage image
-	VkDescriptorSetLayoutBinding cameraBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);			// Camera buffer
+	VkDescriptorSetLayoutBinding cameraBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 2);	// Camera buffer
 	VkDescriptorSetLayoutBinding gBuffersBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3, 6);
 	VkDescriptorSetLayoutBinding lightsBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4);	// Lights
-	VkDescriptorSetLayoutBinding vertexBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5, nInstances);	// Vertices
-	VkDescriptorSetLayoutBinding indexBufferBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6, nInstances);	// Indices
-	VkDescriptorSetLayoutBinding texturesBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 7, nTextures); // Textures buffer
+	VkDescriptorSetLayoutBinding vertexBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5, MAX_MESHES);	// Vertices
+	VkDescriptorSetLayoutBinding indexBufferBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6, MAX_MESHES);	// Indices
+	VkDescriptorSetLayoutBinding texturesBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 7, MAX_TEXTURES); // Textures buffer
 	VkDescriptorSetLayoutBinding matIdxBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 8); // Scene indices
 	VkDescriptorSetLayoutBinding materialBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 9);	// Materials buffer
-	VkDescriptorSetLayoutBinding skyboxBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 10, 2);
+	VkDescriptorSetLayoutBinding skyboxBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_MISS_BIT_KHR, 10, 2);
 	VkDescriptorSetLayoutBinding matrixBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 11);	// Matrices
-	VkDescriptorSetLayoutBinding shadowImageBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 12, nLights);	// Shadow image
+	VkDescriptorSetLayoutBinding shadowImageBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 12);	// Shadow image
+	VkDescriptorSetLayoutBinding skyPagesBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MISS_BIT_KHR, 13);	// Sky page table
+	VkDescriptorSetLayoutBinding skyFeedbackBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MISS_BIT_KHR, 14);	// Sky page requests
+	VkDescriptorSetLayoutBinding environmentSHBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 15);	// Irradiance SH
+	VkDescriptorSetLayoutBinding textureFeedbackBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 16);	// Textures sampled
+	VkDescriptorSetLayoutBinding clusterGridBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 17);	// Light cluster grid
+	VkDescriptorSetLayoutBinding clusterListsBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 18);	// Lights of each cluster
+	VkDescriptorSetLayoutBinding reservoirsBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 19);	// Light reservoirs
+	VkDescriptorSetLayoutBinding restirBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 20);	// Light reservoirs settings
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -2971,7 +3904,15 @@ void Renderer::create_hybrid_descriptors()
 		materialBufferBinding,
 		matIdxBufferBinding,
 		skyboxBufferBinding,
-		shadowImageBinding
+		shadowImageBinding,
+		skyPagesBinding,
+		skyFeedbackBinding,
+		environmentSHBinding,
+		textureFeedbackBinding,
+		clusterGridBinding,
+		clusterListsBinding,
+		reservoirsBinding,
+		restirBinding
 	};
 
 	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(static_cast<uint32_t>(setLayoutBindings.size()), setLayoutBindings);
@@ -3012,40 +3953,11 @@ void Renderer::create_hybrid_descriptors()
 	// Binding = 4 Lights buffer descriptor
 	VkDescriptorBufferInfo lightDescBuffer = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * nLights);
 
+	// Binding = 5 Vertices Info
+	// Binding = 6 Indices Info
 	std::vector<VkDescriptorBufferInfo> vertexDescInfo;
 	std::vector<VkDescriptorBufferInfo> indexDescInfo;
-	std::vector<glm::vec4> idVector;
-	for (Object* obj : _scene->_entities)
-	{
-		AllocatedBuffer vBuffer;
-		size_t bufferSize = sizeof(rtVertexAttribute) * obj->prefab->_mesh->_vertices.size();
-		VulkanEngine::engine->create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, vBuffer);
-
-		std::vector<rtVertexAttribute> vAttr;
-		std::vector<Vertex> vertices = obj->prefab->_mesh->_vertices;
-		vAttr.reserve(vertices.size());
-		for (Vertex& v : vertices) {
-			vAttr.push_back({ {v.normal.x, v.normal.y, v.normal.z, 1}, {v.color.x, v.color.y, v.color.z, 1}, {v.uv.x, v.uv.y, 1, 1} });
-		}
-
-		void* vdata;
-		vmaMapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation, &vdata);
-		memcpy(vdata, vAttr.data(), bufferSize);
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation);
-
-		// Binding = 5 Vertices Info
-		VkDescriptorBufferInfo vertexBufferDescriptor = vkinit::descriptor_buffer_info(vBuffer._buffer, bufferSize);
-		vertexDescInfo.push_back(vertexBufferDescriptor);
-
-		// Binding = 6 Indices Info
-		VkDescriptorBufferInfo indexBufferDescriptor = vkinit::descriptor_buffer_info(obj->prefab->_mesh->_indexBuffer._buffer, sizeof(uint32_t) * obj->prefab->_mesh->_indices.size());
-		indexDescInfo.push_back(indexBufferDescriptor);
-
-		for (Node* root : obj->prefab->_root)
-		{
-			root->fill_index_buffer(idVector);
-		}
-	}
+	get_mesh_infos(vertexDescInfo, indexDescInfo);
 	
 	// Binding = 7 Textures info
 	VkDescriptorSetAllocateInfo textureAllocInfo = {};
@@ -3057,37 +3969,45 @@ void Renderer::create_hybrid_descriptors()
 
 	VK_CHECK(vkAllocateDescriptorSets(*device, &textureAllocInfo, &_textureDescriptorSet));
 
-	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
-	VkSampler sampler;
-	vkCreateSampler(*device, &samplerInfo, nullptr, &sampler);
-
-	std::vector<VkDescriptorImageInfo> imageInfos;
-	for (auto const& texture : Texture::_textures)
-	{
-		VkDescriptorImageInfo imageBufferInfo = vkinit::descriptor_image_info(texture.second->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, sampler);
-		imageInfos.push_back(imageBufferInfo);
-	}
+	std::vector<VkDescriptorImageInfo> imageInfos = get_texture_infos();
 
-	// Binding = 8 Skybox
+	// Binding = 8 Skybox and prefiltered environment
 	VkDescriptorImageInfo skyboxImagesDesc[2];
-	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
-	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[0] = _skyTexture.get_cache_info();
+	skyboxImagesDesc[1] = _environment.get_specular_info();
 
 	// Binding = 9 Material info
-	VkDescriptorBufferInfo materialBufferInfo = vkinit::descriptor_buffer_info(_matBuffer._buffer, sizeof(GPUMaterial) * nMaterials);
+	VkDescriptorBufferInfo materialBufferInfo = _materialTable.get_descriptor_info();
 
 	// Binding = 10 ID info
-	VkDescriptorBufferInfo idDescInfo = vkinit::descriptor_buffer_info(_idBuffer._buffer, sizeof(glm::vec4) * idVector.size());
+	VkDescriptorBufferInfo idDescInfo = vkinit::descriptor_buffer_info(_idBuffer._buffer, sizeof(glm::vec4) * _primitiveCapacity);
 
 	// Binding = 11 Matrices info
-	VkDescriptorBufferInfo matrixDescInfo = vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _scene->_matricesVector.size());
+	VkDescriptorBufferInfo matrixDescInfo = vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _primitiveCapacity);
 
 	// Binding = 12 Shadow image
-	std::vector<VkDescriptorImageInfo> shadowImagesDesc(_denoisedImages.size());
-	for (decltype(_denoisedImages.size()) i = 0; i < _denoisedImages.size(); i++)
-	{
-		shadowImagesDesc[i] = { VK_NULL_HANDLE, _denoisedImages[i].imageView, VK_IMAGE_LAYOUT_GENERAL };
-	}
+	VkDescriptorImageInfo shadowImageDesc = { VK_NULL_HANDLE, _denoisedImage.imageView, VK_IMAGE_LAYOUT_GENERAL };
+
+	// Binding = 13 Sky page table
+	// Binding = 14 Sky page requests
+	VkDescriptorBufferInfo skyPagesInfo		= _skyTexture.get_page_table_info();
+	VkDescriptorBufferInfo skyFeedbackInfo	= _skyTexture.get_feedback_info();
+
+	// Binding = 15 Irradiance SH
+	VkDescriptorBufferInfo environmentSHInfo = _environment.get_sh_info();
+
+	// Binding = 16 Textures sampled
+	VkDescriptorBufferInfo textureFeedbackInfo = _textureResidency.get_feedback_info();
+
+	// Binding = 17 Light cluster grid
+	// Binding = 18 Lights of each cluster
+	VkDescriptorBufferInfo clusterGridInfo	= _lightClusters.get_grid_info();
+	VkDescriptorBufferInfo clusterListsInfo	= _lightClusters.get_lists_info();
+
+	// Binding = 19 Light reservoirs
+	// Binding = 20 Light reservoirs settings
+	VkDescriptorBufferInfo reservoirsInfo	= _lightReservoirs.get_reservoirs_info();
+	VkDescriptorBufferInfo restirInfo		= _lightReservoirs.get_settings_info();
 
 	// Writes list
 	VkWriteDescriptorSet accelerationStructureWrite = vkinit::write_descriptor_acceleration_structure(_hybridDescSet, &descriptorAccelerationStructureInfo, 0);
@@ -3095,14 +4015,22 @@ void Renderer::create_hybrid_descriptors()
 	VkWriteDescriptorSet cameraWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _hybridDescSet, &cameraBufferInfo, 2);
 	VkWriteDescriptorSet gbuffersWrite			= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, gbuffersDescInfo.data(), 3, gbuffersDescInfo.size());
 	VkWriteDescriptorSet lightWrite				= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &lightDescBuffer, 4);
-	VkWriteDescriptorSet vertexBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, vertexDescInfo.data(), 5, nInstances);
-	VkWriteDescriptorSet indexBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, indexDescInfo.data(), 6, nInstances);
-	VkWriteDescriptorSet texturesBufferWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, imageInfos.data(), 7, nTextures);
+	VkWriteDescriptorSet vertexBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, vertexDescInfo.data(), 5, MAX_MESHES);
+	VkWriteDescriptorSet indexBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, indexDescInfo.data(), 6, MAX_MESHES);
+	VkWriteDescriptorSet texturesBufferWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, imageInfos.data(), 7, MAX_TEXTURES);
 	VkWriteDescriptorSet matIdxBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &idDescInfo, 8);
 	VkWriteDescriptorSet materialBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &materialBufferInfo, 9);
 	VkWriteDescriptorSet skyboxBufferWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, skyboxImagesDesc, 10, 2);
 	VkWriteDescriptorSet matrixBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &matrixDescInfo, 11);
-	VkWriteDescriptorSet shadowImageWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _hybridDescSet, shadowImagesDesc.data(), 12, nLights);
+	VkWriteDescriptorSet shadowImageWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _hybridDescSet, &shadowImageDesc, 12);
+	VkWriteDescriptorSet skyPagesWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &skyPagesInfo, 13);
+	VkWriteDescriptorSet skyFeedbackWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &skyFeedbackInfo, 14);
+	VkWriteDescriptorSet environmentSHWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _hybridDescSet, &environmentSHInfo, 15);
+	VkWriteDescriptorSet textureFeedbackWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &textureFeedbackInfo, 16);
+	VkWriteDescriptorSet clusterGridWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _hybridDescSet, &clusterGridInfo, 17);
+	VkWriteDescriptorSet clusterListsWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &clusterListsInfo, 18);
+	VkWriteDescriptorSet reservoirsWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &reservoirsInfo, 19);
+	VkWriteDescriptorSet restirWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _hybridDescSet, &restirInfo, 20);
 	
 	std::vector<VkWriteDescriptorSet> writes = {
 		accelerationStructureWrite,	// 0 TLAS
@@ -3118,13 +4046,20 @@ void Renderer::create_hybrid_descriptors()
 		matIdxBufferWrite,
 		skyboxBufferWrite,
 		shadowImageWrite,
+		skyPagesWrite,
+		skyFeedbackWrite,
+		environmentSHWrite,
+		textureFeedbackWrite,
+		clusterGridWrite,
+		clusterListsWrite,
+		reservoirsWrite,
+		restirWrite
 	};
 
 	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vkDestroyDescriptorSetLayout(*device, _hybridDescSetLayout, nullptr);
-		vkDestroySampler(*device, sampler, nullptr);
 		});
 }
 
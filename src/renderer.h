@@ -4,6 +4,14 @@
 
 #include "scene.h"
 #include "vk_textures.h"
+#include "virtual_texture.h"
+#include "environment_lighting.h"
+#include "texture_residency.h"
+#include "material_table.h"
+#include "frustum_culler.h"
+#include "depth_pyramid.h"
+#include "light_clusters.h"
+#include "light_reservoirs.h"
 
 struct FrameData
 {
@@ -25,14 +33,101 @@ struct pushConstants {
 	glm::mat4 render_matrix;
 };
 
+// Meshlet as read by the cluster culling compute shader
+struct GPUMeshlet {
+	glm::vec4	sphere;
+	glm::vec4	cone;
+	uint32_t	firstIndex;
+	uint32_t	indexCount;
+	uint32_t	drawID;
+	uint32_t	lod;
+};
+
+constexpr uint32_t CULLED_LOD = ~0u;
+
+// One per drawn primitive, the meshlets of all its levels and their indirect commands share the same range.
+// The geometry pass reads it by draw id, the first instance of every indirect command
+struct GPUClusterDraw {
+	glm::mat4	model;
+	glm::mat4	normalMatrix;	// Inverse transpose of the model matrix
+	uint32_t	firstMeshlet;
+	uint32_t	meshletCount;	// Meshlets of the selected level
+	float		scale;		// Largest axis scale of the model matrix, for the bounding spheres
+	uint32_t	lod;		// Selected level, meshlets of the other levels are rejected. CULLED_LOD outside the frustum
+	uint32_t	material;	// Handle in the material table
+	uint32_t	batch;
+	uint32_t	batchMeshlet;	// First meshlet of the batch, culled commands are compacted from there
+	uint32_t	pad;
+};
+
+struct GPUCullData {
+	glm::vec4	planes[6];
+	glm::vec4	cameraPosition;
+	glm::mat4	viewProjection;
+	glm::vec2	pyramidSize;	// Level 0 of the depth pyramid, in texels
+	uint32_t	pyramidLevels;
+	uint32_t	occlusion;
+	uint32_t	meshletCount;
+	uint32_t	compact;
+	uint32_t	coneCulling;
+	uint32_t	pad;
+};
+
+struct ClusterDraw {
+	uint32_t	entity;		// Index in the object store of the scene
+	Node*		node;
+	Primitive*	primitive;
+	uint32_t	firstMeshlet;
+	glm::mat4	model;		// Refreshed every frame by update_cluster_draws
+	uint32_t	lod;		// Selected every frame by update_cluster_draws
+	float		scale;		// Largest axis scale of the model matrix
+};
+
+// Consecutive draws sharing the vertex and index buffers of a mesh, issued with one indirect call
+struct DrawBatch {
+	Mesh*		mesh;
+	uint32_t	firstDraw;
+	uint32_t	drawCount;
+	uint32_t	firstMeshlet;
+	uint32_t	meshletCount;	// Every level of every draw
+	uint32_t	firstGroup;
+	uint32_t	groupCount;
+	uint32_t	firstCommand;	// Instanced commands written by update_cluster_draws, when culling is disabled
+	uint32_t	commandCount;
+};
+
+// Draws of one primitive, the same mesh range and material, in different entities. Without cluster
+// culling those sharing a level are issued as a single instanced command
+struct InstanceGroup {
+	uint32_t	first;		// In the grouped draws
+	uint32_t	count;
+};
+
 struct AccelerationStructure {
-	VkAccelerationStructureKHR	handle;
+	VkAccelerationStructureKHR	handle = VK_NULL_HANDLE;
 	uint64_t					deviceAddress = 0;
 	AllocatedBuffer	buffer;
 };
 
 constexpr unsigned int FRAME_OVERLAP = 2;
 
+enum textureFilter {
+	NEAREST_FILTER,		// Base level only, no filtering
+	BILINEAR_FILTER,	// Nearest mip level
+	TRILINEAR_FILTER	// Blend between mip levels
+};
+
+// Descriptor arrays are sized up front so streamed assets can be inserted without recreating
+// layouts or pipelines. Unused array slots repeat the first resource, the streamer drops the
+// assets that do not fit.
+constexpr uint32_t MAX_TEXTURES				= 256;
+constexpr uint32_t MAX_MESHES				= 128;
+constexpr uint32_t MAX_MATERIALS			= 1024;		// Initial capacity, the material table grows
+constexpr uint32_t MAX_PRIMITIVE_INSTANCES	= 4096;		// Initial capacity, the matrix and id buffers grow
+
+// Frames that streamed entities wait for more files before they are built together
+constexpr uint32_t STREAM_BATCH_FRAMES		= 30;
+
 class Renderer {
 
 public:
@@ -43,7 +138,8 @@ public:
 	VkDevice*		device;
 	VkSwapchainKHR* swapchain;
 	int*			frameNumber;
-	Entity*			gizmoEntity;
+	EntityHandle	gizmoEntity;
+	Node*			gizmoNode{ nullptr };	// Of the gizmo entity prefab, moved instead of the entity when set
 	Scene*			_scene;
 
 	FrameData		_frames[FRAME_OVERLAP];
@@ -55,6 +151,14 @@ public:
 	VkCommandPool				_commandPool;
 	VkCommandPool				_resetCommandPool;
 	VkDescriptorPool			_descriptorPool;
+	VkSampler					_textureSampler;		// Shared by every material texture
+	textureFilter				_textureFilter{ TRILINEAR_FILTER };
+	float						_anisotropy{ 8.0f };	// Clamped to the device limit, 1 disables it
+	VirtualTexture				_skyTexture;			// Paged in from the feedback of the sky shaders
+	EnvironmentLighting			_environment;			// SH irradiance and prefiltered specular of the sky
+	TextureResidency			_textureResidency;		// Keeps the material textures within the VRAM budget
+	size_t						_insertedEntities{ 0 };	// Entities whose GPU data is already built
+	uint32_t					_streamFrames{ 0 };		// Frames since entities started waiting to be built
 
 	// Forward stuff
 	VkPipelineLayout			_forwardPipelineLayout;
@@ -72,7 +176,8 @@ public:
 
 	// Offscreen stuff
 	VkFramebuffer				_offscreenFramebuffer;
-	VkRenderPass				_offscreenRenderPass;
+	VkRenderPass				_offscreenRenderPass;		// Clears, draws the meshlets visible last frame
+	VkRenderPass				_offscreenLateRenderPass;	// Loads, draws the meshlets found visible by occlusion culling
 	VkDescriptorSetLayout		_offscreenDescriptorSetLayout;
 	VkDescriptorSet				_offscreenDescriptorSet;
 	VkDescriptorSetLayout		_objectDescriptorSetLayout;
@@ -88,6 +193,48 @@ public:
 	AllocatedBuffer				_cameraBuffer;
 	AllocatedBuffer				_cameraPositionBuffer;
 
+	// Cluster culling
+	VkDescriptorPool			_cullDescPool;
+	VkDescriptorSetLayout		_cullDescSetLayout;
+	VkDescriptorSet				_cullDescSet;
+	VkPipelineLayout			_cullPipelineLayout;
+	VkPipeline					_cullPipeline;
+	AllocatedBuffer				_meshletBuffer;
+	AllocatedBuffer				_clusterDrawBuffer;
+	AllocatedBuffer				_indirectBuffer;		// Meshlet commands written by the culling shader
+	AllocatedBuffer				_drawCountBuffer;		// Visible meshlets of each batch
+	AllocatedBuffer				_drawCommandBuffer;		// Whole level of each instance group, when culling is disabled
+	AllocatedBuffer				_drawInstanceBuffer;	// Draw id of every instance, identity for the meshlet commands then the grouped draws
+	AllocatedBuffer				_cullDataBuffer;
+	std::vector<ClusterDraw>	_clusterDraws;			// Grouped by mesh
+	std::vector<DrawBatch>		_drawBatches;
+	std::vector<InstanceGroup>	_instanceGroups;		// Grouped by batch
+	std::vector<uint32_t>		_groupedDraws;			// Draw ids ordered by instance group
+	uint32_t					_instancedCommands{ 0 };
+	uint32_t					_nMeshlets{ 0 };
+	bool						_clusterCulling{ true };
+	bool						_coneCulling{ true };
+	bool						_occlusionCulling{ true };
+	AllocatedBuffer				_visibilityBuffer;		// One flag per meshlet, visible at the end of the last frame
+	DepthPyramid				_depthPyramid;
+	float						_lodThreshold{ 1.0f };	// Largest projected simplification error allowed, in pixels
+
+	// Frustum culling of whole primitives on the CPU, before the meshlets
+	FrustumCuller				_frustumCuller;
+	std::vector<uint8_t>		_drawVisible;			// One flag per cluster draw
+	bool						_frustumCulling{ true };
+	uint32_t					_visibleDraws{ 0 };
+	float						_frustumCullTime{ 0.0f };	// Milliseconds
+
+	// Lights binned per view cluster, read by deferred lighting, shadow rays and their denoiser
+	LightClusters				_lightClusters;
+
+	// One light per pixel resampled from the clusters, shaded by the hybrid raygen with a single shadow ray
+	LightReservoirs				_lightReservoirs;
+	bool						_restir{ false };
+	bool						_restirHistory{ false };	// Reservoirs of the last frame are valid
+	VkCommandBuffer				_restirCommandBuffer;
+
 	// Skybox pass
 	VkDescriptorSetLayout		_skyboxDescriptorSetLayout;
 	VkDescriptorSet				_skyboxDescriptorSet;
@@ -112,11 +259,12 @@ public:
 	std::vector<TlasInstance>	_tlas;
 	AllocatedBuffer				_lightBuffer;
 	AllocatedBuffer				_debugBuffer;
-	AllocatedBuffer				_matBuffer;
+	MaterialTable				_materialTable;
 	AllocatedBuffer				_instanceBuffer;
 	AllocatedBuffer				_rtCameraBuffer;
 	AllocatedBuffer				_matricesBuffer;
 	AllocatedBuffer				_idBuffer;
+	uint32_t					_primitiveCapacity{ MAX_PRIMITIVE_INSTANCES };
 	AllocatedBuffer				_shadowSamplesBuffer;
 	AllocatedBuffer				_frameCountBuffer;
 
@@ -166,7 +314,8 @@ public:
 	VkPipelineLayout			_shadowPipelineLayout;
 	VkCommandBuffer				_shadowCommandBuffer;
 	VkSemaphore					_shadowSemaphore;
-	std::vector<Texture>		_shadowImages;
+	Texture						_shadowImage;			// Visibility of the lights of the pixel cluster, four per layer in cluster order
+	uint32_t					_shadowLayers{ 0 };
 
 	AllocatedBuffer				sraygenSBT;
 	AllocatedBuffer				smissSBT;
@@ -179,7 +328,8 @@ public:
 	VkDescriptorPool			_sPostDescPool;
 	VkDescriptorSet				_sPostDescSet;
 	VkDescriptorSetLayout		_sPostDescSetLayout;
-	std::vector<Texture>		_denoisedImages;
+	Texture						_denoisedImage;			// Same packing as _shadowImage
+	Texture						_lightHashImages[2];	// Light list of each pixel, ping-ponged by frame
 	VkCommandBuffer				_denoiseCommandBuffer;
 	VkSemaphore					_denoiseSemaphore;
 	AllocatedBuffer				_denoiseFrameBuffer;
@@ -193,6 +343,7 @@ public:
 	void rasterize_hybrid();
 
 	void render_gui();
+	void node_gui(Node* node, const uint32_t entity);
 
 	void init_commands();
 
@@ -209,6 +360,15 @@ public:
 	void recreate_renderer();
 
 	void buildTlas(const std::vector<TlasInstance>& input, VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR, bool update = false);
+
+	// Builds the GPU data of the entities streamed in since the last build, once per frame
+	void insert_streamed_entities();
+
+	// Uploads the material records changed since the last frame, rewrites the descriptors when the table grew
+	void update_materials();
+
+	// Demotes or restores textures against the VRAM budget, rewrites the descriptors when they change
+	void update_texture_residency();
 private:
 
 	void init_framebuffers();
@@ -231,17 +391,44 @@ private:
 	
 	void build_deferred_command_buffer();
 
+	void init_cluster_culling();
+
+	void build_cluster_draws();
+
+	void destroy_cluster_draws();
+
+	void update_cluster_draws();
+
+	void record_cluster_culling(VkCommandBuffer cmd, const bool late);
+
+	void draw_clusters(VkCommandBuffer cmd);
+
 	void load_data_to_gpu();
 
+	std::vector<VkDescriptorImageInfo> get_texture_infos();
+
+	void get_mesh_infos(std::vector<VkDescriptorBufferInfo>& vertexInfos, std::vector<VkDescriptorBufferInfo>& indexInfos);
+
+	void update_scene_descriptors();
+
+	void record_scene_command_buffers();
+
+	void create_texture_sampler();
+
+	void update_texture_sampler();
+
 	// VKRay
 
-	void create_bottom_acceleration_structure();
+	void create_bottom_acceleration_structure(const size_t firstEntity = 0);
 
 	void create_top_acceleration_structure();
 
+	void destroy_top_acceleration_structure();
+
 	void create_acceleration_structure(AccelerationStructure& accelerationStructure, 
 		VkAccelerationStructureTypeKHR type, 
-		VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo);
+		VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo,
+		const bool destroy = true);
 
 	void buildBlas(const std::vector<BlasInput>& input, VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
 
@@ -263,6 +450,8 @@ private:
 
 	void build_compute_command_buffer();
 
+	void build_restir_command_buffer();
+
 	// POST
 	void create_post_renderPass();
 
@@ -1,12 +1,24 @@
 
 #include "scene.h"
 
+#include "vk_textures.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+
 unsigned int Scene::get_drawable_nodes_size()
 {
 	unsigned int count = 0;
-	for (Object* o : _entities)
+	for (Prefab* prefab : _entities.prefabs)
 	{
-		for (Node* root : o->prefab->_root) {
+		for (Node* root : prefab->_root) {
 			count += root->get_number_nodes();
 		}
 	}
@@ -14,10 +26,41 @@ unsigned int Scene::get_drawable_nodes_size()
 	return count;
 }
 
+glm::mat4& Scene::get_transform(const EntityHandle& entity)
+{
+	assert(entity.type != NO_ENTITY);
+	return entity.type == LIGHT_ENTITY ? _lights.transforms[entity.index] : _entities.transforms[entity.index];
+}
+
+bool StressSceneSettings::parse(const std::string& argument)
+{
+	const size_t separator = argument.find('=');
+	if (separator == std::string::npos)
+		return false;
+
+	const std::string key	= argument.substr(0, separator);
+	const char* value		= argument.c_str() + separator + 1;
+
+	if (key == "seed")				seed			= static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+	else if (key == "instances")	instances		= static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+	else if (key == "meshes")		meshes			= static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+	else if (key == "materials")	materials		= static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+	else if (key == "textures")		textures		= static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+	else if (key == "lights")		lights			= static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+	else if (key == "dynamic")		dynamicFraction	= std::strtof(value, nullptr);
+	else if (key == "spacing")		spacing			= std::strtof(value, nullptr);
+	else if (key == "prefab")		prefabs.push_back(value);
+	else return false;
+
+	return true;
+}
+
 bool equals(int* a) { return *a > 1; }
 
-void Scene::create_scene(int i)
+void Scene::create_scene(int i, const StressSceneSettings& stress)
 {
+	_streamer.init();
+
 	switch (i)
 	{
 	case 0:
@@ -26,11 +69,107 @@ void Scene::create_scene(int i)
 	case 1:
 		cornell_scene();
 		break;
+	case 2:
+		stress_scene(stress);
+		break;
 	default:
 		break;
 	}
 }
 
+void Scene::update(const float dt)
+{
+	_time += dt * 0.001f;
+
+	// Bob and spin around the placement, enough to rebuild the TLAS and refill the draws every frame
+	for (const DynamicEntity& dynamic : _dynamic)
+	{
+		const float angle = _time * dynamic.speed + dynamic.phase;
+		_entities.transforms[dynamic.entity] = glm::translate(glm::mat4(1), glm::vec3(0, 0.5f * std::sin(angle), 0)) *
+			dynamic.base * glm::rotate(glm::mat4(1), angle, glm::vec3(0, 1, 0));
+	}
+}
+
+void Scene::update_index(const bool nodesMoved)
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	// Node matrices are shared by every entity of a prefab, any edit may change its box
+	if (nodesMoved)
+		_prefabBounds.clear();
+
+	_indexMoved = 0;
+	const uint32_t nEntities = _entities.size();
+	for (uint32_t i = 0; i < nEntities; i++)
+	{
+		const glm::mat4& transform	= _entities.transforms[i];
+		const bool indexed			= i < _entityProxies.size();
+		if (indexed && !nodesMoved && transform == _indexedTransforms[i])
+			continue;
+
+		glm::vec3 min, max;
+		get_prefab_bounds(_entities.prefabs[i], min, max);
+		SpatialIndex::transform_box(transform, min, max, min, max);
+
+		if (indexed)
+		{
+			_indexedTransforms[i] = transform;
+			_indexMoved += _index.move(_entityProxies[i], min, max) ? 1 : 0;
+		}
+		else
+		{
+			_indexedTransforms.push_back(transform);
+			_entityProxies.push_back(_index.insert(min, max, i));
+		}
+	}
+
+	_indexUpdateTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+EntityHandle Scene::pick(const glm::vec3& origin, const glm::vec3& direction) const
+{
+	float distance;
+	const uint32_t entity = _index.raycast(origin, direction, std::numeric_limits<float>::max(), distance);
+	if (entity == SpatialIndex::NONE)
+		return {};
+
+	return { OBJECT_ENTITY, entity };
+}
+
+void Scene::get_prefab_bounds(Prefab* prefab, glm::vec3& min, glm::vec3& max)
+{
+	auto cached = _prefabBounds.find(prefab);
+	if (cached != _prefabBounds.end())
+	{
+		min = cached->second.first;
+		max = cached->second.second;
+		return;
+	}
+
+	// Primitive boxes moved by their node, a prefab without geometry is a point at its origin
+	min = glm::vec3(std::numeric_limits<float>::max());
+	max = glm::vec3(-std::numeric_limits<float>::max());
+	std::vector<Node*> nodes(prefab->_root.begin(), prefab->_root.end());
+	while (!nodes.empty())
+	{
+		Node* node = nodes.back();
+		nodes.pop_back();
+		nodes.insert(nodes.end(), node->_children.begin(), node->_children.end());
+
+		for (Primitive* primitive : node->_primitives)
+		{
+			glm::vec3 primitiveMin, primitiveMax;
+			SpatialIndex::transform_box(node->getGlobalMatrix(), primitive->boundsMin, primitive->boundsMax, primitiveMin, primitiveMax);
+			min = glm::min(min, primitiveMin);
+			max = glm::max(max, primitiveMax);
+		}
+	}
+	if (min.x > max.x)
+		min = max = glm::vec3(0);
+
+	_prefabBounds[prefab] = { min, max };
+}
+
 void Scene::default_scene()
 {
 	// Create camera
@@ -38,125 +177,76 @@ void Scene::default_scene()
 
 	// Create lights
 	// -------------
-	Light* light = new Light();
-	light->m_matrix = glm::translate(glm::mat4(1), glm::vec3(10, 12, -5));
-	light->color = glm::vec3{ 1.0f, 0.8f, 0.5f };
-	light->intensity = 500.0f;
-	light->radius = 0.1f;
-
-	Light* light2 = new Light();
-	light2->m_matrix = glm::translate(glm::mat4(1), glm::vec3(-10, 15, -5));
-	light2->color = glm::vec3{ 0.5f, 1.0f, 1.0f };
-	light2->intensity = 250.0f;
-	light2->radius = 0.2f;
-
-	Light* light3 = new Light();
-	light3->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 15, 5));
-	light3->intensity = 500.f;
-	light3->radius = 0.09f;
-
-	_lights.push_back(light);
-	_lights.push_back(light2);
-	_lights.push_back(light3);
+	_lights.add(glm::vec3(10, 12, -5), glm::vec3{ 1.0f, 0.8f, 0.5f }, 500.0f, 0.1f);
+	_lights.add(glm::vec3(-10, 15, -5), glm::vec3{ 0.5f, 1.0f, 1.0f }, 250.0f, 0.2f);
+	_lights.add(glm::vec3(0, 15, 5), glm::vec3(1), 500.f, 0.09f);
 
 	// Create own Materials
 	// --------------------
-	Material* m_mirror = new Material();
-	m_mirror->shadingModel = 3;
-	m_mirror->metallicFactor = 1.f;
-	Material* m_glass = new Material();
-	m_glass->diffuseColor = glm::vec4{ 0.7f, 0.7f, 1.0f, 1 };
-	m_glass->shadingModel = 4;
-	m_glass->ior = 1.125;// 1.2f;
-	m_glass->metallicFactor = 1.f;
-	Material* m_gold = new Material();
-	m_gold->diffuseColor = glm::vec4{ 1.0, 0.71, 0.29, 1.0 };
-	m_gold->metallicFactor = 0.5f;
-	m_gold->roughnessFactor = 0.1f;
-	Material* m_red = new Material();
-	m_red->diffuseColor = glm::vec4{ 1.0, 0.0, 0.0, 1.0 };
-	m_red->metallicFactor = 0.0;
-	m_red->roughnessFactor = 0.2;
-	Material* m_floor = new Material();
-	m_floor->metallicFactor = 0.1f;
+	Material m_mirror;
+	m_mirror.shadingModel = 3;
+	m_mirror.metallicFactor = 1.f;
+	Material m_glass;
+	m_glass.diffuseColor = glm::vec4{ 0.7f, 0.7f, 1.0f, 1 };
+	m_glass.shadingModel = 4;
+	m_glass.ior = 1.125;// 1.2f;
+	m_glass.metallicFactor = 1.f;
+	Material m_gold;
+	m_gold.diffuseColor = glm::vec4{ 1.0, 0.71, 0.29, 1.0 };
+	m_gold.metallicFactor = 0.5f;
+	m_gold.roughnessFactor = 0.1f;
+	Material m_red;
+	m_red.diffuseColor = glm::vec4{ 1.0, 0.0, 0.0, 1.0 };
+	m_red.metallicFactor = 0.0;
+	m_red.roughnessFactor = 0.2;
+	Material m_floor;
+	m_floor.metallicFactor = 0.1f;
 
 	// Create prefabs
 	// --------------
-	//Prefab* p_sphere	= Prefab::GET("sphere.obj");
+	// Built in geometry is ready for the first frame
 	Prefab* p_quad = Prefab::GET("quad", Mesh::get_quad());
 	p_quad->_root[0]->addMaterial(m_floor);
 	Prefab* p_mirror = Prefab::GET("cube", Mesh::get_cube());
 	p_mirror->_root[0]->addMaterial(m_mirror);
-	Prefab* p_sphere_mirror = Prefab::GET("sphere.obj");
-	p_sphere_mirror->_root[0]->addMaterial(m_mirror);
-	Prefab* p_glass_sphere = Prefab::GET("Glass Sphere", Mesh::GET("sphere.obj"));
-	p_glass_sphere->_root[0]->addMaterial(m_glass);
 	//Prefab* p_gold_sphere = Prefab::GET("goldSphere", Mesh::get_cube());
 	//p_gold_sphere->_root[0]->addMaterial(m_gold);
-	Prefab* p_red_sphere = Prefab::GET("Red Sphere", Mesh::GET("sphere.obj"));
-	p_red_sphere->_root[0]->addMaterial(m_mirror);
-	Prefab* p_helmet = Prefab::GET("DamagedHelmet.gltf");
-	Prefab* p_lucy = Prefab::GET("lucy", Mesh::GET("lucy.obj"));
-	p_lucy->_root[0]->addMaterial(m_gold);
 
 	// Create entities
 	// ---------------
-	Object* sphere = new Object();
-	sphere->prefab = p_red_sphere;
-	sphere->m_matrix = glm::translate(glm::mat4(1), glm::vec3(5, 1, -5));
-	sphere->material = Material::_materials[p_red_sphere->_root[0]->_primitives[0]->materialID];
-
-	//Object* sphere2 = new Object();
-	//sphere2->prefab = p_gold_sphere;
-	//sphere2->m_matrix = glm::translate(glm::mat4(1), glm::vec3(-5, 1, -5));
-	//sphere2->material = Material::_materials[p_gold_sphere->_root[0]->_primitives[0]->materialID];
-
-	Object* sphere3 = new Object();
-	sphere3->prefab = p_glass_sphere;
-	sphere3->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 1, -5));
-	sphere3->material = Material::_materials[p_glass_sphere->_root[0]->_primitives[0]->materialID];
-
-	Object* floor = new Object();
-	floor->prefab = p_quad;
-	floor->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 0, -5)) *
+	//_entities.add(p_gold_sphere, glm::translate(glm::mat4(1), glm::vec3(-5, 1, -5)));
+
+	_entities.add(p_quad, glm::translate(glm::mat4(1), glm::vec3(0, 0, -5)) *
 		glm::rotate(glm::mat4(1), glm::radians(-90.0f), glm::vec3(1, 0, 0)) *
-		glm::scale(glm::mat4(1), glm::vec3(15));
-	floor->material = Material::_materials[p_quad->_root[0]->_primitives[0]->materialID];
-
-	Object* mirror = new Object();
-	mirror->prefab = p_mirror;
-	mirror->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 4, -10)) *
-		glm::scale(glm::mat4(1), glm::vec3(4, 4, 1));
-	mirror->material = Material::_materials[p_mirror->_root[0]->_primitives[0]->materialID];
-
-	Object* cube = new Object();
-	cube->prefab = p_glass_sphere;
-	cube->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 0, -5));
-
-	Object* helmet = new Object();
-	helmet->prefab = p_helmet;
-	helmet->m_matrix = glm::translate(glm::mat4(1), glm::vec3(-5, 1, -5));
-	helmet->material = Material::_materials[p_helmet->_root[0]->_primitives[0]->materialID];
-
-	Object* lucy = new Object();
-	lucy->prefab = p_lucy;
-	lucy->m_matrix = glm::scale(glm::mat4(1), glm::vec3(0.01));
-	lucy->material = Material::_materials[p_lucy->_root[0]->_primitives[0]->materialID];
-
-	Object* lucy2 = new Object();
-	lucy2->prefab = p_lucy;
-	lucy2->m_matrix = glm::translate(glm::mat4(1), glm::vec3(-10, 0, 0)) * glm::scale(glm::mat4(1), glm::vec3(0.01));
-	lucy2->material = Material::_materials[p_lucy->_root[0]->_primitives[0]->materialID];
-
-	_entities.push_back(floor);
-	_entities.push_back(sphere);
-	//_entities.push_back(sphere2);
-	_entities.push_back(sphere3);
-	_entities.push_back(mirror);
-	_entities.push_back(lucy);
-	//_entities.push_back(lucy2);
-	_entities.push_back(helmet);
-	//_entities.push_back(cube);
+		glm::scale(glm::mat4(1), glm::vec3(15)));
+
+	_entities.add(p_mirror, glm::translate(glm::mat4(1), glm::vec3(0, 4, -10)) *
+		glm::scale(glm::mat4(1), glm::vec3(4, 4, 1)));
+
+	// Streamed entities, inserted as their files finish loading
+	// ------------------
+	_streamer.request_mesh("sphere.obj", [=](Mesh* mesh) {
+		Prefab* p_red_sphere = Prefab::GET("Red Sphere", mesh);
+		p_red_sphere->_root[0]->addMaterial(m_mirror);
+		Prefab* p_glass_sphere = Prefab::GET("Glass Sphere", mesh);
+		p_glass_sphere->_root[0]->addMaterial(m_glass);
+
+		_entities.add(p_red_sphere, glm::translate(glm::mat4(1), glm::vec3(5, 1, -5)));
+		_entities.add(p_glass_sphere, glm::translate(glm::mat4(1), glm::vec3(0, 1, -5)));
+		//_entities.add(p_glass_sphere, glm::translate(glm::mat4(1), glm::vec3(0, 0, -5)));
+	});
+
+	_streamer.request_mesh("lucy.obj", [=](Mesh* mesh) {
+		Prefab* p_lucy = Prefab::GET("lucy", mesh);
+		p_lucy->_root[0]->addMaterial(m_gold);
+
+		_entities.add(p_lucy, glm::scale(glm::mat4(1), glm::vec3(0.01)));
+		//_entities.add(p_lucy, glm::translate(glm::mat4(1), glm::vec3(-10, 0, 0)) * glm::scale(glm::mat4(1), glm::vec3(0.01)));
+	});
+
+	_streamer.request_prefab("DamagedHelmet.gltf", [=](Prefab* p_helmet) {
+		_entities.add(p_helmet, glm::translate(glm::mat4(1), glm::vec3(-5, 1, -5)));
+	});
 }
 
 void Scene::cornell_scene()
@@ -165,33 +255,27 @@ void Scene::cornell_scene()
 
 	// Create lights
 	// -------------
-	Light* light = new Light();
-	light->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 8.5, -5));
-	light->color = glm::vec3{ 1.0f, 0.8f, 0.5f };
-	light->intensity = 250.0f;
-	light->radius = 0.1f;
-
-	_lights.push_back(light);
+	_lights.add(glm::vec3(0, 8.5, -5), glm::vec3{ 1.0f, 0.8f, 0.5f }, 250.0f, 0.1f);
 
 	// Create own Materials
 	// --------------------
-	Material* m_white = new Material();
-	m_white->diffuseColor = glm::vec4(1, 1, 1, 1);
-	//m_floor->metallicFactor = 0.1f;
-	Material* m_red = new Material();
-	m_red->diffuseColor = glm::vec4(1, 0, 0, 1);
-	Material* m_green = new Material();
-	m_green->diffuseColor = glm::vec4(0, 1, 0, 1);
-
-	Material* m_mirror = new Material();
-	m_mirror->shadingModel = 3;
-	m_mirror->metallicFactor = 1.f;
-
-	Material* m_glass = new Material();
-	m_glass->diffuseColor = glm::vec4{ 0.7f, 0.7f, 1.0f, 1 };
-	m_glass->shadingModel = 4;
-	m_glass->ior = 1.125;
-	m_glass->metallicFactor = 1.f;
+	Material m_white;
+	m_white.diffuseColor = glm::vec4(1, 1, 1, 1);
+	//m_floor.metallicFactor = 0.1f;
+	Material m_red;
+	m_red.diffuseColor = glm::vec4(1, 0, 0, 1);
+	Material m_green;
+	m_green.diffuseColor = glm::vec4(0, 1, 0, 1);
+
+	Material m_mirror;
+	m_mirror.shadingModel = 3;
+	m_mirror.metallicFactor = 1.f;
+
+	Material m_glass;
+	m_glass.diffuseColor = glm::vec4{ 0.7f, 0.7f, 1.0f, 1 };
+	m_glass.shadingModel = 4;
+	m_glass.ior = 1.125;
+	m_glass.metallicFactor = 1.f;
 
 	// Create prefabs
 	// --------------
@@ -203,70 +287,209 @@ void Scene::cornell_scene()
 	p_red_quad->_root[0]->addMaterial(m_red);
 	Prefab* p_green_quad = Prefab::GET("quad", Mesh::get_cube());
 	p_green_quad->_root[0]->addMaterial(m_green);
-	Prefab* p_helmet = Prefab::GET("DamagedHelmet.gltf");
-	Prefab* p_mirror_sphere = Prefab::GET("mirror_sphere", Mesh::GET("sphere.obj"));
-	p_mirror_sphere->_root[0]->addMaterial(m_mirror);
-	Prefab* p_glass_sphere = Prefab::GET("glass_sphere", Mesh::GET("sphere.obj"));
-	p_glass_sphere->_root[0]->addMaterial(m_glass);
-
 	// Create entities
 	// ---------------
-	Object* floor = new Object();
-	floor->prefab = p_white_quad;
-	floor->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 0, -5)) *
-		glm::scale(glm::mat4(1), glm::vec3(5, 0.1, 5));
-	floor->material = Material::_materials[p_white_quad->_root[0]->_primitives[0]->materialID];
+	_entities.add(p_white_quad, glm::translate(glm::mat4(1), glm::vec3(0, 0, -5)) *
+		glm::scale(glm::mat4(1), glm::vec3(5, 0.1, 5)));
 
 	// Back wall
-	Object* wall1 = new Object();
-	wall1->prefab = p_white_quad;
-	wall1->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 5, -10)) *
-		glm::scale(glm::mat4(1), glm::vec3(5, 5, 0.1));
-	wall1->material = Material::_materials[p_white_quad->_root[0]->_primitives[0]->materialID];
+	_entities.add(p_white_quad, glm::translate(glm::mat4(1), glm::vec3(0, 5, -10)) *
+		glm::scale(glm::mat4(1), glm::vec3(5, 5, 0.1)));
 
 	// Left wall
-	Object* wall2 = new Object();
-	wall2->prefab = p_red_quad;
-	wall2->m_matrix = glm::translate(glm::mat4(1), glm::vec3(-5, 5, -5)) *
-		glm::scale(glm::mat4(1), glm::vec3(0.1, 5, 5));
-	wall2->material = Material::_materials[p_red_quad->_root[0]->_primitives[0]->materialID];
+	_entities.add(p_red_quad, glm::translate(glm::mat4(1), glm::vec3(-5, 5, -5)) *
+		glm::scale(glm::mat4(1), glm::vec3(0.1, 5, 5)));
 
 	// Right wall
-	Object* wall3 = new Object();
-	wall3->prefab = p_green_quad;
-	wall3->m_matrix = glm::translate(glm::mat4(1), glm::vec3(5, 5, -5)) *
-		glm::scale(glm::mat4(1), glm::vec3(0.1, 5, 5));
-	wall3->material = Material::_materials[p_green_quad->_root[0]->_primitives[0]->materialID];
+	_entities.add(p_green_quad, glm::translate(glm::mat4(1), glm::vec3(5, 5, -5)) *
+		glm::scale(glm::mat4(1), glm::vec3(0.1, 5, 5)));
 
 	// Cieling
-	Object* wall4 = new Object();
-	wall4->prefab = p_white_quad;
-	wall4->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 10, -5)) *
-		glm::scale(glm::mat4(1), glm::vec3(5, 0.1, 5));
-	wall4->material = Material::_materials[p_white_quad->_root[0]->_primitives[0]->materialID];
-
-	Object* glass_sphere = new Object();
-	glass_sphere->prefab = p_glass_sphere;
-	glass_sphere->m_matrix = glm::translate(glm::mat4(1), glm::vec3(-3.f, 2.2f, -2.5f)) * 
-		glm::scale(glm::mat4(1), glm::vec3(2));
-	glass_sphere->material = Material::_materials[p_glass_sphere->_root[0]->_primitives[0]->materialID];
-
-	Object* mirror_sphere = new Object();
-	mirror_sphere->prefab = p_mirror_sphere;
-	mirror_sphere->m_matrix = glm::translate(glm::mat4(1), glm::vec3(3.5f, 1.f, -2.5f));
-	mirror_sphere->material = Material::_materials[p_mirror_sphere->_root[0]->_primitives[0]->materialID];
-
-	Object* helmet = new Object();
-	helmet->prefab = p_helmet;
-	helmet->m_matrix = glm::translate(glm::mat4(1), glm::vec3(0, 2.5, -5));
-	helmet->material = Material::_materials[p_helmet->_root[0]->_primitives[0]->materialID];
-
-	_entities.push_back(floor);
-	_entities.push_back(wall1);
-	_entities.push_back(wall2);
-	_entities.push_back(wall3);
-	_entities.push_back(wall4);
-	_entities.push_back(glass_sphere);
-	_entities.push_back(mirror_sphere);
-	_entities.push_back(helmet);
-}
\ No newline at end of file
+	_entities.add(p_white_quad, glm::translate(glm::mat4(1), glm::vec3(0, 10, -5)) *
+		glm::scale(glm::mat4(1), glm::vec3(5, 0.1, 5)));
+
+	// Streamed entities, inserted as their files finish loading
+	// ------------------
+	_streamer.request_mesh("sphere.obj", [=](Mesh* mesh) {
+		Prefab* p_mirror_sphere = Prefab::GET("mirror_sphere", mesh);
+		p_mirror_sphere->_root[0]->addMaterial(m_mirror);
+		Prefab* p_glass_sphere = Prefab::GET("glass_sphere", mesh);
+		p_glass_sphere->_root[0]->addMaterial(m_glass);
+
+		_entities.add(p_glass_sphere, glm::translate(glm::mat4(1), glm::vec3(-3.f, 2.2f, -2.5f)) * 
+			glm::scale(glm::mat4(1), glm::vec3(2)));
+		_entities.add(p_mirror_sphere, glm::translate(glm::mat4(1), glm::vec3(3.5f, 1.f, -2.5f)));
+	});
+
+	_streamer.request_prefab("DamagedHelmet.gltf", [=](Prefab* p_helmet) {
+		_entities.add(p_helmet, glm::translate(glm::mat4(1), glm::vec3(0, 2.5, -5)));
+	});
+}
+void Scene::stress_scene(const StressSceneSettings& settings)
+{
+	// Raw engine output only, the std distributions are not the same on every standard library
+	std::mt19937 random(settings.seed);
+	auto uniform = [&](const float min, const float max) {
+		return min + (max - min) * static_cast<float>(random() >> 8) / 16777216.0f;
+	};
+	auto below = [&](const uint32_t n) { return static_cast<uint32_t>(random() % n); };
+
+	const uint32_t nInstances	= settings.instances;
+	const uint32_t nLights		= std::min(std::max(settings.lights, 1u), StressSceneSettings::MAX_LIGHTS);	// Light buffers are never empty
+	const uint32_t nMeshes		= std::min(std::max(settings.meshes, 1u), StressSceneSettings::MAX_MESHES);
+	const uint32_t nMaterials	= std::max(settings.materials, 1u);
+	const uint32_t nTextures	= std::min(settings.textures, StressSceneSettings::MAX_TEXTURES);
+	const float halfExtent		= 0.5f * settings.spacing * std::sqrt(static_cast<float>(nInstances));
+
+	_camera = new Camera(glm::vec3(0, 10, halfExtent + 10));
+
+	// Create lights
+	// -------------
+	for (uint32_t i = 0; i < nLights; i++)
+	{
+		// One call per statement, argument evaluation order would change the scene between compilers
+		const float x = uniform(-halfExtent, halfExtent);
+		const float y = uniform(6.0f, 12.0f);
+		const float z = uniform(-halfExtent, halfExtent);
+		const float r = uniform(0.5f, 1.0f);
+		const float g = uniform(0.5f, 1.0f);
+		const float b = uniform(0.5f, 1.0f);
+		_lights.add(glm::vec3(x, y, z), glm::vec3(r, g, b), 250.0f, 0.1f, POINT_LIGHT, 8.0f * settings.spacing);
+	}
+
+	// Create textures
+	// ---------------
+	// Checkerboards generated here, named after the seed so two stress scenes never share one
+	const int size = 256, cell = 32;
+	std::vector<int> textureIds;
+	for (uint32_t i = 0; i < nTextures; i++)
+	{
+		unsigned char colors[2][4];
+		for (uint32_t c = 0; c < 2; c++)
+		{
+			for (uint32_t channel = 0; channel < 3; channel++)
+				colors[c][channel] = static_cast<unsigned char>(below(256));
+			colors[c][3] = 255;
+		}
+
+		ImageData data;
+		data.name	= "stress_checker_" + std::to_string(settings.seed) + "_" + std::to_string(i);
+		data.width	= size;
+		data.height	= size;
+		data.pixels	= static_cast<unsigned char*>(std::malloc(size * size * 4));	// Released with stbi_image_free
+		for (int y = 0; y < size; y++)
+		{
+			for (int x = 0; x < size; x++)
+				std::memcpy(&data.pixels[(y * size + x) * 4], colors[(x / cell + y / cell) % 2], 4);
+		}
+
+		const int id = static_cast<int>(Texture::_textures.size());
+		if (Texture::insert(data))
+			textureIds.push_back(id);
+	}
+
+	// Create own Materials
+	// --------------------
+	auto materials = std::make_shared<std::vector<Material>>(nMaterials);
+	for (uint32_t i = 0; i < nMaterials; i++)
+	{
+		const float r = uniform(0.2f, 1.0f);
+		const float g = uniform(0.2f, 1.0f);
+		const float b = uniform(0.2f, 1.0f);
+
+		Material& material = (*materials)[i];
+		material.diffuseColor		= glm::vec4(r, g, b, 1);
+		material.metallicFactor		= uniform(0.0f, 1.0f);
+		material.roughnessFactor	= uniform(0.05f, 1.0f);
+		if (!textureIds.empty())
+			material.diffuseTexture = textureIds[i % textureIds.size()];
+	}
+
+	Material m_ground;
+	m_ground.metallicFactor = 0.1f;
+	Prefab* p_ground = Prefab::GET("stress_ground", Mesh::get_quad());
+	p_ground->_root[0]->addMaterial(m_ground);
+	_entities.add(p_ground, glm::rotate(glm::mat4(1), glm::radians(-90.0f), glm::vec3(1, 0, 0)) *
+		glm::scale(glm::mat4(1), glm::vec3(halfExtent + settings.spacing)));
+
+	// Place every instance now, so the layout does not depend on the order files finish streaming
+	// ---------------------------------------------------------------------------------------------
+	struct Placement
+	{
+		uint32_t	material;
+		glm::mat4	transform;
+		bool		dynamic;
+		float		phase;
+		float		speed;
+	};
+
+	auto placements = std::make_shared<std::vector<std::vector<Placement>>>(nMeshes);
+	for (uint32_t i = 0; i < nInstances; i++)
+	{
+		const uint32_t slot	= below(nMeshes);
+		const float x		= uniform(-halfExtent, halfExtent);
+		const float z		= uniform(-halfExtent, halfExtent);
+		const float scale	= uniform(0.5f, 1.5f);
+		const float height	= uniform(0.0f, 2.0f);
+		const float yaw		= uniform(0.0f, glm::radians(360.0f));
+
+		Placement placement;
+		placement.material	= below(nMaterials);
+		placement.transform	= glm::translate(glm::mat4(1), glm::vec3(x, scale + height, z)) *
+			glm::rotate(glm::mat4(1), yaw, glm::vec3(0, 1, 0)) * glm::scale(glm::mat4(1), glm::vec3(scale));
+		placement.dynamic	= uniform(0.0f, 1.0f) < settings.dynamicFraction;
+		placement.phase		= uniform(0.0f, glm::radians(360.0f));
+		placement.speed		= uniform(0.5f, 2.0f);
+		(*placements)[slot].push_back(placement);
+	}
+
+	// One prefab per mesh and material, the instancing path batches entities sharing it
+	auto addMesh = [=](const uint32_t slot, Mesh* mesh) {
+		std::vector<Prefab*> prefabs(nMaterials, nullptr);
+		for (const Placement& placement : (*placements)[slot])
+		{
+			Prefab*& prefab = prefabs[placement.material];
+			if (!prefab)
+			{
+				prefab = Prefab::GET("stress_" + std::to_string(slot) + "_" + std::to_string(placement.material), mesh);
+				prefab->_root[0]->addMaterial((*materials)[placement.material]);
+			}
+
+			const uint32_t entity = _entities.add(prefab, placement.transform);
+			if (placement.dynamic)
+				_dynamic.push_back({ entity, placement.transform, placement.phase, placement.speed });
+		}
+	};
+
+	// glTF prefabs keep their own materials
+	auto addPrefab = [=](const uint32_t slot, Prefab* prefab) {
+		for (const Placement& placement : (*placements)[slot])
+		{
+			const uint32_t entity = _entities.add(prefab, placement.transform);
+			if (placement.dynamic)
+				_dynamic.push_back({ entity, placement.transform, placement.phase, placement.speed });
+		}
+	};
+
+	// Create entities
+	// ---------------
+	// Built in and procedural meshes are ready for the first frame, files are streamed in
+	std::vector<std::string> files = { "sphere.obj" };
+	files.insert(files.end(), settings.prefabs.begin(), settings.prefabs.end());
+
+	uint32_t slot = 0;
+	if (slot < nMeshes)
+		addMesh(slot++, Mesh::get_cube());
+	if (slot < nMeshes)
+		addMesh(slot++, Mesh::get_quad());
+	for (size_t i = 0; i < files.size() && slot < nMeshes; i++, slot++)
+	{
+		const uint32_t fileSlot = slot;
+		if (files[i].find(".obj") != std::string::npos)
+			_streamer.request_mesh(files[i], [=](Mesh* mesh) { addMesh(fileSlot, mesh); });
+		else
+			_streamer.request_prefab(files[i], [=](Prefab* prefab) { addPrefab(fileSlot, prefab); });
+	}
+	for (uint32_t segments = 8; slot < nMeshes; segments += 4)
+		addMesh(slot++, Mesh::get_sphere(segments));
+}
@@ -3,20 +3,72 @@
 #include "vk_types.h"
 #include "camera.h"
 #include "entity.h"
+#include "asset_streamer.h"
+#include "spatial_index.h"
+
+// Knobs of the generated stress scene, scene 2. The same seed always gives the same scene
+struct StressSceneSettings
+{
+	static constexpr uint32_t MAX_MESHES	= 64;	// Built in, streamed and procedural spheres together
+	static constexpr uint32_t MAX_TEXTURES	= 64;
+	static constexpr uint32_t MAX_LIGHTS	= 0x10000;	// Indexed by the light reservoirs in 16 bits
+
+	uint32_t	seed{ 1 };
+	uint32_t	instances{ 1000 };
+	uint32_t	meshes{ 4 };		// Cube, quad, sphere.obj, the prefab files, then spheres of growing tessellation
+	uint32_t	materials{ 16 };
+	uint32_t	textures{ 4 };		// Generated checkerboards, spread over the materials
+	uint32_t	lights{ 3 };		// At least one, at most MAX_LIGHTS
+	float		dynamicFraction{ 0.1f };	// Share of the instances animated every frame
+	float		spacing{ 4.0f };	// Average distance between instances
+	std::vector<std::string>	prefabs;	// Files streamed in as extra meshes
+
+	// One "knob=value" command line argument, false if it is not one
+	bool parse(const std::string& argument);
+};
 
 class Scene
 {
 public:
-	std::vector<Object*>		_entities;
-	std::vector<Light*>			_lights;
+	ObjectStore		_entities;
+	LightStore		_lights;
 
 	std::vector<glm::mat4> _matricesVector;
 
 	Camera* _camera;
 
+	AssetStreamer _streamer;	// Fills _entities in the background after create_scene
+
+	SpatialIndex	_index;					// World boxes of the entities, items are entity indices
+	float			_indexUpdateTime{ 0.0f };	// Milliseconds
+	uint32_t		_indexMoved{ 0 };		// Entities reinserted by the last update
+
 	unsigned int get_drawable_nodes_size();
-	void create_scene(int i);
+	glm::mat4& get_transform(const EntityHandle& entity);
+	void create_scene(int i, const StressSceneSettings& stress = StressSceneSettings());
+	void update(const float dt);	// Animates the dynamic entities, before the transforms are read
+	// Refits the boxes of the entities added or moved since the last call, after the node matrices are updated
+	void update_index(const bool nodesMoved);
+	EntityHandle pick(const glm::vec3& origin, const glm::vec3& direction) const;	// Closest entity box along the ray
 private:
+	// Entity moved by update, around the transform it was placed with
+	struct DynamicEntity
+	{
+		uint32_t	entity;
+		glm::mat4	base;
+		float		phase;
+		float		speed;
+	};
+
 	void default_scene();
 	void cornell_scene();
+	void stress_scene(const StressSceneSettings& settings);
+	void get_prefab_bounds(Prefab* prefab, glm::vec3& min, glm::vec3& max);
+
+	std::vector<DynamicEntity>	_dynamic;
+	float						_time{ 0.0f };	// Seconds
+
+	std::vector<uint32_t>		_entityProxies;		// Proxy of entity i in _index
+	std::vector<glm::mat4>		_indexedTransforms;	// Transform of entity i when its box was computed
+	std::unordered_map<Prefab*, std::pair<glm::vec3, glm::vec3>>	_prefabBounds;	// Relative to the prefab, all nodes
 };
\ No newline at end of file
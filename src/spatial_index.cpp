@@ -0,0 +1,336 @@
+#include "spatial_index.h"
+
+#include <algorithm>
+
+static float surface_area(const glm::vec3& min, const glm::vec3& max)
+{
+	const glm::vec3 d = max - min;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static float merged_area(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB)
+{
+	return surface_area(glm::min(minA, minB), glm::max(maxA, maxB));
+}
+
+// Distance along the ray where it enters the box, false if it misses it before maxDistance
+static bool ray_box(const glm::vec3& origin, const glm::vec3& inverseDirection, const float maxDistance, const glm::vec3& min, const glm::vec3& max, float& distance)
+{
+	const glm::vec3 t1		= (min - origin) * inverseDirection;
+	const glm::vec3 t2		= (max - origin) * inverseDirection;
+	const glm::vec3 near	= glm::min(t1, t2);
+	const glm::vec3 far		= glm::max(t1, t2);
+
+	distance				= std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+	const float exit		= std::min(std::min(far.x, far.y), std::min(far.z, maxDistance));
+	return distance <= exit;
+}
+
+void SpatialIndex::transform_box(const glm::mat4& model, const glm::vec3& min, const glm::vec3& max, glm::vec3& outMin, glm::vec3& outMax)
+{
+	const glm::vec3 center	= glm::vec3(model * glm::vec4((min + max) * 0.5f, 1.0f));
+	const glm::vec3 half	= (max - min) * 0.5f;
+	const glm::mat3 m		= glm::mat3(model);
+	const glm::vec3 extent	= glm::abs(m[0]) * half.x + glm::abs(m[1]) * half.y + glm::abs(m[2]) * half.z;
+
+	outMin = center - extent;
+	outMax = center + extent;
+}
+
+uint32_t SpatialIndex::insert(const glm::vec3& min, const glm::vec3& max, const uint32_t item)
+{
+	const uint32_t leaf = allocate_node();
+
+	// Same margin on every axis, flat boxes like quads still get some room to move
+	const glm::vec3 half	= (max - min) * 0.5f;
+	const float margin		= MARGIN * std::max(half.x, std::max(half.y, half.z));
+
+	TreeNode& node	= _nodes[leaf];
+	node.min		= min - glm::vec3(margin);
+	node.max		= max + glm::vec3(margin);
+	node.boundsMin	= min;
+	node.boundsMax	= max;
+	node.item		= item;
+
+	insert_leaf(leaf);
+	_leafCount++;
+
+	return leaf;
+}
+
+void SpatialIndex::remove(const uint32_t proxy)
+{
+	remove_leaf(proxy);
+	free_node(proxy);
+	_leafCount--;
+}
+
+bool SpatialIndex::move(const uint32_t proxy, const glm::vec3& min, const glm::vec3& max)
+{
+	TreeNode& node = _nodes[proxy];
+	node.boundsMin = min;
+	node.boundsMax = max;
+
+	// Still inside the grown box, and that box is not much larger than the object became
+	const bool inside	= glm::all(glm::greaterThanEqual(min, node.min)) && glm::all(glm::lessThanEqual(max, node.max));
+	const float limit	= 4.0f * surface_area(min, max) * (1.0f + MARGIN) * (1.0f + MARGIN);
+	if (inside && surface_area(node.min, node.max) <= std::max(limit, 1e-6f))
+		return false;
+
+	const uint32_t item = node.item;
+	remove(proxy);
+	insert(min, max, item);		// The freed node is taken again, the proxy does not change
+
+	return true;
+}
+
+void SpatialIndex::clear()
+{
+	_nodes.clear();
+	_root		= NONE;
+	_freeList	= NONE;
+	_leafCount	= 0;
+}
+
+uint32_t SpatialIndex::raycast(const glm::vec3& origin, const glm::vec3& direction, const float maxDistance, float& distance) const
+{
+	uint32_t hit	= NONE;
+	distance		= maxDistance;
+	if (_root == NONE)
+		return hit;
+
+	const glm::vec3 inverseDirection = 1.0f / direction;
+
+	std::vector<uint32_t> stack;
+	stack.reserve(64);
+	stack.push_back(_root);
+	while (!stack.empty())
+	{
+		const TreeNode& node = _nodes[stack.back()];
+		stack.pop_back();
+
+		// Subtrees entered after the closest hit so far cannot hold a closer one
+		float t;
+		if (!ray_box(origin, inverseDirection, distance, node.min, node.max, t))
+			continue;
+
+		if (node.child1 == NONE)
+		{
+			if (ray_box(origin, inverseDirection, distance, node.boundsMin, node.boundsMax, t) && t < distance)
+			{
+				distance	= t;
+				hit			= node.item;
+			}
+			continue;
+		}
+
+		stack.push_back(node.child1);
+		stack.push_back(node.child2);
+	}
+
+	return hit;
+}
+
+uint32_t SpatialIndex::allocate_node()
+{
+	uint32_t index;
+	if (_freeList == NONE)
+	{
+		index = static_cast<uint32_t>(_nodes.size());
+		_nodes.emplace_back();
+	}
+	else
+	{
+		index		= _freeList;
+		_freeList	= _nodes[index].parent;
+	}
+
+	TreeNode& node	= _nodes[index];
+	node.parent		= NONE;
+	node.child1		= NONE;
+	node.child2		= NONE;
+	node.height		= 0;
+	node.item		= NONE;
+
+	return index;
+}
+
+void SpatialIndex::free_node(const uint32_t node)
+{
+	_nodes[node].parent	= _freeList;
+	_nodes[node].height	= -1;
+	_freeList			= node;
+}
+
+void SpatialIndex::insert_leaf(const uint32_t leaf)
+{
+	if (_root == NONE)
+	{
+		_root					= leaf;
+		_nodes[leaf].parent		= NONE;
+		return;
+	}
+
+	// Walk down while pushing the leaf into a child costs less than pairing it with the node
+	const glm::vec3 leafMin = _nodes[leaf].min;
+	const glm::vec3 leafMax = _nodes[leaf].max;
+	uint32_t index = _root;
+	while (_nodes[index].child1 != NONE)
+	{
+		const TreeNode& node		= _nodes[index];
+		const float area			= surface_area(node.min, node.max);
+		const float combinedArea	= merged_area(node.min, node.max, leafMin, leafMax);
+
+		// Pairing here creates a parent of the combined area, every ancestor grows as well
+		const float cost			= 2.0f * combinedArea;
+		const float inheritance		= 2.0f * (combinedArea - area);
+
+		float childCosts[2];
+		const uint32_t children[2] = { node.child1, node.child2 };
+		for (int i = 0; i < 2; i++)
+		{
+			const TreeNode& child	= _nodes[children[i]];
+			const float merged		= merged_area(child.min, child.max, leafMin, leafMax);
+			childCosts[i]			= (child.child1 == NONE ? merged : merged - surface_area(child.min, child.max)) + inheritance;
+		}
+
+		if (cost < childCosts[0] && cost < childCosts[1])
+			break;
+
+		index = childCosts[0] < childCosts[1] ? children[0] : children[1];
+	}
+
+	const uint32_t sibling		= index;
+	const uint32_t oldParent	= _nodes[sibling].parent;
+	const uint32_t newParent	= allocate_node();
+
+	TreeNode& parent	= _nodes[newParent];
+	parent.parent		= oldParent;
+	parent.min			= glm::min(leafMin, _nodes[sibling].min);
+	parent.max			= glm::max(leafMax, _nodes[sibling].max);
+	parent.height		= _nodes[sibling].height + 1;
+	parent.child1		= sibling;
+	parent.child2		= leaf;
+
+	if (oldParent != NONE)
+	{
+		if (_nodes[oldParent].child1 == sibling)
+			_nodes[oldParent].child1 = newParent;
+		else
+			_nodes[oldParent].child2 = newParent;
+	}
+	else
+		_root = newParent;
+
+	_nodes[sibling].parent	= newParent;
+	_nodes[leaf].parent		= newParent;
+
+	refit(newParent);
+}
+
+void SpatialIndex::remove_leaf(const uint32_t leaf)
+{
+	if (leaf == _root)
+	{
+		_root = NONE;
+		return;
+	}
+
+	const uint32_t parent		= _nodes[leaf].parent;
+	const uint32_t grandParent	= _nodes[parent].parent;
+	const uint32_t sibling		= _nodes[parent].child1 == leaf ? _nodes[parent].child2 : _nodes[parent].child1;
+
+	// The sibling takes the place of the parent
+	if (grandParent != NONE)
+	{
+		if (_nodes[grandParent].child1 == parent)
+			_nodes[grandParent].child1 = sibling;
+		else
+			_nodes[grandParent].child2 = sibling;
+		_nodes[sibling].parent = grandParent;
+		free_node(parent);
+
+		refit(grandParent);
+	}
+	else
+	{
+		_root					= sibling;
+		_nodes[sibling].parent	= NONE;
+		free_node(parent);
+	}
+}
+
+void SpatialIndex::refit(uint32_t node)
+{
+	while (node != NONE)
+	{
+		node = balance(node);
+
+		TreeNode& n				= _nodes[node];
+		const TreeNode& child1	= _nodes[n.child1];
+		const TreeNode& child2	= _nodes[n.child2];
+		n.height				= 1 + std::max(child1.height, child2.height);
+		n.min					= glm::min(child1.min, child2.min);
+		n.max					= glm::max(child1.max, child2.max);
+
+		node = n.parent;
+	}
+}
+
+// Rotates the taller child of a up when the heights of its children differ by more than one,
+// returns the node now at the place of a
+uint32_t SpatialIndex::balance(const uint32_t a)
+{
+	TreeNode& A = _nodes[a];
+	if (A.child1 == NONE || A.height < 2)
+		return a;
+
+	const uint32_t b	= A.child1;
+	const uint32_t c	= A.child2;
+	const int32_t diff	= _nodes[c].height - _nodes[b].height;
+	if (diff >= -1 && diff <= 1)
+		return a;
+
+	// The taller child goes up, a keeps the other child and the shorter grandchild
+	const uint32_t up		= diff > 1 ? c : b;
+	const uint32_t other	= diff > 1 ? b : c;
+	TreeNode& U				= _nodes[up];
+	const uint32_t f		= U.child1;
+	const uint32_t g		= U.child2;
+
+	U.child1	= a;
+	U.parent	= A.parent;
+	A.parent	= up;
+
+	if (U.parent != NONE)
+	{
+		if (_nodes[U.parent].child1 == a)
+			_nodes[U.parent].child1 = up;
+		else
+			_nodes[U.parent].child2 = up;
+	}
+	else
+		_root = up;
+
+	const uint32_t taller	= _nodes[f].height > _nodes[g].height ? f : g;
+	const uint32_t shorter	= taller == f ? g : f;
+
+	U.child2					= taller;
+	if (diff > 1)
+		A.child2				= shorter;
+	else
+		A.child1				= shorter;
+	_nodes[shorter].parent		= a;
+
+	const TreeNode& O	= _nodes[other];
+	const TreeNode& S	= _nodes[shorter];
+	const TreeNode& T	= _nodes[taller];
+	A.min		= glm::min(O.min, S.min);
+	A.max		= glm::max(O.max, S.max);
+	A.height	= 1 + std::max(O.height, S.height);
+	U.min		= glm::min(A.min, T.min);
+	U.max		= glm::max(A.max, T.max);
+	U.height	= 1 + std::max(A.height, T.height);
+
+	return up;
+}
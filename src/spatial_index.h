@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Dynamic bounding volume tree over world space boxes, queried on the CPU. Each leaf keeps its box
+// grown by a margin so objects moving a little do not touch the tree. A new leaf goes next to the
+// node whose surface area grows the least and rotations on the way up keep the tree balanced, so
+// moving one object costs a removal and an insertion of logarithmic depth.
+class SpatialIndex
+{
+public:
+	static constexpr uint32_t	NONE	= ~0u;
+	static constexpr float		MARGIN	= 0.2f;	// Leaf growth, relative to the half extent of the box
+
+	// Box enclosing the transformed box (Arvo 1990)
+	static void transform_box(const glm::mat4& model, const glm::vec3& min, const glm::vec3& max, glm::vec3& outMin, glm::vec3& outMax);
+
+	// Returns the proxy of the item, valid until it is removed
+	uint32_t insert(const glm::vec3& min, const glm::vec3& max, const uint32_t item);
+	void remove(const uint32_t proxy);
+	bool move(const uint32_t proxy, const glm::vec3& min, const glm::vec3& max);	// True if the leaf was reinserted
+	void clear();
+
+	// Item whose box the ray enters first, NONE if no box is entered before maxDistance
+	uint32_t raycast(const glm::vec3& origin, const glm::vec3& direction, const float maxDistance, float& distance) const;
+
+	uint32_t get_item(const uint32_t proxy) const { return _nodes[proxy].item; }
+	uint32_t get_leaf_count() const { return _leafCount; }
+	uint32_t get_height() const { return _root == NONE ? 0 : static_cast<uint32_t>(_nodes[_root].height); }
+
+private:
+	struct TreeNode
+	{
+		glm::vec3	min;		// Grown by the margin for leaves
+		glm::vec3	max;
+		glm::vec3	boundsMin;	// Exact box of leaves, tested by the queries
+		glm::vec3	boundsMax;
+		uint32_t	parent;		// Next free node while in the free list
+		uint32_t	child1;		// NONE for leaves
+		uint32_t	child2;
+		int32_t		height;		// 0 for leaves, -1 for free nodes
+		uint32_t	item;
+	};
+
+	uint32_t allocate_node();
+	void free_node(const uint32_t node);
+	void insert_leaf(const uint32_t leaf);
+	void remove_leaf(const uint32_t leaf);
+	uint32_t balance(const uint32_t a);
+	void refit(uint32_t node);		// Boxes and heights from the node up to the root
+
+	std::vector<TreeNode>	_nodes;
+	uint32_t				_root{ NONE };
+	uint32_t				_freeList{ NONE };
+	uint32_t				_leafCount{ 0 };
+};
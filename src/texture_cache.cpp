@@ -0,0 +1,400 @@
+#include "texture_cache.h"
+#include "vk_textures.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+
+#define STB_DXT_IMPLEMENTATION
+#include "stb_dxt.h"
+
+static const uint8_t ktx2Identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+// Khronos data format descriptor values of the block compressed formats written here
+static const uint32_t KHR_DF_MODEL_RGBSDA		= 1;
+static const uint32_t KHR_DF_MODEL_BC1A			= 128;
+static const uint32_t KHR_DF_MODEL_BC3			= 130;
+static const uint32_t KHR_DF_MODEL_BC4			= 131;
+static const uint32_t KHR_DF_MODEL_BC5			= 132;
+static const uint32_t KHR_DF_PRIMARIES_BT709	= 1;
+static const uint32_t KHR_DF_TRANSFER_LINEAR	= 1;
+static const uint32_t KHR_DF_VERSION_1_3		= 2;
+static const uint32_t KHR_DF_CHANNEL_COLOR		= 0;
+static const uint32_t KHR_DF_CHANNEL_ALPHA		= 15;
+static const uint32_t KHR_DF_SAMPLE_SIGNED		= 0x40;		// Qualifiers, in the channel byte
+static const uint32_t KHR_DF_SAMPLE_FLOAT		= 0x80;
+
+static VkFormat choose_format(const ImageData& image, const textureUsage usage)
+{
+	if (usage == NORMAL_USAGE)
+		return VK_FORMAT_BC5_UNORM_BLOCK;
+	if (image.channels == 1)
+		return VK_FORMAT_BC4_UNORM_BLOCK;
+
+	// Grey and alpha or RGBA sources, alpha is only kept if some texel uses it
+	const size_t nPixels = static_cast<size_t>(image.width) * image.height;
+	for (size_t i = 0; (image.channels == 2 || image.channels == 4) && i < nPixels; i++)
+	{
+		if (image.pixels[i * 4 + 3] < 255)
+			return VK_FORMAT_BC3_UNORM_BLOCK;
+	}
+	return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+}
+
+std::vector<unsigned char> vkutil::downsample_image(const std::vector<unsigned char>& src, const int width, const int height, const bool normal)
+{
+	const int w = std::max(width / 2, 1);
+	const int h = std::max(height / 2, 1);
+	std::vector<unsigned char> dst(static_cast<size_t>(w) * h * 4);
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+			for (int j = 0; j < 2; j++)
+			{
+				for (int i = 0; i < 2; i++)
+				{
+					const int sx = std::min(x * 2 + i, width - 1);
+					const int sy = std::min(y * 2 + j, height - 1);
+					const unsigned char* p = &src[(static_cast<size_t>(sy) * width + sx) * 4];
+					for (int c = 0; c < 4; c++)
+						sum[c] += p[c] * 0.25f;
+				}
+			}
+
+			if (normal)
+			{
+				float n[3], length = 0.0f;
+				for (int c = 0; c < 3; c++)
+				{
+					n[c] = sum[c] / 127.5f - 1.0f;
+					length += n[c] * n[c];
+				}
+				length = length > 0.0f ? std::sqrt(length) : 1.0f;
+				for (int c = 0; c < 3; c++)
+					sum[c] = (n[c] / length + 1.0f) * 127.5f;
+			}
+
+			unsigned char* d = &dst[(static_cast<size_t>(y) * w + x) * 4];
+			for (int c = 0; c < 4; c++)
+				d[c] = static_cast<unsigned char>(std::min(std::max(sum[c] + 0.5f, 0.0f), 255.0f));
+		}
+	}
+
+	return dst;
+}
+
+static void compress_level(const unsigned char* rgba, const int width, const int height, const VkFormat format, std::vector<unsigned char>& out)
+{
+	const int blocksX = (width + 3) / 4;
+	const int blocksY = (height + 3) / 4;
+	const uint32_t blockSize = vkutil::get_block_size(format);
+	out.resize(static_cast<size_t>(blocksX) * blocksY * blockSize);
+
+	unsigned char block[64];
+	for (int by = 0; by < blocksY; by++)
+	{
+		for (int bx = 0; bx < blocksX; bx++)
+		{
+			// Levels smaller than a block repeat their edge texels
+			for (int y = 0; y < 4; y++)
+			{
+				for (int x = 0; x < 4; x++)
+				{
+					const int px = std::min(bx * 4 + x, width - 1);
+					const int py = std::min(by * 4 + y, height - 1);
+					const unsigned char* src = &rgba[(static_cast<size_t>(py) * width + px) * 4];
+					const int t = y * 4 + x;
+
+					if (format == VK_FORMAT_BC4_UNORM_BLOCK)
+						block[t] = src[0];
+					else if (format == VK_FORMAT_BC5_UNORM_BLOCK)
+					{
+						block[t * 2 + 0] = src[0];
+						block[t * 2 + 1] = src[1];
+					}
+					else
+						memcpy(&block[t * 4], src, 4);
+				}
+			}
+
+			unsigned char* dest = &out[(static_cast<size_t>(by) * blocksX + bx) * blockSize];
+			switch (format)
+			{
+			case VK_FORMAT_BC3_UNORM_BLOCK:
+				stb_compress_dxt_block(dest, block, 1, STB_DXT_HIGHQUAL);
+				break;
+			case VK_FORMAT_BC4_UNORM_BLOCK:
+				stb_compress_bc4_block(dest, block);
+				break;
+			case VK_FORMAT_BC5_UNORM_BLOCK:
+				stb_compress_bc5_block(dest, block);
+				break;
+			default:
+				stb_compress_dxt_block(dest, block, 0, STB_DXT_HIGHQUAL);
+				break;
+			}
+		}
+	}
+}
+
+void vkutil::compress_image(ImageData& image, const textureUsage usage)
+{
+	image.format = choose_format(image, usage);
+
+	const uint32_t mipLevels = get_mip_levels(image.width, image.height);
+	image.levels.resize(mipLevels);
+
+	std::vector<unsigned char> level(image.pixels, image.pixels + static_cast<size_t>(image.width) * image.height * 4);
+	int width	= image.width;
+	int height	= image.height;
+
+	for (uint32_t i = 0; i < mipLevels; i++)
+	{
+		compress_level(level.data(), width, height, image.format, image.levels[i]);
+
+		if (i + 1 < mipLevels)
+		{
+			level	= downsample_image(level, width, height, usage == NORMAL_USAGE);
+			width	= std::max(width / 2, 1);
+			height	= std::max(height / 2, 1);
+		}
+	}
+}
+
+std::string vkutil::get_cache_filename(const std::string& filename, const VkFormat format)
+{
+	switch (format)
+	{
+	case VK_FORMAT_BC3_UNORM_BLOCK:	return filename + ".bc3.ktx2";
+	case VK_FORMAT_BC4_UNORM_BLOCK:	return filename + ".bc4.ktx2";
+	case VK_FORMAT_BC5_UNORM_BLOCK:	return filename + ".bc5.ktx2";
+	default:						return filename + ".bc1.ktx2";
+	}
+}
+
+std::vector<VkFormat> vkutil::get_cache_formats(const textureUsage usage)
+{
+	if (usage == NORMAL_USAGE)
+		return { VK_FORMAT_BC5_UNORM_BLOCK };
+
+	return { VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_BC3_UNORM_BLOCK, VK_FORMAT_BC4_UNORM_BLOCK };
+}
+
+bool vkutil::is_cache_valid(const std::string& cacheFilename, const std::string& filename)
+{
+	struct stat cacheStat, sourceStat;
+	if (stat(cacheFilename.c_str(), &cacheStat) != 0)
+		return false;
+	if (stat(filename.c_str(), &sourceStat) != 0)
+		return true;
+
+	return cacheStat.st_mtime >= sourceStat.st_mtime;
+}
+
+uint32_t vkutil::get_block_size(const VkFormat format)
+{
+	switch (format)
+	{
+	case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+	case VK_FORMAT_BC4_UNORM_BLOCK:
+	case VK_FORMAT_R16G16B16A16_SFLOAT:	// Single texel blocks
+		return 8;
+	case VK_FORMAT_BC3_UNORM_BLOCK:
+	case VK_FORMAT_BC5_UNORM_BLOCK:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+// KTX2 typeSize, the size of the data type a texel is made of. Block compressed formats use 1
+static uint32_t get_type_size(const VkFormat format)
+{
+	return format == VK_FORMAT_R16G16B16A16_SFLOAT ? 2 : 1;
+}
+
+// Basic data format descriptor block, only what is needed to describe the BC formats above
+static std::vector<uint32_t> build_dfd(const VkFormat format)
+{
+	// Channel, bit offset, bit length, lower and upper
+	const uint32_t floatOne			= 0x3F800000;
+	const uint32_t floatMinusOne	= 0xBF800000;
+	const uint32_t floatChannel		= KHR_DF_SAMPLE_FLOAT | KHR_DF_SAMPLE_SIGNED;
+
+	uint32_t model;
+	std::vector<std::array<uint32_t, 5>> samples;
+	switch (format)
+	{
+	case VK_FORMAT_BC3_UNORM_BLOCK:	model = KHR_DF_MODEL_BC3;	samples = { { KHR_DF_CHANNEL_ALPHA, 0, 64, 0, 0xFFFFFFFF }, { KHR_DF_CHANNEL_COLOR, 64, 64, 0, 0xFFFFFFFF } };	break;
+	case VK_FORMAT_BC4_UNORM_BLOCK:	model = KHR_DF_MODEL_BC4;	samples = { { 0, 0, 64, 0, 0xFFFFFFFF } };															break;
+	case VK_FORMAT_BC5_UNORM_BLOCK:	model = KHR_DF_MODEL_BC5;	samples = { { 0, 0, 64, 0, 0xFFFFFFFF }, { 1, 64, 64, 0, 0xFFFFFFFF } };								break;
+	case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+		// The DFD has a single model for BC1, a colour channel instead of the alpha one marks it as opaque
+		model = KHR_DF_MODEL_BC1A;	samples = { { KHR_DF_CHANNEL_COLOR, 0, 64, 0, 0xFFFFFFFF } };
+		break;
+	case VK_FORMAT_R16G16B16A16_SFLOAT:
+		model	= KHR_DF_MODEL_RGBSDA;
+		samples	= {
+			{ 0 | floatChannel, 0, 16, floatMinusOne, floatOne },
+			{ 1 | floatChannel, 16, 16, floatMinusOne, floatOne },
+			{ 2 | floatChannel, 32, 16, floatMinusOne, floatOne },
+			{ KHR_DF_CHANNEL_ALPHA | floatChannel, 48, 16, floatMinusOne, floatOne } };
+		break;
+	default:
+		return {};
+	}
+
+	const uint32_t blockSize	= 24 + 16 * static_cast<uint32_t>(samples.size());
+	const bool compressed		= model != KHR_DF_MODEL_RGBSDA;
+
+	std::vector<uint32_t> dfd;
+	dfd.push_back(4 + blockSize);
+	dfd.push_back(0);												// Khronos vendor, basic descriptor type
+	dfd.push_back(KHR_DF_VERSION_1_3 | (blockSize << 16));
+	dfd.push_back(model | (KHR_DF_PRIMARIES_BT709 << 8) | (KHR_DF_TRANSFER_LINEAR << 16));
+	dfd.push_back(compressed ? 3 | (3 << 8) : 0);					// 4x4 or single texel blocks, stored minus one
+	dfd.push_back(vkutil::get_block_size(format));					// Bytes per block in plane 0
+	dfd.push_back(0);
+
+	for (const auto& sample : samples)
+	{
+		dfd.push_back(sample[1] | ((sample[2] - 1) << 16) | (sample[0] << 24));	// Bit length stored minus one
+		dfd.push_back(0);
+		dfd.push_back(sample[3]);
+		dfd.push_back(sample[4]);
+	}
+
+	return dfd;
+}
+
+template<typename T>
+static void write_value(std::vector<uint8_t>& out, const T value)
+{
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template<typename T>
+static T read_value(const std::vector<uint8_t>& in, const size_t offset)
+{
+	T value;
+	memcpy(&value, &in[offset], sizeof(T));
+	return value;
+}
+
+bool vkutil::write_ktx2(const std::string& filename, const ImageData& image)
+{
+	const uint32_t blockSize = get_block_size(image.format);
+	if (blockSize == 0 || image.levels.empty())
+		return false;
+
+	const uint32_t levelCount		= static_cast<uint32_t>(image.levels.size());
+	const std::vector<uint32_t> dfd	= build_dfd(image.format);
+	const uint32_t dfdOffset		= 80 + 24 * levelCount;
+	const uint32_t dfdLength		= static_cast<uint32_t>(dfd.size() * sizeof(uint32_t));
+
+	// Levels are stored from the smallest one, each aligned to the block size
+	std::vector<uint64_t> offsets(levelCount);
+	uint64_t offset = dfdOffset + dfdLength;
+	for (int i = levelCount - 1; i >= 0; i--)
+	{
+		offset = (offset + blockSize - 1) / blockSize * blockSize;
+		offsets[i] = offset;
+		offset += image.levels[i].size();
+	}
+
+	std::vector<uint8_t> out;
+	out.reserve(offset);
+	out.insert(out.end(), ktx2Identifier, ktx2Identifier + sizeof(ktx2Identifier));
+	write_value<uint32_t>(out, static_cast<uint32_t>(image.format));
+	write_value<uint32_t>(out, get_type_size(image.format));
+	write_value<uint32_t>(out, static_cast<uint32_t>(image.width));
+	write_value<uint32_t>(out, static_cast<uint32_t>(image.height));
+	write_value<uint32_t>(out, 0);									// pixelDepth
+	write_value<uint32_t>(out, 0);									// layerCount
+	write_value<uint32_t>(out, 1);									// faceCount
+	write_value<uint32_t>(out, levelCount);
+	write_value<uint32_t>(out, 0);									// No supercompression
+	write_value<uint32_t>(out, dfdOffset);
+	write_value<uint32_t>(out, dfdLength);
+	write_value<uint32_t>(out, 0);									// No key/value data
+	write_value<uint32_t>(out, 0);
+	write_value<uint64_t>(out, 0);									// No supercompression global data
+	write_value<uint64_t>(out, 0);
+
+	for (uint32_t i = 0; i < levelCount; i++)
+	{
+		write_value<uint64_t>(out, offsets[i]);
+		write_value<uint64_t>(out, image.levels[i].size());
+		write_value<uint64_t>(out, image.levels[i].size());
+	}
+
+	for (const uint32_t word : dfd)
+		write_value<uint32_t>(out, word);
+
+	for (int i = levelCount - 1; i >= 0; i--)
+	{
+		out.resize(offsets[i], 0);
+		out.insert(out.end(), image.levels[i].begin(), image.levels[i].end());
+	}
+
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	file.write(reinterpret_cast<const char*>(out.data()), out.size());
+	return file.good();
+}
+
+bool vkutil::read_ktx2(const std::string& filename, ImageData& outImage)
+{
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		return false;
+
+	const size_t fileSize = static_cast<size_t>(file.tellg());
+	if (fileSize < 80)
+		return false;
+
+	std::vector<uint8_t> in(fileSize);
+	file.seekg(0);
+	file.read(reinterpret_cast<char*>(in.data()), fileSize);
+
+	if (!file.good() || memcmp(in.data(), ktx2Identifier, sizeof(ktx2Identifier)) != 0)
+		return false;
+
+	const VkFormat format				= static_cast<VkFormat>(read_value<uint32_t>(in, 12));
+	const uint32_t width				= read_value<uint32_t>(in, 20);
+	const uint32_t height				= read_value<uint32_t>(in, 24);
+	const uint32_t faceCount			= read_value<uint32_t>(in, 36);
+	const uint32_t levelCount			= read_value<uint32_t>(in, 40);
+	const uint32_t supercompression		= read_value<uint32_t>(in, 44);
+
+	// Only what write_ktx2 produces is understood, anything else is compressed again
+	if (get_block_size(format) == 0 || faceCount != 1 || levelCount == 0 || supercompression != 0 || fileSize < 80 + 24 * levelCount)
+		return false;
+
+	std::vector<std::vector<unsigned char>> levels(levelCount);
+	for (uint32_t i = 0; i < levelCount; i++)
+	{
+		const uint64_t offset = read_value<uint64_t>(in, 80 + 24 * i);
+		const uint64_t length = read_value<uint64_t>(in, 80 + 24 * i + 8);
+		if (offset + length > fileSize)
+			return false;
+
+		levels[i].assign(in.begin() + offset, in.begin() + offset + length);
+	}
+
+	outImage.format	= format;
+	outImage.width	= static_cast<int>(width);
+	outImage.height	= static_cast<int>(height);
+	outImage.levels	= std::move(levels);
+
+	return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vk_types.h>
+
+struct ImageData;
+
+// How a texture is sampled, picks the block compression used for it
+enum textureUsage {
+	COLOR_USAGE,	// BC1, BC3 when the image has alpha or BC4 when it has a single channel
+	NORMAL_USAGE	// BC5, only x and y are stored
+};
+
+namespace vkutil {
+
+	// Builds the mip chain of the RGBA8 pixels on the CPU and block compresses every level
+	void compress_image(ImageData& image, const textureUsage usage);
+
+	// 2x2 box filter of RGBA8 pixels, odd sizes clamp the last row and column. Normals are renormalized
+	std::vector<unsigned char> downsample_image(const std::vector<unsigned char>& src, const int width, const int height, const bool normal = false);
+
+	// Compressed images are cached next to their source as KTX2, named after their format.
+	// A cache older than the source is ignored
+	std::string get_cache_filename(const std::string& filename, const VkFormat format);
+
+	// Formats compress_image can pick for the usage, in the order their caches are looked for
+	std::vector<VkFormat> get_cache_formats(const textureUsage usage);
+
+	bool is_cache_valid(const std::string& cacheFilename, const std::string& filename);
+
+	bool read_ktx2(const std::string& filename, ImageData& outImage);
+
+	bool write_ktx2(const std::string& filename, const ImageData& image);
+
+	uint32_t get_block_size(const VkFormat format);
+}
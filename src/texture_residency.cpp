@@ -0,0 +1,361 @@
+#include "texture_residency.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "vk_textures.h"
+
+#include <algorithm>
+
+void TextureResidency::init(const uint32_t maxTextures)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	_maxTextures = maxTextures;
+	engine.create_buffer(maxTextures * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, _feedbackBuffer, false);
+
+	void* data;
+	vmaMapMemory(engine._allocator, _feedbackBuffer._allocation, &data);
+	memset(data, 0, maxTextures * sizeof(uint32_t));
+	vmaFlushAllocation(engine._allocator, _feedbackBuffer._allocation, 0, VK_WHOLE_SIZE);
+	vmaUnmapMemory(engine._allocator, _feedbackBuffer._allocation);
+
+	// Restores are rare and read an already compressed cache, one worker is enough
+	_jobs.init(1);
+}
+
+void TextureResidency::destroy()
+{
+	_jobs.shutdown();
+
+	std::pair<uint32_t, ImageData*> restored;
+	while (_restored.pop(restored))
+	{
+		vkutil::free_image(*restored.second);
+		delete restored.second;
+	}
+
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, _feedbackBuffer._buffer, _feedbackBuffer._allocation);
+}
+
+bool TextureResidency::update()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+	_frame++;
+
+	// Textures registered since the last update count as used this frame
+	const uint32_t nTextures = static_cast<uint32_t>(std::min<size_t>(Texture::_textures.size(), _maxTextures));
+	for (uint32_t id = static_cast<uint32_t>(_slots.size()); id < nTextures; id++)
+	{
+		Slot slot;
+		slot.lastUse	= _frame;
+		slot.size		= get_image_size(Texture::_textures[id].second->image);
+		slot.fullSize	= slot.size;
+		_residentBytes	+= slot.size;
+		_slots.push_back(slot);
+	}
+
+	// Frames still in flight may flag textures while the buffer is cleared, those flags come back next frame
+	void* data;
+	vmaMapMemory(engine._allocator, _feedbackBuffer._allocation, &data);
+	vmaInvalidateAllocation(engine._allocator, _feedbackBuffer._allocation, 0, VK_WHOLE_SIZE);
+	const uint32_t* feedback = static_cast<const uint32_t*>(data);
+	for (uint32_t id = 0; id < nTextures; id++)
+	{
+		if (feedback[id])
+			_slots[id].lastUse = _frame;
+	}
+	memset(data, 0, nTextures * sizeof(uint32_t));
+	vmaFlushAllocation(engine._allocator, _feedbackBuffer._allocation, 0, VK_WHOLE_SIZE);
+	vmaUnmapMemory(engine._allocator, _feedbackBuffer._allocation);
+
+	// An override only counts the textures against it
+	if (_budgetOverride > 0)
+	{
+		_usage	= _residentBytes;
+		_budget	= _budgetOverride;
+	}
+	else if (!engine.get_memory_budget(_usage, _budget))
+		_usage = _residentBytes;
+
+	const VkDeviceSize limit		= static_cast<VkDeviceSize>(_budget * BUDGET_FRACTION);
+	const VkDeviceSize restoreLimit	= static_cast<VkDeviceSize>(_budget * RESTORE_FRACTION);
+
+	const bool changed = _usage > limit ? reduce(_usage - limit) : restore(_usage < restoreLimit ? restoreLimit - _usage : 0);
+	if (changed)
+	{
+		_reduced = 0;
+		_evicted = 0;
+		for (const Slot& slot : _slots)
+		{
+			if (!slot.complete)
+				slot.size > 0 ? _reduced++ : _evicted++;
+		}
+	}
+
+	return changed;
+}
+
+// Least recently used first, a texture loses at most one level per update
+bool TextureResidency::reduce(VkDeviceSize excess)
+{
+	std::vector<uint32_t> order;
+	for (uint32_t id = 0; id < _slots.size(); id++)
+	{
+		if (id != PLACEHOLDER && _slots[id].size > 0)
+			order.push_back(id);
+	}
+	std::stable_sort(order.begin(), order.end(), [&](const uint32_t a, const uint32_t b) { return _slots[a].lastUse < _slots[b].lastUse; });
+
+	std::vector<uint32_t> drops, evictions;
+	for (const uint32_t id : order)
+	{
+		if (excess == 0)
+			break;
+
+		const Texture* texture	= Texture::_textures[id].second;
+		const Slot& slot		= _slots[id];
+		if (std::max(texture->width, texture->height) > MIN_SIZE && texture->image._mipLevels > 1)
+		{
+			// The top level is about three quarters of the chain
+			drops.push_back(id);
+			excess -= std::min(excess, slot.size - slot.size / 4);
+		}
+		else if (_frame - slot.lastUse > EVICT_FRAMES)
+		{
+			evictions.push_back(id);
+			excess -= std::min(excess, slot.size);
+		}
+	}
+
+	if (drops.empty() && evictions.empty())
+		return false;
+
+	// Nothing may still read the images that are replaced
+	VulkanEngine& engine = *VulkanEngine::engine;
+	vkDeviceWaitIdle(engine._device);
+
+	drop_top_levels(drops);
+
+	for (const uint32_t id : evictions)
+	{
+		Texture* texture = Texture::_textures[id].second;
+		vkDestroyImageView(engine._device, texture->imageView, nullptr);
+		vmaDestroyImage(engine._allocator, texture->image._image, texture->image._allocation);
+		texture->imageView	= VK_NULL_HANDLE;
+		texture->image		= { VK_NULL_HANDLE, VK_NULL_HANDLE, 0 };
+
+		Slot& slot		= _slots[id];
+		_residentBytes	-= slot.size;
+		slot.size		= 0;
+		slot.complete	= false;
+	}
+
+	return true;
+}
+
+// The lower levels are copied on the GPU into a new image one level shorter
+void TextureResidency::drop_top_levels(const std::vector<uint32_t>& ids)
+{
+	if (ids.empty())
+		return;
+
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	std::vector<AllocatedImage> images(ids.size());
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		const Texture* texture = Texture::_textures[ids[i]].second;
+
+		VkExtent3D extent = { std::max(texture->width / 2, 1u), std::max(texture->height / 2, 1u), 1 };
+		VkImageCreateInfo imageInfo = vkinit::image_create_info(texture->format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, extent);
+		imageInfo.mipLevels = texture->image._mipLevels - 1;
+
+		VmaAllocationCreateInfo allocInfo = {};
+		allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+		VK_CHECK(vmaCreateImage(engine._allocator, &imageInfo, &allocInfo, &images[i]._image, &images[i]._allocation, nullptr));
+		images[i]._mipLevels = imageInfo.mipLevels;
+	}
+
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		std::vector<VkImageMemoryBarrier> barriers;
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			VkImageMemoryBarrier barrier = {};
+			barrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.oldLayout			= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			barrier.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			barrier.image				= Texture::_textures[ids[i]].second->image._image;
+			barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 1, images[i]._mipLevels, 0, 1 };
+			barrier.srcAccessMask		= 0;
+			barrier.dstAccessMask		= VK_ACCESS_TRANSFER_READ_BIT;
+			barriers.push_back(barrier);
+
+			barrier.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
+			barrier.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.image				= images[i]._image;
+			barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, images[i]._mipLevels, 0, 1 };
+			barrier.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
+			barriers.push_back(barrier);
+		}
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr,
+			static_cast<uint32_t>(barriers.size()), barriers.data());
+
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			const Texture* texture = Texture::_textures[ids[i]].second;
+
+			std::vector<VkImageCopy> copies(images[i]._mipLevels);
+			for (uint32_t level = 0; level < images[i]._mipLevels; level++)
+			{
+				copies[level] = {};
+				copies[level].srcSubresource	= { VK_IMAGE_ASPECT_COLOR_BIT, level + 1, 0, 1 };
+				copies[level].dstSubresource	= { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+				copies[level].extent			= { std::max(texture->width >> (level + 1), 1u), std::max(texture->height >> (level + 1), 1u), 1 };
+			}
+
+			vkCmdCopyImage(cmd, texture->image._image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, images[i]._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				static_cast<uint32_t>(copies.size()), copies.data());
+		}
+
+		barriers.clear();
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			VkImageMemoryBarrier barrier = {};
+			barrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.oldLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.newLayout			= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			barrier.image				= images[i]._image;
+			barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, images[i]._mipLevels, 0, 1 };
+			barrier.srcAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask		= VK_ACCESS_SHADER_READ_BIT;
+			barriers.push_back(barrier);
+		}
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+			0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+	});
+
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		Texture* texture = Texture::_textures[ids[i]].second;
+		vkDestroyImageView(engine._device, texture->imageView, nullptr);
+		vmaDestroyImage(engine._allocator, texture->image._image, texture->image._allocation);
+
+		texture->image	= images[i];
+		texture->width	= std::max(texture->width / 2, 1u);
+		texture->height	= std::max(texture->height / 2, 1u);
+		texture->create_view();
+
+		Slot& slot		= _slots[ids[i]];
+		_residentBytes	-= slot.size;
+		slot.size		= get_image_size(texture->image);
+		_residentBytes	+= slot.size;
+		slot.complete	= false;
+	}
+}
+
+// Reads finished since the last update replace their texture if they still fit, then the next
+// reduced texture sampled this frame is read. One read is in flight at a time
+bool TextureResidency::restore(VkDeviceSize room)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	std::vector<uint32_t> ids;
+	std::vector<ImageData*> images;
+	std::pair<uint32_t, ImageData*> restored;
+	while (_restored.pop(restored))
+	{
+		Slot& slot		= _slots[restored.first];
+		slot.loading	= false;
+
+		const VkDeviceSize growth = slot.fullSize - slot.size;
+		if (slot.complete || (!restored.second->pixels && restored.second->levels.empty()) || growth > room)
+		{
+			vkutil::free_image(*restored.second);
+			delete restored.second;
+			continue;
+		}
+
+		room -= growth;
+		ids.push_back(restored.first);
+		images.push_back(restored.second);
+	}
+
+	if (!ids.empty())
+	{
+		std::vector<const ImageData*> uploads(images.begin(), images.end());
+		std::vector<AllocatedImage> uploaded;
+		const bool success = vkutil::upload_images(engine, uploads, uploaded);
+
+		if (success)
+		{
+			// Nothing may still read the images that are replaced
+			vkDeviceWaitIdle(engine._device);
+
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				Texture* texture = Texture::_textures[ids[i]].second;
+				vkDestroyImageView(engine._device, texture->imageView, nullptr);
+				vmaDestroyImage(engine._allocator, texture->image._image, texture->image._allocation);
+
+				texture->image	= uploaded[i];
+				texture->width	= static_cast<uint32_t>(images[i]->width);
+				texture->height	= static_cast<uint32_t>(images[i]->height);
+				texture->create_view();
+
+				Slot& slot		= _slots[ids[i]];
+				_residentBytes	-= slot.size;
+				slot.size		= get_image_size(texture->image);
+				_residentBytes	+= slot.size;
+				slot.complete	= true;
+			}
+		}
+
+		for (ImageData* image : images)
+		{
+			vkutil::free_image(*image);
+			delete image;
+		}
+
+		if (!success)
+			ids.clear();
+	}
+
+	const bool loading = std::any_of(_slots.begin(), _slots.end(), [](const Slot& slot) { return slot.loading; });
+	if (!loading && room > 0)
+	{
+		for (uint32_t id = 0; id < _slots.size(); id++)
+		{
+			Slot& slot = _slots[id];
+			if (slot.complete || slot.lastUse != _frame || slot.fullSize - slot.size > room)
+				continue;
+
+			slot.loading = true;
+
+			const std::string name		= Texture::_textures[id].first;
+			const textureUsage usage	= Texture::_textures[id].second->usage;
+			_jobs.schedule([this, id, name, usage]() {
+				ImageData* image = new ImageData();
+				vkutil::decode_image(name.c_str(), *image, usage);
+				_restored.push({ id, image });
+			});
+			break;
+		}
+	}
+
+	return !ids.empty();
+}
+
+VkDeviceSize TextureResidency::get_image_size(const AllocatedImage& image) const
+{
+	if (image._image == VK_NULL_HANDLE)
+		return 0;
+
+	VkMemoryRequirements requirements;
+	vkGetImageMemoryRequirements(VulkanEngine::engine->_device, image._image, &requirements);
+	return requirements.size;
+}
+
+VkDescriptorBufferInfo TextureResidency::get_feedback_info() const
+{
+	return { _feedbackBuffer._buffer, 0, _maxTextures * sizeof(uint32_t) };
+}
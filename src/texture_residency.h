@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vk_types.h>
+#include "job_system.h"
+
+struct ImageData;
+
+// Keeps the registered textures within the VRAM budget. Shaders flag the textures they sample in a
+// feedback buffer read back in update(). While the device heaps are over budget the least recently
+// used textures lose their top mip, and the ones down to MIN_SIZE that were not sampled for
+// EVICT_FRAMES are released, their descriptors then point to the placeholder, texture 0.
+// Reduced textures that are sampled again are read back from their cache once there is room.
+class TextureResidency
+{
+public:
+	static constexpr float		BUDGET_FRACTION		= 0.9f;	// Share of the budget the heaps may reach
+	static constexpr float		RESTORE_FRACTION	= 0.75f;	// Reloads wait for the heaps to drop below this share
+	static constexpr uint32_t	MIN_SIZE			= 64;	// Largest side kept when dropping mips
+	static constexpr uint32_t	EVICT_FRAMES		= 300;
+	static constexpr uint32_t	PLACEHOLDER			= 0;
+
+	void init(const uint32_t maxTextures);
+	void destroy();
+
+	// Render thread, once per frame. Returns true when textures were replaced, descriptors
+	// and the command buffers recorded with them have to be updated
+	bool update();
+
+	VkDescriptorBufferInfo get_feedback_info() const;
+
+	VkDeviceSize	get_resident_bytes() const { return _residentBytes; }
+	VkDeviceSize	get_usage() const { return _usage; }
+	VkDeviceSize	get_budget() const { return _budget; }
+	uint32_t		get_reduced() const { return _reduced; }
+	uint32_t		get_evicted() const { return _evicted; }
+
+	VkDeviceSize	_budgetOverride{ 0 };	// Bytes of textures allowed, 0 follows the device budget
+
+private:
+	struct Slot
+	{
+		uint64_t		lastUse{ 0 };
+		VkDeviceSize	size{ 0 };			// Resident bytes
+		VkDeviceSize	fullSize{ 0 };		// Bytes with every level, known once the texture was complete
+		bool			complete{ true };	// No level dropped
+		bool			loading{ false };
+	};
+
+	bool reduce(VkDeviceSize excess);
+	bool restore(VkDeviceSize room);
+	void drop_top_levels(const std::vector<uint32_t>& ids);
+	VkDeviceSize get_image_size(const AllocatedImage& image) const;
+
+	std::vector<Slot>			_slots;			// Indexed by texture id
+	uint32_t					_maxTextures{ 0 };
+	uint64_t					_frame{ 0 };
+	VkDeviceSize				_residentBytes{ 0 };
+	VkDeviceSize				_usage{ 0 };
+	VkDeviceSize				_budget{ 0 };
+	uint32_t					_reduced{ 0 };
+	uint32_t					_evicted{ 0 };
+
+	AllocatedBuffer				_feedbackBuffer;
+	JobSystem					_jobs;			// Reads the caches of the textures restored
+	MPSCQueue<std::pair<uint32_t, ImageData*>>	_restored;
+};
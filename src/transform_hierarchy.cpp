@@ -0,0 +1,55 @@
+#include "transform_hierarchy.h"
+
+#include <algorithm>
+#include <cassert>
+
+uint32_t TransformHierarchy::add(const glm::mat4& local, const int32_t parent)
+{
+	assert(parent < static_cast<int32_t>(_local.size()));
+
+	const uint32_t node = static_cast<uint32_t>(_local.size());
+	_local.push_back(local);
+	_world.push_back(parent == NO_PARENT ? local : _world[parent] * local);
+	_parent.push_back(parent);
+	_subtreeEnd.push_back(node + 1);
+	_dirty.push_back(0);
+
+	for (int32_t ancestor = parent; ancestor != NO_PARENT; ancestor = _parent[ancestor])
+		_subtreeEnd[ancestor] = node + 1;
+
+	return node;
+}
+
+void TransformHierarchy::set_local(const uint32_t node, const glm::mat4& local)
+{
+	_local[node] = local;
+	if (!_dirty[node])
+	{
+		_dirty[node] = 1;
+		_dirtyNodes.push_back(node);
+	}
+}
+
+bool TransformHierarchy::update()
+{
+	if (_dirtyNodes.empty())
+		return false;
+
+	// Sorted, a dirty node inside a subtree already recomputed is skipped
+	std::sort(_dirtyNodes.begin(), _dirtyNodes.end());
+
+	uint32_t done = 0;
+	for (const uint32_t node : _dirtyNodes)
+	{
+		_dirty[node] = 0;
+		if (node < done)
+			continue;
+
+		for (uint32_t i = node; i < _subtreeEnd[node]; i++)
+			_world[i] = _parent[i] == NO_PARENT ? _local[i] : _world[_parent[i]] * _local[i];
+		done = _subtreeEnd[node];
+	}
+	_dirtyNodes.clear();
+
+	return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Node transforms of a prefab as flat arrays in depth first order: parents come before their
+// children and every subtree is the contiguous range [node, _subtreeEnd[node]). World matrices are
+// relative to the prefab, update() recomputes only the subtrees below the nodes that changed.
+class TransformHierarchy
+{
+public:
+	static constexpr int32_t NO_PARENT = -1;
+
+	// Nodes must be added in depth first order, returns the index of the node
+	uint32_t add(const glm::mat4& local, const int32_t parent);
+	void set_local(const uint32_t node, const glm::mat4& local);
+
+	// Returns true when any world matrix changed
+	bool update();
+
+	const glm::mat4& get_local(const uint32_t node) const { return _local[node]; }
+	const glm::mat4& get_world(const uint32_t node) const { return _world[node]; }
+	int32_t get_parent(const uint32_t node) const { return _parent[node]; }
+	uint32_t size() const { return static_cast<uint32_t>(_local.size()); }
+
+private:
+	std::vector<glm::mat4>	_local;
+	std::vector<glm::mat4>	_world;
+	std::vector<int32_t>	_parent;
+	std::vector<uint32_t>	_subtreeEnd;	// One past the last descendant
+	std::vector<uint8_t>	_dirty;
+	std::vector<uint32_t>	_dirtyNodes;	// Marked since the last update, unordered
+};
@@ -0,0 +1,412 @@
+#include "virtual_texture.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "texture_cache.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cstdio>
+
+static const uint32_t PAGE_FILE_MAGIC = 0x53454750;	// "PGES"
+
+// Copies the page and its border out of the level pixels, texels outside the level repeat the edge
+static void extract_page(const uint32_t width, const uint32_t height, const uint32_t pagesX, const std::vector<unsigned char>& pixels, const uint32_t index, unsigned char* dst)
+{
+	const uint32_t size		= VirtualTexture::PAGE_SIZE;
+	const uint32_t border	= VirtualTexture::PAGE_BORDER;
+	const uint32_t x0		= (index % pagesX) * VirtualTexture::PAGE_PAYLOAD;
+	const uint32_t y0		= (index / pagesX) * VirtualTexture::PAGE_PAYLOAD;
+
+	for (uint32_t y = 0; y < size; y++)
+	{
+		const int sy = std::min(std::max(static_cast<int>(y0 + y) - static_cast<int>(border), 0), static_cast<int>(height) - 1);
+		for (uint32_t x = 0; x < size; x++)
+		{
+			const int sx = std::min(std::max(static_cast<int>(x0 + x) - static_cast<int>(border), 0), static_cast<int>(width) - 1);
+			memcpy(&dst[(y * size + x) * 4], &pixels[(static_cast<size_t>(sy) * width + sx) * 4], 4);
+		}
+	}
+}
+
+bool VirtualTexture::init(const std::string& filename, const uint32_t cacheSize)
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	int width, height, channels;
+	if (!stbi_info(filename.c_str(), &width, &height, &channels))
+	{
+		std::cout << "Failed to load virtual texture file: " << filename << std::endl;
+		return false;
+	}
+
+	// Levels down to the one that fits in a single page, that page is always resident
+	uint32_t w = static_cast<uint32_t>(width);
+	uint32_t h = static_cast<uint32_t>(height);
+	while (_levels.size() < MAX_LEVELS)
+	{
+		Level l;
+		l.width		= w;
+		l.height	= h;
+		l.pagesX	= (w + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+		l.pagesY	= (h + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+		l.firstPage	= _nPages;
+		_nPages		+= l.pagesX * l.pagesY;
+		_levels.push_back(l);
+
+		if (w <= PAGE_PAYLOAD && h <= PAGE_PAYLOAD)
+			break;
+		w = std::max(w / 2, 1u);
+		h = std::max(h / 2, 1u);
+	}
+
+	const std::string pageFilename = filename + ".pages";
+	if (!is_page_file_valid(filename, pageFilename) && !build_page_file(filename, pageFilename))
+	{
+		std::cout << "Failed to write the pages of virtual texture " << filename << std::endl;
+		_levels.clear();
+		return false;
+	}
+	_pageFile.open(pageFilename, std::ios::binary);
+
+	const uint32_t nLevels = static_cast<uint32_t>(_levels.size());
+
+	_pageTable.assign(HEADER_SIZE + _nPages, NOT_RESIDENT);
+	_pageTable[0] = static_cast<uint32_t>(width);
+	_pageTable[1] = static_cast<uint32_t>(height);
+	_pageTable[2] = nLevels;
+	_pageTable[3] = PAGE_PAYLOAD;
+	_pageTable[4] = PAGE_BORDER;
+	_pageTable[5] = cacheSize / PAGE_SIZE;
+	_pageTable[6] = cacheSize;
+	_pageTable[7] = PAGE_SIZE;
+	for (uint32_t i = 0; i < MAX_LEVELS; i++)
+		_pageTable[8 + i] = i < nLevels ? _levels[i].firstPage : 0;
+
+	_cacheSize		= cacheSize;
+	_slotsPerRow	= cacheSize / PAGE_SIZE;
+	_slotPage.assign(_slotsPerRow * _slotsPerRow, NOT_RESIDENT);
+	_slotLastUse.assign(_slotPage.size(), 0);
+
+	// Physical cache, a single level the pages are copied into
+	VkExtent3D extent = { cacheSize, cacheSize, 1 };
+	VkImageCreateInfo imageInfo = vkinit::image_create_info(VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, extent);
+
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VK_CHECK(vmaCreateImage(engine._allocator, &imageInfo, &allocInfo, &_cache._image, &_cache._allocation, nullptr));
+
+	VkImageViewCreateInfo viewInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, _cache._image, VK_IMAGE_ASPECT_COLOR_BIT);
+	VK_CHECK(vkCreateImageView(engine._device, &viewInfo, nullptr, &_cacheView));
+
+	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	VK_CHECK(vkCreateSampler(engine._device, &samplerInfo, nullptr, &_sampler));
+
+	const size_t pageBytes = PAGE_SIZE * PAGE_SIZE * 4;
+
+	engine.create_buffer(_pageTable.size() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _pageTableBuffer, false);
+	engine.create_buffer(_nPages * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, _feedbackBuffer, false);
+	engine.create_buffer(STAGING_SEGMENTS * get_segment_size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, _stagingBuffer, false);
+
+	void* data;
+	vmaMapMemory(engine._allocator, _feedbackBuffer._allocation, &data);
+	memset(data, 0, _nPages * sizeof(uint32_t));
+	vmaFlushAllocation(engine._allocator, _feedbackBuffer._allocation, 0, VK_WHOLE_SIZE);
+	vmaUnmapMemory(engine._allocator, _feedbackBuffer._allocation);
+
+	// The coarsest page is pinned in slot 0, every lookup ends there
+	const uint32_t root = _levels.back().firstPage;
+	_slotPage[0]		= root;
+	_slotLastUse[0]		= UINT64_MAX;
+	_pageTable[HEADER_SIZE + root] = 0;
+	_residentPages		= 1;
+
+	vmaMapMemory(engine._allocator, _stagingBuffer._allocation, &data);
+	copy_page(root, static_cast<unsigned char*>(data));
+	memcpy(static_cast<char*>(data) + pageBytes, _pageTable.data(), _pageTable.size() * sizeof(uint32_t));
+	vmaUnmapMemory(engine._allocator, _stagingBuffer._allocation);
+
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.image				= _cache._image;
+		barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		barrier.srcAccessMask		= 0;
+		barrier.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		// Slots never written are cleared so a stale lookup reads black
+		VkClearColorValue clear = { { 0.0f, 0.0f, 0.0f, 1.0f } };
+		vkCmdClearColorImage(cmd, _cache._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear, 1, &barrier.subresourceRange);
+
+		barrier.oldLayout		= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		VkBufferImageCopy copy = {};
+		copy.bufferOffset		= 0;
+		copy.imageSubresource	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		copy.imageOffset		= { 0, 0, 0 };
+		copy.imageExtent		= { PAGE_SIZE, PAGE_SIZE, 1 };
+		vkCmdCopyBufferToImage(cmd, _stagingBuffer._buffer, _cache._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+		VkBufferCopy tableCopy = { pageBytes, 0, _pageTable.size() * sizeof(uint32_t) };
+		vkCmdCopyBuffer(cmd, _stagingBuffer._buffer, _pageTableBuffer._buffer, 1, &tableCopy);
+
+		barrier.newLayout		= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT;
+
+		VkMemoryBarrier tableBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT };
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+			0, 1, &tableBarrier, 0, nullptr, 1, &barrier);
+	});
+
+	return true;
+}
+
+bool VirtualTexture::is_page_file_valid(const std::string& filename, const std::string& pageFilename)
+{
+	if (!vkutil::is_cache_valid(pageFilename, filename))
+		return false;
+
+	std::ifstream file(pageFilename, std::ios::binary | std::ios::ate);
+	const uint64_t expectedSize = FILE_HEADER * sizeof(uint32_t) + static_cast<uint64_t>(_nPages) * PAGE_SIZE * PAGE_SIZE * 4;
+	if (!file.is_open() || static_cast<uint64_t>(file.tellg()) != expectedSize)
+		return false;
+
+	uint32_t header[FILE_HEADER];
+	file.seekg(0);
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+
+	return file.good() && header[0] == PAGE_FILE_MAGIC && header[1] == _levels[0].width && header[2] == _levels[0].height
+		&& header[3] == PAGE_SIZE && header[4] == PAGE_BORDER && header[5] == _levels.size() && header[6] == _nPages;
+}
+
+bool VirtualTexture::build_page_file(const std::string& filename, const std::string& pageFilename)
+{
+	int width, height, channels;
+	stbi_uc* pixels = stbi_load(filename.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+	if (!pixels)
+		return false;
+
+	std::vector<unsigned char> level(pixels, pixels + static_cast<size_t>(width) * height * 4);
+	stbi_image_free(pixels);
+
+	std::ofstream file(pageFilename, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+		return false;
+
+	const uint32_t header[FILE_HEADER] = { PAGE_FILE_MAGIC, _levels[0].width, _levels[0].height, PAGE_SIZE, PAGE_BORDER,
+		static_cast<uint32_t>(_levels.size()), _nPages, 0 };
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	// Pages follow in page order, each level is dropped once the next one is built from it
+	std::vector<unsigned char> page(PAGE_SIZE * PAGE_SIZE * 4);
+	for (size_t l = 0; l < _levels.size(); l++)
+	{
+		const Level& info = _levels[l];
+		for (uint32_t i = 0; i < info.pagesX * info.pagesY; i++)
+		{
+			extract_page(info.width, info.height, info.pagesX, level, i, page.data());
+			file.write(reinterpret_cast<const char*>(page.data()), page.size());
+		}
+
+		if (l + 1 < _levels.size())
+			level = vkutil::downsample_image(level, info.width, info.height);
+	}
+
+	file.close();
+	if (!file.good())
+	{
+		std::remove(pageFilename.c_str());
+		return false;
+	}
+	return true;
+}
+
+void VirtualTexture::destroy()
+{
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	vkDestroySampler(engine._device, _sampler, nullptr);
+	vkDestroyImageView(engine._device, _cacheView, nullptr);
+	vmaDestroyImage(engine._allocator, _cache._image, _cache._allocation);
+	vmaDestroyBuffer(engine._allocator, _pageTableBuffer._buffer, _pageTableBuffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _feedbackBuffer._buffer, _feedbackBuffer._allocation);
+	vmaDestroyBuffer(engine._allocator, _stagingBuffer._buffer, _stagingBuffer._allocation);
+	_pageFile.close();
+	_levels.clear();
+}
+
+// Free slots first, otherwise the least recently requested page that was not requested this update
+uint32_t VirtualTexture::allocate_slot()
+{
+	uint32_t best = NOT_RESIDENT;
+	for (uint32_t i = 0; i < _slotPage.size(); i++)
+	{
+		if (_slotPage[i] == NOT_RESIDENT)
+			return i;
+		if (_slotLastUse[i] < _frame && (best == NOT_RESIDENT || _slotLastUse[i] < _slotLastUse[best]))
+			best = i;
+	}
+
+	if (best != NOT_RESIDENT)
+	{
+		_pageTable[HEADER_SIZE + _slotPage[best]] = NOT_RESIDENT;
+		_slotPage[best] = NOT_RESIDENT;
+		_residentPages--;
+	}
+	return best;
+}
+
+// Reads the page back from the page file, a page that cannot be read stays black
+void VirtualTexture::copy_page(const uint32_t page, unsigned char* dst)
+{
+	const size_t pageBytes = PAGE_SIZE * PAGE_SIZE * 4;
+
+	_pageFile.seekg(FILE_HEADER * sizeof(uint32_t) + static_cast<uint64_t>(page) * pageBytes);
+	if (!_pageFile.read(reinterpret_cast<char*>(dst), pageBytes))
+	{
+		_pageFile.clear();
+		memset(dst, 0, pageBytes);
+	}
+}
+
+uint32_t VirtualTexture::update(const uint32_t maxUploads)
+{
+	if (_levels.empty())
+		return 0;
+
+	VulkanEngine& engine = *VulkanEngine::engine;
+	_frame++;
+
+	// Frames still in flight may flag pages while the buffer is cleared, those requests come back next frame
+	std::vector<uint32_t> requests;
+	void* data;
+	vmaMapMemory(engine._allocator, _feedbackBuffer._allocation, &data);
+	vmaInvalidateAllocation(engine._allocator, _feedbackBuffer._allocation, 0, VK_WHOLE_SIZE);
+	uint32_t* feedback = static_cast<uint32_t*>(data);
+	for (uint32_t page = 0; page < _nPages; page++)
+	{
+		if (!feedback[page])
+			continue;
+
+		const uint32_t slot = _pageTable[HEADER_SIZE + page];
+		if (slot != NOT_RESIDENT)
+			_slotLastUse[slot] = std::max(_slotLastUse[slot], _frame);
+		else
+			requests.push_back(page);
+	}
+	memset(data, 0, _nPages * sizeof(uint32_t));
+	vmaFlushAllocation(engine._allocator, _feedbackBuffer._allocation, 0, VK_WHOLE_SIZE);
+	vmaUnmapMemory(engine._allocator, _feedbackBuffer._allocation);
+
+	if (requests.empty())
+		return 0;
+
+	// Coarse pages first, they are the fallback of everything finer
+	std::sort(requests.begin(), requests.end(), std::greater<uint32_t>());
+
+	// Pages assigned by updates whose frame was not recorded are still waiting
+	const uint32_t budget = std::min(maxUploads, MAX_UPLOADS);
+	uint32_t assigned = 0;
+	for (const uint32_t page : requests)
+	{
+		if (_uploads.size() >= budget)
+			break;
+
+		const uint32_t slot = allocate_slot();
+		if (slot == NOT_RESIDENT)
+			break;
+
+		_uploads.push_back({ page, slot });
+		_slotPage[slot]		= page;
+		_slotLastUse[slot]	= _frame;
+		_pageTable[HEADER_SIZE + page] = slot;
+		_residentPages++;
+		assigned++;
+	}
+
+	return assigned;
+}
+
+// Staging segments alternate, the frame that last copied from this one has finished
+void VirtualTexture::record_uploads(VkCommandBuffer cmd)
+{
+	if (_uploads.empty())
+		return;
+
+	VulkanEngine& engine = *VulkanEngine::engine;
+
+	const size_t pageBytes			= PAGE_SIZE * PAGE_SIZE * 4;
+	const VkDeviceSize segment		= _segment * get_segment_size();
+	const VkDeviceSize tableOffset	= segment + MAX_UPLOADS * pageBytes;
+
+	std::vector<VkBufferImageCopy> copies;
+	void* data;
+	vmaMapMemory(engine._allocator, _stagingBuffer._allocation, &data);
+	for (const auto& upload : _uploads)
+	{
+		const uint32_t slot = upload.second;
+		copy_page(upload.first, static_cast<unsigned char*>(data) + segment + copies.size() * pageBytes);
+
+		VkBufferImageCopy copy = {};
+		copy.bufferOffset		= segment + copies.size() * pageBytes;
+		copy.imageSubresource	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		copy.imageOffset		= { static_cast<int32_t>((slot % _slotsPerRow) * PAGE_SIZE), static_cast<int32_t>((slot / _slotsPerRow) * PAGE_SIZE), 0 };
+		copy.imageExtent		= { PAGE_SIZE, PAGE_SIZE, 1 };
+		copies.push_back(copy);
+	}
+	memcpy(static_cast<char*>(data) + tableOffset, _pageTable.data(), _pageTable.size() * sizeof(uint32_t));
+	vmaUnmapMemory(engine._allocator, _stagingBuffer._allocation);
+
+	// The barriers wait for earlier work of the frame still sampling the slots being replaced
+	const VkPipelineStageFlags shaderStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout			= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.image				= _cache._image;
+	barrier.subresourceRange	= { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	barrier.srcAccessMask		= VK_ACCESS_SHADER_READ_BIT;
+	barrier.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	VkMemoryBarrier tableBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT };
+	vkCmdPipelineBarrier(cmd, shaderStages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &tableBarrier, 0, nullptr, 1, &barrier);
+
+	vkCmdCopyBufferToImage(cmd, _stagingBuffer._buffer, _cache._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(copies.size()), copies.data());
+
+	VkBufferCopy tableCopy = { tableOffset, 0, _pageTable.size() * sizeof(uint32_t) };
+	vkCmdCopyBuffer(cmd, _stagingBuffer._buffer, _pageTableBuffer._buffer, 1, &tableCopy);
+
+	std::swap(barrier.oldLayout, barrier.newLayout);
+	std::swap(barrier.srcAccessMask, barrier.dstAccessMask);
+	std::swap(tableBarrier.srcAccessMask, tableBarrier.dstAccessMask);
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, shaderStages, 0, 1, &tableBarrier, 0, nullptr, 1, &barrier);
+
+	_uploads.clear();
+	_segment = (_segment + 1) % STAGING_SEGMENTS;
+}
+
+VkDeviceSize VirtualTexture::get_segment_size() const
+{
+	return MAX_UPLOADS * PAGE_SIZE * PAGE_SIZE * 4 + _pageTable.size() * sizeof(uint32_t);
+}
+
+VkDescriptorImageInfo VirtualTexture::get_cache_info() const
+{
+	return { _sampler, _cacheView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+}
+
+VkDescriptorBufferInfo VirtualTexture::get_page_table_info() const
+{
+	return { _pageTableBuffer._buffer, 0, _pageTable.size() * sizeof(uint32_t) };
+}
+
+VkDescriptorBufferInfo VirtualTexture::get_feedback_info() const
+{
+	return { _feedbackBuffer._buffer, 0, _nPages * sizeof(uint32_t) };
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Image too large to keep resident. Every mip level is split in pages that are copied on demand
+// into a fixed size physical cache. Shaders translate their uv through the page table, falling back
+// to coarser levels, and flag the pages they wanted in a feedback buffer read back in update().
+// The page table, feedback layout and lookup are mirrored in virtual_texture.glsl.
+// The pages are built once into <file>.pages next to the source and read back from there, the
+// texels are never all in memory after the first run.
+class VirtualTexture
+{
+public:
+	static constexpr uint32_t PAGE_SIZE		= 128;							// Texels of a physical slot
+	static constexpr uint32_t PAGE_BORDER	= 4;							// Bilinear filtering never reads a neighbour slot
+	static constexpr uint32_t PAGE_PAYLOAD	= PAGE_SIZE - 2 * PAGE_BORDER;	// Virtual texels of a page
+	static constexpr uint32_t MAX_LEVELS	= 16;
+	static constexpr uint32_t MAX_UPLOADS	= 16;							// Pages copied per frame at most
+	static constexpr uint32_t STAGING_SEGMENTS = 2;							// Frames in flight that may still copy from staging
+	static constexpr uint32_t HEADER_SIZE	= 8 + MAX_LEVELS;				// uints of the page table before the entries
+	static constexpr uint32_t NOT_RESIDENT	= 0xFFFFFFFF;
+	static constexpr uint32_t FILE_HEADER	= 8;							// uints before the pages of the page file
+
+	// cacheSize is the side of the physical cache in texels, VRAM does not depend on the image
+	bool init(const std::string& filename, const uint32_t cacheSize = 2048);
+	void destroy();
+
+	// Render thread. Reads the feedback and assigns slots to up to maxUploads pages, returns how many
+	uint32_t update(const uint32_t maxUploads = MAX_UPLOADS);
+	// Copies the pages assigned since the last call, outside of a render pass of the frame command buffer
+	void record_uploads(VkCommandBuffer cmd);
+
+	VkDescriptorImageInfo	get_cache_info() const;
+	VkDescriptorBufferInfo	get_page_table_info() const;
+	VkDescriptorBufferInfo	get_feedback_info() const;
+
+	uint32_t get_resident_pages() const { return _residentPages; }
+	uint32_t get_slot_count() const { return static_cast<uint32_t>(_slotPage.size()); }
+
+private:
+	struct Level
+	{
+		uint32_t	width;
+		uint32_t	height;
+		uint32_t	pagesX;
+		uint32_t	pagesY;
+		uint32_t	firstPage;
+	};
+
+	// Decodes the image and writes every page of every level, one level is in memory at a time
+	bool build_page_file(const std::string& filename, const std::string& pageFilename);
+	bool is_page_file_valid(const std::string& filename, const std::string& pageFilename);
+
+	uint32_t allocate_slot();
+	void copy_page(const uint32_t page, unsigned char* dst);
+	VkDeviceSize get_segment_size() const;
+
+	std::vector<Level>		_levels;
+	std::ifstream			_pageFile;
+	std::vector<uint32_t>	_pageTable;		// Header followed by the slot of every page
+	std::vector<uint32_t>	_slotPage;		// Page held by each slot, NOT_RESIDENT when free
+	std::vector<uint64_t>	_slotLastUse;	// Last update the page of the slot was requested
+	std::vector<std::pair<uint32_t, uint32_t>> _uploads;	// Page and slot waiting for record_uploads
+	uint32_t				_nPages{ 0 };
+	uint32_t				_slotsPerRow{ 0 };
+	uint32_t				_cacheSize{ 0 };
+	uint32_t				_residentPages{ 0 };
+	uint64_t				_frame{ 0 };
+	uint32_t				_segment{ 0 };
+
+	AllocatedImage			_cache;
+	VkImageView				_cacheView{ VK_NULL_HANDLE };
+	VkSampler				_sampler{ VK_NULL_HANDLE };
+	AllocatedBuffer			_pageTableBuffer;
+	AllocatedBuffer			_feedbackBuffer;
+	AllocatedBuffer			_stagingBuffer;	// Per segment, the pages of one frame followed by the page table
+};
@@ -42,7 +42,7 @@ void VulkanEngine::init()
 	init_upload_commands();
 
 	_scene = new Scene();
-	_scene->create_scene(0);
+	_scene->create_scene(_sceneIndex, _stressSettings);
 
 	// Add necessary features to the engine
 	init_ray_tracing();
@@ -64,6 +64,8 @@ void VulkanEngine::cleanup()
 {
 	if (_isInitialized) {
 
+		_scene->_streamer.shutdown();
+
 		for (auto& frames : renderer->_frames)
 			vkWaitForFences(_device, 1, &frames._renderFence, VK_TRUE, 1000000000);
 
@@ -105,9 +107,18 @@ void VulkanEngine::run()
 			_window->handleEvent(e, dt);
 		}
 
+		// Streamed assets are inserted before the TLAS is updated with their entities
+		_scene->_streamer.update();
+		renderer->insert_streamed_entities();
+
+		// Sky pages and textures flagged by the previous frames
+		renderer->_skyTexture.update();
+		renderer->update_texture_residency();
+
 		update(dt);
 
 		renderer->render_gui();
+		renderer->update_materials();
 		switch (_mode)
 		{
 		case DEFERRED:
@@ -130,6 +141,7 @@ void VulkanEngine::run()
 void VulkanEngine::update(const float dt)
 {
 	_window->input_update();
+	_scene->update(dt);
 	updateFrame();
 	updateCameraMatrices();
 
@@ -146,18 +158,17 @@ void VulkanEngine::update(const float dt)
 	void* rtLightData;
 	vmaMapMemory(_allocator, renderer->_lightBuffer._allocation, &rtLightData);
 	uboLight* rtLightUBO = (uboLight*)rtLightData;
-	for (int i = 0; i < _scene->_lights.size(); i++)
+	const LightStore& lights = _scene->_lights;
+	for (uint32_t i = 0; i < lights.size(); i++)
 	{
-		_scene->_lights[i]->update();
-		Light* l = _scene->_lights[i];
-		if (l->type == DIRECTIONAL_LIGHT) {
-			rtLightUBO[i].color		= glm::vec4(l->color.x, l->color.y, l->color.z, l->intensity);
-			rtLightUBO[i].position	= glm::vec4(l->position.x, l->position.y, l->position.z, -1);
+		const glm::vec3 position = glm::vec3(lights.transforms[i][3]);
+		rtLightUBO[i].color		= glm::vec4(lights.colors[i], lights.intensities[i]);
+		if (lights.types[i] == DIRECTIONAL_LIGHT) {
+			rtLightUBO[i].position	= glm::vec4(position, -1);
 		}
 		else {
-			rtLightUBO[i].color		= glm::vec4(l->color.x, l->color.y, l->color.z, l->intensity);
-			rtLightUBO[i].position	= glm::vec4(l->position.x, l->position.y, l->position.z, l->maxDistance);
-			rtLightUBO[i].radius	= l->radius;
+			rtLightUBO[i].position	= glm::vec4(position, lights.maxDistances[i]);
+			rtLightUBO[i].radius	= lights.radii[i];
 		}
 	}
 	memcpy(rtLightData, rtLightUBO, sizeof(rtLightUBO));
@@ -169,18 +180,20 @@ void VulkanEngine::update(const float dt)
 	std::memcpy(samplesData, &_samples, sizeof(int));
 	vmaUnmapMemory(_allocator, renderer->_shadowSamplesBuffer._allocation);
 
+	// Node matrices edited since the last frame, only their subtrees are recomputed
+	const bool nodesMoved = Prefab::update_transforms();
+	_scene->update_index(nodesMoved);
+
 	// TODO: MEMORY LEAK and update only when instances changed
 	// Rebuild instances matrix for TLAS
 	int instanceIndex = 0;
 	renderer->_tlas.clear();
-	for (Object* obj : _scene->_entities)
+	const ObjectStore& entities = _scene->_entities;
+	for (uint32_t i = 0; i < entities.size(); i++)
 	{
-		if (!obj->prefab->_root.empty())
+		for (Node* root : entities.prefabs[i]->_root)
 		{
-			for (Node* root : obj->prefab->_root)
-			{
-				root->node_to_instance(renderer->_tlas, instanceIndex, obj->m_matrix);
-			}
+			root->node_to_instance(renderer->_tlas, instanceIndex, entities.transforms[i]);
 		}
 	}
 	
@@ -276,11 +289,22 @@ void VulkanEngine::init_vulkan()
 		VK_KHR_SHADER_FLOAT_CONTROLS_EXTENSION_NAME
 	};
 
+	// Cluster culling writes several indirect draws per primitive
+	VkPhysicalDeviceFeatures required_features{};
+	required_features.multiDrawIndirect = VK_TRUE;
+	required_features.drawIndirectFirstInstance = VK_TRUE;	// Draw id of the geometry pass
+	required_features.samplerAnisotropy = VK_TRUE;
+	required_features.textureCompressionBC = VK_TRUE;
+	required_features.fragmentStoresAndAtomics = VK_TRUE;
+
 	vkb::PhysicalDeviceSelector selector{ vkb_inst };
 	vkb::PhysicalDevice physicalDevice = selector
 		.set_minimum_version(1, 1)
 		.set_surface(_surface)
 		.add_required_extensions(required_device_extensions)
+		.add_desired_extension(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)
+		.add_desired_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)
+		.set_required_features(required_features)
 		.select()
 		.value();
 
@@ -291,6 +315,14 @@ void VulkanEngine::init_vulkan()
 	std::vector<VkExtensionProperties> props(count);
 	vkEnumerateDeviceExtensionProperties(physicalDevice.physical_device, nullptr, &count, props.data());
 
+	for (const VkExtensionProperties& prop : props)
+	{
+		if (strcmp(prop.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0)
+			_drawIndirectCount = true;
+		if (strcmp(prop.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0)
+			_memoryBudget = true;
+	}
+
 	get_enabled_features();
 
 	vkb::Device vkbDevice = deviceBuilder.add_pNext(deviceCreatepNextChain).build().value();
@@ -309,6 +341,8 @@ void VulkanEngine::init_vulkan()
 	allocatorInfo.device			= _device;
 	allocatorInfo.instance			= _instance;
 	allocatorInfo.flags				= VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+	if (_memoryBudget)
+		allocatorInfo.flags			|= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 	vmaCreateAllocator(&allocatorInfo, &_allocator);
 
 	vkGetPhysicalDeviceProperties(_gpu, &_gpuProperties);
@@ -437,6 +471,8 @@ void VulkanEngine::init_ray_tracing()
 	vkGetPhysicalDeviceFeatures2(_gpu, &deviceFeatures2);
 
 	vkGetBufferDeviceAddressKHR = reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(vkGetDeviceProcAddr(_device, "vkGetBufferDeviceAddressKHR"));
+	if (_drawIndirectCount)
+		vkCmdDrawIndexedIndirectCountKHR = reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(vkGetDeviceProcAddr(_device, "vkCmdDrawIndexedIndirectCountKHR"));
 }
 
 void VulkanEngine::init_upload_commands()
@@ -579,6 +615,7 @@ void VulkanEngine::get_enabled_features()
 {
 	enabledIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
 	enabledIndexingFeatures.runtimeDescriptorArray = VK_TRUE;
+	enabledIndexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;	// Multi draws of the geometry pass mix materials
 	enabledIndexingFeatures.pNext = nullptr;
 
 	enabledBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
@@ -666,6 +703,30 @@ size_t VulkanEngine::pad_uniform_buffer_size(size_t originalSize)
 	return alignedSize;
 }
 
+bool VulkanEngine::get_memory_budget(VkDeviceSize& usage, VkDeviceSize& budget) const
+{
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {};
+	budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+	VkPhysicalDeviceMemoryProperties2 properties = {};
+	properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+	properties.pNext = _memoryBudget ? &budgetProperties : nullptr;
+	vkGetPhysicalDeviceMemoryProperties2(_gpu, &properties);
+
+	usage	= 0;
+	budget	= 0;
+	for (uint32_t i = 0; i < properties.memoryProperties.memoryHeapCount; i++)
+	{
+		if (!(properties.memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+			continue;
+
+		usage	+= _memoryBudget ? budgetProperties.heapUsage[i] : 0;
+		budget	+= _memoryBudget ? budgetProperties.heapBudget[i] : properties.memoryProperties.memoryHeaps[i].size / 10 * 8;
+	}
+
+	return _memoryBudget;
+}
+
 void VulkanEngine::updateFrame()
 {
 	static glm::mat4 refMatrix;
@@ -719,7 +780,8 @@ void VulkanEngine::updateCameraMatrices()
 
 	void* frameData;
 	vmaMapMemory(_allocator, renderer->_frameCountBuffer._allocation, &frameData);
-	memcpy(frameData, &_denoise_frame, sizeof(int));
+	int frameCount[2] = { _denoise_frame, _frameNumber };	// The denoiser alternates its light hashes by frame
+	memcpy(frameData, frameCount, sizeof(frameCount));
 	vmaUnmapMemory(_allocator, renderer->_frameCountBuffer._allocation);
 
 	// Copy RAY-TRACING camera, it need the inverse
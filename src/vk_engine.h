@@ -107,6 +107,8 @@ public:
 
 	Window *_window;
 	Scene* _scene;
+	int		_sceneIndex{ 0 };			// Set before init, from the command line
+	StressSceneSettings	_stressSettings;	// Knobs of scene 2
 
 	DeletionQueue _mainDeletionQueue;
 
@@ -168,6 +170,13 @@ public:
 
 	PFN_vkGetBufferDeviceAddressKHR						vkGetBufferDeviceAddressKHR;
 
+	// Compacted indirect draws, falls back to plain indirect draws when missing
+	bool												_drawIndirectCount{ false };
+	PFN_vkCmdDrawIndexedIndirectCountKHR				vkCmdDrawIndexedIndirectCountKHR;
+
+	// Heap usage and budget reported by the driver, otherwise only the heap sizes are known
+	bool												_memoryBudget{ false };
+
 	VkCommandPool	_commandPool;
 
 	AllocatedBuffer transformBuffer;
@@ -187,6 +196,9 @@ public:
 
 	size_t pad_uniform_buffer_size(size_t originalSize);
 
+	// Summed over the device local heaps. Returns false when the usage is unknown, the budget is then a share of the heap sizes
+	bool get_memory_budget(VkDeviceSize& usage, VkDeviceSize& budget) const;
+
 	void create_attachment(VkFormat format, VkImageUsageFlagBits usage, Texture* texture);
 
 	// Loads a shader module from a SPIR-V file
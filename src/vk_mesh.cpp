@@ -3,6 +3,11 @@
 #include "vk_initializers.h"
 #include "vk_engine.h"
 #include "vk_utils.h"
+#include "job_system.h"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_set>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -14,6 +19,7 @@
 
 extern std::vector<std::string> searchPaths;
 std::unordered_map<std::string, Mesh*> Mesh::_loadedMeshes;
+std::vector<Mesh*> Mesh::_meshes;
 std::unordered_map<std::string, Prefab*> Prefab::_prefabsMap;
 std::vector<Material*> Material::_materials;
 
@@ -82,10 +88,7 @@ Mesh* Mesh::GET(const char* filename)
 	
 	if(!_loadedMeshes[name])
 	{
-		Mesh* mesh = new Mesh();
-		mesh->load_from_obj(name.c_str());
-		_loadedMeshes[name] = mesh;
-		return mesh;
+		return insert(name, load(name));
 	}
 	else
 	{
@@ -93,6 +96,36 @@ Mesh* Mesh::GET(const char* filename)
 	}
 }
 
+Mesh* Mesh::load(const std::string& filename)
+{
+	Mesh* mesh = new Mesh();
+	if (!mesh->load_from_obj(filename.c_str()))
+	{
+		delete mesh;
+		return nullptr;
+	}
+
+	return mesh;
+}
+
+Mesh* Mesh::insert(const std::string& name, Mesh* mesh)
+{
+	auto it = _loadedMeshes.find(name);
+	if (it != _loadedMeshes.end() && it->second)
+	{
+		// Loaded meanwhile through GET, this copy never reached the GPU
+		delete mesh;
+		return it->second;
+	}
+
+	if (!mesh)
+		return nullptr;
+
+	mesh->upload();
+	_loadedMeshes[name] = mesh;
+	return mesh;
+}
+
 bool Mesh::load_from_obj(const char* filename)
 {
 	tinyobj::attrib_t attrib;
@@ -152,8 +185,9 @@ bool Mesh::load_from_obj(const char* filename)
 		}
 	}
 
-	// upload mesh
-	upload();
+	// Triangle and vertex order, then the level of detail chain before the index buffer goes to the GPU
+	optimize_indices(filename, 0, static_cast<uint32_t>(_indices.size()));
+	build_lods(0, static_cast<uint32_t>(_indices.size()));
 
 	return true;
 }
@@ -262,6 +296,52 @@ Mesh* Mesh::get_cube()
 	return _loadedMeshes["cube"];
 }
 
+Mesh* Mesh::get_sphere(const uint32_t segments)
+{
+	const std::string name = "sphere_" + std::to_string(segments);
+	if (!_loadedMeshes[name])
+	{
+		Mesh* mesh = new Mesh();
+
+		const uint32_t rings = std::max(segments / 2, 2u);
+		const float pi = 3.14159265359f;
+		for (uint32_t r = 0; r <= rings; r++)
+		{
+			const float v		= static_cast<float>(r) / rings;
+			const float theta	= v * pi;
+			for (uint32_t s = 0; s <= segments; s++)
+			{
+				const float u	= static_cast<float>(s) / segments;
+				const float phi	= u * 2.0f * pi;
+				const glm::vec3 position = { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) };
+				mesh->_vertices.push_back({ position, position, {1.0f, 1.0f, 1.0f}, {u, v} });
+			}
+		}
+
+		// Counter clockwise seen from outside, like the OBJ meshes, so the meshlet cones point out
+		const uint32_t stride = segments + 1;
+		for (uint32_t r = 0; r < rings; r++)
+		{
+			for (uint32_t s = 0; s < segments; s++)
+			{
+				const uint32_t a = r * stride + s;
+				const uint32_t b = a + stride;
+				if (r > 0)
+					mesh->_indices.insert(mesh->_indices.end(), { a, a + 1, b });
+				if (r < rings - 1)
+					mesh->_indices.insert(mesh->_indices.end(), { a + 1, b + 1, b });
+			}
+		}
+
+		mesh->upload();
+		_loadedMeshes[name] = mesh;
+
+		return mesh;
+	}
+
+	return _loadedMeshes[name];
+}
+
 void Mesh::create_vertex_buffer()
 {
 	const size_t bufferSize = _vertices.size() * sizeof(Vertex);
@@ -358,10 +438,91 @@ void Mesh::create_index_buffer()
 	vmaDestroyBuffer(VulkanEngine::engine->_allocator, stagingBuffer._buffer, stagingBuffer._allocation);
 }
 
+void Mesh::create_rt_attributes_buffer()
+{
+	// Texel density sqrt(uv area / object area) around each vertex, hit shaders use it to pick
+	// a mip level from the ray cone since there are no derivatives in ray tracing stages
+	std::vector<float> uvArea(_vertices.size(), 0.0f);
+	std::vector<float> objectArea(_vertices.size(), 0.0f);
+	for (size_t i = 0; i + 2 < _indices.size(); i += 3)
+	{
+		const Vertex& v0 = _vertices[_indices[i]];
+		const Vertex& v1 = _vertices[_indices[i + 1]];
+		const Vertex& v2 = _vertices[_indices[i + 2]];
+
+		const glm::vec2 e1 = v1.uv - v0.uv;
+		const glm::vec2 e2 = v2.uv - v0.uv;
+		const float triUvArea		= std::abs(e1.x * e2.y - e2.x * e1.y);
+		const float triObjectArea	= glm::length(glm::cross(v1.position - v0.position, v2.position - v0.position));
+
+		for (size_t j = 0; j < 3; j++)
+		{
+			uvArea[_indices[i + j]]		+= triUvArea;
+			objectArea[_indices[i + j]]	+= triObjectArea;
+		}
+	}
+
+	std::vector<rtVertexAttribute> vAttr;
+	vAttr.reserve(_vertices.size());
+	for (size_t i = 0; i < _vertices.size(); i++) {
+		const Vertex& v = _vertices[i];
+		const float texelDensity = objectArea[i] > 0.0f ? std::sqrt(uvArea[i] / objectArea[i]) : 0.0f;
+		vAttr.push_back({ {v.normal.x, v.normal.y, v.normal.z, 1}, {v.color.x, v.color.y, v.color.z, 1}, {v.uv.x, v.uv.y, texelDensity, 1} });
+	}
+
+	const size_t bufferSize = vAttr.size() * sizeof(rtVertexAttribute);
+	VkBufferCreateInfo stagingBufferInfo = vkinit::buffer_create_info(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+
+	VmaAllocationCreateInfo vmaAllocInfo = {};
+	vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+
+	AllocatedBuffer stagingBuffer;
+
+	VK_CHECK(vmaCreateBuffer(VulkanEngine::engine->_allocator, &stagingBufferInfo, &vmaAllocInfo,
+		&stagingBuffer._buffer,
+		&stagingBuffer._allocation,
+		nullptr));
+
+	void* data;
+	vmaMapMemory(VulkanEngine::engine->_allocator, stagingBuffer._allocation, &data);
+	memcpy(data, vAttr.data(), bufferSize);
+	vmaUnmapMemory(VulkanEngine::engine->_allocator, stagingBuffer._allocation);
+
+	vmaAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	VkBufferCreateInfo attributesBufferInfo = vkinit::buffer_create_info(bufferSize,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+	VK_CHECK(vmaCreateBuffer(VulkanEngine::engine->_allocator, &attributesBufferInfo, &vmaAllocInfo,
+		&_rtAttributesBuffer._buffer,
+		&_rtAttributesBuffer._allocation,
+		nullptr));
+
+	// Copy attribute data
+	VulkanEngine::engine->immediate_submit([=](VkCommandBuffer cmd) {
+		VkBufferCopy copy;
+		copy.dstOffset = 0;
+		copy.srcOffset = 0;
+		copy.size = bufferSize;
+		vkCmdCopyBuffer(cmd, stagingBuffer._buffer, _rtAttributesBuffer._buffer, 1, &copy);
+		});
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vmaDestroyBuffer(VulkanEngine::engine->_allocator, this->_rtAttributesBuffer._buffer, this->_rtAttributesBuffer._allocation);
+		});
+
+	vmaDestroyBuffer(VulkanEngine::engine->_allocator, stagingBuffer._buffer, stagingBuffer._allocation);
+}
+
 void Mesh::upload()
 {
 	create_vertex_buffer();
 	create_index_buffer();
+	create_rt_attributes_buffer();
+
+	// Meshes are shared between entities, the ray tracing descriptors are indexed by this id
+	_id = static_cast<uint32_t>(_meshes.size());
+	_meshes.push_back(this);
 }
 
 BlasInput Mesh::mesh_to_geometry()
@@ -372,7 +533,9 @@ BlasInput Mesh::mesh_to_geometry()
 	vertexBufferDeviceAddress.deviceAddress = VulkanEngine::engine->getBufferDeviceAddress(_vertexBuffer._buffer);
 	indexBufferDeviceAddress.deviceAddress	= VulkanEngine::engine->getBufferDeviceAddress(_indexBuffer._buffer);
 
-	const uint32_t nTriangles = _indices.size() / 3;
+	// Only the full resolution range, coarser levels are appended after it
+	auto lods = _lodRanges.find(0);
+	const uint32_t nTriangles = (lods != _lodRanges.end() ? lods->second[0].indexCount : static_cast<uint32_t>(_indices.size())) / 3;
 
 	// Set the triangles geometry
 	VkAccelerationStructureGeometryTrianglesDataKHR triangles{};
@@ -405,6 +568,634 @@ BlasInput Mesh::mesh_to_geometry()
 	return input;
 }
 
+glm::uvec2 Mesh::build_meshlets(const uint32_t firstIndex, const uint32_t indexCount)
+{
+	auto add_meshlet = [&](const uint32_t first, const uint32_t count)
+	{
+		// Bounding sphere around the meshlet AABB
+		glm::vec3 min(std::numeric_limits<float>::max());
+		glm::vec3 max(-std::numeric_limits<float>::max());
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			min = glm::min(min, _vertices[_indices[i]].position);
+			max = glm::max(max, _vertices[_indices[i]].position);
+		}
+		const glm::vec3 center = (min + max) * 0.5f;
+		float radius = 0.0f;
+		for (uint32_t i = first; i < first + count; i++)
+			radius = std::max(radius, glm::length(_vertices[_indices[i]].position - center));
+
+		// Normal cone from the face normals, oriented as the shading normals
+		std::vector<glm::vec3> normals;
+		normals.reserve(count / 3);
+		glm::vec3 axis(0.0f);
+		for (uint32_t i = first; i + 2 < first + count; i += 3)
+		{
+			const Vertex& v0 = _vertices[_indices[i + 0]];
+			const Vertex& v1 = _vertices[_indices[i + 1]];
+			const Vertex& v2 = _vertices[_indices[i + 2]];
+			glm::vec3 n = glm::cross(v1.position - v0.position, v2.position - v0.position);
+			const float length = glm::length(n);
+			if (length == 0.0f)
+				continue;
+			n /= length;
+			if (glm::dot(n, v0.normal + v1.normal + v2.normal) < 0.0f)
+				n = -n;
+			normals.push_back(n);
+			axis += n;
+		}
+
+		float cutoff = 1.0f;
+		if (!normals.empty() && glm::length(axis) > 0.0f)
+		{
+			axis = glm::normalize(axis);
+			float minDot = 1.0f;
+			for (const glm::vec3& n : normals)
+				minDot = std::min(minDot, glm::dot(axis, n));
+			// Cones wider than a hemisphere are never fully back facing
+			if (minDot > 0.0f)
+				cutoff = std::sqrt(1.0f - minDot * minDot);
+		}
+
+		_meshlets.push_back({ glm::vec4(center, radius), glm::vec4(axis, cutoff), first, count });
+	};
+
+	const uint32_t firstMeshlet = static_cast<uint32_t>(_meshlets.size());
+
+	// Greedy split following the index order, the index buffer is left untouched
+	std::vector<uint32_t> meshletVertices;
+	meshletVertices.reserve(MESHLET_MAX_VERTICES);
+	const uint32_t lastIndex	= firstIndex + indexCount;
+	uint32_t meshletStart		= firstIndex;
+	uint32_t i					= firstIndex;
+	for (; i + 2 < lastIndex; i += 3)
+	{
+		uint32_t newVertices = 0;
+		for (uint32_t v = 0; v < 3; v++)
+		{
+			const uint32_t index = _indices[i + v];
+			const bool repeated = (v > 0 && _indices[i] == index) || (v > 1 && _indices[i + 1] == index);
+			if (!repeated && std::find(meshletVertices.begin(), meshletVertices.end(), index) == meshletVertices.end())
+				newVertices++;
+		}
+
+		if (meshletVertices.size() + newVertices > MESHLET_MAX_VERTICES || (i - meshletStart) / 3 >= MESHLET_MAX_TRIANGLES)
+		{
+			add_meshlet(meshletStart, i - meshletStart);
+			meshletVertices.clear();
+			meshletStart = i;
+		}
+
+		for (uint32_t v = 0; v < 3; v++)
+		{
+			if (std::find(meshletVertices.begin(), meshletVertices.end(), _indices[i + v]) == meshletVertices.end())
+				meshletVertices.push_back(_indices[i + v]);
+		}
+	}
+	if (i > meshletStart)
+		add_meshlet(meshletStart, i - meshletStart);
+
+	return glm::uvec2(firstMeshlet, static_cast<uint32_t>(_meshlets.size()) - firstMeshlet);
+}
+
+void Mesh::get_bounds(const uint32_t firstIndex, const uint32_t indexCount, glm::vec3& min, glm::vec3& max) const
+{
+	min = glm::vec3(std::numeric_limits<float>::max());
+	max = glm::vec3(-std::numeric_limits<float>::max());
+	for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++)
+	{
+		min = glm::min(min, _vertices[_indices[i]].position);
+		max = glm::max(max, _vertices[_indices[i]].position);
+	}
+}
+
+const std::vector<MeshLod>& Mesh::build_lods(const uint32_t firstIndex, const uint32_t indexCount)
+{
+	// Same index range already processed, e.g. an OBJ mesh shared by several prefabs
+	auto cached = _lodRanges.find(firstIndex);
+	if (cached != _lodRanges.end())
+		return cached->second;
+
+	// Bounding sphere around the full resolution AABB, shared by every level
+	glm::vec3 min, max;
+	get_bounds(firstIndex, indexCount, min, max);
+	const glm::vec3 center = (min + max) * 0.5f;
+	float radius = 0.0f;
+	for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++)
+		radius = std::max(radius, glm::length(_vertices[_indices[i]].position - center));
+	const glm::vec4 sphere(center, radius);
+
+	std::vector<MeshLod>& lods = _lodRanges[firstIndex];
+	glm::uvec2 meshlets = build_meshlets(firstIndex, indexCount);
+	lods.push_back({ firstIndex, indexCount, meshlets.x, meshlets.y, 0.0f, sphere });
+
+	// Levels are appended to the index buffer, not possible once it lives on the GPU
+	if (_indexBuffer._buffer != VK_NULL_HANDLE)
+		return lods;
+
+	std::vector<uint32_t> indices(_indices.begin() + firstIndex, _indices.begin() + firstIndex + indexCount);
+	float error = 0.0f;
+	while (lods.size() < MAX_MESH_LODS && indices.size() / 3 > MIN_LOD_TRIANGLES)
+	{
+		float levelError = 0.0f;
+		std::vector<uint32_t> simplified = simplify(indices, indices.size() / 2, levelError);
+
+		// Stop once the simplifier gets stuck, e.g. on a mesh made of locked borders
+		if (simplified.empty() || simplified.size() * 20 > indices.size() * 17)
+			break;
+
+		// Each level is measured against the previous one, accumulate to bound the total
+		error += levelError;
+
+		const uint32_t first = static_cast<uint32_t>(_indices.size());
+		const uint32_t count = static_cast<uint32_t>(simplified.size());
+		_indices.insert(_indices.end(), simplified.begin(), simplified.end());
+		optimize_vertex_cache(first, count);
+		meshlets = build_meshlets(first, count);
+		lods.push_back({ first, count, meshlets.x, meshlets.y, error, sphere });
+
+		indices.swap(simplified);
+	}
+
+	return lods;
+}
+
+void Mesh::optimize_indices(const std::string& name, const uint32_t firstIndex, const uint32_t indexCount)
+{
+	if (indexCount < 3)
+		return;
+
+	const VertexCacheStats before = analyze_vertex_cache(firstIndex, indexCount);
+	optimize_vertex_cache(firstIndex, indexCount);
+	optimize_vertex_fetch(firstIndex, indexCount);
+	const VertexCacheStats after = analyze_vertex_cache(firstIndex, indexCount);
+
+	std::cout << "Index optimization " << name << " (" << indexCount / 3 << " triangles): ACMR "
+		<< before.acmr << " -> " << after.acmr << ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
+}
+
+VertexCacheStats Mesh::analyze_vertex_cache(const uint32_t firstIndex, const uint32_t indexCount) const
+{
+	// FIFO cache of the last transformed vertices, as most hardware behaves
+	std::vector<uint32_t> cache;
+	std::unordered_map<uint32_t, bool> referenced;
+	uint32_t misses = 0;
+	for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++)
+	{
+		const uint32_t index = _indices[i];
+		referenced[index] = true;
+		if (std::find(cache.begin(), cache.end(), index) != cache.end())
+			continue;
+		misses++;
+		cache.push_back(index);
+		if (cache.size() > VERTEX_CACHE_SIZE)
+			cache.erase(cache.begin());
+	}
+
+	VertexCacheStats stats;
+	stats.acmr = indexCount >= 3 ? float(misses) / float(indexCount / 3) : 0.0f;
+	stats.atvr = referenced.empty() ? 0.0f : float(misses) / float(referenced.size());
+	return stats;
+}
+
+void Mesh::optimize_vertex_cache(const uint32_t firstIndex, const uint32_t indexCount)
+{
+	// Tipsify (Sander et al. 2007): fan around the vertex that is most likely still in the cache,
+	// then sort the resulting clusters so outward facing ones are drawn first to reduce overdraw
+	const uint32_t nTriangles = indexCount / 3;
+	if (nTriangles < 2)
+		return;
+
+	const uint32_t* indices = &_indices[firstIndex];
+	uint32_t firstVertex = std::numeric_limits<uint32_t>::max(), lastVertex = 0;
+	for (uint32_t i = 0; i < nTriangles * 3; i++)
+	{
+		firstVertex = std::min(firstVertex, indices[i]);
+		lastVertex = std::max(lastVertex, indices[i]);
+	}
+	const uint32_t nVertices = lastVertex - firstVertex + 1;
+
+	// Triangles around each vertex
+	std::vector<uint32_t> adjacencyOffsets(nVertices + 1, 0);
+	std::vector<uint32_t> adjacency(nTriangles * 3);
+	for (uint32_t i = 0; i < nTriangles * 3; i++)
+		adjacencyOffsets[indices[i] - firstVertex + 1]++;
+	for (uint32_t v = 0; v < nVertices; v++)
+		adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+	{
+		std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (uint32_t i = 0; i < nTriangles * 3; i++)
+			adjacency[fill[indices[i] - firstVertex]++] = i / 3;
+	}
+
+	std::vector<uint32_t> liveTriangles(nVertices);
+	for (uint32_t v = 0; v < nVertices; v++)
+		liveTriangles[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+
+	std::vector<uint32_t> cacheTime(nVertices, 0);
+	std::vector<bool> emitted(nTriangles, false);
+	std::vector<uint32_t> deadEnd;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> order;				// Triangles in output order
+	std::vector<uint32_t> clusterStarts;		// Positions in order where the cache went cold
+	order.reserve(nTriangles);
+
+	uint32_t time = VERTEX_CACHE_SIZE + 1;
+	uint32_t cursor = 0;
+	int32_t fan = 0;
+	while (fan >= 0)
+	{
+		candidates.clear();
+		for (uint32_t a = adjacencyOffsets[fan]; a < adjacencyOffsets[fan + 1]; a++)
+		{
+			const uint32_t t = adjacency[a];
+			if (emitted[t])
+				continue;
+			emitted[t] = true;
+			order.push_back(t);
+			for (uint32_t k = 0; k < 3; k++)
+			{
+				const uint32_t v = indices[t * 3 + k] - firstVertex;
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				liveTriangles[v]--;
+				if (time - cacheTime[v] > VERTEX_CACHE_SIZE)
+					cacheTime[v] = time++;
+			}
+		}
+
+		// Next fan: the candidate that will still be cached once its triangles are emitted
+		fan = -1;
+		int32_t bestPriority = -1;
+		for (const uint32_t v : candidates)
+		{
+			if (liveTriangles[v] == 0)
+				continue;
+			int32_t priority = 0;
+			if (time - cacheTime[v] + 2 * liveTriangles[v] <= VERTEX_CACHE_SIZE)
+				priority = static_cast<int32_t>(time - cacheTime[v]);
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fan = static_cast<int32_t>(v);
+			}
+		}
+		if (fan >= 0)
+			continue;
+
+		// Dead end, restart from recently used vertices or scan for any vertex left
+		clusterStarts.push_back(static_cast<uint32_t>(order.size()));
+		while (!deadEnd.empty() && fan < 0)
+		{
+			const uint32_t v = deadEnd.back();
+			deadEnd.pop_back();
+			if (liveTriangles[v] > 0)
+				fan = static_cast<int32_t>(v);
+		}
+		while (fan < 0 && cursor < nVertices)
+		{
+			if (liveTriangles[cursor] > 0)
+				fan = static_cast<int32_t>(cursor);
+			cursor++;
+		}
+	}
+
+	// Clusters sorted by how much they face away from the mesh center, outer surfaces occlude the inner ones
+	struct Cluster
+	{
+		uint32_t	begin;
+		uint32_t	end;
+		float		sort;
+	};
+	std::vector<Cluster> clusters;
+	uint32_t begin = 0;
+	for (const uint32_t end : clusterStarts)
+	{
+		if (end > begin)
+			clusters.push_back({ begin, end, 0.0f });
+		begin = end;
+	}
+	if (begin < order.size())
+		clusters.push_back({ begin, static_cast<uint32_t>(order.size()), 0.0f });
+
+	auto position = [&](const uint32_t t, const uint32_t k) -> const glm::vec3& { return _vertices[indices[t * 3 + k]].position; };
+
+	glm::vec3 meshCenter(0.0f);
+	float meshArea = 0.0f;
+	for (uint32_t t = 0; t < nTriangles; t++)
+	{
+		const float area = glm::length(glm::cross(position(t, 1) - position(t, 0), position(t, 2) - position(t, 0)));
+		meshCenter += (position(t, 0) + position(t, 1) + position(t, 2)) / 3.0f * area;
+		meshArea += area;
+	}
+	if (meshArea > 0.0f)
+		meshCenter /= meshArea;
+
+	for (Cluster& cluster : clusters)
+	{
+		glm::vec3 center(0.0f), normal(0.0f);
+		float area = 0.0f;
+		for (uint32_t o = cluster.begin; o < cluster.end; o++)
+		{
+			const uint32_t t = order[o];
+			const glm::vec3 n = glm::cross(position(t, 1) - position(t, 0), position(t, 2) - position(t, 0));
+			const float a = glm::length(n);
+			center += (position(t, 0) + position(t, 1) + position(t, 2)) / 3.0f * a;
+			normal += n;
+			area += a;
+		}
+		if (area > 0.0f && glm::length(normal) > 0.0f)
+			cluster.sort = glm::dot(center / area - meshCenter, glm::normalize(normal));
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.sort > b.sort; });
+
+	std::vector<uint32_t> result;
+	result.reserve(nTriangles * 3);
+	for (const Cluster& cluster : clusters)
+	{
+		for (uint32_t o = cluster.begin; o < cluster.end; o++)
+		{
+			for (uint32_t k = 0; k < 3; k++)
+				result.push_back(indices[order[o] * 3 + k]);
+		}
+	}
+	std::copy(result.begin(), result.end(), _indices.begin() + firstIndex);
+}
+
+void Mesh::optimize_vertex_fetch(const uint32_t firstIndex, const uint32_t indexCount)
+{
+	// Vertices renumbered in order of first use inside the range they already occupy,
+	// the ranges of other primitives are not touched
+	uint32_t firstVertex = std::numeric_limits<uint32_t>::max(), lastVertex = 0;
+	for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++)
+	{
+		firstVertex = std::min(firstVertex, _indices[i]);
+		lastVertex = std::max(lastVertex, _indices[i]);
+	}
+	if (firstVertex > lastVertex)
+		return;
+
+	const uint32_t nVertices = lastVertex - firstVertex + 1;
+	const uint32_t unused = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> remap(nVertices, unused);
+	uint32_t next = 0;
+	for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++)
+	{
+		uint32_t& target = remap[_indices[i] - firstVertex];
+		if (target == unused)
+			target = next++;
+		_indices[i] = firstVertex + target;
+	}
+	// Unreferenced vertices keep their relative order at the end of the range
+	for (uint32_t& target : remap)
+	{
+		if (target == unused)
+			target = next++;
+	}
+
+	std::vector<Vertex> vertices(_vertices.begin() + firstVertex, _vertices.begin() + firstVertex + nVertices);
+	for (uint32_t v = 0; v < nVertices; v++)
+		_vertices[firstVertex + remap[v]] = vertices[v];
+}
+
+// Symmetric 4x4 error quadric, squared distance to a set of planes
+struct Quadric
+{
+	double xx{ 0 }, xy{ 0 }, xz{ 0 }, yy{ 0 }, yz{ 0 }, zz{ 0 };
+	double xw{ 0 }, yw{ 0 }, zw{ 0 }, ww{ 0 };
+
+	Quadric() = default;
+	Quadric(const glm::vec3& n, const float d) :
+		xx(n.x * n.x), xy(n.x * n.y), xz(n.x * n.z), yy(n.y * n.y), yz(n.y * n.z), zz(n.z * n.z),
+		xw(n.x * d), yw(n.y * d), zw(n.z * d), ww(d * d) {}
+
+	Quadric& operator+=(const Quadric& q)
+	{
+		xx += q.xx; xy += q.xy; xz += q.xz; yy += q.yy; yz += q.yz; zz += q.zz;
+		xw += q.xw; yw += q.yw; zw += q.zw; ww += q.ww;
+		return *this;
+	}
+
+	float evaluate(const glm::vec3& p) const
+	{
+		const double e =
+			xx * p.x * p.x + yy * p.y * p.y + zz * p.z * p.z +
+			2.0 * (xy * p.x * p.y + xz * p.x * p.z + yz * p.y * p.z) +
+			2.0 * (xw * p.x + yw * p.y + zw * p.z) + ww;
+		return static_cast<float>(std::max(e, 0.0));
+	}
+};
+
+std::vector<uint32_t> Mesh::simplify(const std::vector<uint32_t>& indices, const size_t targetIndexCount, float& error)
+{
+	// Quadric edge collapse restricted to existing vertices: a vertex is always moved onto
+	// one of its neighbours so every level indexes the same vertex buffer.
+
+	// Local numbering of the referenced vertices, vertices sharing a position are welded
+	// so seams in normals or uvs collapse together instead of tearing apart
+	std::unordered_map<uint32_t, uint32_t> localIndex;
+	std::unordered_map<glm::vec3, uint32_t> positions;
+	std::vector<uint32_t> globalIndex;
+	std::vector<uint32_t> weld;
+	std::vector<uint32_t> corners(indices.size());
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		auto it = localIndex.find(indices[i]);
+		if (it == localIndex.end())
+		{
+			const uint32_t local = static_cast<uint32_t>(globalIndex.size());
+			it = localIndex.emplace(indices[i], local).first;
+			globalIndex.push_back(indices[i]);
+			weld.push_back(positions.emplace(_vertices[indices[i]].position, local).first->second);
+		}
+		corners[i] = it->second;
+	}
+
+	const size_t nVertices = globalIndex.size();
+	auto position = [&](const uint32_t v) -> const glm::vec3& { return _vertices[globalIndex[v]].position; };
+
+	// Collapse targets, followed until a vertex maps onto itself
+	std::vector<uint32_t> remap(nVertices);
+	for (uint32_t v = 0; v < nVertices; v++)
+		remap[v] = v;
+	auto find = [&](uint32_t v)
+	{
+		while (remap[v] != v)
+			v = remap[v] = remap[remap[v]];
+		return v;
+	};
+
+	// Plane quadrics and open borders of the welded vertices
+	std::vector<Quadric> quadrics(nVertices);
+	std::vector<bool> locked(nVertices, false);
+	std::unordered_map<uint64_t, uint32_t> edgeUses;
+	for (size_t i = 0; i + 2 < corners.size(); i += 3)
+	{
+		const uint32_t v[3] = { weld[corners[i]], weld[corners[i + 1]], weld[corners[i + 2]] };
+		glm::vec3 n = glm::cross(position(v[1]) - position(v[0]), position(v[2]) - position(v[0]));
+		const float length = glm::length(n);
+		if (length > 0.0f)
+		{
+			n /= length;
+			const Quadric q(n, -glm::dot(n, position(v[0])));
+			for (uint32_t k = 0; k < 3; k++)
+				quadrics[v[k]] += q;
+		}
+		for (uint32_t k = 0; k < 3; k++)
+		{
+			const uint32_t a = std::min(v[k], v[(k + 1) % 3]), b = std::max(v[k], v[(k + 1) % 3]);
+			edgeUses[(uint64_t(a) << 32) | b]++;
+		}
+	}
+	// Border and non manifold vertices stay in place so holes do not grow
+	for (const auto& edge : edgeUses)
+	{
+		if (edge.second != 2)
+		{
+			locked[edge.first >> 32] = true;
+			locked[edge.first & 0xFFFFFFFF] = true;
+		}
+	}
+
+	struct Collapse
+	{
+		uint32_t	from;
+		uint32_t	to;
+		float		cost;
+	};
+
+	const size_t targetTriangles = targetIndexCount / 3;
+	std::vector<uint64_t> edges;
+	std::vector<Collapse> collapses;
+	std::vector<uint32_t> adjacencyOffsets(nVertices + 1);
+	std::vector<uint32_t> adjacency;
+	std::vector<bool> touched(nVertices);
+	float maxCost = 0.0f;
+
+	while (corners.size() / 3 > targetTriangles)
+	{
+		// Unique edges of the current triangles
+		edges.clear();
+		for (size_t i = 0; i + 2 < corners.size(); i += 3)
+		{
+			for (uint32_t k = 0; k < 3; k++)
+			{
+				const uint32_t a = weld[corners[i + k]], b = weld[corners[i + (k + 1) % 3]];
+				edges.push_back((uint64_t(std::min(a, b)) << 32) | std::max(a, b));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+		// Cheapest direction of every edge
+		collapses.clear();
+		for (const uint64_t edge : edges)
+		{
+			const uint32_t a = static_cast<uint32_t>(edge >> 32), b = static_cast<uint32_t>(edge & 0xFFFFFFFF);
+			if (locked[a] && locked[b])
+				continue;
+			Quadric q = quadrics[a];
+			q += quadrics[b];
+			const float costAB = locked[a] ? std::numeric_limits<float>::max() : q.evaluate(position(b));
+			const float costBA = locked[b] ? std::numeric_limits<float>::max() : q.evaluate(position(a));
+			collapses.push_back(costAB <= costBA ? Collapse{ a, b, costAB } : Collapse{ b, a, costBA });
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+		// Triangles around each welded vertex
+		std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+		for (const uint32_t c : corners)
+			adjacencyOffsets[weld[c] + 1]++;
+		for (size_t v = 0; v < nVertices; v++)
+			adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+		adjacency.resize(corners.size());
+		{
+			std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+			for (size_t i = 0; i < corners.size(); i++)
+				adjacency[fill[weld[corners[i]]]++] = static_cast<uint32_t>(i / 3);
+		}
+
+		// Independent collapses, the one ring of a collapsed vertex is frozen for this pass
+		std::fill(touched.begin(), touched.end(), false);
+		size_t triangles = corners.size() / 3;
+		size_t collapsed = 0;
+		for (const Collapse& c : collapses)
+		{
+			if (triangles <= targetTriangles)
+				break;
+			if (touched[c.from] || touched[c.to])
+				continue;
+
+			// Reject collapses that flip a remaining triangle
+			bool flips = false;
+			size_t removed = 0;
+			for (uint32_t a = adjacencyOffsets[c.from]; a < adjacencyOffsets[c.from + 1] && !flips; a++)
+			{
+				const uint32_t t = adjacency[a] * 3;
+				const uint32_t v[3] = { weld[corners[t]], weld[corners[t + 1]], weld[corners[t + 2]] };
+				if (v[0] == c.to || v[1] == c.to || v[2] == c.to)
+				{
+					removed++;
+					continue;
+				}
+				glm::vec3 p[3] = { position(v[0]), position(v[1]), position(v[2]) };
+				const glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				for (uint32_t k = 0; k < 3; k++)
+				{
+					if (v[k] == c.from)
+						p[k] = position(c.to);
+				}
+				const glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+				flips = glm::dot(before, after) <= 0.0f;
+			}
+			if (flips)
+				continue;
+
+			remap[c.from] = c.to;
+			quadrics[c.to] += quadrics[c.from];
+			maxCost = std::max(maxCost, c.cost);
+			triangles -= removed;
+			collapsed++;
+
+			for (uint32_t a = adjacencyOffsets[c.from]; a < adjacencyOffsets[c.from + 1]; a++)
+			{
+				const uint32_t t = adjacency[a] * 3;
+				for (uint32_t k = 0; k < 3; k++)
+					touched[weld[corners[t + k]]] = true;
+			}
+		}
+
+		if (collapsed == 0)
+			break;
+
+		// Move collapsed corners onto their target and drop the degenerate triangles
+		size_t write = 0;
+		for (size_t i = 0; i + 2 < corners.size(); i += 3)
+		{
+			uint32_t v[3];
+			for (uint32_t k = 0; k < 3; k++)
+			{
+				const uint32_t target = find(weld[corners[i + k]]);
+				v[k] = target == weld[corners[i + k]] ? corners[i + k] : target;
+			}
+			if (weld[v[0]] == weld[v[1]] || weld[v[1]] == weld[v[2]] || weld[v[0]] == weld[v[2]])
+				continue;
+			corners[write++] = v[0];
+			corners[write++] = v[1];
+			corners[write++] = v[2];
+		}
+		corners.resize(write);
+	}
+
+	// Quadrics sum squared plane distances, the root bounds the distance to any of them
+	error = std::sqrt(maxCost);
+
+	std::vector<uint32_t> result(corners.size());
+	for (size_t i = 0; i < corners.size(); i++)
+		result[i] = globalIndex[corners[i]];
+	return result;
+}
+
 void Node::addChild(Node* child)
 {
 	assert(child->_parent == NULL);
@@ -412,15 +1203,6 @@ void Node::addChild(Node* child)
 	child->_parent = this;
 }
 
-glm::mat4 Node::getGlobalMatrix(bool fast)
-{
-	if (_parent)
-		_global_matrix = (fast ? _parent->_matrix : _parent->getGlobalMatrix()) * _matrix;
-	else
-		_global_matrix = _matrix;
-	return _global_matrix;
-}
-
 void Node::node_to_geometry(
 	std::vector<BlasInput>& blasVector,
 	const VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress,
@@ -473,7 +1255,7 @@ void Node::node_to_instance(std::vector<TlasInstance>& instances, int& index, gl
 {
 	if (!_primitives.empty())
 	{
-		glm::mat4 matrix = model * getGlobalMatrix(false);
+		glm::mat4 matrix = model * getGlobalMatrix();
 		for (auto& prim : _primitives)
 		{
 			TlasInstance instance{};
@@ -518,31 +1300,23 @@ void Node::fill_matrix_buffer(std::vector<glm::mat4>& buffer, const glm::mat4 mo
 		n->fill_matrix_buffer(buffer, model);
 }
 
-void Node::fill_index_buffer(std::vector<glm::vec4>& buffer)
+void Node::fill_index_buffer(std::vector<glm::vec4>& buffer, const uint32_t meshID)
 {
 	if (!_primitives.empty())
 	{
 		for (const auto& prim : _primitives)
 		{
-			glm::vec4 aux = glm::vec4(prim->instanceID, prim->materialID, prim->transformID, prim->firstIndex);
+			glm::vec4 aux = glm::vec4(meshID, prim->materialID, prim->transformID, prim->firstIndex);
 			buffer.push_back(aux);
 		}
 	}
 	for (Node* n : _children)
-		n->fill_index_buffer(buffer);
+		n->fill_index_buffer(buffer, meshID);
 }
 
-void Node::addMaterial(Material* mat)
+void Node::addMaterial(const Material& mat)
 {
-	if (Material::exists(mat))
-	{
-		_primitives[0]->materialID = Material::getIndex(mat);
-	}
-	else
-	{
-		Material::_materials.push_back(mat);
-		_primitives[0]->materialID = Material::_materials.size() - 1;
-	}
+	_primitives[0]->materialID = Material::intern(mat);
 }
 
 BlasInput Prefab::primitive_to_geometry(const Primitive& p)
@@ -586,30 +1360,6 @@ BlasInput Prefab::primitive_to_geometry(const Primitive& p)
 	return input;
 }
 
-void Prefab::drawNode(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, Node& node, glm::mat4& model)
-{
-	if (node._primitives.size() > 0)
-	{
-		glm::mat4 node_matrix = model * node.getGlobalMatrix(false);
-		ModelMatrices m = {node_matrix, glm::inverse(node_matrix)};
-
-		for (Primitive* prim : node._primitives)
-		{
-			GPUMaterial mat = Material::_materials[prim->materialID]->materialToShader();
-
-			if (prim->indexCount > 0) 
-			{
-				vkCmdPushConstants(cmd, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4) * 2, &m);
-				vkCmdPushConstants(cmd, pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(glm::mat4) * 2, sizeof(GPUMaterial), &mat);
-				vkCmdDrawIndexed(cmd, prim->indexCount, 1, prim->firstIndex, 0, 0);
-			}
-		}
-	}
-
-	for(auto& child : node._children)
-		drawNode(cmd, pipelineLayout, *child, model);
-}
-
 glm::mat4 Prefab::get_local_matrix(const tinygltf::Node& inputNode)
 {
 	glm::mat4 matrix = glm::mat4(1);
@@ -631,23 +1381,24 @@ glm::mat4 Prefab::get_local_matrix(const tinygltf::Node& inputNode)
 	return matrix;
 }
 
-void Prefab::draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::mat4& model)
+bool Prefab::update_transforms()
 {
-	VkDeviceSize offset{ 0 };
-	vkCmdBindVertexBuffers(cmd, 0, 1, &_mesh->_vertexBuffer._buffer, &offset);
-	vkCmdBindIndexBuffer(cmd, _mesh->_indexBuffer._buffer, offset, VK_INDEX_TYPE_UINT32);
-	if (!_root.empty())
+	bool changed = false;
+	for (auto& it : _prefabsMap)
 	{
-		for(auto& root : _root)
-			drawNode(cmd, pipelineLayout, *root, model);
+		if (it.second)
+			changed |= it.second->_transforms.update();
 	}
+	return changed;
 }
 
 void Prefab::loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode, Node* parent, const bool invertNormals)
 {
-	// Init node and compute its local matrix
+	// Init node, its transform is added before the children so the hierarchy stays depth first
 	Node* node = new Node();
-	node->_matrix = get_local_matrix(tnode);
+	node->_name			= tnode.name;
+	node->_hierarchy	= &_transforms;
+	node->_transform	= _transforms.add(get_local_matrix(tnode), parent ? static_cast<int32_t>(parent->_transform) : TransformHierarchy::NO_PARENT);
 
 	// Load node's children
 	if (tnode.children.size() > 0)
@@ -750,14 +1501,17 @@ void Prefab::loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode
 				}
 			}
 
+			_mesh->optimize_indices(mesh.name, firstIndex, indexCount);
+
 			// Load the primitive information
 			Primitive* prim = new Primitive();
 			prim->firstIndex	= firstIndex;
 			prim->indexCount	= indexCount;
 			prim->firstVertex	= firstVertex;
 			prim->vertexCount	= vertexCount;
-			prim->materialID	= loadMaterial(tmodel, tprimitive.material);
-			loadTextures(tmodel, prim->materialID);
+			prim->materialID	= tprimitive.material;	// glTF index until loadMaterials registers it
+			prim->lods			= _mesh->build_lods(firstIndex, indexCount);
+			_mesh->get_bounds(firstIndex, indexCount, prim->boundsMin, prim->boundsMax);
 			node->_primitives.push_back(prim);
 		}
 	}
@@ -774,68 +1528,67 @@ void Prefab::loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode
 	}
 }
 
+void Prefab::loadMaterials(const tinygltf::Model& tmodel, Node* node)
+{
+	for (Node* child : node->_children)
+		loadMaterials(tmodel, child);
+
+	for (Primitive* prim : node->_primitives)
+		prim->materialID = loadMaterial(tmodel, prim->materialID);
+}
+
+// Texture ids are resolved before interning, so materials of different files only merge when they
+// really sample the same textures
 int Prefab::loadMaterial(const tinygltf::Model& tmodel, const int index)
 {
-	Material* mat = new Material();
+	Material mat;
 	if (index > -1)
 	{
 		auto& tmat = tmodel.materials[index];
 		
 		auto& tpbr = tmat.pbrMetallicRoughness;
-		mat->diffuseColor				= glm::vec4(tpbr.baseColorFactor[0], tpbr.baseColorFactor[1], tpbr.baseColorFactor[2], tpbr.baseColorFactor[3]);
-		mat->metallicFactor				= tpbr.metallicFactor;
-		mat->roughnessFactor			= tpbr.roughnessFactor;
-		mat->diffuseTexture				= tpbr.baseColorTexture.index;
-		mat->metallicRoughnessTexture	= tpbr.metallicRoughnessTexture.index;
-		mat->emissiveTexture			= tmat.emissiveTexture.index;
-		mat->normalTexture				= tmat.normalTexture.index;
+		mat.diffuseColor				= glm::vec4(tpbr.baseColorFactor[0], tpbr.baseColorFactor[1], tpbr.baseColorFactor[2], tpbr.baseColorFactor[3]);
+		mat.metallicFactor				= tpbr.metallicFactor;
+		mat.roughnessFactor				= tpbr.roughnessFactor;
+		mat.diffuseTexture				= tpbr.baseColorTexture.index;
+		mat.metallicRoughnessTexture	= tpbr.metallicRoughnessTexture.index;
+		mat.emissiveTexture				= tmat.emissiveTexture.index;
+		mat.normalTexture				= tmat.normalTexture.index;
+		loadTextures(tmodel, mat);
 	}
 
-	if (Material::exists(mat))
-	{
-		return Material::getIndex(mat);
-	}
-	else
-	{
-		Material::_materials.push_back(mat);
-		return Material::_materials.size() - 1;
-	}
+	return Material::intern(mat);
 }
 
-void Prefab::loadTextures(const tinygltf::Model& tmodel, const int index)
+void Prefab::loadTextures(const tinygltf::Model& tmodel, Material& mat)
 {
-	Material* mat = Material::_materials[index];
-
-	if (mat->diffuseTexture > -1)
-	{
-		Texture::GET(tmodel.images[mat->diffuseTexture].uri.c_str());
-		mat->diffuseTexture = Texture::get_id(tmodel.images[mat->diffuseTexture].uri.c_str());
-	}
-	if (mat->normalTexture > -1)
-	{
-		Texture::GET(tmodel.images[mat->normalTexture].uri.c_str());
-		mat->normalTexture = Texture::get_id(tmodel.images[mat->normalTexture].uri.c_str());
-	}
-	if (mat->emissiveTexture > -1)
-	{
-		Texture::GET(tmodel.images[mat->emissiveTexture].uri.c_str());
-		mat->emissiveTexture = Texture::get_id(tmodel.images[mat->emissiveTexture].uri.c_str());
-	}
-	if (mat->metallicRoughnessTexture > -1)
-	{
-		Texture::GET(tmodel.images[mat->metallicRoughnessTexture].uri.c_str());
-		mat->metallicRoughnessTexture = Texture::get_id(tmodel.images[mat->metallicRoughnessTexture].uri.c_str());
-	}
+	// Ids are looked up by name, the files are only searched for the first time a name is seen
+	if (mat.diffuseTexture > -1)
+		mat.diffuseTexture = Texture::get_id(tmodel.images[mat.diffuseTexture].uri.c_str());
+	if (mat.normalTexture > -1)
+		mat.normalTexture = Texture::get_id(tmodel.images[mat.normalTexture].uri.c_str(), NORMAL_USAGE);
+	if (mat.emissiveTexture > -1)
+		mat.emissiveTexture = Texture::get_id(tmodel.images[mat.emissiveTexture].uri.c_str());
+	if (mat.metallicRoughnessTexture > -1)
+		mat.metallicRoughnessTexture = Texture::get_id(tmodel.images[mat.metallicRoughnessTexture].uri.c_str());
 }
 
 void Prefab::createOBJprefab(Mesh* mesh)
 {
 	Node* node = new Node();
+	node->_hierarchy	= &_transforms;
+	node->_transform	= _transforms.add(glm::mat4(1), TransformHierarchy::NO_PARENT);
 	_mesh = mesh;
 	Primitive* p = new Primitive();
-	p->indexCount		= _mesh ? _mesh->_indices.size() : 0;
 	p->vertexCount		= _mesh ? _mesh->_vertices.size() : 0;
 	p->materialID	= Material::setDefaultMaterial();
+	if (_mesh)
+	{
+		// Levels of OBJ meshes were generated on load, lods[0] holds the original range
+		p->lods			= _mesh->build_lods(0, static_cast<uint32_t>(_mesh->_indices.size()));
+		p->indexCount	= p->lods[0].indexCount;
+		_mesh->get_bounds(0, p->indexCount, p->boundsMin, p->boundsMax);
+	}
 	node->_primitives.push_back(p);
 	_root.push_back(node);
 }
@@ -845,9 +1598,9 @@ Prefab* Prefab::GET(const std::string filename, bool invertNormals)
 	std::string name = vkutil::findFile(filename, searchPaths, true);
 	if (!_prefabsMap[name])
 	{
-		Prefab* prefab = new Prefab();
 		if (filename.find(".obj") != std::string::npos) 
 		{
+			Prefab* prefab = new Prefab();
 			prefab->createOBJprefab(Mesh::GET(name.c_str()));
 			_prefabsMap[name] = prefab;
 
@@ -855,49 +1608,124 @@ Prefab* Prefab::GET(const std::string filename, bool invertNormals)
 		}
 		else
 		{
-			bool binary;
-			if (filename.find(".gltf") != std::string::npos)
-				binary = false;
-			else if (filename.find(".glb") != std::string::npos)
-				binary = true;
-			else {
-				std::cout << "No valid filename" << std::endl;
+			Prefab* prefab = load(name, invertNormals);
+			if (!prefab)
 				return nullptr;
-			}
 
-			std::cout << "Loading gltf... " << filename << std::endl;
+			std::vector<ImageData> images;
+			prefab->decodeImages(images);
+			return insert(name, prefab, images);
+		}
+	}
 
-			tinygltf::Model		gltfModel;
-			tinygltf::TinyGLTF	gltfContext;
-			std::string			warn, err;
-			bool				fileLoaded{ false };
+	return _prefabsMap[name];
+}
 
-			fileLoaded = binary ? gltfContext.LoadBinaryFromFile(&gltfModel, &err, &warn, vkutil::findFile(filename, searchPaths, true))
-				: gltfContext.LoadASCIIFromFile(&gltfModel, &err, &warn, vkutil::findFile(filename, searchPaths, true));
+Prefab* Prefab::load(const std::string& filename, const bool invertNormals)
+{
+	bool binary;
+	if (filename.find(".gltf") != std::string::npos)
+		binary = false;
+	else if (filename.find(".glb") != std::string::npos)
+		binary = true;
+	else {
+		std::cout << "No valid filename" << std::endl;
+		return nullptr;
+	}
 
-			if (!err.empty())
-				throw std::runtime_error(err.c_str());
+	std::cout << "Loading gltf... " << filename << std::endl;
 
-			if (fileLoaded)
-			{
-				// TODO: import materials
-				const tinygltf::Scene& scene = gltfModel.scenes[0];
-				prefab->_mesh = new Mesh();
+	tinygltf::Model*	gltfModel = new tinygltf::Model();
+	tinygltf::TinyGLTF	gltfContext;
+	std::string			warn, err;
+	bool				fileLoaded{ false };
 
-				for (const int node : scene.nodes)
-				{
-					prefab->loadNode(gltfModel, gltfModel.nodes[node], nullptr, invertNormals);
-				}
+	fileLoaded = binary ? gltfContext.LoadBinaryFromFile(gltfModel, &err, &warn, filename)
+		: gltfContext.LoadASCIIFromFile(gltfModel, &err, &warn, filename);
 
-				prefab->_mesh->upload();
+	// May run on a worker, report instead of throwing
+	if (!err.empty())
+		std::cout << "ERR: " << err << std::endl;
 
-				_prefabsMap[name] = prefab;
-				return prefab;
-			}
-		}
+	if (!fileLoaded)
+	{
+		delete gltfModel;
+		return nullptr;
 	}
 
-	return _prefabsMap[name];
+	const tinygltf::Scene& scene = gltfModel->scenes[0];
+	Prefab* prefab		= new Prefab();
+	prefab->_mesh		= new Mesh();
+	prefab->_gltfModel	= gltfModel;
+
+	for (const int node : scene.nodes)
+	{
+		prefab->loadNode(*gltfModel, gltfModel->nodes[node], nullptr, invertNormals);
+	}
+
+	return prefab;
+}
+
+Prefab* Prefab::insert(const std::string& name, Prefab* prefab, std::vector<ImageData>& images)
+{
+	auto it = _prefabsMap.find(name);
+	if (it != _prefabsMap.end() && it->second)
+	{
+		// Loaded meanwhile through GET, this copy never reached the GPU
+		for (ImageData& image : images)
+			vkutil::free_image(image);
+		delete prefab->_gltfModel;
+		delete prefab->_mesh;
+		delete prefab;
+		return it->second;
+	}
+
+	// Decoded images are registered first so the materials find them by name
+	Texture::insert(images);
+
+	for (Node* root : prefab->_root)
+		prefab->loadMaterials(*prefab->_gltfModel, root);
+
+	delete prefab->_gltfModel;
+	prefab->_gltfModel = nullptr;
+
+	prefab->_mesh->upload();
+
+	_prefabsMap[name] = prefab;
+	return prefab;
+}
+
+void Prefab::decodeImages(std::vector<ImageData>& outImages) const
+{
+	const tinygltf::Model& model = *_gltfModel;
+
+	// Normal maps are compressed differently, indexed like loadTextures does
+	std::vector<textureUsage> usages(model.images.size(), COLOR_USAGE);
+	for (const tinygltf::Material& material : model.materials)
+	{
+		if (material.normalTexture.index > -1 && static_cast<size_t>(material.normalTexture.index) < usages.size())
+			usages[material.normalTexture.index] = NORMAL_USAGE;
+	}
+
+	// Images sharing a uri and usage are decoded once, they end up as the same texture
+	std::vector<char> unique(model.images.size(), 0);
+	std::unordered_set<std::string> uris;
+	for (size_t i = 0; i < model.images.size(); i++)
+		unique[i] = !model.images[i].uri.empty() && uris.insert(model.images[i].uri + '#' + std::to_string(usages[i])).second;
+
+	// Decoding and compressing dominate, the images are spread over the shared job pool
+	std::vector<ImageData> images(model.images.size());
+	std::vector<char> decoded(model.images.size(), 0);
+	parallel_for(static_cast<uint32_t>(model.images.size()), [&](uint32_t i) {
+		if (unique[i])
+			decoded[i] = vkutil::decode_image(vkutil::findFile(model.images[i].uri, searchPaths, true).c_str(), images[i], usages[i]);
+	});
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		if (decoded[i])
+			outImages.push_back(std::move(images[i]));
+	}
 }
 
 Prefab* Prefab::GET(const std::string name, Mesh* mesh)
@@ -3,6 +3,7 @@
 #include <vk_types.h>
 #include <vk_textures.h>
 #include "material.h"
+#include "transform_hierarchy.h"
 
 struct VertexInputDescription{
 	std::vector<VkVertexInputBindingDescription> bindings;
@@ -47,14 +48,44 @@ struct TlasInstance {
 	glm::mat4					transform{ glm::mat4(1) };	// Identity model matrix
 };
 
-struct material_matrix {
-	glm::mat4 matrix;
-	int material;
+// Meshlet limits, kept within what task/mesh shader implementations usually expect
+constexpr uint32_t MESHLET_MAX_VERTICES		= 64;
+constexpr uint32_t MESHLET_MAX_TRIANGLES	= 124;
+
+struct Meshlet
+{
+	glm::vec4	sphere;		// xyz center, w radius. Object space
+	glm::vec4	cone;		// xyz axis, w cutoff. A cutoff of 1 means the cone can not be culled
+	uint32_t	firstIndex;
+	uint32_t	indexCount;
+};
+
+// Simplified levels generated on import, coarser levels keep the same vertices
+constexpr uint32_t MAX_MESH_LODS			= 6;
+constexpr uint32_t MIN_LOD_TRIANGLES		= 64;
+
+struct MeshLod
+{
+	uint32_t	firstIndex;
+	uint32_t	indexCount;
+	uint32_t	firstMeshlet;
+	uint32_t	meshletCount;
+	float		error;		// Object space deviation from the full resolution level
+	glm::vec4	sphere;		// xyz center, w radius. Object space
 };
 
-struct ModelMatrices {
+// Post transform vertex cache simulated when optimizing index buffers
+constexpr uint32_t VERTEX_CACHE_SIZE		= 16;
+
+struct VertexCacheStats
+{
+	float acmr;		// Average cache miss ratio, transformed vertices per triangle
+	float atvr;		// Average transformed to vertex ratio, 1 is optimal
+};
+
+struct material_matrix {
 	glm::mat4 matrix;
-	glm::mat4 inv_matric;
+	int material;
 };
 
 struct Primitive
@@ -66,25 +97,38 @@ struct Primitive
 	int32_t	materialID;
 	int32_t	instanceID;
 	int32_t	transformID;
-
+	std::vector<MeshLod> lods;	// lods[0] is the full resolution range above
+	glm::vec3 boundsMin{ 0 };	// Object space box of the full resolution range, set on import
+	glm::vec3 boundsMax{ 0 };
 };
 
 struct Mesh
 {
 	static std::unordered_map<std::string, Mesh*> _loadedMeshes;
+	static std::vector<Mesh*> _meshes;		// Every uploaded mesh, indexed by _id
 	std::vector<Vertex>		_vertices;
 	std::vector<uint32_t>	_indices;
+	std::vector<Meshlet>	_meshlets;
+	uint32_t				_id{ 0 };
 	
 	AllocatedBuffer			_vertexBuffer;
 	AllocatedBuffer			_indexBuffer;
+	AllocatedBuffer			_rtAttributesBuffer;	// Normal, color and uv for the hit shaders
 
 	static Mesh* GET(const char* filename);
+	static Mesh* load(const std::string& filename);					// Geometry only, safe on worker threads
+	static Mesh* insert(const std::string& name, Mesh* mesh);		// Uploads and registers, render thread
 
 	static Mesh* get_quad();
 	static Mesh* get_triangle();
 	static Mesh* get_cube();
+	static Mesh* get_sphere(const uint32_t segments);	// Unit UV sphere, segments around and half as many rings
 
 	void upload();
+	const std::vector<MeshLod>& build_lods(const uint32_t firstIndex, const uint32_t indexCount);
+	void get_bounds(const uint32_t firstIndex, const uint32_t indexCount, glm::vec3& min, glm::vec3& max) const;
+	void optimize_indices(const std::string& name, const uint32_t firstIndex, const uint32_t indexCount);
+	VertexCacheStats analyze_vertex_cache(const uint32_t firstIndex, const uint32_t indexCount) const;
 	BlasInput mesh_to_geometry();
 
 private:
@@ -92,23 +136,31 @@ private:
 	bool load_from_obj(const char* filename);
 	void create_vertex_buffer();
 	void create_index_buffer();
+	void create_rt_attributes_buffer();
+	glm::uvec2 build_meshlets(const uint32_t firstIndex, const uint32_t indexCount);
+	void optimize_vertex_cache(const uint32_t firstIndex, const uint32_t indexCount);
+	void optimize_vertex_fetch(const uint32_t firstIndex, const uint32_t indexCount);
+	std::vector<uint32_t> simplify(const std::vector<uint32_t>& indices, const size_t targetIndexCount, float& error);
+
+	// Primitives sharing an index range share their levels, keyed by first index
+	std::unordered_map<uint32_t, std::vector<MeshLod>> _lodRanges;
 };
 
 class Node
 {
 public:
 	std::string				_name;
-	Node*					_parent;
+	Node*					_parent{ nullptr };
 	std::vector<Node*>		_children;
 
 	std::vector<Primitive*>	_primitives;
-	glm::mat4				_matrix;
-	glm::mat4				_global_matrix;
-
-	Node() { _matrix = glm::mat4(1); }
+	TransformHierarchy*		_hierarchy{ nullptr };	// Of the prefab, holds the matrices
+	uint32_t				_transform{ 0 };		// Index in _hierarchy
 
 	void addChild(Node* child);
-	glm::mat4 getGlobalMatrix(bool fast = false);
+	const glm::mat4& getLocalMatrix() const { return _hierarchy->get_local(_transform); }
+	const glm::mat4& getGlobalMatrix() const { return _hierarchy->get_world(_transform); }
+	void setLocalMatrix(const glm::mat4& matrix) { _hierarchy->set_local(_transform, matrix); }
 
 	void node_to_geometry(
 		std::vector<BlasInput>& blasVector,
@@ -121,8 +173,8 @@ public:
 
 	unsigned int get_number_nodes();
 	void fill_matrix_buffer(std::vector<glm::mat4>& buffer, const glm::mat4 model);
-	void fill_index_buffer(std::vector<glm::vec4>& index_buffer);
-	void addMaterial(Material* mat);
+	void fill_index_buffer(std::vector<glm::vec4>& index_buffer, const uint32_t meshID);
+	void addMaterial(const Material& mat);
 };
 
 namespace tinygltf {
@@ -137,19 +189,24 @@ public:
 
 	std::string			_name;
 	std::vector<Node*>	_root;
+	TransformHierarchy	_transforms;			// Matrices of every node, relative to the prefab
 	Mesh*				_mesh = NULL;
+	tinygltf::Model*	_gltfModel = nullptr;	// Kept between load and insert to register the materials
 
 	static Prefab* GET(std::string filename, const bool invertNormals = false);
 	static Prefab* GET(std::string name, Mesh* mesh);
-	void draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::mat4& model);
+	static Prefab* load(const std::string& filename, const bool invertNormals = false);		// glTF hierarchy and geometry, safe on worker threads
+	static Prefab* insert(const std::string& name, Prefab* prefab, std::vector<ImageData>& images);	// Textures, materials and upload, render thread
+	void decodeImages(std::vector<ImageData>& outImages) const;	// Images of the loaded model decoded in parallel, any thread
+	static bool update_transforms();	// World matrices of the nodes moved since the last call, true if any
 	BlasInput primitive_to_geometry(const Primitive& prim);
 
 private:
 
 	void loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode, Node* parent, const bool invertNormals = false);
+	void loadMaterials(const tinygltf::Model& tmodel, Node* node);
 	int loadMaterial(const tinygltf::Model& tmodel, const int index);
-	void loadTextures(const tinygltf::Model&, const int index);
-	void drawNode(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, Node& node, glm::mat4& model);
+	void loadTextures(const tinygltf::Model& tmodel, Material& mat);
 	void createOBJprefab(Mesh* mesh = NULL);
 	glm::mat4 get_local_matrix(const tinygltf::Node& tnode);
 };
\ No newline at end of file
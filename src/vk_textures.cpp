@@ -5,100 +5,326 @@
 #include "stb_image.h"
 #include "vk_utils.h"
 
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_set>
+
 extern std::vector<std::string> searchPaths;
 std::vector<std::pair<std::string, Texture*>> Texture::_textures;
+std::unordered_map<std::string, int> Texture::_textureIds;
+std::unordered_map<std::string, std::string> Texture::_resolvedPaths;
 
-bool vkutil::load_image_from_file(VulkanEngine& engine, const char* filename, AllocatedImage& outImage)
+bool vkutil::decode_image(const char* filename, ImageData& outData, const textureUsage usage)
 {
-	int texWidth, textHeight, texChannels;
+	outData.name	= filename;
+	outData.usage	= usage;
+
+	// Workers decoding the same file take turns, the later ones read the cache the first one writes
+	const std::string key = std::string(filename) + '#' + std::to_string(usage);
+	static std::mutex transcodingMutex;
+	static std::condition_variable transcodingDone;
+	static std::unordered_set<std::string> transcoding;
+	{
+		std::unique_lock<std::mutex> lock(transcodingMutex);
+		transcodingDone.wait(lock, [&]() { return transcoding.count(key) == 0; });
+		transcoding.insert(key);
+	}
 
-	stbi_uc* pixels = stbi_load(filename, &texWidth, &textHeight, &texChannels, STBI_rgb_alpha);
+	struct Release
+	{
+		const std::string& name;
+		~Release()
+		{
+			{
+				std::lock_guard<std::mutex> lock(transcodingMutex);
+				transcoding.erase(name);
+			}
+			transcodingDone.notify_all();
+		}
+	} release{ key };
 
-	if (!pixels) {
+	// The format also depends on the pixels, any cache the usage could have written is taken
+	for (const VkFormat format : get_cache_formats(usage))
+	{
+		const std::string cacheFilename = get_cache_filename(filename, format);
+		if (is_cache_valid(cacheFilename, filename) && read_ktx2(cacheFilename, outData))
+			return true;
+	}
+
+	outData.pixels = stbi_load(filename, &outData.width, &outData.height, &outData.channels, STBI_rgb_alpha);
+
+	if (!outData.pixels) {
 		std::cout << "Failed to load texture file: " << filename << std::endl;
 		return false;
 	}
 
-	void* pixels_ptr = pixels;
-	VkDeviceSize imageSize = texWidth * textHeight * 4;
+	// The RGBA8 pixels are only needed to build the compressed levels
+	compress_image(outData, usage);
+	stbi_image_free(outData.pixels);
+	outData.pixels = nullptr;
 
-	// The format R8G8B8A8 match exactly with the pixels loaded from stbi_load lib
-	VkFormat image_format = VK_FORMAT_R8G8B8A8_UNORM;
+	const std::string cacheFilename = get_cache_filename(filename, outData.format);
+	if (!write_ktx2(cacheFilename, outData))
+		std::cout << "Could not write texture cache " << cacheFilename << std::endl;
 
-	// Allocate temporary buffer for holding texture data to upload
-	AllocatedBuffer stagingBuffer;
-	engine.create_buffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, stagingBuffer, false);
+	return true;
+}
 
-	void* data;
-	vmaMapMemory(engine._allocator, stagingBuffer._allocation, &data);
-	memcpy(data, pixels_ptr, static_cast<size_t>(imageSize));
-	vmaUnmapMemory(engine._allocator, stagingBuffer._allocation);
+void vkutil::free_image(ImageData& data)
+{
+	if (data.pixels)
+		stbi_image_free(data.pixels);
+	data.pixels = nullptr;
+	data.levels.clear();
+}
+
+bool vkutil::load_image_from_file(VulkanEngine& engine, const char* filename, AllocatedImage& outImage, const textureUsage usage)
+{
+	ImageData data;
+	if (!decode_image(filename, data, usage))
+		return false;
+
+	const bool uploaded = upload_image(engine, data, outImage);
+	free_image(data);
 
-	stbi_image_free(pixels);
+	if (uploaded)
+		std::cout << "Texture loaded successfully " << filename << std::endl;
+
+	return uploaded;
+}
+
+uint32_t vkutil::get_mip_levels(const uint32_t width, const uint32_t height)
+{
+	return static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+}
+
+static VkDeviceSize get_upload_size(const ImageData& image)
+{
+	if (image.levels.empty())
+		return static_cast<VkDeviceSize>(image.width) * image.height * 4;
 
+	VkDeviceSize size = 0;
+	for (const auto& level : image.levels)
+		size += level.size();
+	return size;
+}
+
+static void copy_to_staging(const ImageData& image, char* dst)
+{
+	if (image.levels.empty())
+	{
+		memcpy(dst, image.pixels, static_cast<size_t>(get_upload_size(image)));
+		return;
+	}
+
+	for (const auto& level : image.levels)
+	{
+		memcpy(dst, level.data(), level.size());
+		dst += level.size();
+	}
+}
+
+// Compressed images keep their own mip chain, RGBA8 ones get a full chain blitted from level 0
+// if the format can be linearly filtered in a blit
+static AllocatedImage create_image(VulkanEngine& engine, const ImageData& image)
+{
 	VkExtent3D imageExtent;
-	imageExtent.width = static_cast<uint32_t>(texWidth);
-	imageExtent.height = static_cast<uint32_t>(textHeight);
+	imageExtent.width = static_cast<uint32_t>(image.width);
+	imageExtent.height = static_cast<uint32_t>(image.height);
 	imageExtent.depth = 1;
 
-	VkImageCreateInfo dimb_info = vkinit::image_create_info(
-		image_format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, imageExtent);
-
+	// Transfer source so the residency manager can copy the lower mips out when it drops the top one
 	AllocatedImage newImage;
+	VkImageUsageFlags usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+	if (!image.levels.empty())
+	{
+		newImage._mipLevels = static_cast<uint32_t>(image.levels.size());
+	}
+	else
+	{
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(engine._gpu, image.format, &formatProperties);
+		const bool canBlit = (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) != 0;
+
+		newImage._mipLevels = canBlit ? vkutil::get_mip_levels(imageExtent.width, imageExtent.height) : 1;
+	}
+
+	VkImageCreateInfo dimb_info = vkinit::image_create_info(image.format, usage, imageExtent);
+	dimb_info.mipLevels = newImage._mipLevels;
 
 	VmaAllocationCreateInfo dimg_allocinfo = {};
 	dimg_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
 
 	vmaCreateImage(engine._allocator, &dimb_info, &dimg_allocinfo, &newImage._image, &newImage._allocation, nullptr);
 
-	engine.immediate_submit([&](VkCommandBuffer cmd) {
-		VkImageSubresourceRange range;
-		range.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
-		range.baseMipLevel		= 0;
-		range.levelCount		= 1;
-		range.baseArrayLayer	= 0;
-		range.layerCount		= 1;
-
-		VkImageMemoryBarrier imageBarrier_toTransfer = {};
-		imageBarrier_toTransfer.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		imageBarrier_toTransfer.pNext				= nullptr;
-		imageBarrier_toTransfer.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
-		imageBarrier_toTransfer.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		imageBarrier_toTransfer.image				= newImage._image;
-		imageBarrier_toTransfer.subresourceRange	= range;
-		imageBarrier_toTransfer.srcAccessMask		= 0;
-		imageBarrier_toTransfer.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
-
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-			0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toTransfer);
-
-		VkBufferImageCopy copyRegion = {};
-		copyRegion.bufferOffset						= 0;
+	return newImage;
+}
+
+// Copies the image from the staging buffer and leaves every level ready to be sampled
+static void record_upload(VkCommandBuffer cmd, VkBuffer stagingBuffer, VkDeviceSize offset, const ImageData& image, const AllocatedImage& newImage)
+{
+	const VkExtent3D imageExtent = { static_cast<uint32_t>(image.width), static_cast<uint32_t>(image.height), 1 };
+	const bool compressed = !image.levels.empty();
+
+	VkImageSubresourceRange range;
+	range.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
+	range.baseMipLevel		= 0;
+	range.levelCount		= newImage._mipLevels;
+	range.baseArrayLayer	= 0;
+	range.layerCount		= 1;
+
+	VkImageMemoryBarrier imageBarrier_toTransfer = {};
+	imageBarrier_toTransfer.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	imageBarrier_toTransfer.pNext				= nullptr;
+	imageBarrier_toTransfer.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
+	imageBarrier_toTransfer.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	imageBarrier_toTransfer.image				= newImage._image;
+	imageBarrier_toTransfer.subresourceRange	= range;
+	imageBarrier_toTransfer.srcAccessMask		= 0;
+	imageBarrier_toTransfer.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toTransfer);
+
+	// One region per compressed level, only level 0 otherwise
+	std::vector<VkBufferImageCopy> copyRegions(compressed ? image.levels.size() : 1);
+	for (uint32_t i = 0; i < copyRegions.size(); i++)
+	{
+		VkBufferImageCopy& copyRegion = copyRegions[i];
+		copyRegion = {};
+		copyRegion.bufferOffset						= offset;
 		copyRegion.bufferRowLength					= 0;
 		copyRegion.bufferImageHeight				= 0;
 		copyRegion.imageSubresource.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
-		copyRegion.imageSubresource.mipLevel		= 0;
+		copyRegion.imageSubresource.mipLevel		= i;
 		copyRegion.imageSubresource.baseArrayLayer	= 0;
 		copyRegion.imageSubresource.layerCount		= 1;
-		copyRegion.imageExtent						= imageExtent;
+		copyRegion.imageExtent						= { std::max(imageExtent.width >> i, 1u), std::max(imageExtent.height >> i, 1u), 1 };
+
+		if (compressed)
+			offset += image.levels[i].size();
+	}
 
-		vkCmdCopyBufferToImage(cmd, stagingBuffer._buffer, newImage._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+	vkCmdCopyBufferToImage(cmd, stagingBuffer, newImage._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		static_cast<uint32_t>(copyRegions.size()), copyRegions.data());
 
+	// Textures are read by the G-buffer and by the ray tracing stages
+	const VkPipelineStageFlags readStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+	if (compressed)
+	{
 		VkImageMemoryBarrier imageBarrier_toReadable = imageBarrier_toTransfer;
 		imageBarrier_toReadable.oldLayout		= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 		imageBarrier_toReadable.newLayout		= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 		imageBarrier_toReadable.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
 		imageBarrier_toReadable.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT;
 
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toReadable);
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, readStages, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toReadable);
+		return;
+	}
+
+	// Each level is blitted from the previous one, which is moved to TRANSFER_SRC first
+	VkImageMemoryBarrier mipBarrier = imageBarrier_toTransfer;
+	mipBarrier.subresourceRange.levelCount = 1;
+
+	int32_t mipWidth	= static_cast<int32_t>(imageExtent.width);
+	int32_t mipHeight	= static_cast<int32_t>(imageExtent.height);
+	for (uint32_t i = 1; i < newImage._mipLevels; i++)
+	{
+		mipBarrier.subresourceRange.baseMipLevel	= i - 1;
+		mipBarrier.oldLayout						= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		mipBarrier.newLayout						= VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		mipBarrier.srcAccessMask					= VK_ACCESS_TRANSFER_WRITE_BIT;
+		mipBarrier.dstAccessMask					= VK_ACCESS_TRANSFER_READ_BIT;
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &mipBarrier);
+
+		VkImageBlit blit = {};
+		blit.srcOffsets[1]					= { mipWidth, mipHeight, 1 };
+		blit.srcSubresource.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
+		blit.srcSubresource.mipLevel		= i - 1;
+		blit.srcSubresource.baseArrayLayer	= 0;
+		blit.srcSubresource.layerCount		= 1;
+		mipWidth	= std::max(mipWidth / 2, 1);
+		mipHeight	= std::max(mipHeight / 2, 1);
+		blit.dstOffsets[1]					= { mipWidth, mipHeight, 1 };
+		blit.dstSubresource					= blit.srcSubresource;
+		blit.dstSubresource.mipLevel		= i;
+
+		vkCmdBlitImage(cmd, newImage._image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, newImage._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+	}
+
+	// Every level but the last one ends in TRANSFER_SRC
+	VkImageMemoryBarrier barriers_toReadable[2];
+	barriers_toReadable[0] = imageBarrier_toTransfer;
+	barriers_toReadable[0].subresourceRange.baseMipLevel	= 0;
+	barriers_toReadable[0].subresourceRange.levelCount		= newImage._mipLevels - 1;
+	barriers_toReadable[0].oldLayout						= VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers_toReadable[0].newLayout						= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barriers_toReadable[0].srcAccessMask					= VK_ACCESS_TRANSFER_READ_BIT;
+	barriers_toReadable[0].dstAccessMask					= VK_ACCESS_SHADER_READ_BIT;
+
+	barriers_toReadable[1] = imageBarrier_toTransfer;
+	barriers_toReadable[1].subresourceRange.baseMipLevel	= newImage._mipLevels - 1;
+	barriers_toReadable[1].subresourceRange.levelCount		= 1;
+	barriers_toReadable[1].oldLayout						= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers_toReadable[1].newLayout						= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barriers_toReadable[1].srcAccessMask					= VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers_toReadable[1].dstAccessMask					= VK_ACCESS_SHADER_READ_BIT;
+
+	const uint32_t nBarriers = newImage._mipLevels > 1 ? 2 : 1;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, readStages,
+		0, 0, nullptr, 0, nullptr, nBarriers, &barriers_toReadable[2 - nBarriers]);
+}
+
+bool vkutil::upload_images(VulkanEngine& engine, const std::vector<const ImageData*>& images, std::vector<AllocatedImage>& outImages)
+{
+	if (images.empty())
+		return true;
+
+	// Every image shares one staging buffer, offsets are aligned for the largest texel block
+	std::vector<VkDeviceSize> offsets(images.size());
+	VkDeviceSize stagingSize = 0;
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		offsets[i] = (stagingSize + 15) & ~VkDeviceSize(15);
+		stagingSize = offsets[i] + get_upload_size(*images[i]);
+	}
+
+	AllocatedBuffer stagingBuffer;
+	engine.create_buffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, stagingBuffer, false);
+
+	void* data;
+	vmaMapMemory(engine._allocator, stagingBuffer._allocation, &data);
+	for (size_t i = 0; i < images.size(); i++)
+		copy_to_staging(*images[i], static_cast<char*>(data) + offsets[i]);
+	vmaUnmapMemory(engine._allocator, stagingBuffer._allocation);
+
+	outImages.resize(images.size());
+	for (size_t i = 0; i < images.size(); i++)
+		outImages[i] = create_image(engine, *images[i]);
 
+	// A single submit and wait for the whole batch
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		for (size_t i = 0; i < images.size(); i++)
+			record_upload(cmd, stagingBuffer._buffer, offsets[i], *images[i], outImages[i]);
 	});
 
 	vmaDestroyBuffer(engine._allocator, stagingBuffer._buffer, stagingBuffer._allocation);
 
-	std::cout << "Texture loaded successfully " << filename << std::endl;
+	return true;
+}
 
-	outImage = newImage;
+bool vkutil::upload_image(VulkanEngine& engine, const ImageData& image, AllocatedImage& outImage)
+{
+	std::vector<AllocatedImage> outImages;
+	if (!upload_images(engine, { &image }, outImages))
+		return false;
+
+	outImage = outImages[0];
 	return true;
 }
 
@@ -119,31 +345,105 @@ bool vkutil::load_cubemap(VulkanEngine& engine, const char* filename, VkFormat f
 
 }
 
-bool isInVector(const std::string name, const std::pair<std::string, Texture*> textures)
+const std::string& Texture::resolve(const std::string& filename)
 {
-	return textures.first == name;
+	auto it = _resolvedPaths.find(filename);
+	if (it == _resolvedPaths.end())
+		it = _resolvedPaths.emplace(filename, vkutil::findFile(filename, searchPaths, true)).first;
+
+	return it->second;
 }
 
-Texture* Texture::GET(const char* filename, const bool cubemap)
+int Texture::find(const std::string& name)
 {
-	std::string name = vkutil::findFile(filename, searchPaths, true);
+	auto it = _textureIds.find(name);
+	return it != _textureIds.end() ? it->second : -1;
+}
+
+Texture* Texture::GET(const char* filename, const bool cubemap, const textureUsage usage)
+{
+	const std::string& name = resolve(filename);
 
 	// Return if it already exists
-	for (auto& tex : Texture::_textures)
+	const int id = find(name);
+	if (id > -1)
+		return _textures[id].second;
+
+	// Load texture if it does not exist
+	ImageData data;
+	if (!vkutil::decode_image(name.c_str(), data, usage))
+		return nullptr;
+
+	return insert(data);
+}
+
+Texture* Texture::insert(ImageData& data)
+{
+	// Another prefab may have brought the same image in first
+	const int id = find(data.name);
+	if (id > -1)
 	{
-		if (std::get<0>(tex) == name)
-		{
-			return std::get<1>(tex);
-		}
+		vkutil::free_image(data);
+		return _textures[id].second;
 	}
 
-	// Load texture if it does not exist
-	Texture* t = new Texture();
-	vkutil::load_image_from_file(*VulkanEngine::engine, name.c_str(), t->image);
-	VkImageViewCreateInfo imageInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, t->image._image, VK_IMAGE_ASPECT_COLOR_BIT);
-	vkCreateImageView(VulkanEngine::engine->_device, &imageInfo, nullptr, &t->imageView);
+	if (!data.pixels && data.levels.empty())
+		return nullptr;
 
-	_textures.push_back({ name, t });
+	AllocatedImage image;
+	const bool uploaded = vkutil::upload_image(*VulkanEngine::engine, data, image);
+	vkutil::free_image(data);
+
+	return uploaded ? create(data, image) : nullptr;
+}
+
+void Texture::insert(std::vector<ImageData>& images)
+{
+	// Images already registered, or repeated in the batch, are dropped before the upload
+	std::vector<const ImageData*> uploads;
+	std::unordered_set<std::string> batched;
+	for (const ImageData& data : images)
+	{
+		if (find(data.name) > -1 || (!data.pixels && data.levels.empty()) || !batched.insert(data.name).second)
+			continue;
+
+		uploads.push_back(&data);
+	}
+
+	std::vector<AllocatedImage> uploaded;
+	if (vkutil::upload_images(*VulkanEngine::engine, uploads, uploaded))
+	{
+		for (size_t i = 0; i < uploads.size(); i++)
+			create(*uploads[i], uploaded[i]);
+	}
+
+	for (ImageData& data : images)
+		vkutil::free_image(data);
+}
+
+void Texture::create_view()
+{
+	VkImageViewCreateInfo imageInfo = vkinit::image_view_create_info(format, image._image, VK_IMAGE_ASPECT_COLOR_BIT);
+	imageInfo.subresourceRange.levelCount = image._mipLevels;
+
+	// Single channel images read as grey like they did when expanded to RGBA8
+	if (format == VK_FORMAT_BC4_UNORM_BLOCK)
+		imageInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_ONE };
+	vkCreateImageView(VulkanEngine::engine->_device, &imageInfo, nullptr, &imageView);
+}
+
+Texture* Texture::create(const ImageData& data, const AllocatedImage& image)
+{
+	Texture* t	= new Texture();
+	t->image	= image;
+	t->format	= data.format;
+	t->width	= static_cast<uint32_t>(data.width);
+	t->height	= static_cast<uint32_t>(data.height);
+	t->usage	= data.usage;
+	t->create_view();
+
+	_textureIds[data.name] = static_cast<int>(_textures.size());
+	_textures.push_back({ data.name, t });
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=](){
 		vkDestroyImageView(VulkanEngine::engine->_device, t->imageView, nullptr);
@@ -153,17 +453,13 @@ Texture* Texture::GET(const char* filename, const bool cubemap)
 	return t;
 }
 
-int Texture::get_id(const char* filename)
+int Texture::get_id(const char* filename, const textureUsage usage)
 {
-	std::string name = vkutil::findFile(filename, searchPaths, true);
-
-	for (int i = 0; i < Texture::_textures.size(); i++)
-	{
-		if (Texture::_textures.at(i).first == name)
-			return i;
-	}
+	const std::string& name = resolve(filename);
 
-	GET(name.c_str());
+	const int id = find(name);
+	if (id > -1)
+		return id;
 
-	return Texture::_textures.size() - 1;
+	return GET(name.c_str(), false, usage) ? find(name) : -1;
 }
\ No newline at end of file
@@ -1,22 +1,65 @@
 #pragma once
 
 #include <vk_types.h>
+#include "texture_cache.h"
 //#include "vk_utils.h"
 
 class VulkanEngine;
 
+// Decoded on the CPU, can be produced by any thread. Either RGBA8 pixels or a block compressed mip chain
+struct ImageData {
+	std::string		name;		// Resolved path, the texture is registered under it
+	int				width{ 0 };
+	int				height{ 0 };
+	int				channels{ 4 };	// Channels of the source file, pixels are always RGBA8
+	unsigned char*	pixels{ nullptr };
+	VkFormat		format{ VK_FORMAT_R8G8B8A8_UNORM };
+	textureUsage	usage{ COLOR_USAGE };	// Picks the cache the texture is read from again
+	std::vector<std::vector<unsigned char>> levels;	// Precomputed levels, block compressed or RGBA16F, level 0 first
+};
+
 struct Texture {
 	AllocatedImage  image;
 	VkImageView		imageView;
+	VkFormat		format{ VK_FORMAT_UNDEFINED };
+	uint32_t		width{ 0 };		// Of the resident level 0, the residency manager may drop top mips
+	uint32_t		height{ 0 };
+	textureUsage	usage{ COLOR_USAGE };
+
+	void create_view();
+
+	static std::vector<std::pair<std::string, Texture*>> _textures;	// Index is the id used by the shaders, never reordered
+	static Texture* GET(const char* filename, const bool cubemap = false, const textureUsage usage = COLOR_USAGE);
+	static Texture* insert(ImageData& data);	// Uploads an image decoded by a worker and frees its pixels
+	static void insert(std::vector<ImageData>& images);	// Same for many images with a single staging buffer and submit
+	static int get_id(const char* filename, const textureUsage usage = COLOR_USAGE);	// Loads the texture if needed, -1 if it failed
+
+private:
+	static std::unordered_map<std::string, int>			_textureIds;	// Resolved path to id
+	static std::unordered_map<std::string, std::string>	_resolvedPaths;	// Requested name to resolved path, findFile is only called once per name
 
-	static std::vector<std::pair<std::string, Texture*>> _textures;
-	static Texture* GET(const char* filename, const bool cubemap = false);
-	static int get_id(const char* filename);
+	static const std::string& resolve(const std::string& filename);
+	static int find(const std::string& name);
+	static Texture* create(const ImageData& data, const AllocatedImage& image);
 };
 
 namespace vkutil {
 
-	bool load_image_from_file(VulkanEngine& engine, const char* filename, AllocatedImage& outImage);
+	// Reads the KTX2 cache when it is up to date, otherwise decodes, compresses and writes it.
+	// Concurrent calls for the same file wait for the one writing the cache.
+	bool decode_image(const char* filename, ImageData& outData, const textureUsage usage = COLOR_USAGE);
+
+	void free_image(ImageData& data);
+
+	uint32_t get_mip_levels(const uint32_t width, const uint32_t height);
+
+	// Copies every compressed level, RGBA8 images upload level 0 and blit the rest of the mip chain on the GPU
+	bool upload_image(VulkanEngine& engine, const ImageData& image, AllocatedImage& outImage);
+
+	// Batched upload, one staging buffer and one submit for all the images
+	bool upload_images(VulkanEngine& engine, const std::vector<const ImageData*>& images, std::vector<AllocatedImage>& outImages);
+
+	bool load_image_from_file(VulkanEngine& engine, const char* filename, AllocatedImage& outImage, const textureUsage usage = COLOR_USAGE);
 
 	bool load_cubemap(VulkanEngine& engine, const char* filename, VkFormat format, AllocatedImage& outImage);
 }
\ No newline at end of file
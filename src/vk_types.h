@@ -29,4 +29,5 @@ struct AllocatedBuffer {
 struct AllocatedImage {
 	VkImage			_image;
 	VmaAllocation	_allocation;
+	uint32_t		_mipLevels = 1;
 };
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "spatial_index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <random>
+
+// Compares SpatialIndex::raycast with a brute force loop over the same boxes, after building the
+// tree, after moving part of the boxes and after removing half of them. Returns 1 on a mismatch.
+
+static const uint32_t	N_BOXES	= 100000;
+static const uint32_t	N_RAYS	= 200;
+
+struct Box
+{
+	glm::vec3	min;
+	glm::vec3	max;
+	uint32_t	proxy;
+	bool		alive;
+};
+
+// Same slab test as the index, on every box still alive
+static uint32_t brute_force_raycast(const std::vector<Box>& boxes, const glm::vec3& origin, const glm::vec3& direction, float& distance)
+{
+	const glm::vec3 inverseDirection = 1.0f / direction;
+
+	uint32_t hit	= SpatialIndex::NONE;
+	distance		= std::numeric_limits<float>::max();
+	for (uint32_t i = 0; i < boxes.size(); i++)
+	{
+		if (!boxes[i].alive)
+			continue;
+
+		const glm::vec3 t1		= (boxes[i].min - origin) * inverseDirection;
+		const glm::vec3 t2		= (boxes[i].max - origin) * inverseDirection;
+		const glm::vec3 near	= glm::min(t1, t2);
+		const glm::vec3 far		= glm::max(t1, t2);
+		const float enter		= std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+		const float exit		= std::min(std::min(far.x, far.y), far.z);
+		if (enter <= exit && enter < distance)
+		{
+			distance	= enter;
+			hit			= i;
+		}
+	}
+	return hit;
+}
+
+static bool check_rays(const SpatialIndex& index, const std::vector<Box>& boxes, std::mt19937& random, const char* stage)
+{
+	std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+	std::uniform_real_distribution<float> slope(-1.0f, 1.0f);
+
+	for (uint32_t i = 0; i < N_RAYS; i++)
+	{
+		// Rays from above, steep enough to cross the boxes lying on the ground
+		const float x = position(random);
+		const float z = position(random);
+		const glm::vec3 origin(x, 50.0f, z);
+		const float dx = slope(random);
+		const float dz = slope(random);
+		const glm::vec3 direction(dx, -1.0f, dz);
+
+		float distance, expectedDistance;
+		const uint32_t hit		= index.raycast(origin, direction, std::numeric_limits<float>::max(), distance);
+		const uint32_t expected	= brute_force_raycast(boxes, origin, direction, expectedDistance);
+		// Boxes entered at the same distance may come out in either order
+		const bool tie = hit != SpatialIndex::NONE && expected != SpatialIndex::NONE && distance == expectedDistance;
+		if (hit != expected && !tie)
+		{
+			std::printf("%s: ray %u hit %u, brute force hit %u\n", stage, i, hit, expected);
+			return false;
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	std::mt19937 random(7);
+	std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+	std::uniform_real_distribution<float> height(0.0f, 5.0f);
+	std::uniform_real_distribution<float> size(0.5f, 1.5f);
+	std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+	SpatialIndex index;
+	std::vector<Box> boxes(N_BOXES);
+	for (uint32_t i = 0; i < N_BOXES; i++)
+	{
+		const float x = position(random);
+		const float y = height(random);
+		const float z = position(random);
+		const glm::vec3 center(x, y, z);
+		const glm::vec3 half(size(random));
+
+		boxes[i].min	= center - half;
+		boxes[i].max	= center + half;
+		boxes[i].proxy	= index.insert(boxes[i].min, boxes[i].max, i);
+		boxes[i].alive	= true;
+	}
+	if (!check_rays(index, boxes, random, "build"))
+		return 1;
+
+	// Small and large moves, within and beyond the leaf margin
+	for (uint32_t i = 0; i < N_BOXES; i += 10)
+	{
+		const float scale = (i % 20 == 0) ? 1.0f : 20.0f;
+		const float x = offset(random);
+		const float y = offset(random);
+		const float z = offset(random);
+		const glm::vec3 move = glm::vec3(x, y, z) * scale;
+
+		boxes[i].min += move;
+		boxes[i].max += move;
+		index.move(boxes[i].proxy, boxes[i].min, boxes[i].max);
+	}
+	if (!check_rays(index, boxes, random, "move"))
+		return 1;
+
+	for (uint32_t i = 0; i < N_BOXES; i += 2)
+	{
+		index.remove(boxes[i].proxy);
+		boxes[i].alive = false;
+	}
+	if (index.get_leaf_count() != N_BOXES / 2)
+	{
+		std::printf("remove: %u leaves left, expected %u\n", index.get_leaf_count(), N_BOXES / 2);
+		return 1;
+	}
+	for (uint32_t i = 1; i < N_BOXES; i += 2)
+	{
+		if (index.get_item(boxes[i].proxy) != i)
+		{
+			std::printf("remove: proxy of box %u points at item %u\n", i, index.get_item(boxes[i].proxy));
+			return 1;
+		}
+	}
+	if (!check_rays(index, boxes, random, "remove"))
+		return 1;
+
+	std::printf("spatial index matches brute force, tree height %u\n", index.get_height());
+	return 0;
+}